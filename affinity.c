@@ -0,0 +1,90 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "affinity.h"
+
+// Largest CPU number accepted in lists
+#define AFFINITY_MAX_CPUS 1024
+
+struct affinity_set {
+#ifdef __linux__
+    cpu_set_t cpus;
+#endif
+    guint count;
+};
+
+affinity_set* affinity_set_from_string(const gchar *cpus) {
+    g_return_val_if_fail(cpus, NULL);
+    affinity_set *self = g_malloc0(sizeof(affinity_set));
+    gchar **ranges = g_strsplit(cpus, ",", -1);
+    gboolean valid = ranges[0] != NULL;
+
+    for (guint i = 0; valid && ranges[i]; i++) {
+        gchar *end = NULL;
+        guint64 first = g_ascii_strtoull(ranges[i], &end, 10);
+        guint64 last = first;
+        valid = end != ranges[i];
+        if (valid && *end == '-') {
+            gchar *range_end = end + 1;
+            last = g_ascii_strtoull(range_end, &end, 10);
+            valid = end != range_end;
+        }
+        valid = valid && *end == '\0' && first <= last && last < AFFINITY_MAX_CPUS;
+        for (guint64 cpu = first; valid && cpu <= last; cpu++) {
+#ifdef __linux__
+            if (cpu >= CPU_SETSIZE) {
+                valid = FALSE;
+                break;
+            }
+            if (!CPU_ISSET(cpu, &self->cpus)) {
+                CPU_SET(cpu, &self->cpus);
+                self->count++;
+            }
+#else
+            self->count++;
+#endif
+        }
+    }
+    g_strfreev(ranges);
+    if (!valid || !self->count) {
+        g_free(self);
+        return NULL;
+    }
+    return self;
+}
+
+affinity_set* affinity_set_all() {
+    affinity_set *self = g_malloc0(sizeof(affinity_set));
+#ifdef __linux__
+    // the process' own mask, which may be restricted already (taskset, cgroups)
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &self->cpus) == 0) {
+        self->count = CPU_COUNT(&self->cpus);
+        return self;
+    }
+#endif
+    self->count = g_get_num_processors();
+    return self;
+}
+
+guint affinity_set_count(const affinity_set *self) {
+    return self ? self->count : 0;
+}
+
+gboolean affinity_pin_current_thread(const affinity_set *self) {
+    g_return_val_if_fail(self, FALSE);
+#ifdef __linux__
+    // 0 is the calling thread, threads inherit the mask of the thread creating them
+    return sched_setaffinity(0, sizeof(cpu_set_t), &self->cpus) == 0;
+#else
+    return FALSE;
+#endif
+}
+
+void affinity_set_free(affinity_set *self) {
+    g_free(self);
+}
@@ -0,0 +1,27 @@
+#ifndef _AFFINITY_H_
+#define _AFFINITY_H_
+
+#include <glib.h>
+
+// Set of CPUs streaming threads are pinned to. Pinning is supported on Linux only,
+// elsewhere sets parse but pinning fails.
+typedef struct affinity_set affinity_set;
+
+/**
+ * Parses a CPU list in taskset -c syntax, e.g. "0-3,6".
+ * @return newly allocated set, NULL if the list is malformed or empty
+ */
+affinity_set* affinity_set_from_string(const gchar *cpus);
+
+// All CPUs the process may run on, to undo pinning of reused threads
+affinity_set* affinity_set_all();
+
+// Number of CPUs in the set
+guint affinity_set_count(const affinity_set *self);
+
+// Pins the calling thread (and threads it creates later on) to the set
+gboolean affinity_pin_current_thread(const affinity_set *self);
+
+void affinity_set_free(affinity_set *self);
+
+#endif
@@ -0,0 +1,242 @@
+#include <string.h>
+
+#include "av_sync.h"
+
+// A track of a verified file, followed by the probe on the decoder's pad
+typedef struct {
+    av_sync_monitor *monitor;
+    av_sync_track track;
+    gint followed;
+} av_sync_verified_track;
+
+typedef struct {
+    GstElement *pipeline;
+    av_sync_verified_track tracks[AV_SYNC_TRACKS];
+} av_sync_verification;
+
+void av_sync_monitor_init(av_sync_monitor *self, gint max_offset_ms, gint max_drift_ms_per_hour) {
+    g_return_if_fail(self);
+    memset(self, 0, sizeof(av_sync_monitor));
+    g_mutex_init(&self->lock);
+    av_sync_monitor_set_limits(self, max_offset_ms, max_drift_ms_per_hour);
+}
+
+void av_sync_monitor_clear(av_sync_monitor *self) {
+    g_return_if_fail(self);
+    g_mutex_clear(&self->lock);
+}
+
+void av_sync_monitor_set_limits(av_sync_monitor *self, gint max_offset_ms, gint max_drift_ms_per_hour) {
+    g_return_if_fail(self);
+    g_mutex_lock(&self->lock);
+    self->max_offset = (max_offset_ms > 0 ? max_offset_ms : AV_SYNC_DEFAULT_MAX_OFFSET_MS) * GST_MSECOND;
+    self->max_drift_ms_per_hour = max_drift_ms_per_hour > 0 ? max_drift_ms_per_hour :
+            AV_SYNC_DEFAULT_MAX_DRIFT_MS_PER_HOUR;
+    g_mutex_unlock(&self->lock);
+}
+
+// Running time of a timestamp of data pushed through the pad, FALSE if there is none
+static gboolean av_sync_running_time(GstPad *pad, GstClockTime timestamp, GstClockTimeDiff *running_time) {
+    GstEvent *segment_event = GST_CLOCK_TIME_IS_VALID(timestamp) ?
+            gst_pad_get_sticky_event(pad, GST_EVENT_SEGMENT, 0) : NULL;
+    if (!segment_event) {
+        return FALSE;
+    }
+    const GstSegment *segment = NULL;
+    guint64 position = 0;
+    gst_event_parse_segment(segment_event, &segment);
+    gint sign = gst_segment_to_running_time_full(segment, GST_FORMAT_TIME, timestamp, &position);
+    gst_event_unref(segment_event);
+    if (!sign) {
+        return FALSE;
+    }
+    *running_time = (sign > 0 ? (GstClockTimeDiff)position : -(GstClockTimeDiff)position) + gst_pad_get_offset(pad);
+    return TRUE;
+}
+
+// Offset, drift and alarm once both tracks started, with the lock held
+static gboolean av_sync_monitor_update(av_sync_monitor *self) {
+    av_sync_timeline *video = &self->tracks[AV_SYNC_VIDEO];
+    av_sync_timeline *audio = &self->tracks[AV_SYNC_AUDIO];
+    self->offset = audio->origin - video->origin;
+    self->position = MAX(MIN(video->end - video->first, audio->end - audio->first), 0);
+    if (!self->started) {
+        self->started = TRUE;
+        self->start_offset = self->offset;
+        self->first_sample = self->next_sample = self->position;
+    }
+    if (ABS(self->offset) > ABS(self->furthest_offset)) {
+        self->furthest_offset = self->offset;
+    }
+    if (self->position >= self->next_sample) {
+        gdouble x = (self->position - self->first_sample) / (gdouble)GST_SECOND;
+        gdouble y = self->offset / (gdouble)GST_MSECOND;
+        self->samples++;
+        self->sum_x += x;
+        self->sum_y += y;
+        self->sum_xx += x * x;
+        self->sum_xy += x * y;
+        self->next_sample = self->position + AV_SYNC_SAMPLE_INTERVAL;
+        gdouble n = self->samples;
+        gdouble denominator = n * self->sum_xx - self->sum_x * self->sum_x;
+        if (self->position - self->first_sample >= AV_SYNC_MIN_DRIFT_SPAN && denominator > 0) {
+            self->drift_ms_per_hour = (n * self->sum_xy - self->sum_x * self->sum_y) / denominator * 3600;
+        }
+    }
+    gboolean alarm = ABS(self->offset) > self->max_offset || ABS(self->drift_ms_per_hour) > self->max_drift_ms_per_hour;
+    gboolean raised = alarm && !self->alarm;
+    if (raised) {
+        self->alarms++;
+    }
+    self->alarm = alarm;
+    return raised;
+}
+
+gboolean av_sync_monitor_push(av_sync_monitor *self, av_sync_track track, GstPad *pad, GstBuffer *buffer) {
+    g_return_val_if_fail(self && track < AV_SYNC_TRACKS && pad && buffer, FALSE);
+    GstClockTimeDiff pts = 0, dts = 0;
+    gboolean has_pts = av_sync_running_time(pad, GST_BUFFER_PTS(buffer), &pts);
+    gboolean has_dts = av_sync_running_time(pad, GST_BUFFER_DTS(buffer), &dts);
+    gboolean raised = FALSE;
+    if (!has_pts && !has_dts) {
+        return FALSE;
+    }
+
+    g_mutex_lock(&self->lock);
+    av_sync_timeline *timeline = &self->tracks[track];
+    if (!timeline->buffers) {
+        timeline->dts_shift = has_pts && has_dts ? pts - dts : 0;
+    }
+    // reordered video is followed in decoding order, shifted to where its first frame is shown
+    GstClockTimeDiff start = has_dts ? dts + timeline->dts_shift : pts;
+    if (!timeline->buffers) {
+        timeline->first = timeline->origin = start;
+    } else if (timeline->end_known) {
+        GstClockTimeDiff jump = start - timeline->end;
+        if (ABS(jump) > AV_SYNC_DISCONT_TOLERANCE || GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DISCONT)) {
+            // playback follows the timestamps across the jump
+            timeline->discontinuities++;
+        } else {
+            timeline->origin += jump;
+        }
+    }
+    timeline->buffers++;
+    timeline->end_known = GST_BUFFER_DURATION_IS_VALID(buffer);
+    timeline->end = start + (timeline->end_known ? (GstClockTimeDiff)GST_BUFFER_DURATION(buffer) : 0);
+    if (self->tracks[AV_SYNC_VIDEO].buffers && self->tracks[AV_SYNC_AUDIO].buffers) {
+        raised = av_sync_monitor_update(self);
+    }
+    g_mutex_unlock(&self->lock);
+    return raised;
+}
+
+void av_sync_monitor_read(av_sync_monitor *self, av_sync_stats *stats) {
+    g_return_if_fail(self && stats);
+    memset(stats, 0, sizeof(av_sync_stats));
+    g_mutex_lock(&self->lock);
+    if (self->started) {
+        stats->offset_ms = self->offset / (gdouble)GST_MSECOND;
+        stats->start_offset_ms = self->start_offset / (gdouble)GST_MSECOND;
+        stats->max_offset_ms = self->furthest_offset / (gdouble)GST_MSECOND;
+        stats->drift_ms_per_hour = self->drift_ms_per_hour;
+        stats->duration_ms = self->position / GST_MSECOND;
+    }
+    stats->video_discontinuities = self->tracks[AV_SYNC_VIDEO].discontinuities;
+    stats->audio_discontinuities = self->tracks[AV_SYNC_AUDIO].discontinuities;
+    stats->alarm = self->alarm;
+    stats->alarms = self->alarms;
+    g_mutex_unlock(&self->lock);
+}
+
+static GstPadProbeReturn av_sync_verify_probe(GstPad *pad, GstPadProbeInfo *info, av_sync_verified_track *track) {
+    av_sync_monitor_push(track->monitor, track->track, pad, GST_PAD_PROBE_INFO_BUFFER(info));
+    return GST_PAD_PROBE_OK;
+}
+
+// Every decoded track goes to a fakesink, the first video and audio track are followed
+static void av_sync_verify_pad_added(GstElement *decoder, GstPad *pad, av_sync_verification *verification) {
+    GstCaps *caps = gst_pad_get_current_caps(pad);
+    if (!caps) {
+        caps = gst_pad_query_caps(pad, NULL);
+    }
+    const gchar *name = gst_caps_is_empty(caps) ? "" : gst_structure_get_name(gst_caps_get_structure(caps, 0));
+    av_sync_track track = g_str_has_prefix(name, "video/") ? AV_SYNC_VIDEO :
+            g_str_has_prefix(name, "audio/") ? AV_SYNC_AUDIO : AV_SYNC_TRACKS;
+    gst_caps_unref(caps);
+
+    GstElement *sink = gst_element_factory_make("fakesink", NULL);
+    if (!sink) {
+        g_printerr("Failed to create a sink for the verified track %s.\n", GST_PAD_NAME(pad));
+        return;
+    }
+    g_object_set(sink, "sync", FALSE, NULL);
+    gst_bin_add(GST_BIN(verification->pipeline), sink);
+    gst_element_sync_state_with_parent(sink);
+    GstPad *sink_pad = gst_element_get_static_pad(sink, "sink");
+    if (GST_PAD_LINK_FAILED(gst_pad_link(pad, sink_pad))) {
+        g_printerr("Failed to link the verified track %s.\n", GST_PAD_NAME(pad));
+    } else if (track < AV_SYNC_TRACKS &&
+               g_atomic_int_compare_and_exchange(&verification->tracks[track].followed, FALSE, TRUE)) {
+        gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, (GstPadProbeCallback)av_sync_verify_probe,
+                          &verification->tracks[track], NULL);
+    }
+    gst_object_unref(sink_pad);
+}
+
+gboolean av_sync_verify_file(const gchar *location, gint max_offset_ms, gint max_drift_ms_per_hour,
+                             av_sync_stats *stats) {
+    g_return_val_if_fail(location && stats, FALSE);
+    gchar *uri = gst_uri_is_valid(location) ? g_strdup(location) : gst_filename_to_uri(location, NULL);
+    av_sync_monitor monitor;
+    av_sync_verification verification = { 0 };
+    gboolean res = FALSE;
+
+    av_sync_monitor_init(&monitor, max_offset_ms, max_drift_ms_per_hour);
+    verification.pipeline = gst_pipeline_new("av-sync-verification");
+    GstElement *decoder = gst_element_factory_make("uridecodebin", NULL);
+    if (!uri || !verification.pipeline || !decoder) {
+        g_printerr("Failed to create the pipeline verifying %s.\n", location);
+        if (decoder) {
+            gst_object_unref(decoder);
+        }
+        goto exit;
+    }
+    for (guint i = 0; i < AV_SYNC_TRACKS; i++) {
+        verification.tracks[i].monitor = &monitor;
+        verification.tracks[i].track = i;
+    }
+    g_object_set(decoder, "uri", uri, NULL);
+    gst_bin_add(GST_BIN(verification.pipeline), decoder);
+    g_signal_connect(decoder, "pad-added", G_CALLBACK(av_sync_verify_pad_added), &verification);
+    if (gst_element_set_state(verification.pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+        g_printerr("Failed to start verifying %s.\n", location);
+        goto exit;
+    }
+    GstBus *bus = gst_element_get_bus(verification.pipeline);
+    GstMessage *msg = gst_bus_timed_pop_filtered(bus, GST_CLOCK_TIME_NONE, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+    if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR) {
+        GError *error = NULL;
+        gst_message_parse_error(msg, &error, NULL);
+        g_printerr("Failed to verify %s: %s\n", location, error->message);
+        g_error_free(error);
+    } else {
+        res = TRUE;
+    }
+    gst_message_unref(msg);
+    gst_object_unref(bus);
+
+    exit:
+    if (verification.pipeline) {
+        // streaming threads are gone once stopped, the monitor can be read and cleared
+        gst_element_set_state(verification.pipeline, GST_STATE_NULL);
+        gst_object_unref(verification.pipeline);
+    }
+    av_sync_monitor_read(&monitor, stats);
+    av_sync_monitor_clear(&monitor);
+    if (res && (!verification.tracks[AV_SYNC_VIDEO].followed || !verification.tracks[AV_SYNC_AUDIO].followed)) {
+        g_printerr("%s lacks a video or an audio track.\n", location);
+        res = FALSE;
+    }
+    g_free(uri);
+    return res;
+}
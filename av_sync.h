@@ -0,0 +1,100 @@
+#ifndef _AV_SYNC_H_
+#define _AV_SYNC_H_
+
+#include <gst/gst.h>
+#include <glib.h>
+
+#include "twitch_broadcaster.h"
+
+// Alarm thresholds when the config leaves them 0
+#define AV_SYNC_DEFAULT_MAX_OFFSET_MS 80
+#define AV_SYNC_DEFAULT_MAX_DRIFT_MS_PER_HOUR 40
+// A buffer starting further than this off the end of the track's previous one is a discontinuity
+#define AV_SYNC_DISCONT_TOLERANCE (10 * GST_MSECOND)
+// The offset is sampled for the drift fit once per this much stream time, the drift is judged
+// once the samples span a minute
+#define AV_SYNC_SAMPLE_INTERVAL GST_SECOND
+#define AV_SYNC_MIN_DRIFT_SPAN (60 * GST_SECOND)
+
+typedef enum {
+    AV_SYNC_VIDEO = 0,
+    AV_SYNC_AUDIO,
+    AV_SYNC_TRACKS
+} av_sync_track;
+
+// Timeline of a single track, in running time (signed, decoding timestamps may come before 0)
+typedef struct {
+    guint64 buffers;
+    GstClockTimeDiff first;
+    // end of the previous buffer, not known when it had no duration (the next one is taken as
+    // following it right away)
+    GstClockTimeDiff end;
+    gboolean end_known;
+    // where the timestamps put the track's first sample with the media played back to back:
+    // timestamps running ahead of (or behind) the media move it, discontinuities don't
+    GstClockTimeDiff origin;
+    // PTS - DTS of the first buffer, decoding order timestamps are shifted by it (reordered video)
+    GstClockTimeDiff dts_shift;
+    guint discontinuities;
+} av_sync_timeline;
+
+/*
+ * Keeps the audio and video tracks of a stream aligned: both tracks' origins are followed from
+ * buffers probed where they are about to be combined (the mixers, the muxer). Audio and video
+ * take different paths (scaling and compositing, resampling and mixing, separate encoders)
+ * and timestamps of one of them slowly running off its media, or jumping, show as the offset
+ * between the origins growing. The offset is sampled every second of stream time and fitted
+ * by least squares for the drift. Pushed from both tracks' streaming threads.
+ */
+typedef struct {
+    GMutex lock;
+    av_sync_timeline tracks[AV_SYNC_TRACKS];
+    GstClockTimeDiff max_offset;
+    gdouble max_drift_ms_per_hour;
+
+    gboolean started;
+    GstClockTimeDiff start_offset;
+    GstClockTimeDiff offset;
+    GstClockTimeDiff furthest_offset;
+    // stream time both tracks cover
+    GstClockTimeDiff position;
+    // least squares fit of the offset (ms) over stream time since the first sample (s)
+    GstClockTimeDiff first_sample;
+    GstClockTimeDiff next_sample;
+    guint64 samples;
+    gdouble sum_x, sum_y, sum_xx, sum_xy;
+    gdouble drift_ms_per_hour;
+
+    gboolean alarm;
+    guint alarms;
+} av_sync_monitor;
+
+/**
+ * @param max_offset_ms alarm threshold of the offset, 0 for the default
+ * @param max_drift_ms_per_hour alarm threshold of the drift, 0 for the default
+ */
+void av_sync_monitor_init(av_sync_monitor *self, gint max_offset_ms, gint max_drift_ms_per_hour);
+
+void av_sync_monitor_clear(av_sync_monitor *self);
+
+// Changes the alarm thresholds, 0 for the defaults, they're judged from the next buffer on
+void av_sync_monitor_set_limits(av_sync_monitor *self, gint max_offset_ms, gint max_drift_ms_per_hour);
+
+/**
+ * Follows a buffer of the track pushed through the pad, from the pad's streaming thread.
+ * @return TRUE when the buffer raised the alarm (it wasn't raised before)
+ */
+gboolean av_sync_monitor_push(av_sync_monitor *self, av_sync_track track, GstPad *pad, GstBuffer *buffer);
+
+void av_sync_monitor_read(av_sync_monitor *self, av_sync_stats *stats);
+
+/**
+ * Offline verification of a produced file (or uri): decodes it as fast as possible and follows
+ * its first video and audio track with a monitor of the given thresholds.
+ * @return FALSE if the file couldn't be decoded or lacks audio or video, stats are filled in
+ * either way
+ */
+gboolean av_sync_verify_file(const gchar *location, gint max_offset_ms, gint max_drift_ms_per_hour,
+                             av_sync_stats *stats);
+
+#endif
@@ -0,0 +1,67 @@
+#include <string.h>
+
+#include "bitrate_controller.h"
+
+// Congested once the queue is this full, or growing for a few samples while above the idle mark
+#define CONGESTED_PERCENT 20
+#define GROWING_SAMPLES 3
+// Room to increase below this
+#define IDLE_PERCENT 5
+// A decrease goes this far below the measured video throughput (percent), minus what drains
+// the queue within DRAIN_SECONDS
+#define HEADROOM_PERCENT 90
+#define DRAIN_SECONDS 4
+// A decrease takes a while to show at the sink (encoder lookahead, the queue), the next one
+// waits unless the queue keeps growing. Increases wait a while longer.
+#define DECREASE_INTERVAL_US (1 * G_USEC_PER_SEC)
+#define HOLD_US (3 * G_USEC_PER_SEC)
+// Additive increase, a share of the maximum per sample
+#define INCREASE_DIVISOR 20
+
+void bitrate_controller_init(bitrate_controller *self, guint max_bitrate, guint min_bitrate, guint audio_bitrate) {
+    g_return_if_fail(self && max_bitrate);
+    memset(self, 0, sizeof(bitrate_controller));
+    self->max_bitrate = max_bitrate;
+    self->min_bitrate = MIN(min_bitrate ? min_bitrate : MAX(max_bitrate / 8, 1), max_bitrate);
+    self->audio_bitrate = audio_bitrate;
+    self->bitrate = self->lowest_bitrate = max_bitrate;
+}
+
+guint bitrate_controller_update(bitrate_controller *self, gint64 now, guint throughput, guint queue_bytes,
+                                guint queue_percent) {
+    g_return_val_if_fail(self, 0);
+    self->growing = queue_bytes > self->last_queue_bytes ? self->growing + 1 : 0;
+    self->last_queue_bytes = queue_bytes;
+    self->throughput = throughput;
+    self->queue_percent = queue_percent;
+    self->max_queue_percent = MAX(self->max_queue_percent, queue_percent);
+    self->congested = queue_percent >= CONGESTED_PERCENT ||
+            (queue_percent >= IDLE_PERCENT && self->growing >= GROWING_SAMPLES);
+
+    guint bitrate = self->bitrate;
+    gboolean recent = self->last_decrease && now - self->last_decrease < DECREASE_INTERVAL_US;
+    if (self->congested && (!recent || self->growing)) {
+        // the output sent video and audio, what it managed is the estimate of the uplink
+        gint64 video = (gint64)throughput - self->audio_bitrate;
+        gint64 backlog = (gint64)queue_bytes * 8 / 1000;
+        gint64 estimate = video * HEADROOM_PERCENT / 100 - backlog / DRAIN_SECONDS;
+        bitrate = (guint)MAX(MIN((gint64)bitrate, estimate), (gint64)self->min_bitrate);
+        if (bitrate < self->bitrate) {
+            self->last_decrease = now;
+        }
+    } else if (!self->congested && queue_percent < IDLE_PERCENT && !self->growing &&
+               (!self->last_decrease || now - self->last_decrease >= HOLD_US)) {
+        bitrate = MIN(bitrate + MAX(self->max_bitrate / INCREASE_DIVISOR, 1), self->max_bitrate);
+    }
+    if (bitrate == self->bitrate) {
+        return 0;
+    }
+    if (bitrate < self->bitrate) {
+        self->decreases++;
+    } else {
+        self->increases++;
+    }
+    self->bitrate = bitrate;
+    self->lowest_bitrate = MIN(self->lowest_bitrate, bitrate);
+    return bitrate;
+}
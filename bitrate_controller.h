@@ -0,0 +1,58 @@
+#ifndef _BITRATE_CONTROLLER_H_
+#define _BITRATE_CONTROLLER_H_
+
+#include <glib.h>
+
+// Decisions are taken this often
+#define BITRATE_CONTROLLER_INTERVAL_MS 500
+// x264enc's default bitrate, the maximum when a rendition doesn't set one
+#define BITRATE_CONTROLLER_DEFAULT_MAX 2048
+// avenc_aac's default bitrate, muxed next to the video
+#define BITRATE_CONTROLLER_AUDIO_BITRATE 128
+
+/*
+ * Congestion control of a single encoder, fed with samples of the output it's written to
+ * (all bitrates in kbit/s). The queue in front of the sink tells whether the uplink keeps up:
+ * when it fills up (or keeps growing) the bitrate drops at once to just below what the output
+ * actually sent, leaving room to drain the queue. Once the queue stays nearly empty the
+ * bitrate climbs back in small additive steps, after a hold period following every decrease,
+ * probing for the uplink's capacity up to the maximum.
+ */
+typedef struct {
+    guint max_bitrate;
+    guint min_bitrate;
+    guint audio_bitrate;
+    // the encoder's bitrate
+    guint bitrate;
+    // previous sample
+    guint last_queue_bytes;
+    guint growing;
+    gint64 last_decrease;
+
+    // metrics of the decisions so far
+    guint lowest_bitrate;
+    guint decreases;
+    guint increases;
+    guint throughput;
+    guint queue_percent;
+    guint max_queue_percent;
+    gboolean congested;
+} bitrate_controller;
+
+/**
+ * Starts at the maximum.
+ * @param min_bitrate 0 for an eighth of the maximum
+ */
+void bitrate_controller_init(bitrate_controller *self, guint max_bitrate, guint min_bitrate, guint audio_bitrate);
+
+/**
+ * Takes a sample of the output, every BITRATE_CONTROLLER_INTERVAL_MS.
+ * @param throughput what the output sent since the previous sample, in kbit/s
+ * @param queue_bytes fill level of the output's queue
+ * @param queue_percent fill level relative to the queue's limit
+ * @return new bitrate for the encoder, 0 when it stays
+ */
+guint bitrate_controller_update(bitrate_controller *self, gint64 now, guint throughput, guint queue_bytes,
+                                guint queue_percent);
+
+#endif
@@ -6,16 +6,52 @@
 #include <glib.h>
 
 #include "twitch_broadcaster.h"
+#include "layout.h"
+#include "output.h"
+#include "rendition.h"
+#include "offline_render.h"
+#include "source_registry.h"
+#include "av_sync.h"
 
 static Config config;
+static gchar *layout_name = NULL;
+static gchar **output_descriptions = NULL;
+static gchar **rendition_descriptions = NULL;
+static gint memory_budget_mb = 0;
+static gint prefetch_mb = 0;
+static gint cache_max_mb = 0;
+static gint render_workers = 0;
+static gboolean share_decoders = FALSE;
+static gchar *verify_location = NULL;
 
 static GOptionEntry entries[] =
 {
         { "filesink", 'f', G_OPTION_FLAG_OPTIONAL_ARG, G_OPTION_ARG_STRING, &(config.file_sink), "Optional file sink location, if present overwrites rtmp", "" },
-        { "source1", '1', 0, G_OPTION_ARG_STRING, &(config.source1), "Source 1 location", "" },
-        { "source2", '2', 0, G_OPTION_ARG_STRING, &(config.source2), "Source 2 location", "" },
-        { "source3", '3', 0, G_OPTION_ARG_STRING, &(config.source3), "Source 3 location", "" },
+        { "source", 's', 0, G_OPTION_ARG_STRING_ARRAY, &(config.sources), "Source location (repeat for every source)", "" },
         { "rtmp_address", 'r', 0, G_OPTION_ARG_STRING, &(config.rtmp_address), "rtmp ddress", "" },
+        { "output", 'o', 0, G_OPTION_ARG_STRING_ARRAY, &output_descriptions, "Output location, rtmp:// or tcp://host:port address, shm:///socket/path or file (repeat for every output, overrides filesink and rtmp_address)", "" },
+        { "rendition", 'R', 0, G_OPTION_ARG_STRING_ARRAY, &rendition_descriptions, "ABR ladder step WIDTHxHEIGHT[@KBPS]=OUTPUT (repeat for every rendition, overrides outputs)", "" },
+        { "width", 'W', 0, G_OPTION_ARG_INT, &(config.width), "Output width (default 1920)", "" },
+        { "height", 'H', 0, G_OPTION_ARG_INT, &(config.height), "Output height (default 1080)", "" },
+        { "fps", 0, 0, G_OPTION_ARG_INT, &(config.fps), "Output frame rate (default 30)", "" },
+        { "layout", 'l', 0, G_OPTION_ARG_STRING, &layout_name, "side-by-side (default), grid, pip or main-thumbnails", "" },
+        { "low-latency", 0, 0, G_OPTION_ARG_NONE, &(config.low_latency), "Minimise latency at the cost of compression efficiency", NULL },
+        { "stall-timeout", 0, 0, G_OPTION_ARG_INT, &(config.stall_timeout_ms), "Keep mixing without sources that stall for longer than this many ms", "" },
+        { "fast-start", 0, 0, G_OPTION_ARG_NONE, &(config.fast_start), "Go live with the first ready source instead of waiting for all of them (needs --stall-timeout)", NULL },
+        { "cache-dir", 0, 0, G_OPTION_ARG_STRING, &(config.cache_dir), "Keep remote sources in this directory and replay them from there", "" },
+        { "cache-max", 0, 0, G_OPTION_ARG_INT, &cache_max_mb, "Evict the least recently played sources beyond this many MB of cache", "" },
+        { "prefetch", 0, 0, G_OPTION_ARG_INT, &prefetch_mb, "Read remote sources this many MB ahead", "" },
+        { "memory-budget", 0, 0, G_OPTION_ARG_INT, &memory_budget_mb, "Cap memory buffered by queues and sources at this many MB", "" },
+        { "passthrough", 0, 0, G_OPTION_ARG_NONE, &(config.passthrough), "Remux compatible H.264/AAC of a single source without decoding", NULL },
+        { "adaptive-bitrate", 0, 0, G_OPTION_ARG_NONE, &(config.adaptive_bitrate), "Lower the video bitrate when an output's uplink can't keep up", NULL },
+        { "min-bitrate", 0, 0, G_OPTION_ARG_INT, &(config.min_bitrate), "Lowest adaptive video bitrate in kbit/s (default 1/8 of the configured one)", "" },
+        { "source-cpus", 0, 0, G_OPTION_ARG_STRING, &(config.source_cpus), "Pin decoding, scaling and mixing threads to these CPUs (e.g. 0-3)", "" },
+        { "encoder-cpus", 0, 0, G_OPTION_ARG_STRING, &(config.encoder_cpus), "Pin encoder threads to these CPUs (e.g. 4-7)", "" },
+        { "share-decoders", 0, 0, G_OPTION_ARG_NONE, &share_decoders, "Decode a source repeated on several tiles only once", NULL },
+        { "render-workers", 0, 0, G_OPTION_ARG_INT, &render_workers, "Render the file sink offline, in segments encoded by this many parallel pipelines", "" },
+        { "av-sync-max-offset", 0, 0, G_OPTION_ARG_INT, &(config.av_sync_max_offset_ms), "Raise the A/V sync alarm once audio is this many ms off video (default 80)", "" },
+        { "av-sync-max-drift", 0, 0, G_OPTION_ARG_INT, &(config.av_sync_max_drift_ms_per_hour), "Raise the A/V sync alarm once audio drifts off video by this many ms per hour (default 40)", "" },
+        { "verify", 0, 0, G_OPTION_ARG_STRING, &verify_location, "Only verify A/V sync of this produced file, exits non 0 on alarms or discontinuities", "" },
 };
 
 int main(int argc, char *argv[]) {
@@ -29,8 +65,53 @@ int main(int argc, char *argv[]) {
         g_print("option parsing failed: %s\n", error->message);
         exit(1);
     }
+    config.memory_budget = memory_budget_mb > 0 ? (guint64)memory_budget_mb * 1024 * 1024 : 0;
+    config.prefetch_bytes = prefetch_mb > 0 ? (guint64)prefetch_mb * 1024 * 1024 : 0;
+    config.cache_max_bytes = cache_max_mb > 0 ? (guint64)cache_max_mb * 1024 * 1024 : 0;
+    if (layout_name && !layout_type_from_string(layout_name, &config.layout)) {
+        g_print("unknown layout: %s\n", layout_name);
+        exit(1);
+    }
+    if (output_descriptions) {
+        config.num_outputs = g_strv_length(output_descriptions);
+        config.outputs = g_new0(Output, config.num_outputs);
+        for (guint i = 0; i < config.num_outputs; i++) {
+            output_from_string(output_descriptions[i], &config.outputs[i]);
+        }
+    }
+    if (rendition_descriptions) {
+        config.num_renditions = g_strv_length(rendition_descriptions);
+        config.renditions = g_new0(Rendition, config.num_renditions);
+        Output *rendition_outputs = g_new0(Output, config.num_renditions);
+        for (guint i = 0; i < config.num_renditions; i++) {
+            if (!rendition_from_string(rendition_descriptions[i], &config.renditions[i], &rendition_outputs[i])) {
+                g_print("malformed rendition: %s\n", rendition_descriptions[i]);
+                exit(1);
+            }
+        }
+    }
     gst_init(&argc, &argv);
 
+    if (verify_location) {
+        av_sync_stats stats;
+        gboolean verified = av_sync_verify_file(verify_location, config.av_sync_max_offset_ms,
+                                                config.av_sync_max_drift_ms_per_hour, &stats);
+        g_print("%s: audio %+.1f ms against video (%+.1f ms at the start, %+.1f ms at most), drifting %+.1f ms/h over "
+                "%" G_GINT64_FORMAT " ms, %u video and %u audio discontinuities, %u alarms\n", verify_location,
+                stats.offset_ms, stats.start_offset_ms, stats.max_offset_ms, stats.drift_ms_per_hour, stats.duration_ms,
+                stats.video_discontinuities, stats.audio_discontinuities, stats.alarms);
+        return verified && !stats.alarms && !stats.video_discontinuities && !stats.audio_discontinuities ? 0 : 1;
+    }
+
+    if (render_workers > 0) {
+        RenderConfig render = { (guint)render_workers };
+        return offline_render(&config, &render, NULL) == 0 ? 0 : 1;
+    }
+
+    if (share_decoders) {
+        // tiles subscribe together, a replacement source joins a running decoder
+        config.registry = source_registry_new(FALSE);
+    }
     twitch_broadcaster *broadcaster = twitch_broadcaster_new();
 
     twitch_broadcaster_init(broadcaster, &config);
@@ -38,4 +119,5 @@ int main(int argc, char *argv[]) {
     twitch_broadcaster_run(broadcaster);
 
     twitch_broadcaster_destroy(broadcaster);
+    source_registry_free(config.registry);
 }
\ No newline at end of file
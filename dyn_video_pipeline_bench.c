@@ -0,0 +1,1223 @@
+//
+// Broadcaster benchmark. Runs without network by default: sources are generated
+// locally (test patterns encoded at several resolutions and codecs) and the output
+// goes to /dev/null. Every run reports one JSON object per line (stdout or --results)
+// so results can be collected and compared between commits.
+//
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "twitch_broadcaster.h"
+#include "fixtures.h"
+#include "layout.h"
+#include "tile_compositor.h"
+#include "host.h"
+#include "offline_render.h"
+#include "stats.h"
+#include "av_sync.h"
+
+static gchar **sources = NULL;
+static gint max_sources = 0;
+static gint step = 1;
+static gchar *file_sink = "/dev/null";
+static gchar *fixtures_dir = "fixtures";
+static gint width = 0;
+static gint height = 0;
+static gint duration = 10;
+static gchar *results_file = NULL;
+static gint max_cores = 0;
+static gboolean composite = FALSE;
+static gint max_broadcasts = 0;
+static gint slow_source_ms = 0;
+static gint max_render_workers = 0;
+static gint shared_broadcasts = 0;
+static gboolean packet_output = FALSE;
+static gint soak_minutes = 0;
+static gboolean av_sync = FALSE;
+
+static GOptionEntry entries[] =
+{
+        { "source", 's', 0, G_OPTION_ARG_STRING_ARRAY, &sources, "Source location, repeated in a round robin fashion up to the number of sources (default generated 720p sources)", "" },
+        { "max-sources", 'n', 0, G_OPTION_ARG_INT, &max_sources, "Run the scaling benchmark with 1 up to n sources instead of the configuration matrix", "" },
+        { "step", 'i', 0, G_OPTION_ARG_INT, &step, "Increment of the number of sources between scaling runs (default 1)", "" },
+        { "filesink", 'f', 0, G_OPTION_ARG_STRING, &file_sink, "Output location (default /dev/null)", "" },
+        { "fixtures-dir", 'd', 0, G_OPTION_ARG_STRING, &fixtures_dir, "Where generated sources are kept between runs (default ./fixtures)", "" },
+        { "width", 'W', 0, G_OPTION_ARG_INT, &width, "Output width of the scaling benchmark (default 1920)", "" },
+        { "height", 'H', 0, G_OPTION_ARG_INT, &height, "Output height of the scaling benchmark (default 1080)", "" },
+        { "duration", 't', 0, G_OPTION_ARG_INT, &duration, "Duration of generated sources in seconds (default 10)", "" },
+        { "max-cores", 'c', 0, G_OPTION_ARG_INT, &max_cores, "Run the core scaling benchmark: the 3x720p to 1080p case pinned to 1 up to n cores", "" },
+        { "composite", 'm', 0, G_OPTION_ARG_NONE, &composite, "Run the compositor microbenchmark: cost per composited frame of compositor and tilecompositor", "" },
+        { "max-broadcasts", 'b', 0, G_OPTION_ARG_INT, &max_broadcasts, "Run the density benchmark: 1 up to n concurrent 3x720p broadcasts in one host", "" },
+        { "slow-source", 'S', 0, G_OPTION_ARG_INT, &slow_source_ms, "Run the fast start benchmark: time to first byte of 3x720p with one source served over HTTP that can't be discovered for n ms, with and without fast start", "" },
+        { "render-workers", 'r', 0, G_OPTION_ARG_INT, &max_render_workers, "Run the offline render benchmark: speed-up of rendering 3x720p segment-parallel on 1 up to n workers over a single pipeline", "" },
+        { "shared-source", 'k', 0, G_OPTION_ARG_INT, &shared_broadcasts, "Run the shared decoding benchmark: decode CPU saved when n broadcasts in one host mix the same 720p source decoded once", "" },
+        { "packet-output", 'p', 0, G_OPTION_ARG_NONE, &packet_output, "Run the packet output benchmark: latency and memcpy volume of callback and shared memory outputs against a file tailed by a reader", NULL },
+        { "soak", 'L', 0, G_OPTION_ARG_INT, &soak_minutes, "Run the soak test for n minutes: 3x720p with sources replaced over and over, fails unless memory, threads and elements stay flat and the CPU cost per frame constant", "" },
+        { "av-sync", 'y', 0, G_OPTION_ARG_NONE, &av_sync, "Run the A/V sync benchmark: offset, drift and discontinuities of 3x720p sources of --duration entering the mixers and the muxer and in the written file, and the monitor's cost per buffer", NULL },
+        { "results", 'o', 0, G_OPTION_ARG_STRING, &results_file, "Append JSON results to this file instead of printing them", "" },
+        { NULL }
+};
+
+// A single configuration of the matrix
+typedef struct {
+    const gchar *name;
+    fixture_spec input;
+    guint num_sources;
+    gint width;
+    gint height;
+    layout_type layout;
+    gboolean low_latency;
+    // encode the ABR ladder below from a single composite
+    gboolean ladder;
+    // scale every source regardless of its caps, the baseline for the cases without it
+    gboolean always_scale;
+} bench_case;
+
+static const bench_case cases[] = {
+        { "3x480p-h264-to-1080p", { 854, 480, 30, 0, FIXTURE_H264_AAC_MP4 }, 3, 1920, 1080, LAYOUT_SIDE_BY_SIDE, FALSE },
+        { "3x720p-h264-to-1080p", { 1280, 720, 30, 0, FIXTURE_H264_AAC_MP4 }, 3, 1920, 1080, LAYOUT_SIDE_BY_SIDE, FALSE },
+        { "3x1080p-h264-to-1080p", { 1920, 1080, 30, 0, FIXTURE_H264_AAC_MP4 }, 3, 1920, 1080, LAYOUT_SIDE_BY_SIDE, FALSE },
+        { "3x720p-vp8-to-1080p", { 1280, 720, 30, 0, FIXTURE_VP8_VORBIS_WEBM }, 3, 1920, 1080, LAYOUT_SIDE_BY_SIDE, FALSE },
+        { "3x720p-h264-to-720p", { 1280, 720, 30, 0, FIXTURE_H264_AAC_MP4 }, 3, 1280, 720, LAYOUT_SIDE_BY_SIDE, FALSE },
+        { "3x720p-h264-to-1080p-low-latency", { 1280, 720, 30, 0, FIXTURE_H264_AAC_MP4 }, 3, 1920, 1080, LAYOUT_SIDE_BY_SIDE, TRUE },
+        { "9x480p-h264-to-1080p-grid", { 854, 480, 30, 0, FIXTURE_H264_AAC_MP4 }, 9, 1920, 1080, LAYOUT_GRID, FALSE },
+        { "3x720p-h264-to-1080p-720p-480p-ladder", { 1280, 720, 30, 0, FIXTURE_H264_AAC_MP4 }, 3, 1920, 1080, LAYOUT_SIDE_BY_SIDE, FALSE, TRUE },
+        { "3x480p-h264-to-1080p-always-scale", { 854, 480, 30, 0, FIXTURE_H264_AAC_MP4 }, 3, 1920, 1080, LAYOUT_SIDE_BY_SIDE, FALSE, FALSE, TRUE },
+        { "3x720p-h264-to-1080p-always-scale", { 1280, 720, 30, 0, FIXTURE_H264_AAC_MP4 }, 3, 1920, 1080, LAYOUT_SIDE_BY_SIDE, FALSE, FALSE, TRUE },
+        { "3x1080p-h264-to-1080p-always-scale", { 1920, 1080, 30, 0, FIXTURE_H264_AAC_MP4 }, 3, 1920, 1080, LAYOUT_SIDE_BY_SIDE, FALSE, FALSE, TRUE },
+        // sources already of their tile's size skip scaling altogether
+        { "4x540p-h264-to-1080p-grid", { 960, 540, 30, 0, FIXTURE_H264_AAC_MP4 }, 4, 1920, 1080, LAYOUT_GRID, FALSE },
+        { "4x540p-h264-to-1080p-grid-always-scale", { 960, 540, 30, 0, FIXTURE_H264_AAC_MP4 }, 4, 1920, 1080, LAYOUT_GRID, FALSE, FALSE, TRUE },
+};
+
+// ABR ladder of the ladder cases, compare with the sum of the single rendition cases
+static Rendition ladder[] = {
+        { 1920, 1080, 4500, NULL, 1 },
+        { 1280, 720, 2500, NULL, 1 },
+        { 854, 480, 1000, NULL, 1 },
+};
+
+// Number of distinct test patterns used for generated sources
+#define BENCH_PATTERNS 3
+
+// user + system CPU time consumed by the process so far
+static gdouble cpu_seconds() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+// Resets the process' peak RSS (Linux >= 4.0) so it can be measured per run
+static void reset_peak_rss() {
+    FILE *clear_refs = fopen("/proc/self/clear_refs", "w");
+    if (clear_refs) {
+        fputs("5", clear_refs);
+        fclose(clear_refs);
+    }
+}
+
+// Peak RSS in kB since the last reset, 0 if not available
+static gint64 peak_rss_kb() {
+    gchar *status = NULL;
+    gint64 peak = 0;
+    if (g_file_get_contents("/proc/self/status", &status, NULL, NULL)) {
+        gchar *line = strstr(status, "VmHWM:");
+        if (line) {
+            peak = g_ascii_strtoll(line + strlen("VmHWM:"), NULL, 10);
+        }
+        g_free(status);
+    }
+    return peak;
+}
+
+// Appends a JSON line to --results or prints it
+static void print_result(const gchar *json) {
+    FILE *results = results_file ? fopen(results_file, "a") : NULL;
+    if (results) {
+        fputs(json, results);
+        fclose(results);
+    } else {
+        g_print("%s", json);
+    }
+}
+
+/**
+ * Runs a single configuration and prints its results as JSON.
+ * @param cores in: cores needed by the previous run of a scaling series, out: cores needed
+ * by this run (to sustain the output frame rate in realtime), NULL outside of scaling series
+ */
+static gboolean run_case(const gchar *name, Config *config, guint num_sources, gdouble *cores) {
+    twitch_broadcaster *broadcaster = twitch_broadcaster_new();
+    broadcaster_stats stats;
+    output_stats output;
+    GString *json = g_string_new(NULL);
+
+    if (twitch_broadcaster_init(broadcaster, config) != 0) {
+        g_printerr("Failed to initialise broadcaster for %s\n", name);
+        twitch_broadcaster_destroy(broadcaster);
+        g_string_free(json, TRUE);
+        return FALSE;
+    }
+    reset_peak_rss();
+    gdouble cpu_start = cpu_seconds();
+    gint64 wall_start = g_get_monotonic_time();
+    int res = twitch_broadcaster_run(broadcaster);
+    gdouble wall = (g_get_monotonic_time() - wall_start) / 1e6;
+    gdouble cpu = cpu_seconds() - cpu_start;
+    twitch_broadcaster_get_stats(broadcaster, &stats);
+    twitch_broadcaster_get_output_stats(broadcaster, 0, &output);
+    twitch_broadcaster_destroy(broadcaster);
+
+    guint64 frames = stats.stages[STAGE_ENCODER].buffers;
+    gdouble cpu_per_frame = frames ? cpu / frames : 0;
+    g_string_append_printf(json,
+            "{\"case\":\"%s\",\"sources\":%u,\"result\":%d,\"frames\":%" G_GUINT64_FORMAT ","
+            "\"wall_s\":%.3f,\"cpu_s\":%.3f,\"fps\":%.2f,\"cpu_ms_per_frame\":%.3f,"
+            "\"peak_rss_kb\":%" G_GINT64_FORMAT ",\"ttfb_ms\":%.1f,\"ttfb_sink_ms\":%.1f,"
+            "\"latency_ms\":%.1f,\"max_latency_ms\":%.1f,\"dropped\":%" G_GUINT64_FORMAT ","
+            "\"peak_held_kb\":%" G_GUINT64_FORMAT,
+            name, num_sources, res, frames,
+            wall, cpu, wall > 0 ? frames / wall : 0, cpu_per_frame * 1000,
+            peak_rss_kb(), stats.time_to_first_buffer_us / 1000.0, output.time_to_first_byte_us / 1000.0,
+            stats.pipeline_latency_us / 1000.0, stats.max_pipeline_latency_us / 1000.0,
+            stats.stages[STAGE_MIXER].dropped + stats.stages[STAGE_SINK].dropped,
+            (stats.peak_held_bytes[MEMORY_SOURCES] + stats.peak_held_bytes[MEMORY_ENCODERS] +
+             stats.peak_held_bytes[MEMORY_OUTPUTS]) / 1024);
+    if (cores) {
+        gdouble previous = *cores;
+        *cores = cpu_per_frame * (config->fps ? config->fps : 30);
+        g_string_append_printf(json, ",\"cores_at_realtime\":%.3f,\"cores_per_added_source\":%.3f",
+                               *cores, num_sources > 1 ? (*cores - previous) / step : *cores);
+    }
+    g_string_append(json, "}\n");
+    print_result(json->str);
+    g_string_free(json, TRUE);
+    return res == 0;
+}
+
+// Generated sources for the given spec, distinct patterns round robin
+static gchar** generated_sources(const fixture_spec *spec, guint num_sources) {
+    gchar **uris = g_new0(gchar *, num_sources + 1);
+    for (guint i = 0; i < num_sources; i++) {
+        fixture_spec source_spec = *spec;
+        source_spec.pattern = i % BENCH_PATTERNS;
+        source_spec.duration_s = duration;
+        uris[i] = fixture_get_uri(fixtures_dir, &source_spec);
+        if (!uris[i]) {
+            g_strfreev(uris);
+            return NULL;
+        }
+    }
+    return uris;
+}
+
+static gboolean run_matrix() {
+    gboolean res = TRUE;
+    for (guint i = 0; i < G_N_ELEMENTS(cases); i++) {
+        Config config = { 0 };
+        gchar **uris = generated_sources(&cases[i].input, cases[i].num_sources);
+        if (!uris) {
+            g_printerr("Failed to generate sources for %s\n", cases[i].name);
+            return FALSE;
+        }
+        config.sources = uris;
+        config.file_sink = file_sink;
+        config.width = cases[i].width;
+        config.height = cases[i].height;
+        config.layout = cases[i].layout;
+        config.low_latency = cases[i].low_latency;
+        config.always_scale = cases[i].always_scale;
+        Output ladder_output = { OUTPUT_FILE, file_sink };
+        if (cases[i].ladder) {
+            for (guint j = 0; j < G_N_ELEMENTS(ladder); j++) {
+                ladder[j].outputs = &ladder_output;
+            }
+            config.renditions = ladder;
+            config.num_renditions = G_N_ELEMENTS(ladder);
+        }
+        res = run_case(cases[i].name, &config, cases[i].num_sources, NULL) && res;
+        g_strfreev(uris);
+    }
+    return res;
+}
+
+// Throughput as the number of cores the broadcaster may use grows, all streaming threads
+// (and the decoder and encoder worker threads they start) pinned to the first n cores
+static gboolean run_cores() {
+    gboolean res = TRUE;
+    fixture_spec spec = { 1280, 720, 30, 0, FIXTURE_H264_AAC_MP4 };
+    gchar **uris = sources ? g_strdupv(sources) : generated_sources(&spec, BENCH_PATTERNS);
+    if (!uris) {
+        g_printerr("Failed to generate sources\n");
+        return FALSE;
+    }
+    gint num_cores = MIN(max_cores, (gint)g_get_num_processors());
+    for (gint n = 1; n <= num_cores; n++) {
+        Config config = { 0 };
+        gchar *cpus = n > 1 ? g_strdup_printf("0-%d", n - 1) : g_strdup("0");
+        config.sources = uris;
+        config.file_sink = file_sink;
+        config.width = width;
+        config.height = height;
+        config.source_cpus = cpus;
+        config.encoder_cpus = cpus;
+        gchar *name = g_strdup_printf("cores-%d", n);
+        res = run_case(name, &config, g_strv_length(uris), NULL) && res;
+        g_free(name);
+        g_free(cpus);
+    }
+    g_strfreev(uris);
+    return res;
+}
+
+// CPU per added source and end-to-end fps as the number of sources grows
+static gboolean run_scaling() {
+    gboolean res = TRUE;
+    gdouble cores = 0;
+    gchar **uris = sources;
+    if (!uris) {
+        fixture_spec spec = { 1280, 720, 30, 0, FIXTURE_H264_AAC_MP4 };
+        uris = generated_sources(&spec, BENCH_PATTERNS);
+        if (!uris) {
+            g_printerr("Failed to generate sources\n");
+            return FALSE;
+        }
+    }
+    guint num_uris = g_strv_length(uris);
+    for (gint n = 1; n <= max_sources; n += step) {
+        Config config = { 0 };
+        gchar **run_sources = g_new0(gchar *, n + 1);
+        for (gint i = 0; i < n; i++) {
+            run_sources[i] = uris[i % num_uris];
+        }
+        config.sources = run_sources;
+        config.file_sink = file_sink;
+        config.width = width;
+        config.height = height;
+        config.layout = LAYOUT_GRID;
+        gchar *name = g_strdup_printf("scaling-%d", n);
+        res = run_case(name, &config, n, &cores) && res;
+        g_free(name);
+        g_free(run_sources);
+    }
+    if (uris != sources) {
+        g_strfreev(uris);
+    }
+    return res;
+}
+
+// How many 3 source 720p broadcasts one machine carries: 1 up to --max-broadcasts of them run
+// concurrently in one host as fast as they can, a run sustains realtime if every broadcast
+// still encodes at least its frame rate
+static gboolean run_density() {
+    gboolean res = TRUE;
+    guint sustained = 0;
+    fixture_spec spec = { 1280, 720, 30, 0, FIXTURE_H264_AAC_MP4 };
+    gchar **uris = sources ? g_strdupv(sources) : generated_sources(&spec, BENCH_PATTERNS);
+    if (!uris) {
+        g_printerr("Failed to generate sources\n");
+        return FALSE;
+    }
+    for (gint n = 1; n <= max_broadcasts; n++) {
+        HostConfig host_config = { .expected_broadcasters = n };
+        GMainContext *context = g_main_context_new();
+        broadcaster_host *host = host_new(&host_config, context);
+        host_stats stats;
+        int added = 0;
+        reset_peak_rss();
+        gint64 wall_start = g_get_monotonic_time();
+        for (gint i = 0; host && i < n; i++) {
+            Config config = { 0 };
+            config.sources = uris;
+            config.file_sink = file_sink;
+            config.width = 1280;
+            config.height = 720;
+            added += host_add(host, &config, NULL, NULL) >= 0 ? 1 : 0;
+        }
+        // reads the starting point of CPU time
+        if (host) {
+            host_get_stats(host, &stats);
+        }
+        int result = host && added == n ? host_run(host) : -1;
+        gdouble wall = (g_get_monotonic_time() - wall_start) / 1e6;
+        if (host) {
+            host_get_stats(host, &stats);
+        } else {
+            memset(&stats, 0, sizeof(stats));
+        }
+        gdouble fps_per_broadcast = wall > 0 ? stats.frames / wall / n : 0;
+        gboolean realtime = result == 0 && fps_per_broadcast >= 30;
+        if (realtime) {
+            sustained = n;
+        }
+        gchar *json = g_strdup_printf(
+                "{\"case\":\"density-%d\",\"broadcasts\":%d,\"result\":%d,\"frames\":%" G_GUINT64_FORMAT ","
+                "\"wall_s\":%.3f,\"fps_per_broadcast\":%.2f,\"cores\":%.2f,\"peak_rss_kb\":%" G_GUINT64_FORMAT ","
+                "\"threads\":%u,\"encoder_threads_per_broadcast\":%u,\"realtime\":%s}\n",
+                n, n, result, stats.frames, wall, fps_per_broadcast, stats.cpu_cores,
+                stats.peak_rss_bytes / 1024, stats.threads, stats.encoder_threads, realtime ? "true" : "false");
+        print_result(json);
+        g_free(json);
+        res = res && result == 0;
+        host_free(host);
+        g_main_context_unref(context);
+    }
+    gchar *json = g_strdup_printf("{\"case\":\"density\",\"sustained_broadcasts\":%u}\n", sustained);
+    print_result(json);
+    g_free(json);
+    g_strfreev(uris);
+    return res;
+}
+
+// Time to first byte when one of three sources is slow to be discovered: it's served over HTTP
+// and stalls right at its start for --slow-source ms. Without fast start the broadcast waits for
+// it, with fast start it goes live with the others.
+static gboolean run_fast_start() {
+    gboolean res = TRUE;
+    fixture_spec spec = { 1280, 720, 30, 0, FIXTURE_H264_AAC_MP4 };
+    // webm plays from a non seekable http stream
+    fixture_spec slow_spec = { 1280, 720, 30, 0, FIXTURE_VP8_VORBIS_WEBM };
+    gchar **uris = generated_sources(&spec, 3);
+    gchar **slow_uris = generated_sources(&slow_spec, 1);
+    fixture_http_server *server = fixture_http_server_new(fixtures_dir, 16, slow_source_ms);
+    if (!uris || !slow_uris || !server) {
+        g_printerr("Failed to serve sources\n");
+        res = FALSE;
+        goto exit;
+    }
+    g_free(uris[2]);
+    uris[2] = fixture_http_server_uri(server, slow_uris[0]);
+    for (gint fast_start = 0; fast_start <= 1; fast_start++) {
+        Config config = { 0 };
+        config.sources = uris;
+        config.file_sink = file_sink;
+        config.fast_start = fast_start;
+        // the live mix of fast start sits behind the stall fallback
+        config.stall_timeout_ms = fast_start ? 500 : 0;
+        gchar *name = g_strdup_printf("slow-source-%dms%s", slow_source_ms, fast_start ? "-fast-start" : "");
+        res = run_case(name, &config, 3, NULL) && res;
+        g_free(name);
+    }
+    exit:
+    fixture_http_server_free(server);
+    g_strfreev(uris);
+    g_strfreev(slow_uris);
+    return res;
+}
+
+// Segment-parallel offline rendering of 3x720p sources of --duration into a 1080p file against
+// a single pipeline with the same keyframe interval, with 1 up to --render-workers workers
+static gboolean run_render() {
+    gboolean res = TRUE;
+    fixture_spec spec = { 1280, 720, 30, 0, FIXTURE_H264_AAC_MP4 };
+    gchar **uris = sources ? g_strdupv(sources) : generated_sources(&spec, BENCH_PATTERNS);
+    // segments are written next to the output, /dev/null won't do
+    gchar *location = g_build_filename(fixtures_dir, "render.flv", NULL);
+    if (!uris) {
+        g_printerr("Failed to generate sources\n");
+        g_free(location);
+        return FALSE;
+    }
+    Config config = { 0 };
+    config.sources = uris;
+    config.file_sink = location;
+    config.keyframe_interval = 2 * 30;
+    gint64 wall_start = g_get_monotonic_time();
+    res = run_case("render-single", &config, g_strv_length(uris), NULL);
+    gdouble single_wall = (g_get_monotonic_time() - wall_start) / 1e6;
+    config.keyframe_interval = 0;
+    for (gint n = 1; res && n <= max_render_workers; n++) {
+        RenderConfig render = { (guint)n, 0, 2 };
+        render_stats stats;
+        memset(&stats, 0, sizeof(stats));
+        reset_peak_rss();
+        gdouble cpu_start = cpu_seconds();
+        int result = offline_render(&config, &render, &stats);
+        gdouble cpu = cpu_seconds() - cpu_start;
+        gdouble wall = stats.total_us / 1e6;
+        gchar *json = g_strdup_printf(
+                "{\"case\":\"render-%d\",\"workers\":%u,\"segments\":%u,\"result\":%d,"
+                "\"frames\":%" G_GUINT64_FORMAT ",\"wall_s\":%.3f,\"render_s\":%.3f,\"concat_s\":%.3f,"
+                "\"cpu_s\":%.3f,\"peak_rss_kb\":%" G_GINT64_FORMAT ",\"realtime_factor\":%.2f,"
+                "\"speedup\":%.2f}\n",
+                n, stats.workers, stats.segments, result, stats.frames, wall, stats.render_us / 1e6,
+                stats.concat_us / 1e6, cpu, peak_rss_kb(), stats.speed, wall > 0 ? single_wall / wall : 0);
+        print_result(json);
+        g_free(json);
+        res = res && result == 0;
+    }
+    g_unlink(location);
+    g_free(location);
+    g_strfreev(uris);
+    return res;
+}
+
+// CPU of --shared-source broadcasts in one host mixing the same 720p source onto small
+// canvases (so decoding weighs as much as it can next to encoding), every one decoding it on its
+// own and all of them sharing a single decoder. Late broadcasts join the shared decoder where it
+// is, so CPU is compared per encoded frame as well.
+static gboolean run_shared() {
+    gboolean res = TRUE;
+    gdouble cpu_per_frame[2] = { 0 };
+    gdouble cpu[2] = { 0 };
+    fixture_spec spec = { 1280, 720, 30, 0, FIXTURE_H264_AAC_MP4 };
+    gchar **uris = sources ? g_strdupv(sources) : generated_sources(&spec, 1);
+    if (!uris) {
+        g_printerr("Failed to generate sources\n");
+        return FALSE;
+    }
+    gchar *source[] = { uris[0], NULL };
+    for (gint shared = 0; shared <= 1; shared++) {
+        HostConfig host_config = { .expected_broadcasters = shared_broadcasts, .share_decoders = shared };
+        GMainContext *context = g_main_context_new();
+        broadcaster_host *host = host_new(&host_config, context);
+        host_stats stats;
+        int added = 0;
+        reset_peak_rss();
+        gint64 wall_start = g_get_monotonic_time();
+        gdouble cpu_start = cpu_seconds();
+        for (gint i = 0; host && i < shared_broadcasts; i++) {
+            Config config = { 0 };
+            config.sources = source;
+            config.file_sink = file_sink;
+            config.width = 640;
+            config.height = 360;
+            added += host_add(host, &config, NULL, NULL) >= 0 ? 1 : 0;
+        }
+        int result = host && added == shared_broadcasts ? host_run(host) : -1;
+        gdouble wall = (g_get_monotonic_time() - wall_start) / 1e6;
+        cpu[shared] = cpu_seconds() - cpu_start;
+        if (host) {
+            host_get_stats(host, &stats);
+        } else {
+            memset(&stats, 0, sizeof(stats));
+        }
+        cpu_per_frame[shared] = stats.frames ? cpu[shared] * 1e3 / stats.frames : 0;
+        gchar *json = g_strdup_printf(
+                "{\"case\":\"shared-source-%d%s\",\"broadcasts\":%d,\"shared\":%s,\"result\":%d,"
+                "\"frames\":%" G_GUINT64_FORMAT ",\"wall_s\":%.3f,\"cpu_s\":%.3f,\"cpu_ms_per_frame\":%.3f,"
+                "\"frames_not_decoded\":%" G_GUINT64_FORMAT ",\"peak_rss_kb\":%" G_GINT64_FORMAT "}\n",
+                shared_broadcasts, shared ? "-shared" : "", shared_broadcasts, shared ? "true" : "false", result,
+                stats.frames, wall, cpu[shared], cpu_per_frame[shared], stats.shared_frames, peak_rss_kb());
+        print_result(json);
+        g_free(json);
+        res = res && result == 0;
+        host_free(host);
+        g_main_context_unref(context);
+    }
+    gchar *json = g_strdup_printf(
+            "{\"case\":\"shared-source\",\"broadcasts\":%d,\"decode_cpu_saved_s\":%.3f,"
+            "\"cpu_saved_per_frame_ms\":%.3f,\"cpu_saved_pct\":%.1f}\n",
+            shared_broadcasts, cpu[0] - cpu[1], cpu_per_frame[0] - cpu_per_frame[1],
+            cpu_per_frame[0] > 0 ? (cpu_per_frame[0] - cpu_per_frame[1]) * 100 / cpu_per_frame[0] : 0);
+    print_result(json);
+    g_free(json);
+    g_strfreev(uris);
+    return res;
+}
+
+// When every video frame of a packet output route reached its consumer, single writer per route
+typedef struct {
+    const gchar *name;
+    GArray *arrivals;
+    // bytes the consumer copied to get at the data (read() of the file route)
+    guint64 bytes_read;
+} packet_route;
+
+// TRUE for an FLV tag holding a video frame (not the AVC sequence header)
+static gboolean flv_is_video_frame(const guint8 *tag, gsize size) {
+    return size > 12 && tag[0] == 9 && tag[12] == 1;
+}
+
+static void packet_route_arrived(packet_route *route) {
+    gint64 now = g_get_monotonic_time();
+    g_array_append_val(route->arrivals, now);
+}
+
+static void packet_callback(const output_packet *packet, void *user_data) {
+    if (packet->track == PACKET_MUXED ? flv_is_video_frame(packet->data, packet->size) :
+        packet->track == PACKET_VIDEO && !packet->header) {
+        packet_route_arrived(user_data);
+    }
+}
+
+// A consumer of the file or the shared memory route, stopped once the broadcast is over
+typedef struct {
+    packet_route route;
+    gchar *location;
+    gint done;
+} packet_reader;
+
+// Tails the file as it's written, a tag counts once it's read in full
+static gpointer file_reader_thread(packet_reader *reader) {
+    FILE *file = NULL;
+    while (!file && !g_atomic_int_get(&reader->done)) {
+        if (!(file = fopen(reader->location, "rb"))) {
+            g_usleep(1000);
+        }
+    }
+    if (!file) {
+        return NULL;
+    }
+    GByteArray *pending = g_byte_array_new();
+    guint8 chunk[64 * 1024];
+    gboolean in_header = TRUE;
+    while (TRUE) {
+        // whatever was written before done was set is still read
+        gboolean finishing = g_atomic_int_get(&reader->done);
+        gsize length = fread(chunk, 1, sizeof(chunk), file);
+        if (!length) {
+            if (finishing) {
+                break;
+            }
+            clearerr(file);
+            g_usleep(1000);
+            continue;
+        }
+        reader->route.bytes_read += length;
+        g_byte_array_append(pending, chunk, length);
+        // FLV header and the first previous tag size
+        if (in_header) {
+            if (pending->len < 13) {
+                continue;
+            }
+            g_byte_array_remove_range(pending, 0, 13);
+            in_header = FALSE;
+        }
+        while (pending->len >= 11) {
+            guint size = 11 + ((guint)pending->data[1] << 16 | (guint)pending->data[2] << 8 | pending->data[3]) + 4;
+            if (pending->len < size) {
+                break;
+            }
+            if (flv_is_video_frame(pending->data, size)) {
+                packet_route_arrived(&reader->route);
+            }
+            g_byte_array_remove_range(pending, 0, size);
+        }
+    }
+    g_byte_array_unref(pending);
+    fclose(file);
+    return NULL;
+}
+
+static void shm_handoff_handler(GstElement *sink, GstBuffer *buffer, GstPad *pad, packet_reader *reader) {
+    GstMapInfo map;
+    // shmsink writes one tag per buffer, mapped from the shared area
+    if (gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+        if (flv_is_video_frame(map.data, map.size)) {
+            packet_route_arrived(&reader->route);
+        }
+        gst_buffer_unmap(buffer, &map);
+    }
+}
+
+// Reads the shared memory route in process, from when the sink creates its socket until it closes
+static gpointer shm_reader_thread(packet_reader *reader) {
+    while (!g_file_test(reader->location, G_FILE_TEST_EXISTS)) {
+        if (g_atomic_int_get(&reader->done)) {
+            return NULL;
+        }
+        g_usleep(1000);
+    }
+    GstElement *pipeline = gst_parse_launch("shmsrc name=src is-live=true ! fakesink name=sink signal-handoffs=true sync=false", NULL);
+    if (!pipeline) {
+        return NULL;
+    }
+    GstElement *src = gst_bin_get_by_name(GST_BIN(pipeline), "src");
+    GstElement *sink = gst_bin_get_by_name(GST_BIN(pipeline), "sink");
+    g_object_set(src, "socket-path", reader->location, NULL);
+    g_signal_connect(sink, "handoff", G_CALLBACK(shm_handoff_handler), reader);
+    gst_object_unref(src);
+    gst_object_unref(sink);
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+    GstBus *bus = gst_element_get_bus(pipeline);
+    gint64 deadline = 0;
+    // the sink closing its socket errors the reader out, a little later than done is set
+    while (!deadline || g_get_monotonic_time() < deadline) {
+        GstMessage *message = gst_bus_timed_pop_filtered(bus, 10 * GST_MSECOND, GST_MESSAGE_ERROR | GST_MESSAGE_EOS);
+        if (message) {
+            gst_message_unref(message);
+            break;
+        }
+        if (!deadline && g_atomic_int_get(&reader->done)) {
+            deadline = g_get_monotonic_time() + 200 * 1000;
+        }
+    }
+    gst_object_unref(bus);
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(pipeline);
+    return NULL;
+}
+
+/**
+ * One 720p broadcast to a file tailed by a reader, an FLV callback, an elementary callback and a
+ * shared memory output read by an in process shmsrc. Every route's arrival of a video frame is
+ * compared to the elementary callback's (where packets come out first), routes that started late
+ * (shm readers connect once the broadcast runs) are matched from the end. Copies are what the
+ * outputs copied on the way out plus what the consumer copied to read it.
+ */
+static gboolean run_packets() {
+    fixture_spec spec = { 1280, 720, 30, 0, FIXTURE_H264_AAC_MP4 };
+    gchar **uris = sources ? g_strdupv(sources) : generated_sources(&spec, 1);
+    if (!uris) {
+        g_printerr("Failed to generate sources\n");
+        return FALSE;
+    }
+    packet_route flv = { "flv-callback", g_array_new(FALSE, FALSE, sizeof(gint64)) };
+    packet_route elementary = { "elementary-callback", g_array_new(FALSE, FALSE, sizeof(gint64)) };
+    packet_reader file_reader = { { "file", g_array_new(FALSE, FALSE, sizeof(gint64)) } };
+    packet_reader shm_reader = { { "shm", g_array_new(FALSE, FALSE, sizeof(gint64)) } };
+    file_reader.location = g_build_filename(fixtures_dir, "packets.flv", NULL);
+    shm_reader.location = g_build_filename(g_get_tmp_dir(), "broadcaster-bench-packets", NULL);
+    gchar *shm_location = g_strconcat("shm://", shm_reader.location, NULL);
+    g_unlink(file_reader.location);
+    g_unlink(shm_reader.location);
+
+    Output outputs[4];
+    memset(outputs, 0, sizeof(outputs));
+    outputs[0].type = OUTPUT_FILE;
+    outputs[0].location = file_reader.location;
+    outputs[1].type = OUTPUT_CALLBACK;
+    outputs[1].callback = packet_callback;
+    outputs[1].callback_data = &flv;
+    outputs[2].type = OUTPUT_CALLBACK;
+    outputs[2].callback = packet_callback;
+    outputs[2].callback_data = &elementary;
+    outputs[2].format = PACKETS_ELEMENTARY;
+    outputs[3].type = OUTPUT_SHM;
+    outputs[3].location = shm_location;
+    Config config = { 0 };
+    config.sources = uris;
+    config.width = 1280;
+    config.height = 720;
+    config.outputs = outputs;
+    config.num_outputs = G_N_ELEMENTS(outputs);
+
+    twitch_broadcaster *broadcaster = twitch_broadcaster_new();
+    output_stats stats[G_N_ELEMENTS(outputs)];
+    memset(stats, 0, sizeof(stats));
+    int res = -1;
+    if (twitch_broadcaster_init(broadcaster, &config) == 0) {
+        GThread *threads[] = {
+                g_thread_new("file-reader", (GThreadFunc)file_reader_thread, &file_reader),
+                g_thread_new("shm-reader", (GThreadFunc)shm_reader_thread, &shm_reader),
+        };
+        res = twitch_broadcaster_run(broadcaster);
+        g_atomic_int_set(&file_reader.done, TRUE);
+        g_atomic_int_set(&shm_reader.done, TRUE);
+        for (guint i = 0; i < G_N_ELEMENTS(threads); i++) {
+            g_thread_join(threads[i]);
+        }
+        for (guint i = 0; i < G_N_ELEMENTS(outputs); i++) {
+            twitch_broadcaster_get_output_stats(broadcaster, i, &stats[i]);
+        }
+    } else {
+        g_printerr("Failed to initialise broadcaster for packet outputs\n");
+    }
+    twitch_broadcaster_destroy(broadcaster);
+
+    // in the order of outputs
+    packet_route *routes[] = { &file_reader.route, &flv, &elementary, &shm_reader.route };
+    GArray *reference = elementary.arrivals;
+    for (guint i = 0; i < G_N_ELEMENTS(routes); i++) {
+        GArray *arrivals = routes[i]->arrivals;
+        guint matched = MIN(arrivals->len, reference->len);
+        gint64 total = 0, max = 0;
+        for (guint j = 0; j < matched; j++) {
+            gint64 latency = g_array_index(arrivals, gint64, arrivals->len - matched + j) -
+                    g_array_index(reference, gint64, reference->len - matched + j);
+            total += latency;
+            max = MAX(max, latency);
+        }
+        guint64 copied = stats[i].bytes_copied + routes[i]->bytes_read;
+        gchar *json = g_strdup_printf(
+                "{\"case\":\"packets-%s\",\"result\":%d,\"frames\":%u,\"reference_frames\":%u,"
+                "\"latency_ms\":%.3f,\"max_latency_ms\":%.3f,\"bytes\":%" G_GUINT64_FORMAT ","
+                "\"bytes_copied\":%" G_GUINT64_FORMAT ",\"copies_per_byte\":%.2f}\n",
+                routes[i]->name, res, arrivals->len, reference->len,
+                matched ? total / 1000.0 / matched : 0, max / 1000.0, stats[i].bytes, copied,
+                stats[i].bytes ? (gdouble)copied / stats[i].bytes : 0);
+        print_result(json);
+        g_free(json);
+    }
+    for (guint i = 0; i < G_N_ELEMENTS(routes); i++) {
+        g_array_free(routes[i]->arrivals, TRUE);
+    }
+    g_unlink(file_reader.location);
+    g_unlink(shm_reader.location);
+    g_free(file_reader.location);
+    g_free(shm_reader.location);
+    g_free(shm_location);
+    g_strfreev(uris);
+    return res == 0;
+}
+
+// Soak test: samples taken before memory and cost are compared (decoders and encoders warming up),
+// RSS growth tolerated between the first and last third of the run (the larger of the two) and
+// CPU cost per frame tolerated in the last third relative to the first
+#define SOAK_SOURCES 3
+#define SOAK_WARMUP_SAMPLES 2
+#define SOAK_MAX_RSS_GROWTH (16 * 1024 * 1024)
+#define SOAK_MAX_RSS_GROWTH_PERCENT 5
+#define SOAK_MAX_COST_RATIO 1.2
+
+typedef struct {
+    guint64 rss_bytes;
+    guint threads;
+    guint elements;
+    gdouble cpu_ms_per_frame;
+} soak_sample;
+
+typedef struct {
+    twitch_broadcaster *broadcaster;
+    GMainLoop *loop;
+    gchar **uris;
+    guint num_uris;
+    guint next_uri;
+    // mixed frames after which a source is replaced, half of its length so none ever ends
+    guint64 frames_per_play;
+    guint replacements;
+    gint64 start;
+    gint64 end;
+    gdouble last_cpu;
+    guint64 last_frames;
+    GArray *samples;
+    gboolean completed;
+    int result;
+} soak_run;
+
+static gboolean soak_replace_tick(soak_run *run) {
+    for (guint i = 0; i < SOAK_SOURCES; i++) {
+        source_stats source;
+        if (twitch_broadcaster_get_source_stats(run->broadcaster, i, &source) == 0 &&
+            source.video_frames >= run->frames_per_play &&
+            twitch_broadcaster_replace_source(run->broadcaster, i, run->uris[run->next_uri++ % run->num_uris]) == 0) {
+            run->replacements++;
+        }
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean soak_sample_tick(soak_run *run) {
+    broadcaster_stats stats;
+    soak_sample sample = { 0 };
+    gint64 now = g_get_monotonic_time();
+    gdouble cpu = cpu_seconds();
+    twitch_broadcaster_get_stats(run->broadcaster, &stats);
+    guint64 frames = stats.stages[STAGE_ENCODER].buffers;
+    stats_process_memory(&sample.rss_bytes, NULL, &sample.threads);
+    sample.elements = stats.elements;
+    sample.cpu_ms_per_frame = frames > run->last_frames ? (cpu - run->last_cpu) * 1e3 / (frames - run->last_frames) : 0;
+    g_array_append_val(run->samples, sample);
+    run->last_cpu = cpu;
+    run->last_frames = frames;
+    gchar *json = g_strdup_printf(
+            "{\"case\":\"soak-sample\",\"minutes\":%.1f,\"frames\":%" G_GUINT64_FORMAT ",\"replacements\":%u,"
+            "\"rss_kb\":%" G_GUINT64_FORMAT ",\"threads\":%u,\"elements\":%u,\"mixer_pads\":%u,"
+            "\"cpu_ms_per_frame\":%.3f}\n",
+            (now - run->start) / 6e7, frames, run->replacements, sample.rss_bytes / 1024, sample.threads,
+            sample.elements, stats.mixer_pads, sample.cpu_ms_per_frame);
+    print_result(json);
+    g_free(json);
+    if (now >= run->end) {
+        run->completed = TRUE;
+        twitch_broadcaster_stop(run->broadcaster);
+        return G_SOURCE_REMOVE;
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static void soak_finished(twitch_broadcaster *broadcaster, int result, void *user_data) {
+    soak_run *run = user_data;
+    run->result = result;
+    g_main_loop_quit(run->loop);
+}
+
+// Averages (and highest thread and element counts) of count samples from first on
+static void soak_average(GArray *samples, guint first, guint count, soak_sample *average) {
+    memset(average, 0, sizeof(soak_sample));
+    for (guint i = first; i < first + count; i++) {
+        soak_sample *sample = &g_array_index(samples, soak_sample, i);
+        average->rss_bytes += sample->rss_bytes / count;
+        average->cpu_ms_per_frame += sample->cpu_ms_per_frame / count;
+        average->threads = MAX(average->threads, sample->threads);
+        average->elements = MAX(average->elements, sample->elements);
+    }
+}
+
+/**
+ * Runs 3x720p for --soak minutes, replacing every source before it ends with another one of
+ * the same kind, so decoders and tracks come and go all the time. Samples are taken 20 times
+ * over the run (at most every minute); once warmed up, the last third of them has to hold as
+ * much memory, as many threads and elements and cost as much CPU per frame as the first third.
+ */
+static gboolean run_soak() {
+    fixture_spec spec = { 1280, 720, 30, 0, FIXTURE_H264_AAC_MP4 };
+    gchar **uris = sources ? g_strdupv(sources) : generated_sources(&spec, BENCH_PATTERNS);
+    if (!uris) {
+        g_printerr("Failed to generate sources\n");
+        return FALSE;
+    }
+    gchar *playing[SOAK_SOURCES + 1] = { NULL };
+    for (guint i = 0; i < SOAK_SOURCES; i++) {
+        playing[i] = uris[i % g_strv_length(uris)];
+    }
+    GMainContext *context = g_main_context_new();
+    soak_run run = { 0 };
+    run.broadcaster = twitch_broadcaster_new();
+    run.loop = g_main_loop_new(context, FALSE);
+    run.uris = uris;
+    run.num_uris = g_strv_length(uris);
+    run.next_uri = SOAK_SOURCES;
+    run.frames_per_play = (guint64)duration * 30 / 2;
+    run.samples = g_array_new(FALSE, FALSE, sizeof(soak_sample));
+    run.result = -1;
+    Config config = { 0 };
+    config.sources = playing;
+    config.file_sink = file_sink;
+    config.width = 1280;
+    config.height = 720;
+    broadcaster_callbacks callbacks = { .finished = soak_finished };
+
+    GSource *ticks[] = {
+            g_timeout_source_new(100),
+            g_timeout_source_new_seconds(CLAMP(soak_minutes * 60 / 20, 1, 60)),
+    };
+    g_source_set_callback(ticks[0], (GSourceFunc)soak_replace_tick, &run, NULL);
+    g_source_set_callback(ticks[1], (GSourceFunc)soak_sample_tick, &run, NULL);
+    if (twitch_broadcaster_init(run.broadcaster, &config) == 0 &&
+        twitch_broadcaster_start(run.broadcaster, context, &callbacks, &run) == 0) {
+        run.start = g_get_monotonic_time();
+        run.end = run.start + (gint64)soak_minutes * 60 * G_USEC_PER_SEC;
+        run.last_cpu = cpu_seconds();
+        for (guint i = 0; i < G_N_ELEMENTS(ticks); i++) {
+            g_source_attach(ticks[i], context);
+        }
+        g_main_loop_run(run.loop);
+    } else {
+        g_printerr("Failed to start the soak broadcast\n");
+    }
+    for (guint i = 0; i < G_N_ELEMENTS(ticks); i++) {
+        g_source_destroy(ticks[i]);
+        g_source_unref(ticks[i]);
+    }
+    twitch_broadcaster_destroy(run.broadcaster);
+
+    gboolean flat_memory = FALSE, constant_cost = FALSE;
+    soak_sample first = { 0 }, last = { 0 };
+    guint compared = run.samples->len > SOAK_WARMUP_SAMPLES ? (run.samples->len - SOAK_WARMUP_SAMPLES) / 3 : 0;
+    if (compared) {
+        soak_average(run.samples, SOAK_WARMUP_SAMPLES, compared, &first);
+        soak_average(run.samples, run.samples->len - compared, compared, &last);
+        guint64 tolerance = MAX(first.rss_bytes * SOAK_MAX_RSS_GROWTH_PERCENT / 100, SOAK_MAX_RSS_GROWTH);
+        flat_memory = last.rss_bytes <= first.rss_bytes + tolerance && last.threads <= first.threads &&
+                last.elements <= first.elements;
+        constant_cost = last.cpu_ms_per_frame <= first.cpu_ms_per_frame * SOAK_MAX_COST_RATIO;
+    } else {
+        g_printerr("Too few samples to compare, the soak test needs a longer run\n");
+    }
+    gchar *json = g_strdup_printf(
+            "{\"case\":\"soak\",\"minutes\":%d,\"result\":%d,\"completed\":%s,\"replacements\":%u,"
+            "\"rss_growth_kb\":%" G_GINT64_FORMAT ",\"threads\":[%u,%u],\"elements\":[%u,%u],"
+            "\"cpu_ms_per_frame\":[%.3f,%.3f],\"flat_memory\":%s,\"constant_cost\":%s}\n",
+            soak_minutes, run.result, run.completed ? "true" : "false", run.replacements,
+            ((gint64)last.rss_bytes - (gint64)first.rss_bytes) / 1024, first.threads, last.threads,
+            first.elements, last.elements, first.cpu_ms_per_frame, last.cpu_ms_per_frame,
+            flat_memory ? "true" : "false", constant_cost ? "true" : "false");
+    print_result(json);
+    g_free(json);
+    g_array_free(run.samples, TRUE);
+    g_main_loop_unref(run.loop);
+    g_main_context_unref(context);
+    g_strfreev(uris);
+    return run.result == 0 && run.completed && flat_memory && constant_cost;
+}
+
+// Buffers pushed through a monitor for its cost per buffer
+#define AV_SYNC_MONITOR_BUFFERS 1000000
+
+// JSON object of A/V sync stats
+static gchar* av_sync_json(const av_sync_stats *stats) {
+    return g_strdup_printf("{\"offset_ms\":%.2f,\"start_offset_ms\":%.2f,\"max_offset_ms\":%.2f,"
+                           "\"drift_ms_per_hour\":%.2f,\"video_discontinuities\":%u,\"audio_discontinuities\":%u,"
+                           "\"duration_ms\":%" G_GINT64_FORMAT ",\"alarms\":%u}",
+                           stats->offset_ms, stats->start_offset_ms, stats->max_offset_ms, stats->drift_ms_per_hour,
+                           stats->video_discontinuities, stats->audio_discontinuities, stats->duration_ms, stats->alarms);
+}
+
+// CPU time of pushing AV_SYNC_MONITOR_BUFFERS buffers of interleaved 30 fps video and AAC
+// sized audio through a monitor, per buffer in ns
+static gdouble av_sync_monitor_cost() {
+    av_sync_monitor monitor;
+    GstPad *pads[AV_SYNC_TRACKS] = { gst_pad_new("video", GST_PAD_SRC), gst_pad_new("audio", GST_PAD_SRC) };
+    GstClockTime durations[AV_SYNC_TRACKS] = { GST_SECOND / 30, gst_util_uint64_scale(1024, GST_SECOND, 44100) };
+    GstClockTime positions[AV_SYNC_TRACKS] = { 0, 0 };
+    GstSegment segment;
+    gst_segment_init(&segment, GST_FORMAT_TIME);
+    for (guint i = 0; i < AV_SYNC_TRACKS; i++) {
+        gst_pad_set_active(pads[i], TRUE);
+        gst_pad_push_event(pads[i], gst_event_new_stream_start(GST_PAD_NAME(pads[i])));
+        gst_pad_push_event(pads[i], gst_event_new_caps(gst_caps_new_empty_simple(i ? "audio/x-raw" : "video/x-raw")));
+        gst_pad_push_event(pads[i], gst_event_new_segment(&segment));
+    }
+    av_sync_monitor_init(&monitor, 0, 0);
+    GstBuffer *buffer = gst_buffer_new();
+    gdouble cpu_start = cpu_seconds();
+    for (guint i = 0; i < AV_SYNC_MONITOR_BUFFERS; i++) {
+        av_sync_track track = positions[AV_SYNC_VIDEO] <= positions[AV_SYNC_AUDIO] ? AV_SYNC_VIDEO : AV_SYNC_AUDIO;
+        GST_BUFFER_PTS(buffer) = positions[track];
+        GST_BUFFER_DURATION(buffer) = durations[track];
+        av_sync_monitor_push(&monitor, track, pads[track], buffer);
+        positions[track] += durations[track];
+    }
+    gdouble cpu = cpu_seconds() - cpu_start;
+    gst_buffer_unref(buffer);
+    av_sync_monitor_clear(&monitor);
+    for (guint i = 0; i < AV_SYNC_TRACKS; i++) {
+        gst_object_unref(pads[i]);
+    }
+    return cpu * 1e9 / AV_SYNC_MONITOR_BUFFERS;
+}
+
+/**
+ * Mixes 3x720p sources of --duration into a file and reports A/V sync of every source entering
+ * the mixers, of the encoded tracks entering the muxer and of the written file (decoded again,
+ * as CI verifies files), fails on any alarm. Long durations show drift the 3 s test sources don't.
+ */
+static gboolean run_av_sync() {
+    fixture_spec spec = { 1280, 720, 30, 0, FIXTURE_H264_AAC_MP4 };
+    gchar **uris = sources ? g_strdupv(sources) : generated_sources(&spec, BENCH_PATTERNS);
+    if (!uris) {
+        g_printerr("Failed to generate sources\n");
+        return FALSE;
+    }
+    // the file is decoded again, it can't go to /dev/null
+    gchar *location = g_str_equal(file_sink, "/dev/null") ? g_build_filename(fixtures_dir, "av_sync.flv", NULL) :
+            g_strdup(file_sink);
+    Config config = { 0 };
+    config.sources = uris;
+    config.file_sink = location;
+    config.width = 1280;
+    config.height = 720;
+    twitch_broadcaster *broadcaster = twitch_broadcaster_new();
+    broadcaster_stats stats = { 0 };
+    av_sync_stats file = { 0 }, worst_source = { 0 };
+    guint num_sources = g_strv_length(uris), source_alarms = 0;
+    int result = twitch_broadcaster_init(broadcaster, &config) == 0 ? twitch_broadcaster_run(broadcaster) : -1;
+    twitch_broadcaster_get_stats(broadcaster, &stats);
+    for (guint i = 0; i < num_sources; i++) {
+        source_stats source;
+        if (twitch_broadcaster_get_source_stats(broadcaster, i, &source) == 0) {
+            source_alarms += source.av_sync.alarms;
+            if (i == 0 || ABS(source.av_sync.max_offset_ms) > ABS(worst_source.max_offset_ms)) {
+                worst_source = source.av_sync;
+            }
+        }
+    }
+    twitch_broadcaster_destroy(broadcaster);
+    gint64 verify_start = g_get_monotonic_time();
+    gboolean verified = result == 0 && av_sync_verify_file(location, 0, 0, &file);
+    gdouble verify_s = (g_get_monotonic_time() - verify_start) / 1e6;
+
+    gchar *muxer_json = av_sync_json(&stats.av_sync);
+    gchar *source_json = av_sync_json(&worst_source);
+    gchar *file_json = av_sync_json(&file);
+    gchar *json = g_strdup_printf(
+            "{\"case\":\"av-sync\",\"sources\":%u,\"result\":%d,\"verified\":%s,\"verify_s\":%.3f,"
+            "\"source_alarms\":%u,\"worst_source\":%s,\"muxer\":%s,\"file\":%s,\"monitor_ns_per_buffer\":%.1f}\n",
+            num_sources, result, verified ? "true" : "false", verify_s, source_alarms, source_json, muxer_json,
+            file_json, av_sync_monitor_cost());
+    print_result(json);
+    g_free(json);
+    g_free(muxer_json);
+    g_free(source_json);
+    g_free(file_json);
+    g_free(location);
+    g_strfreev(uris);
+    return verified && !source_alarms && !stats.av_sync.alarms && !file.alarms;
+}
+
+// Layouts of the compositor microbenchmark, on the --width x --height canvas
+static const struct {
+    const gchar *name;
+    layout_type layout;
+    guint num_tiles;
+} composite_cases[] = {
+        { "side-by-side-3", LAYOUT_SIDE_BY_SIDE, 3 },
+        { "grid-9", LAYOUT_GRID, 9 },
+};
+
+#define COMPOSITE_FRAMES 600
+#define COMPOSITE_FPS 30
+
+// A tile's input: the same frame over and over, so producing it costs next to nothing
+typedef struct {
+    GstBuffer *frame;
+    guint pushed;
+} composite_source;
+
+static void composite_need_data(GstElement *appsrc, guint length, composite_source *source) {
+    GstFlowReturn ret;
+    if (source->pushed >= COMPOSITE_FRAMES) {
+        if (source->pushed++ == COMPOSITE_FRAMES) {
+            g_signal_emit_by_name(appsrc, "end-of-stream", &ret);
+        }
+        return;
+    }
+    // copies share the frame's memory
+    GstBuffer *buffer = gst_buffer_copy(source->frame);
+    GST_BUFFER_PTS(buffer) = gst_util_uint64_scale(source->pushed, GST_SECOND, COMPOSITE_FPS);
+    GST_BUFFER_DURATION(buffer) = GST_SECOND / COMPOSITE_FPS;
+    source->pushed++;
+    g_signal_emit_by_name(appsrc, "push-buffer", buffer, &ret);
+    gst_buffer_unref(buffer);
+}
+
+/**
+ * Composites COMPOSITE_FRAMES frames of the layout with the given element as fast as possible.
+ * Without an element every tile goes straight to a fakesink, which is the baseline.
+ * @return CPU seconds of the run, negative on failure
+ */
+static gdouble run_composite(const gchar *factory, layout_type layout, guint num_tiles) {
+    gint canvas_width = width ? width : LAYOUT_DEFAULT_WIDTH;
+    gint canvas_height = height ? height : LAYOUT_DEFAULT_HEIGHT;
+    layout_tile tiles[16];
+    composite_source inputs[16] = { { 0 } };
+    gdouble cpu = -1;
+
+    if (num_tiles > G_N_ELEMENTS(tiles) || !layout_compute(layout, canvas_width, canvas_height, num_tiles, tiles)) {
+        return -1;
+    }
+    GstElement *pipeline = gst_pipeline_new("composite-bench");
+    GstElement *mixer = NULL;
+    if (factory) {
+        GstElement *capsfilter = gst_element_factory_make("capsfilter", NULL);
+        GstElement *sink = gst_element_factory_make("fakesink", NULL);
+        mixer = gst_element_factory_make(factory, NULL);
+        if (!capsfilter || !sink || !mixer) {
+            g_printerr("Failed to create %s\n", factory);
+            goto exit;
+        }
+        GstCaps *caps = gst_caps_new_simple("video/x-raw", "format", G_TYPE_STRING, "I420",
+                                            "width", G_TYPE_INT, canvas_width, "height", G_TYPE_INT, canvas_height,
+                                            "framerate", GST_TYPE_FRACTION, COMPOSITE_FPS, 1, NULL);
+        g_object_set(capsfilter, "caps", caps, NULL);
+        gst_caps_unref(caps);
+        g_object_set(sink, "sync", FALSE, NULL);
+        gst_bin_add_many(GST_BIN(pipeline), mixer, capsfilter, sink, NULL);
+        gst_element_link_many(mixer, capsfilter, sink, NULL);
+    }
+    for (guint i = 0; i < num_tiles; i++) {
+        GstVideoInfo info;
+        gst_video_info_set_format(&info, GST_VIDEO_FORMAT_I420, tiles[i].width, tiles[i].height);
+        GST_VIDEO_INFO_FPS_N(&info) = COMPOSITE_FPS;
+        GST_VIDEO_INFO_FPS_D(&info) = 1;
+        GstCaps *caps = gst_video_info_to_caps(&info);
+        GstElement *appsrc = gst_element_factory_make("appsrc", NULL);
+        if (!appsrc) {
+            gst_caps_unref(caps);
+            goto exit;
+        }
+        inputs[i].frame = gst_buffer_new_allocate(NULL, GST_VIDEO_INFO_SIZE(&info), NULL);
+        gst_buffer_memset(inputs[i].frame, 0, (guint8)(16 * (i + 1)), GST_VIDEO_INFO_SIZE(&info));
+        g_object_set(appsrc, "caps", caps, "format", GST_FORMAT_TIME, NULL);
+        gst_caps_unref(caps);
+        g_signal_connect(appsrc, "need-data", G_CALLBACK(composite_need_data), &inputs[i]);
+        gst_bin_add(GST_BIN(pipeline), appsrc);
+        if (mixer) {
+            GstPad *src_pad = gst_element_get_static_pad(appsrc, "src");
+            GstPad *mixer_pad = gst_element_get_request_pad(mixer, "sink_%u");
+            g_object_set(mixer_pad, "xpos", tiles[i].x, "ypos", tiles[i].y,
+                         "width", tiles[i].width, "height", tiles[i].height, "zorder", tiles[i].zorder, NULL);
+            gst_pad_link(src_pad, mixer_pad);
+            gst_object_unref(src_pad);
+            gst_object_unref(mixer_pad);
+        } else {
+            GstElement *sink = gst_element_factory_make("fakesink", NULL);
+            g_object_set(sink, "sync", FALSE, NULL);
+            gst_bin_add(GST_BIN(pipeline), sink);
+            gst_element_link(appsrc, sink);
+        }
+    }
+    if (mixer && g_str_equal(factory, "compositor")) {
+        g_object_set(mixer, "background", 1, NULL);
+    }
+
+    gdouble cpu_start = cpu_seconds();
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+    GstBus *bus = gst_element_get_bus(pipeline);
+    GstMessage *msg = gst_bus_timed_pop_filtered(bus, GST_CLOCK_TIME_NONE, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+    cpu = cpu_seconds() - cpu_start;
+    if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR) {
+        g_printerr("Compositing with %s failed\n", factory);
+        cpu = -1;
+    }
+    gst_message_unref(msg);
+    gst_object_unref(bus);
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+
+    exit:
+    gst_object_unref(pipeline);
+    for (guint i = 0; i < num_tiles; i++) {
+        if (inputs[i].frame) {
+            gst_buffer_unref(inputs[i].frame);
+        }
+    }
+    return cpu;
+}
+
+// Cost per composited frame of the stock compositor and tilecompositor, over the baseline of
+// pushing the same tiles to fakesinks
+static gboolean run_composite_matrix() {
+    gboolean res = tile_compositor_register();
+    const gchar *factories[] = { "compositor", TILE_COMPOSITOR_FACTORY };
+    for (guint i = 0; i < G_N_ELEMENTS(composite_cases) && res; i++) {
+        gdouble baseline = run_composite(NULL, composite_cases[i].layout, composite_cases[i].num_tiles);
+        for (guint j = 0; j < G_N_ELEMENTS(factories); j++) {
+            gdouble cpu = run_composite(factories[j], composite_cases[i].layout, composite_cases[i].num_tiles);
+            res = res && baseline >= 0 && cpu >= 0;
+            gchar *json = g_strdup_printf(
+                    "{\"case\":\"composite-%s\",\"element\":\"%s\",\"frames\":%d,\"cpu_s\":%.3f,"
+                    "\"cpu_us_per_frame\":%.1f,\"composite_us_per_frame\":%.1f}\n",
+                    composite_cases[i].name, factories[j], COMPOSITE_FRAMES, cpu,
+                    cpu * 1e6 / COMPOSITE_FRAMES, (cpu - baseline) * 1e6 / COMPOSITE_FRAMES);
+            print_result(json);
+            g_free(json);
+        }
+    }
+    return res;
+}
+
+int main(int argc, char *argv[]) {
+    GError *error = NULL;
+    GOptionContext *context;
+
+    context = g_option_context_new("- broadcaster benchmark");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        g_print("option parsing failed: %s\n", error->message);
+        exit(1);
+    }
+    if (max_sources < 0 || max_cores < 0 || max_broadcasts < 0 || slow_source_ms < 0 || max_render_workers < 0 ||
+        shared_broadcasts < 0 || soak_minutes < 0 || step < 1 || duration < 1) {
+        g_printerr("--max-sources, --max-cores, --max-broadcasts, --slow-source, --render-workers, --shared-source, "
+                   "--soak, --step and --duration have to be positive\n");
+        exit(1);
+    }
+    gst_init(&argc, &argv);
+
+    gboolean res = composite ? run_composite_matrix() : max_broadcasts ? run_density() :
+            slow_source_ms ? run_fast_start() : max_render_workers ? run_render() :
+            shared_broadcasts ? run_shared() : packet_output ? run_packets() :
+            soak_minutes ? run_soak() : av_sync ? run_av_sync() : max_cores ? run_cores() :
+            max_sources ? run_scaling() : run_matrix();
+    return res ? 0 : 1;
+}
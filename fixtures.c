@@ -0,0 +1,443 @@
+#include <gst/gst.h>
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+#include <string.h>
+
+#include "fixtures.h"
+
+#define FIXTURE_AUDIO_RATE 44100
+#define FIXTURE_AUDIO_SAMPLES_PER_BUFFER 1024
+
+static const gchar* fixture_extension(fixture_codec codec) {
+    switch (codec) {
+        case FIXTURE_VP8_VORBIS_WEBM:
+            return "webm";
+        case FIXTURE_THEORA_VORBIS_OGG:
+            return "ogg";
+        default:
+            return "mp4";
+    }
+}
+
+// Runs the pipeline description until EOS
+static gboolean fixture_run_pipeline(const gchar *description) {
+    GError *error = NULL;
+    gboolean res = FALSE;
+    GstElement *pipeline = gst_parse_launch(description, &error);
+    if (!pipeline) {
+        g_printerr("Failed to create fixture pipeline: %s\n", error ? error->message : "unknown error");
+        g_clear_error(&error);
+        return FALSE;
+    }
+    GstBus *bus = gst_element_get_bus(pipeline);
+    if (gst_element_set_state(pipeline, GST_STATE_PLAYING) != GST_STATE_CHANGE_FAILURE) {
+        GstMessage *msg = gst_bus_timed_pop_filtered(bus, GST_CLOCK_TIME_NONE,
+                                                     GST_MESSAGE_ERROR | GST_MESSAGE_EOS);
+        if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR) {
+            gst_message_parse_error(msg, &error, NULL);
+            g_printerr("Failed to generate fixture: %s\n", error->message);
+            g_clear_error(&error);
+        } else {
+            res = TRUE;
+        }
+        gst_message_unref(msg);
+    }
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(bus);
+    gst_object_unref(pipeline);
+    return res;
+}
+
+gchar* fixture_get_uri(const gchar *directory, const fixture_spec *spec) {
+    g_return_val_if_fail(directory && spec && spec->fps > 0 && spec->duration_s > 0, NULL);
+    gchar *name = g_strdup_printf("fixture-%dx%d-%dfps-%ds-p%d-%dk.%s",
+                                  spec->width, spec->height, spec->fps, spec->duration_s,
+                                  spec->pattern, spec->bitrate, fixture_extension(spec->codec));
+    // uris need absolute paths
+    gchar *current_dir = g_get_current_dir();
+    gchar *path = g_path_is_absolute(directory) ?
+            g_build_filename(directory, name, NULL) :
+            g_build_filename(current_dir, directory, name, NULL);
+    gchar *uri = NULL;
+    g_free(current_dir);
+    g_free(name);
+
+    if (!g_file_test(path, G_FILE_TEST_EXISTS)) {
+        gchar *video_encoder = NULL;
+        const gchar *audio_encoder = NULL;
+        const gchar *muxer = NULL;
+        if (spec->codec == FIXTURE_VP8_VORBIS_WEBM) {
+            // bitrate in bits/s
+            video_encoder = spec->bitrate ?
+                    g_strdup_printf("vp8enc deadline=1 target-bitrate=%d", spec->bitrate * 1000) :
+                    g_strdup("vp8enc deadline=1");
+            audio_encoder = "vorbisenc";
+            muxer = "webmmux";
+        } else if (spec->codec == FIXTURE_THEORA_VORBIS_OGG) {
+            // bitrate in kbit/s
+            video_encoder = spec->bitrate ?
+                    g_strdup_printf("theoraenc bitrate=%d", spec->bitrate) :
+                    g_strdup("theoraenc");
+            audio_encoder = "vorbisenc";
+            muxer = "oggmux";
+        } else {
+            video_encoder = spec->bitrate ?
+                    g_strdup_printf("x264enc speed-preset=ultrafast bitrate=%d", spec->bitrate) :
+                    g_strdup("x264enc speed-preset=ultrafast");
+            audio_encoder = "avenc_aac";
+            muxer = "mp4mux";
+        }
+        gchar *fixture_dir = g_path_get_dirname(path);
+        g_mkdir_with_parents(fixture_dir, 0755);
+        g_free(fixture_dir);
+        gchar *tmp_path = g_strconcat(path, ".tmp", NULL);
+        gchar *description = g_strdup_printf(
+                "videotestsrc num-buffers=%d pattern=%d ! "
+                "video/x-raw,width=%d,height=%d,framerate=%d/1 ! %s ! queue ! "
+                "%s name=mux ! filesink location=\"%s\" "
+                "audiotestsrc num-buffers=%d samplesperbuffer=%d freq=%d ! "
+                "audio/x-raw,rate=%d,channels=2 ! audioconvert ! %s ! queue ! mux.",
+                spec->fps * spec->duration_s, spec->pattern,
+                spec->width, spec->height, spec->fps, video_encoder,
+                muxer, tmp_path,
+                spec->duration_s * FIXTURE_AUDIO_RATE / FIXTURE_AUDIO_SAMPLES_PER_BUFFER,
+                FIXTURE_AUDIO_SAMPLES_PER_BUFFER, 220 * (spec->pattern + 1),
+                FIXTURE_AUDIO_RATE, audio_encoder);
+        // generated under a temporary name so an interrupted run never leaves a broken fixture
+        if (fixture_run_pipeline(description) && g_rename(tmp_path, path) == 0) {
+            uri = g_filename_to_uri(path, NULL, NULL);
+        }
+        g_free(description);
+        g_free(tmp_path);
+        g_free(video_encoder);
+    } else {
+        uri = g_filename_to_uri(path, NULL, NULL);
+    }
+    g_free(path);
+    return uri;
+}
+
+gchar* fixture_get_chained_uri(const gchar *directory, const fixture_spec *first, const fixture_spec *second) {
+    g_return_val_if_fail(first && first->codec == FIXTURE_THEORA_VORBIS_OGG, NULL);
+    g_return_val_if_fail(second && second->codec == FIXTURE_THEORA_VORBIS_OGG, NULL);
+    gchar *uris[2] = { fixture_get_uri(directory, first), fixture_get_uri(directory, second) };
+    gchar *paths[2] = { NULL, NULL };
+    gchar *path = NULL;
+    gchar *uri = NULL;
+    for (guint i = 0; i < G_N_ELEMENTS(paths); i++) {
+        if (!uris[i] || !(paths[i] = g_filename_from_uri(uris[i], NULL, NULL))) {
+            goto exit;
+        }
+    }
+    // named after both parts, next to them
+    gchar *directory_path = g_path_get_dirname(paths[0]);
+    gchar *first_name = g_path_get_basename(paths[0]);
+    gchar *second_name = g_path_get_basename(paths[1]);
+    *strrchr(first_name, '.') = '\0';
+    gchar *name = g_strdup_printf("chained-%s-%s", first_name, second_name);
+    path = g_build_filename(directory_path, name, NULL);
+    g_free(name);
+    g_free(second_name);
+    g_free(first_name);
+    g_free(directory_path);
+
+    if (!g_file_test(path, G_FILE_TEST_EXISTS)) {
+        // Ogg chains are just concatenated (oggmux picks random serial numbers for the streams)
+        GString *contents = g_string_new(NULL);
+        gboolean res = TRUE;
+        for (guint i = 0; res && i < G_N_ELEMENTS(paths); i++) {
+            gchar *part = NULL;
+            gsize length = 0;
+            res = g_file_get_contents(paths[i], &part, &length, NULL);
+            if (res) {
+                g_string_append_len(contents, part, length);
+            }
+            g_free(part);
+        }
+        // written atomically so an interrupted run never leaves a broken fixture
+        if (res && g_file_set_contents(path, contents->str, contents->len, NULL)) {
+            uri = g_filename_to_uri(path, NULL, NULL);
+        } else {
+            g_printerr("Failed to generate chained fixture %s\n", path);
+        }
+        g_string_free(contents, TRUE);
+    } else {
+        uri = g_filename_to_uri(path, NULL, NULL);
+    }
+    exit:
+    g_free(path);
+    g_free(paths[0]);
+    g_free(paths[1]);
+    g_free(uris[0]);
+    g_free(uris[1]);
+    return uri;
+}
+
+#define FIXTURE_HTTP_CHUNK 4096
+
+struct fixture_http_server {
+    gchar *directory;
+    guint64 stall_offset;
+    guint stall_ms;
+    guint16 port;
+    GSocketListener *listener;
+    GCancellable *cancellable;
+    GThread *thread;
+    volatile gint requests;
+};
+
+// Answers a single request, the connection is closed afterwards
+static void fixture_http_serve(fixture_http_server *self, GSocketConnection *connection) {
+    GInputStream *input = g_io_stream_get_input_stream(G_IO_STREAM(connection));
+    GOutputStream *output = g_io_stream_get_output_stream(G_IO_STREAM(connection));
+    GDataInputStream *lines = g_data_input_stream_new(input);
+    gchar *request = g_data_input_stream_read_line(lines, NULL, self->cancellable, NULL);
+    gchar *contents = NULL;
+    gsize length = 0;
+    // range requests (from an offset to the end) are answered, other headers just consumed
+    gsize start = 0;
+    gboolean range = FALSE;
+
+    gchar *header = NULL;
+    while ((header = g_data_input_stream_read_line(lines, NULL, self->cancellable, NULL)) &&
+           header[0] != '\0' && header[0] != '\r') {
+        if (g_ascii_strncasecmp(header, "Range: bytes=", strlen("Range: bytes=")) == 0) {
+            start = g_ascii_strtoull(header + strlen("Range: bytes="), NULL, 10);
+            range = TRUE;
+        }
+        g_free(header);
+    }
+    g_free(header);
+    gchar **parts = request ? g_strsplit(request, " ", 3) : NULL;
+    if (parts && g_strv_length(parts) >= 2 && !strstr(parts[1], "..")) {
+        gchar *path = g_build_filename(self->directory, parts[1], NULL);
+        g_file_get_contents(path, &contents, &length, NULL);
+        g_free(path);
+    }
+    g_atomic_int_inc(&self->requests);
+    if (!contents || (range && start >= length)) {
+        const gchar *not_found = contents ? "HTTP/1.0 416 Range Not Satisfiable\r\nContent-Length: 0\r\n\r\n" :
+                "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+        g_output_stream_write_all(output, not_found, strlen(not_found), NULL, self->cancellable, NULL);
+    } else {
+        gchar *content_range = range ? g_strdup_printf("Content-Range: bytes %" G_GSIZE_FORMAT "-%" G_GSIZE_FORMAT
+                                                       "/%" G_GSIZE_FORMAT "\r\n", start, length - 1, length) :
+                g_strdup("");
+        gchar *headers = g_strdup_printf("HTTP/1.0 %s\r\nContent-Type: application/octet-stream\r\n"
+                                         "Accept-Ranges: bytes\r\n%sContent-Length: %" G_GSIZE_FORMAT "\r\n"
+                                         "Connection: close\r\n\r\n", range ? "206 Partial Content" : "200 OK",
+                                         content_range, length - start);
+        gboolean ok = g_output_stream_write_all(output, headers, strlen(headers), NULL, self->cancellable, NULL);
+        g_free(headers);
+        g_free(content_range);
+        for (gsize sent = start; ok && sent < length;) {
+            gsize chunk = MIN(FIXTURE_HTTP_CHUNK, length - sent);
+            if (self->stall_offset && sent < self->stall_offset && sent + chunk >= self->stall_offset) {
+                ok = g_output_stream_write_all(output, contents + sent, self->stall_offset - sent, NULL,
+                                               self->cancellable, NULL) && g_output_stream_flush(output, NULL, NULL);
+                sent = self->stall_offset;
+                g_usleep(self->stall_ms * 1000);
+                continue;
+            }
+            ok = g_output_stream_write_all(output, contents + sent, chunk, NULL, self->cancellable, NULL);
+            sent += chunk;
+        }
+    }
+    g_io_stream_close(G_IO_STREAM(connection), NULL, NULL);
+    g_strfreev(parts);
+    g_free(request);
+    g_free(contents);
+    g_object_unref(lines);
+}
+
+static gpointer fixture_http_thread(gpointer user_data) {
+    fixture_http_server *self = user_data;
+    GSocketConnection *connection = NULL;
+    while ((connection = g_socket_listener_accept(self->listener, NULL, self->cancellable, NULL))) {
+        fixture_http_serve(self, connection);
+        g_object_unref(connection);
+    }
+    return NULL;
+}
+
+fixture_http_server* fixture_http_server_new(const gchar *directory, guint64 stall_offset, guint stall_ms) {
+    g_return_val_if_fail(directory, NULL);
+    GError *error = NULL;
+    fixture_http_server *self = g_malloc0(sizeof(fixture_http_server));
+    gchar *current_dir = g_get_current_dir();
+    self->directory = g_path_is_absolute(directory) ?
+            g_strdup(directory) : g_build_filename(current_dir, directory, NULL);
+    g_free(current_dir);
+    self->stall_offset = stall_offset;
+    self->stall_ms = stall_ms;
+    self->cancellable = g_cancellable_new();
+    self->listener = g_socket_listener_new();
+
+    GInetAddress *loopback = g_inet_address_new_loopback(G_SOCKET_FAMILY_IPV4);
+    GSocketAddress *address = g_inet_socket_address_new(loopback, 0);
+    GSocketAddress *bound = NULL;
+    g_object_unref(loopback);
+    if (!g_socket_listener_add_address(self->listener, address, G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_TCP,
+                                       NULL, &bound, &error)) {
+        g_printerr("Failed to start fixture http server: %s\n", error->message);
+        g_clear_error(&error);
+        g_object_unref(address);
+        fixture_http_server_free(self);
+        return NULL;
+    }
+    self->port = g_inet_socket_address_get_port(G_INET_SOCKET_ADDRESS(bound));
+    g_object_unref(bound);
+    g_object_unref(address);
+    self->thread = g_thread_new("fixture-http", fixture_http_thread, self);
+    return self;
+}
+
+gchar* fixture_http_server_uri(fixture_http_server *self, const gchar *file_uri) {
+    g_return_val_if_fail(self && file_uri, NULL);
+    gchar *path = g_filename_from_uri(file_uri, NULL, NULL);
+    if (!path) {
+        return NULL;
+    }
+    gchar *name = g_path_get_basename(path);
+    gchar *uri = g_strdup_printf("http://127.0.0.1:%u/%s", self->port, name);
+    g_free(name);
+    g_free(path);
+    return uri;
+}
+
+guint fixture_http_server_requests(fixture_http_server *self) {
+    return g_atomic_int_get(&self->requests);
+}
+
+void fixture_http_server_free(fixture_http_server *self) {
+    if (!self) {
+        return;
+    }
+    g_cancellable_cancel(self->cancellable);
+    if (self->thread) {
+        g_thread_join(self->thread);
+    }
+    g_socket_listener_close(self->listener);
+    g_object_unref(self->listener);
+    g_object_unref(self->cancellable);
+    g_free(self->directory);
+    g_free(self);
+}
+
+struct fixture_tcp_server {
+    guint16 port;
+    GSocketListener *listener;
+    GCancellable *cancellable;
+    GThread *thread;
+    GMutex lock;
+    // GByteArray of every accepted connection
+    GPtrArray *connections;
+};
+
+static gpointer fixture_tcp_thread(gpointer user_data) {
+    fixture_tcp_server *self = user_data;
+    GSocketConnection *connection = NULL;
+    guint8 chunk[FIXTURE_HTTP_CHUNK];
+    while ((connection = g_socket_listener_accept(self->listener, NULL, self->cancellable, NULL))) {
+        GInputStream *input = g_io_stream_get_input_stream(G_IO_STREAM(connection));
+        GByteArray *data = g_byte_array_new();
+        g_mutex_lock(&self->lock);
+        g_ptr_array_add(self->connections, data);
+        g_mutex_unlock(&self->lock);
+        gssize received = 0;
+        while ((received = g_input_stream_read(input, chunk, sizeof(chunk), self->cancellable, NULL)) > 0) {
+            g_mutex_lock(&self->lock);
+            g_byte_array_append(data, chunk, received);
+            g_mutex_unlock(&self->lock);
+        }
+        g_io_stream_close(G_IO_STREAM(connection), NULL, NULL);
+        g_object_unref(connection);
+    }
+    return NULL;
+}
+
+// Listens on the server's port (a free one the first time) and starts accepting
+static gboolean fixture_tcp_server_listen(fixture_tcp_server *self) {
+    GError *error = NULL;
+    GInetAddress *loopback = g_inet_address_new_loopback(G_SOCKET_FAMILY_IPV4);
+    GSocketAddress *address = g_inet_socket_address_new(loopback, self->port);
+    GSocketAddress *bound = NULL;
+    g_object_unref(loopback);
+    self->cancellable = g_cancellable_new();
+    self->listener = g_socket_listener_new();
+    if (!g_socket_listener_add_address(self->listener, address, G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_TCP,
+                                       NULL, &bound, &error)) {
+        g_printerr("Failed to start fixture tcp server: %s\n", error->message);
+        g_clear_error(&error);
+        g_object_unref(address);
+        g_clear_object(&self->listener);
+        g_clear_object(&self->cancellable);
+        return FALSE;
+    }
+    self->port = g_inet_socket_address_get_port(G_INET_SOCKET_ADDRESS(bound));
+    g_object_unref(bound);
+    g_object_unref(address);
+    self->thread = g_thread_new("fixture-tcp", fixture_tcp_thread, self);
+    return TRUE;
+}
+
+fixture_tcp_server* fixture_tcp_server_new() {
+    fixture_tcp_server *self = g_malloc0(sizeof(fixture_tcp_server));
+    g_mutex_init(&self->lock);
+    self->connections = g_ptr_array_new_with_free_func((GDestroyNotify)g_byte_array_unref);
+    if (!fixture_tcp_server_listen(self)) {
+        fixture_tcp_server_free(self);
+        return NULL;
+    }
+    return self;
+}
+
+guint16 fixture_tcp_server_port(fixture_tcp_server *self) {
+    return self->port;
+}
+
+void fixture_tcp_server_stop(fixture_tcp_server *self) {
+    g_return_if_fail(self);
+    if (!self->thread) {
+        return;
+    }
+    g_cancellable_cancel(self->cancellable);
+    g_thread_join(self->thread);
+    self->thread = NULL;
+    g_socket_listener_close(self->listener);
+    g_clear_object(&self->listener);
+    g_clear_object(&self->cancellable);
+}
+
+gboolean fixture_tcp_server_restart(fixture_tcp_server *self) {
+    g_return_val_if_fail(self, FALSE);
+    return self->thread || fixture_tcp_server_listen(self);
+}
+
+guint fixture_tcp_server_connections(fixture_tcp_server *self) {
+    g_mutex_lock(&self->lock);
+    guint connections = self->connections->len;
+    g_mutex_unlock(&self->lock);
+    return connections;
+}
+
+GBytes* fixture_tcp_server_data(fixture_tcp_server *self, guint connection) {
+    GBytes *bytes = NULL;
+    g_mutex_lock(&self->lock);
+    if (connection < self->connections->len) {
+        GByteArray *data = g_ptr_array_index(self->connections, connection);
+        bytes = g_bytes_new(data->data, data->len);
+    }
+    g_mutex_unlock(&self->lock);
+    return bytes;
+}
+
+void fixture_tcp_server_free(fixture_tcp_server *self) {
+    if (!self) {
+        return;
+    }
+    fixture_tcp_server_stop(self);
+    g_ptr_array_free(self->connections, TRUE);
+    g_mutex_clear(&self->lock);
+    g_free(self);
+}
@@ -0,0 +1,91 @@
+#ifndef _FIXTURES_H_
+#define _FIXTURES_H_
+
+#include <glib.h>
+
+// Locally generated media files, so tests and benchmarks run without network
+
+typedef enum {
+    FIXTURE_H264_AAC_MP4 = 0,
+    FIXTURE_VP8_VORBIS_WEBM,
+    FIXTURE_THEORA_VORBIS_OGG,
+} fixture_codec;
+
+typedef struct {
+    gint width;
+    gint height;
+    gint fps;
+    gint duration_s;
+    fixture_codec codec;
+    // videotestsrc pattern, so sources are told apart in the mix
+    gint pattern;
+    // bitrate of the video track in kbit/s, 0 for the encoder's default
+    gint bitrate;
+} fixture_spec;
+
+/**
+ * Makes sure a file matching the spec exists in the given directory, generating
+ * it (test patterns encoded with the spec's codecs) if it's not there yet.
+ * Files are named after the spec, so repeated runs reuse them.
+ * @return newly allocated file:// uri of the fixture, NULL on failure
+ */
+gchar* fixture_get_uri(const gchar *directory, const fixture_spec *spec);
+
+/**
+ * Like fixture_get_uri(), for a chained Ogg file: the fixtures of both specs (which must be
+ * FIXTURE_THEORA_VORBIS_OGG) one after the other, so decoders replace their tracks midway.
+ * @return newly allocated file:// uri of the fixture, NULL on failure
+ */
+gchar* fixture_get_chained_uri(const gchar *directory, const fixture_spec *first, const fixture_spec *second);
+
+/*
+ * Minimal HTTP/1.0 server on localhost serving fixtures, for sources that have to come
+ * over the network: it answers requests one at a time, ranges from an offset to the end of
+ * the file (so demuxers can seek) included, and can stall responses to simulate a slow or
+ * paused source.
+ */
+typedef struct fixture_http_server fixture_http_server;
+
+/**
+ * Starts serving files of the directory on a free port.
+ * @param stall_offset once this many bytes of a response were sent the server stops
+ * sending for stall_ms, 0 for no stall
+ * @return NULL if the server couldn't be started
+ */
+fixture_http_server* fixture_http_server_new(const gchar *directory, guint64 stall_offset, guint stall_ms);
+
+// http:// uri the file:// uri of a fixture is served at, newly allocated
+gchar* fixture_http_server_uri(fixture_http_server *self, const gchar *file_uri);
+
+// Requests served so far
+guint fixture_http_server_requests(fixture_http_server *self);
+
+void fixture_http_server_free(fixture_http_server *self);
+
+/*
+ * Receiving end of a tcp:// output on localhost: it records everything sent over every
+ * connection (one at a time) and can be stopped and restarted on the same port, like a
+ * receiver that crashes and comes back.
+ */
+typedef struct fixture_tcp_server fixture_tcp_server;
+
+// Starts listening on a free port, NULL if the server couldn't be started
+fixture_tcp_server* fixture_tcp_server_new();
+
+guint16 fixture_tcp_server_port(fixture_tcp_server *self);
+
+// Closes the listening socket and the current connection, unread data makes the sender fail
+void fixture_tcp_server_stop(fixture_tcp_server *self);
+
+// Listens on the same port again, FALSE on failure
+gboolean fixture_tcp_server_restart(fixture_tcp_server *self);
+
+// Connections accepted so far
+guint fixture_tcp_server_connections(fixture_tcp_server *self);
+
+// Data received over the connection (in the order they were accepted), NULL if there's no such connection
+GBytes* fixture_tcp_server_data(fixture_tcp_server *self, guint connection);
+
+void fixture_tcp_server_free(fixture_tcp_server *self);
+
+#endif
@@ -0,0 +1,402 @@
+#include <gst/gst.h>
+#include <glib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "host.h"
+#include "source_registry.h"
+#include "stats.h"
+
+// Task pool of the host: a GThreadPool whose idle threads are reused by any broadcaster's tasks,
+// with at most max_threads tasks at once (0 for no bound)
+typedef struct {
+    GstTaskPool parent;
+    GThreadPool *threads;
+    guint max_threads;
+    gint tasks;
+} HostTaskPool;
+
+typedef struct {
+    GstTaskPoolClass parent_class;
+} HostTaskPoolClass;
+
+G_DEFINE_TYPE(HostTaskPool, host_task_pool, GST_TYPE_TASK_POOL)
+
+typedef struct {
+    GstTaskPoolFunction func;
+    gpointer user_data;
+} host_task;
+
+// A broadcaster of the host and the callbacks it was added with
+typedef struct {
+    guint index;
+    broadcaster_host *host;
+    twitch_broadcaster *broadcaster;
+    broadcaster_callbacks callbacks;
+    gpointer user_data;
+    gboolean running;
+} host_entry;
+
+struct broadcaster_host {
+    HostConfig config;
+    GMainContext *context;
+    // host_run() loop, NULL when not running
+    GMainLoop *loop;
+    // streaming threads of all broadcasters
+    GstTaskPool *task_pool;
+    // decoders shared by all broadcasters, NULL unless share_decoders
+    source_registry *registry;
+    // host_entry per added broadcaster, removed ones leave NULL behind so indexes stay
+    GPtrArray *entries;
+    guint running;
+    guint finished;
+    guint failed;
+    // encoder threads of every broadcaster
+    guint encoder_threads;
+    guint64 last_memory_limit;
+    // previous host_get_stats() call
+    gint64 last_read;
+    guint64 last_cpu_us;
+    guint64 last_frames;
+};
+
+// user + system CPU time consumed by the process so far
+static guint64 host_cpu_us() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (guint64)usage.ru_utime.tv_sec * G_USEC_PER_SEC + usage.ru_utime.tv_usec +
+           (guint64)usage.ru_stime.tv_sec * G_USEC_PER_SEC + usage.ru_stime.tv_usec;
+}
+
+// Broadcasters the budget is divided by
+static guint host_shares(broadcaster_host *self, guint running) {
+    return MAX(MAX(running, self->config.expected_broadcasters), 1);
+}
+
+// Splits the memory budget evenly between the running broadcasters
+static void host_balance_memory(broadcaster_host *self) {
+    if (!self->config.memory_budget || !self->running) {
+        return;
+    }
+    self->last_memory_limit = self->config.memory_budget / host_shares(self, self->running);
+    for (guint i = 0; i < self->entries->len; i++) {
+        host_entry *entry = g_ptr_array_index(self->entries, i);
+        if (entry && entry->running) {
+            twitch_broadcaster_set_memory_limit(entry->broadcaster, self->last_memory_limit);
+        }
+    }
+}
+
+//----------------------------------------------------------------------------------------
+// Task pool
+
+static void host_task_pool_run(gpointer data, gpointer user_data) {
+    host_task *task = data;
+    HostTaskPool *self = user_data;
+    task->func(task->user_data);
+    g_free(task);
+    g_atomic_int_dec_and_test(&self->tasks);
+}
+
+static void host_task_pool_prepare(GstTaskPool *pool, GError **error) {
+    HostTaskPool *self = (HostTaskPool *)pool;
+    // tasks run until their element stops, a queued one would wait for that, so the pool
+    // itself is unbounded and push() refuses tasks beyond the bound instead
+    self->threads = g_thread_pool_new(host_task_pool_run, self, -1, FALSE, error);
+}
+
+static void host_task_pool_cleanup(GstTaskPool *pool) {
+    HostTaskPool *self = (HostTaskPool *)pool;
+    if (self->threads) {
+        // waits for the running tasks
+        g_thread_pool_free(self->threads, FALSE, TRUE);
+        self->threads = NULL;
+    }
+}
+
+static gpointer host_task_pool_push(GstTaskPool *pool, GstTaskPoolFunction func, gpointer user_data, GError **error) {
+    HostTaskPool *self = (HostTaskPool *)pool;
+    gint tasks = g_atomic_int_add(&self->tasks, 1);
+    if (self->max_threads && (guint)tasks >= self->max_threads) {
+        g_atomic_int_dec_and_test(&self->tasks);
+        g_set_error(error, GST_CORE_ERROR, GST_CORE_ERROR_THREAD,
+                    "All %u threads of the host are taken", self->max_threads);
+        return NULL;
+    }
+    host_task *task = g_malloc(sizeof(host_task));
+    task->func = func;
+    task->user_data = user_data;
+    if (!g_thread_pool_push(self->threads, task, error)) {
+        g_free(task);
+        g_atomic_int_dec_and_test(&self->tasks);
+    }
+    // tasks are not joined, like with the default pool
+    return NULL;
+}
+
+static void host_task_pool_class_init(HostTaskPoolClass *klass) {
+    GstTaskPoolClass *pool_class = GST_TASK_POOL_CLASS(klass);
+    pool_class->prepare = host_task_pool_prepare;
+    pool_class->cleanup = host_task_pool_cleanup;
+    pool_class->push = host_task_pool_push;
+}
+
+static void host_task_pool_init(HostTaskPool *self) {
+}
+
+//----------------------------------------------------------------------------------------
+// Callbacks passed on to the ones broadcasters were added with
+
+static void host_state_changed(twitch_broadcaster *broadcaster, const char *old_state, const char *new_state,
+                               void *user_data) {
+    host_entry *entry = user_data;
+    if (entry->callbacks.state_changed) {
+        entry->callbacks.state_changed(broadcaster, old_state, new_state, entry->user_data);
+    }
+}
+
+static void host_error(twitch_broadcaster *broadcaster, const char *element, const char *message, int fatal,
+                       void *user_data) {
+    host_entry *entry = user_data;
+    if (entry->callbacks.error) {
+        entry->callbacks.error(broadcaster, element, message, fatal, entry->user_data);
+    }
+}
+
+static void host_eos(twitch_broadcaster *broadcaster, void *user_data) {
+    host_entry *entry = user_data;
+    if (entry->callbacks.eos) {
+        entry->callbacks.eos(broadcaster, entry->user_data);
+    }
+}
+
+static void host_source_added(twitch_broadcaster *broadcaster, unsigned int index, void *user_data) {
+    host_entry *entry = user_data;
+    if (entry->callbacks.source_added) {
+        entry->callbacks.source_added(broadcaster, index, entry->user_data);
+    }
+}
+
+static void host_source_lost(twitch_broadcaster *broadcaster, unsigned int index, void *user_data) {
+    host_entry *entry = user_data;
+    if (entry->callbacks.source_lost) {
+        entry->callbacks.source_lost(broadcaster, index, entry->user_data);
+    }
+}
+
+static void host_finished(twitch_broadcaster *broadcaster, int result, void *user_data) {
+    host_entry *entry = user_data;
+    broadcaster_host *self = entry->host;
+    entry->running = FALSE;
+    self->running--;
+    self->finished++;
+    if (result != 0) {
+        self->failed++;
+    }
+    // the others get the finished one's share
+    host_balance_memory(self);
+    if (entry->callbacks.finished) {
+        entry->callbacks.finished(broadcaster, result, entry->user_data);
+    }
+    if (!self->running && self->loop) {
+        g_main_loop_quit(self->loop);
+    }
+}
+
+static void host_av_sync_alarm(twitch_broadcaster *broadcaster, int source, const av_sync_stats *stats, void *user_data) {
+    host_entry *entry = user_data;
+    if (entry->callbacks.av_sync_alarm) {
+        entry->callbacks.av_sync_alarm(broadcaster, source, stats, entry->user_data);
+    }
+}
+
+static const broadcaster_callbacks host_callbacks = {
+        host_state_changed, host_error, host_eos, host_source_added, host_source_lost, host_finished,
+        host_av_sync_alarm
+};
+
+static void host_entry_free(host_entry *entry) {
+    if (!entry) {
+        return;
+    }
+    // a running broadcaster is stopped first, its finished callback still fires
+    twitch_broadcaster_destroy(entry->broadcaster);
+    g_free(entry);
+}
+
+//----------------------------------------------------------------------------------------
+// API implementation
+
+broadcaster_host* host_new(const HostConfig *config, GMainContext *context) {
+    GError *error = NULL;
+    if (!config || !config->expected_broadcasters) {
+        g_printerr("The host needs the number of expected broadcasters to divide encoder threads.\n");
+        return NULL;
+    }
+    broadcaster_host *self = g_malloc0(sizeof(broadcaster_host));
+    self->config = *config;
+    if (!self->config.encoder_threads) {
+        self->config.encoder_threads = g_get_num_processors();
+    }
+    // x264enc takes its thread count when it starts, running encoders can't be given more or
+    // fewer threads later, so every broadcaster gets the share of the expected number of them
+    self->encoder_threads = MAX(self->config.encoder_threads / self->config.expected_broadcasters, 1);
+    self->context = context ? g_main_context_ref(context) : NULL;
+    self->entries = g_ptr_array_new();
+    // tasks stopped by one broadcaster (finished broadcasts, replaced sources) leave their
+    // threads to the others
+    self->task_pool = g_object_new(host_task_pool_get_type(), NULL);
+    gst_object_ref_sink(self->task_pool);
+    ((HostTaskPool *)self->task_pool)->max_threads = self->config.max_threads;
+    gst_task_pool_prepare(self->task_pool, &error);
+    if (error) {
+        g_printerr("Failed to prepare the host's thread pool: %s\n", error->message);
+        g_clear_error(&error);
+        host_free(self);
+        return NULL;
+    }
+    if (self->config.share_decoders) {
+        self->registry = source_registry_new(self->config.share_from_start);
+    }
+    self->last_read = g_get_monotonic_time();
+    self->last_cpu_us = host_cpu_us();
+    return self;
+}
+
+int host_add(broadcaster_host *self, const Config *config, const broadcaster_callbacks *callbacks, void *user_data) {
+    g_return_val_if_fail(self && config, -1);
+    Config host_config = *config;
+    host_entry *entry = g_malloc0(sizeof(host_entry));
+    entry->index = self->entries->len;
+    entry->host = self;
+    entry->broadcaster = twitch_broadcaster_new();
+    if (callbacks) {
+        entry->callbacks = *callbacks;
+    }
+    entry->user_data = user_data;
+
+    host_config.task_pool = self->task_pool;
+    if (self->registry) {
+        host_config.registry = self->registry;
+    }
+    if (host_config.encoder_threads <= 0) {
+        host_config.encoder_threads = self->encoder_threads;
+    }
+    if (twitch_broadcaster_init(entry->broadcaster, &host_config) != 0) {
+        g_printerr("Failed to initialise broadcaster %u of the host.\n", entry->index);
+        host_entry_free(entry);
+        return -1;
+    }
+    g_ptr_array_add(self->entries, entry);
+    entry->running = TRUE;
+    self->running++;
+    // limited before it starts buffering
+    host_balance_memory(self);
+    if (twitch_broadcaster_start(entry->broadcaster, self->context, &host_callbacks, entry) != 0) {
+        g_printerr("Failed to start broadcaster %u of the host.\n", entry->index);
+        entry->running = FALSE;
+        self->running--;
+        self->finished++;
+        self->failed++;
+        host_balance_memory(self);
+        return -1;
+    }
+    return entry->index;
+}
+
+twitch_broadcaster* host_get_broadcaster(broadcaster_host *self, unsigned int index) {
+    g_return_val_if_fail(self, NULL);
+    host_entry *entry = index < self->entries->len ? g_ptr_array_index(self->entries, index) : NULL;
+    return entry ? entry->broadcaster : NULL;
+}
+
+int host_remove(broadcaster_host *self, unsigned int index) {
+    g_return_val_if_fail(self, -1);
+    host_entry *entry = index < self->entries->len ? g_ptr_array_index(self->entries, index) : NULL;
+    if (!entry) {
+        g_printerr("No broadcaster %u in the host.\n", index);
+        return -1;
+    }
+    if (entry->running) {
+        twitch_broadcaster_stop(entry->broadcaster);
+    }
+    self->entries->pdata[index] = NULL;
+    host_entry_free(entry);
+    return 0;
+}
+
+int host_run(broadcaster_host *self) {
+    g_return_val_if_fail(self && !self->loop, -1);
+    if (self->running) {
+        self->loop = g_main_loop_new(self->context, FALSE);
+        g_main_loop_run(self->loop);
+        g_main_loop_unref(self->loop);
+        self->loop = NULL;
+    }
+    return self->failed ? -1 : 0;
+}
+
+int host_get_stats(broadcaster_host *self, host_stats *stats) {
+    g_return_val_if_fail(self && stats, -1);
+    gint64 now = g_get_monotonic_time();
+
+    memset(stats, 0, sizeof(host_stats));
+    stats->broadcasters = self->running;
+    stats->finished = self->finished;
+    stats->failed = self->failed;
+    stats->cpu_us = host_cpu_us();
+    stats->cpu_cores = now > self->last_read ? (gdouble)(stats->cpu_us - self->last_cpu_us) / (now - self->last_read) : 0;
+    stats_process_memory(&stats->rss_bytes, &stats->peak_rss_bytes, &stats->threads);
+    stats->memory_limit = self->running ? self->last_memory_limit : 0;
+    stats->encoder_threads = self->encoder_threads;
+
+    for (guint i = 0; i < self->entries->len; i++) {
+        host_entry *entry = g_ptr_array_index(self->entries, i);
+        broadcaster_stats broadcaster;
+        output_stats output;
+        if (!entry || twitch_broadcaster_get_stats(entry->broadcaster, &broadcaster) != 0) {
+            continue;
+        }
+        stats->frames += broadcaster.stages[STAGE_ENCODER].buffers;
+        for (guint j = 0; entry->running && twitch_broadcaster_get_output_stats(entry->broadcaster, j, &output) == 0; j++) {
+            stats->queued_bytes += output.queue_bytes;
+        }
+    }
+    stats->fps = now > self->last_read && stats->frames >= self->last_frames ?
+            (stats->frames - self->last_frames) * (gdouble)G_USEC_PER_SEC / (now - self->last_read) : 0;
+    if (self->registry) {
+        registry_stats registry;
+        source_registry_get_stats(self->registry, &registry);
+        stats->shared_decoders = registry.decoders;
+        stats->shared_sources = registry.subscribers;
+        stats->shared_frames = registry.delivered_frames - registry.decoded_frames;
+    }
+    self->last_read = now;
+    self->last_cpu_us = stats->cpu_us;
+    self->last_frames = stats->frames;
+    return 0;
+}
+
+void host_free(broadcaster_host *self) {
+    if (!self) {
+        return;
+    }
+    for (guint i = 0; i < self->entries->len; i++) {
+        // the others are rebalanced while this one finishes, it mustn't be visited
+        host_entry *entry = g_ptr_array_index(self->entries, i);
+        self->entries->pdata[i] = NULL;
+        host_entry_free(entry);
+    }
+    g_ptr_array_free(self->entries, TRUE);
+    // every broadcaster ended its subscriptions
+    source_registry_free(self->registry);
+    if (self->task_pool) {
+        // waits for the threads of the pool to finish
+        gst_task_pool_cleanup(self->task_pool);
+        gst_object_unref(self->task_pool);
+    }
+    if (self->context) {
+        g_main_context_unref(self->context);
+    }
+    g_free(self);
+}
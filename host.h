@@ -0,0 +1,107 @@
+#ifndef _HOST_H_
+#define _HOST_H_
+
+#include <stdint.h>
+
+#include "twitch_broadcaster.h"
+
+/*
+ * A set of broadcasters sharing one process: their streaming threads come from one task
+ * pool, a global memory budget is balanced between them as they come and go and encoder
+ * threads are divided evenly. All broadcasters are driven by a bus watch on the host's main
+ * context, so the host needs no thread per broadcast. Host functions are to be called from
+ * the thread running that context.
+ */
+
+typedef struct {
+    // bytes all broadcasters may buffer together (output queues and source buffering), split
+    // evenly between the running broadcasters, 0 leaves every broadcaster its defaults
+    uint64_t memory_budget;
+    // encoder threads divided between the broadcasters, 0 for the number of CPUs
+    unsigned int encoder_threads;
+    // broadcasts expected to run at the same time, required: every broadcaster gets this
+    // share of the encoder threads (encoders can't change theirs once started, more
+    // broadcasters than expected oversubscribe them) and the memory budget is divided by it
+    // until more are running
+    unsigned int expected_broadcasters;
+    // non 0 decodes every source uri once for all broadcasters mixing it (see
+    // source_registry.h) instead of once per broadcaster
+    int share_decoders;
+    // most streaming tasks of all broadcasters at once, a task which doesn't fit fails the
+    // element starting it (with an error of its broadcaster) instead of waiting for a thread.
+    // 0 for no bound
+    unsigned int max_threads;
+    // with share_decoders, non 0 plays every source from its start: a broadcaster added once
+    // the decoder of a uri delivered data gets a decoder of its own instead of joining it
+    int share_from_start;
+} HostConfig;
+
+typedef struct {
+    unsigned int broadcasters; // running
+    unsigned int finished; // finished (or stopped), failed ones included
+    unsigned int failed;
+    // CPU used by the process: in total and since the previous host_get_stats() call, in cores
+    uint64_t cpu_us;
+    double cpu_cores;
+    uint64_t rss_bytes;
+    uint64_t peak_rss_bytes;
+    unsigned int threads; // threads of the process
+    // bytes held by the output queues of the running broadcasters
+    uint64_t queued_bytes;
+    // share of the memory budget of every running broadcaster, 0 without a budget
+    uint64_t memory_limit;
+    // encoder threads given to every broadcaster which doesn't set its own
+    unsigned int encoder_threads;
+    // frames encoded by all broadcasters (their first rendition), per second since the previous call
+    uint64_t frames;
+    double fps;
+    // with share_decoders: decoders running, broadcasters' sources fed by them and video
+    // frames handed to a broadcaster without decoding them again
+    unsigned int shared_decoders;
+    unsigned int shared_sources;
+    uint64_t shared_frames;
+} host_stats;
+
+typedef struct broadcaster_host broadcaster_host;
+
+/**
+ * Creates a host whose broadcasters are driven from the given context (NULL for the global
+ * default context).
+ * @return NULL on failure (e.g. no expected_broadcasters)
+ */
+broadcaster_host* host_new(const HostConfig *config, struct _GMainContext *context);
+
+/**
+ * Initialises a broadcaster for the config, with the host's thread pool, its share of
+ * encoder threads (unless config sets its own) and the host's shared decoders, and starts
+ * it. The memory budget is rebalanced between all running broadcasters. Callbacks are
+ * passed on from the host.
+ * @return index of the broadcaster, -1 on failure
+ */
+int host_add(broadcaster_host *self, const Config *config, const broadcaster_callbacks *callbacks, void *user_data);
+
+// Broadcaster at the index (running or finished), NULL once removed
+twitch_broadcaster* host_get_broadcaster(broadcaster_host *self, unsigned int index);
+
+/**
+ * Stops the broadcaster if it's running, destroys it and gives its memory share to the others.
+ * @return non 0 on failure (e.g. no broadcaster at the index), 0 otherwise
+ */
+int host_remove(broadcaster_host *self, unsigned int index);
+
+/**
+ * Runs the host's context until no broadcaster is running.
+ * @return non 0 if any broadcaster failed, 0 otherwise
+ */
+int host_run(broadcaster_host *self);
+
+/**
+ * Aggregate stats of the process and all broadcasters of the host.
+ * @return non 0 on failure, 0 otherwise
+ */
+int host_get_stats(broadcaster_host *self, host_stats *stats);
+
+// Stops and destroys all broadcasters and releases the host
+void host_free(broadcaster_host *self);
+
+#endif
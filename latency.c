@@ -0,0 +1,76 @@
+#include "latency.h"
+
+void latency_tracker_init(latency_tracker *self, GstClockTime frame_duration) {
+    g_return_if_fail(self);
+    g_mutex_init(&self->lock);
+    for (guint i = 0; i < LATENCY_RING_SIZE; i++) {
+        self->ring[i].running_time = GST_CLOCK_TIME_NONE;
+    }
+    self->head = 0;
+    self->frame_duration = frame_duration;
+    self->last_us = self->max_us = self->total_us = 0;
+    self->count = 0;
+}
+
+void latency_tracker_clear(latency_tracker *self) {
+    g_return_if_fail(self);
+    g_mutex_clear(&self->lock);
+}
+
+void latency_tracker_ingress(latency_tracker *self, GstClockTime running_time, gint64 now) {
+    if (!GST_CLOCK_TIME_IS_VALID(running_time)) {
+        return;
+    }
+    g_mutex_lock(&self->lock);
+    self->ring[self->head].running_time = running_time;
+    self->ring[self->head].arrival = now;
+    self->head = (self->head + 1) % LATENCY_RING_SIZE;
+    g_mutex_unlock(&self->lock);
+}
+
+gboolean latency_tracker_egress(latency_tracker *self, GstClockTime running_time, gint64 now,
+                                gint64 *latency_us) {
+    gint64 oldest_arrival = G_MAXINT64;
+    if (!GST_CLOCK_TIME_IS_VALID(running_time)) {
+        return FALSE;
+    }
+    g_mutex_lock(&self->lock);
+    // inputs up to the output's running time are consumed by now and get forgotten,
+    // only those within the last frame contributed to this output
+    for (guint i = 0; i < LATENCY_RING_SIZE; i++) {
+        latency_sample *sample = &self->ring[i];
+        if (!GST_CLOCK_TIME_IS_VALID(sample->running_time) || sample->running_time > running_time) {
+            continue;
+        }
+        if (sample->running_time + self->frame_duration > running_time) {
+            oldest_arrival = MIN(oldest_arrival, sample->arrival);
+        }
+        sample->running_time = GST_CLOCK_TIME_NONE;
+    }
+    if (oldest_arrival != G_MAXINT64) {
+        self->last_us = now - oldest_arrival;
+        self->max_us = MAX(self->max_us, self->last_us);
+        self->total_us += self->last_us;
+        self->count++;
+        if (latency_us) {
+            *latency_us = self->last_us;
+        }
+    }
+    g_mutex_unlock(&self->lock);
+    return oldest_arrival != G_MAXINT64;
+}
+
+void latency_tracker_get(latency_tracker *self, gint64 *last_us, gint64 *average_us, gint64 *max_us) {
+    g_return_if_fail(self);
+    g_mutex_lock(&self->lock);
+    if (last_us) {
+        *last_us = self->last_us;
+    }
+    if (average_us) {
+        *average_us = self->count ? self->total_us / (gint64)self->count : 0;
+    }
+    if (max_us) {
+        *max_us = self->max_us;
+    }
+    g_mutex_unlock(&self->lock);
+}
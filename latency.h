@@ -0,0 +1,50 @@
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#include <gst/gst.h>
+#include <glib.h>
+
+// How many in-flight ingress timestamps are remembered, frames older than that
+// (e.g. dropped by the mixer) simply fall out of the ring
+#define LATENCY_RING_SIZE 512
+
+typedef struct {
+    GstClockTime running_time;
+    gint64 arrival; // monotonic time in us
+} latency_sample;
+
+// Matches buffers entering the pipeline (decoder src pads) with buffers leaving it
+// (sink) by running time and keeps wall clock latency statistics between the two
+typedef struct {
+    GMutex lock;
+    latency_sample ring[LATENCY_RING_SIZE];
+    guint head;
+    // output buffer at running time T contains inputs from (T - frame_duration, T]
+    GstClockTime frame_duration;
+
+    gint64 last_us;
+    gint64 max_us;
+    gint64 total_us;
+    guint64 count;
+} latency_tracker;
+
+void latency_tracker_init(latency_tracker *self, GstClockTime frame_duration);
+
+void latency_tracker_clear(latency_tracker *self);
+
+// Remembers that a buffer with the given running time entered the pipeline at `now`
+void latency_tracker_ingress(latency_tracker *self, GstClockTime running_time, gint64 now);
+
+/**
+ * Matches an output buffer against remembered inputs. Latency is measured against the
+ * oldest input that made it into the output buffer (slowest source).
+ * @return TRUE if a matching input was found and latency_us was set
+ */
+gboolean latency_tracker_egress(latency_tracker *self, GstClockTime running_time, gint64 now,
+                                gint64 *latency_us);
+
+// Last, average and max latency in us, 0 when nothing was measured yet. Any of the
+// out params can be NULL
+void latency_tracker_get(latency_tracker *self, gint64 *last_us, gint64 *average_us, gint64 *max_us);
+
+#endif
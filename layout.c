@@ -0,0 +1,114 @@
+#include "layout.h"
+
+// Picture-in-picture overlays take 1/4 of the canvas in each dimension
+#define PIP_SCALE 4
+#define PIP_MARGIN 16
+
+// Main source width share (in percent) of the main + thumbnails layout
+#define MAIN_WIDTH_PERCENT 75
+
+// Splits [0, length) into count even aligned segments covering it exactly
+static gint segment_start(gint length, guint count, guint i) {
+    return (gint)(((gint64)length * i / count) & ~1);
+}
+
+static void fill_tile(layout_tile *tile, gint x, gint y, gint x_end, gint y_end, guint zorder) {
+    tile->x = x;
+    tile->y = y;
+    tile->width = x_end - x;
+    tile->height = y_end - y;
+    tile->zorder = zorder;
+}
+
+static void layout_grid(gint width, gint height, guint cols, guint rows, gint x0, gint y0,
+                        guint num_tiles, layout_tile *tiles) {
+    for (guint i = 0; i < num_tiles; i++) {
+        guint col = i % cols;
+        guint row = i / cols;
+        fill_tile(&tiles[i],
+                  x0 + segment_start(width, cols, col),
+                  y0 + segment_start(height, rows, row),
+                  x0 + (col + 1 == cols ? width : segment_start(width, cols, col + 1)),
+                  y0 + (row + 1 == rows ? height : segment_start(height, rows, row + 1)),
+                  0);
+    }
+}
+
+gboolean layout_compute(layout_type type, gint canvas_width, gint canvas_height,
+                        guint num_tiles, layout_tile *tiles) {
+    g_return_val_if_fail(tiles && num_tiles > 0, FALSE);
+    if (canvas_width <= 0 || canvas_height <= 0 || canvas_width % 2 || canvas_height % 2) {
+        return FALSE;
+    }
+    switch (type) {
+        case LAYOUT_SIDE_BY_SIDE:
+            layout_grid(canvas_width, canvas_height, num_tiles, 1, 0, 0, num_tiles, tiles);
+            break;
+        case LAYOUT_GRID: {
+            guint cols = 1;
+            while (cols * cols < num_tiles) {
+                cols++;
+            }
+            guint rows = (num_tiles + cols - 1) / cols;
+            layout_grid(canvas_width, canvas_height, cols, rows, 0, 0, num_tiles, tiles);
+            break;
+        }
+        case LAYOUT_PICTURE_IN_PICTURE: {
+            // first source full screen, the rest in rows from the bottom-right corner on top of it
+            gint pip_width = (canvas_width / PIP_SCALE) & ~1;
+            gint pip_height = (canvas_height / PIP_SCALE) & ~1;
+            guint per_row = MAX((canvas_width - PIP_MARGIN) / (pip_width + PIP_MARGIN), 1);
+            fill_tile(&tiles[0], 0, 0, canvas_width, canvas_height, 0);
+            for (guint i = 1; i < num_tiles; i++) {
+                guint col = (i - 1) % per_row;
+                guint row = (i - 1) / per_row;
+                gint x = canvas_width - (gint)(col + 1) * (pip_width + PIP_MARGIN);
+                gint y = canvas_height - (gint)(row + 1) * (pip_height + PIP_MARGIN);
+                if (x < 0 || y < 0) {
+                    return FALSE;
+                }
+                fill_tile(&tiles[i], x, y, x + pip_width, y + pip_height, 1);
+            }
+            break;
+        }
+        case LAYOUT_MAIN_THUMBNAILS: {
+            // first source weighted on the left, the rest in one column on the right
+            if (num_tiles == 1) {
+                fill_tile(&tiles[0], 0, 0, canvas_width, canvas_height, 0);
+                break;
+            }
+            gint main_width = (gint)(((gint64)canvas_width * MAIN_WIDTH_PERCENT / 100) & ~1);
+            if (canvas_height / (gint)(num_tiles - 1) < 2) {
+                return FALSE;
+            }
+            fill_tile(&tiles[0], 0, 0, main_width, canvas_height, 0);
+            layout_grid(canvas_width - main_width, canvas_height, 1, num_tiles - 1, main_width, 0,
+                        num_tiles - 1, tiles + 1);
+            break;
+        }
+        default:
+            return FALSE;
+    }
+    for (guint i = 0; i < num_tiles; i++) {
+        if (tiles[i].width <= 0 || tiles[i].height <= 0) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+gboolean layout_type_from_string(const gchar *name, layout_type *type) {
+    g_return_val_if_fail(name && type, FALSE);
+    if (g_str_equal(name, "side-by-side")) {
+        *type = LAYOUT_SIDE_BY_SIDE;
+    } else if (g_str_equal(name, "grid")) {
+        *type = LAYOUT_GRID;
+    } else if (g_str_equal(name, "pip")) {
+        *type = LAYOUT_PICTURE_IN_PICTURE;
+    } else if (g_str_equal(name, "main-thumbnails")) {
+        *type = LAYOUT_MAIN_THUMBNAILS;
+    } else {
+        return FALSE;
+    }
+    return TRUE;
+}
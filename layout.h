@@ -0,0 +1,40 @@
+#ifndef _LAYOUT_H_
+#define _LAYOUT_H_
+
+#include <glib.h>
+
+#include "twitch_broadcaster.h"
+
+// Default output canvas
+#define LAYOUT_DEFAULT_WIDTH 1920
+#define LAYOUT_DEFAULT_HEIGHT 1080
+#define LAYOUT_DEFAULT_FPS 30
+
+// Position and size of a single source on the output canvas
+typedef struct {
+    gint x;
+    gint y;
+    gint width;
+    gint height;
+    // tiles with higher zorder are drawn on top
+    guint zorder;
+} layout_tile;
+
+/**
+ * Computes tile geometry for the given number of sources.
+ * All coordinates and sizes are even so tiles map onto I420 chroma planes
+ * and neighbouring tiles share edges without gaps or overlaps (except for
+ * the picture-in-picture overlays).
+ * @param tiles array of at least num_tiles elements to be filled in
+ * @return FALSE if the canvas is too small for the requested layout
+ */
+gboolean layout_compute(layout_type type, gint canvas_width, gint canvas_height,
+                        guint num_tiles, layout_tile *tiles);
+
+/**
+ * Parses layout name (side-by-side, grid, pip, main-thumbnails).
+ * @return FALSE for unknown names
+ */
+gboolean layout_type_from_string(const gchar *name, layout_type *type);
+
+#endif
@@ -0,0 +1,299 @@
+#include <gst/gst.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+
+#include "offline_render.h"
+#include "host.h"
+#include "layout.h"
+
+#define RENDER_DEFAULT_KEYFRAME_SECONDS 2
+// how long a source may take to preroll while its duration is probed
+#define RENDER_PROBE_TIMEOUT (10 * GST_SECOND)
+// segment files are written next to the output
+#define RENDER_SEGMENT_LOCATION "%s.segment%03u.flv"
+
+// Segments of a render and the ones handed to the host so far
+typedef struct {
+    broadcaster_host *host;
+    const Config *config;
+    guint keyframe_interval;
+    guint segments;
+    // start of every segment, the next one's start is where it stops (the last one at the end)
+    GstClockTime *starts;
+    gchar **locations;
+    guint next;
+    guint failed;
+} render_job;
+
+// Concat pads the tracks of a segment file go to and where the segment lies on the timeline
+typedef struct {
+    GstPad *video;
+    GstPad *audio;
+    GstClockTime start;
+    // GST_CLOCK_TIME_NONE for the last segment
+    GstClockTime length;
+} render_part;
+
+// Duration of the longest source, GST_CLOCK_TIME_NONE if any of them can't be prerolled
+static GstClockTime render_duration(char **sources) {
+    GstClockTime duration = 0;
+    for (guint i = 0; sources[i]; i++) {
+        GstElement *player = gst_element_factory_make("playbin", NULL);
+        gint64 source_duration = -1;
+        if (!player) {
+            g_printerr("Failed to create a player probing source %u.\n", i);
+            return GST_CLOCK_TIME_NONE;
+        }
+        g_object_set(player, "uri", sources[i],
+                     "video-sink", gst_element_factory_make("fakesink", NULL),
+                     "audio-sink", gst_element_factory_make("fakesink", NULL), NULL);
+        if (gst_element_set_state(player, GST_STATE_PAUSED) != GST_STATE_CHANGE_FAILURE &&
+            gst_element_get_state(player, NULL, NULL, RENDER_PROBE_TIMEOUT) == GST_STATE_CHANGE_SUCCESS) {
+            gst_element_query_duration(player, GST_FORMAT_TIME, &source_duration);
+        }
+        gst_element_set_state(player, GST_STATE_NULL);
+        gst_object_unref(player);
+        if (source_duration <= 0) {
+            g_printerr("Can't find the duration of source %u (%s).\n", i, sources[i]);
+            return GST_CLOCK_TIME_NONE;
+        }
+        duration = MAX(duration, (GstClockTime)source_duration);
+    }
+    return duration;
+}
+
+static void render_segment_finished(twitch_broadcaster *broadcaster, int result, void *user_data);
+
+static const broadcaster_callbacks render_callbacks = { .finished = render_segment_finished };
+
+// Hands the next segment to the host
+static gboolean render_add_segment(render_job *job) {
+    guint index = job->next++;
+    Config segment = *job->config;
+    segment.file_sink = job->locations[index];
+    segment.segment_start_ns = job->starts[index];
+    segment.segment_stop_ns = index + 1 < job->segments ? job->starts[index + 1] : 0;
+    segment.keyframe_interval = (int)job->keyframe_interval;
+    g_print("Rendering segment %u of %u from %.3f s\n", index + 1, job->segments,
+            (gdouble)segment.segment_start_ns / GST_SECOND);
+    return host_add(job->host, &segment, &render_callbacks, job) >= 0;
+}
+
+static void render_segment_finished(twitch_broadcaster *broadcaster, int result, void *user_data) {
+    render_job *job = user_data;
+    if (result != 0) {
+        job->failed++;
+        return;
+    }
+    // the worker that's done takes the next segment
+    if (!job->failed && job->next < job->segments && !render_add_segment(job)) {
+        job->failed++;
+    }
+}
+
+// Drops the AAC frame running into the next segment, whose audio starts at the boundary
+static GstPadProbeReturn render_part_trim_probe(GstPad *pad, GstPadProbeInfo *info, render_part *part) {
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    if (GST_BUFFER_PTS_IS_VALID(buffer) && GST_BUFFER_DURATION_IS_VALID(buffer) &&
+        GST_BUFFER_PTS(buffer) + GST_BUFFER_DURATION(buffer) > part->length) {
+        return GST_PAD_PROBE_DROP;
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+static void render_part_pad_added(GstElement *demuxer, GstPad *pad, render_part *part) {
+    gboolean audio = g_str_equal(GST_PAD_NAME(pad), "audio");
+    GstPad *target = g_str_equal(GST_PAD_NAME(pad), "video") ? part->video : audio ? part->audio : NULL;
+    // segment files start at 0
+    gst_pad_set_offset(pad, (gint64)part->start);
+    if (audio && GST_CLOCK_TIME_IS_VALID(part->length)) {
+        gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, (GstPadProbeCallback)render_part_trim_probe, part, NULL);
+    }
+    if (!target || GST_PAD_LINK_FAILED(gst_pad_link(pad, target))) {
+        g_printerr("Failed to link %s track of a segment.\n", GST_PAD_NAME(pad));
+    }
+}
+
+// Remuxes the segment files one after the other into the location. Both tracks of a segment
+// are placed at its start rather than behind the previous segment's end: the last AAC frame
+// of a segment runs past it, following it would shift the audio a little more at every
+// boundary
+static gboolean render_concat(gchar **locations, const GstClockTime *starts, guint segments, const gchar *location) {
+    GstElement *pipeline = gst_pipeline_new("render-concat");
+    GstElement *video_concat = gst_element_factory_make("concat", "video-concat");
+    GstElement *audio_concat = gst_element_factory_make("concat", "audio-concat");
+    GstElement *muxer = gst_element_factory_make("flvmux", "muxer");
+    GstElement *sink = gst_element_factory_make("filesink", "sink");
+    render_part *parts = g_new0(render_part, segments);
+    gboolean concatenated = FALSE;
+
+    if (!pipeline || !video_concat || !audio_concat || !muxer || !sink) {
+        g_printerr("Failed to create elements concatenating the segments.\n");
+        GstElement *elements[] = { pipeline, video_concat, audio_concat, muxer, sink };
+        for (guint i = 0; i < G_N_ELEMENTS(elements); i++) {
+            if (elements[i]) {
+                gst_object_unref(elements[i]);
+            }
+        }
+        g_free(parts);
+        return FALSE;
+    }
+    g_object_set(sink, "location", location, NULL);
+    g_object_set(video_concat, "adjust-base", FALSE, NULL);
+    g_object_set(audio_concat, "adjust-base", FALSE, NULL);
+    gst_bin_add_many(GST_BIN(pipeline), video_concat, audio_concat, muxer, sink, NULL);
+    gboolean linked = gst_element_link_pads(video_concat, "src", muxer, "video") &&
+            gst_element_link_pads(audio_concat, "src", muxer, "audio") && gst_element_link(muxer, sink);
+    for (guint i = 0; linked && i < segments; i++) {
+        // concat plays its pads in the order they were requested
+        parts[i].video = gst_element_get_request_pad(video_concat, "sink_%u");
+        parts[i].audio = gst_element_get_request_pad(audio_concat, "sink_%u");
+        parts[i].start = starts[i];
+        parts[i].length = i + 1 < segments ? starts[i + 1] - starts[i] : GST_CLOCK_TIME_NONE;
+        GstElement *source = gst_element_factory_make("filesrc", NULL);
+        GstElement *demuxer = gst_element_factory_make("flvdemux", NULL);
+        if (!source || !demuxer) {
+            if (source) {
+                gst_object_unref(source);
+            }
+            if (demuxer) {
+                gst_object_unref(demuxer);
+            }
+            linked = FALSE;
+            break;
+        }
+        g_object_set(source, "location", locations[i], NULL);
+        gst_bin_add_many(GST_BIN(pipeline), source, demuxer, NULL);
+        g_signal_connect(demuxer, "pad-added", G_CALLBACK(render_part_pad_added), &parts[i]);
+        linked = gst_element_link(source, demuxer);
+    }
+    if (!linked) {
+        g_printerr("Failed to link elements concatenating the segments.\n");
+    } else if (gst_element_set_state(pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+        g_printerr("Unable to start concatenating the segments.\n");
+    } else {
+        GstBus *bus = gst_element_get_bus(pipeline);
+        GstMessage *msg = gst_bus_timed_pop_filtered(bus, GST_CLOCK_TIME_NONE, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+        if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR) {
+            GError *error = NULL;
+            gst_message_parse_error(msg, &error, NULL);
+            g_printerr("Error received from element %s while concatenating: %s\n",
+                       GST_OBJECT_NAME(msg->src), error->message);
+            g_clear_error(&error);
+        } else {
+            concatenated = TRUE;
+        }
+        gst_message_unref(msg);
+        gst_object_unref(bus);
+    }
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    for (guint i = 0; i < segments; i++) {
+        if (parts[i].video) {
+            gst_object_unref(parts[i].video);
+        }
+        if (parts[i].audio) {
+            gst_object_unref(parts[i].audio);
+        }
+    }
+    gst_object_unref(pipeline);
+    g_free(parts);
+    return concatenated;
+}
+
+int offline_render(const Config *config, const RenderConfig *render, render_stats *stats) {
+    g_return_val_if_fail(config && config->sources && config->sources[0], -1);
+    RenderConfig defaults = { 0 };
+    if (!render) {
+        render = &defaults;
+    }
+    if (!config->file_sink || config->num_outputs || config->num_renditions || config->stall_timeout_ms > 0 ||
+        config->fast_start || config->passthrough) {
+        g_printerr("Offline rendering needs a file_sink without outputs, renditions, stall timeout, fast start "
+                   "and passthrough.\n");
+        return -1;
+    }
+    gint64 start_time = g_get_monotonic_time();
+    guint workers = render->workers ? render->workers : g_get_num_processors();
+    guint fps = config->fps > 0 ? (guint)config->fps : LAYOUT_DEFAULT_FPS;
+    guint keyframe_seconds = render->keyframe_seconds ? render->keyframe_seconds : RENDER_DEFAULT_KEYFRAME_SECONDS;
+    GstClockTime duration = render_duration(config->sources);
+    if (!GST_CLOCK_TIME_IS_VALID(duration)) {
+        return -1;
+    }
+
+    // segments are whole keyframe intervals, the last one takes what's left
+    render_job job = { 0 };
+    job.config = config;
+    job.keyframe_interval = keyframe_seconds * fps;
+    guint64 frames = gst_util_uint64_scale_ceil(duration, fps, GST_SECOND);
+    guint64 intervals = MAX((frames + job.keyframe_interval - 1) / job.keyframe_interval, 1);
+    guint64 requested = render->segments ? render->segments : workers;
+    guint64 segment_intervals = (intervals + requested - 1) / requested;
+    job.segments = (guint)((intervals + segment_intervals - 1) / segment_intervals);
+    job.starts = g_new0(GstClockTime, job.segments);
+    job.locations = g_new0(gchar *, job.segments + 1);
+    for (guint i = 0; i < job.segments; i++) {
+        job.starts[i] = gst_util_uint64_scale(i * segment_intervals * job.keyframe_interval, GST_SECOND, fps);
+        job.locations[i] = g_strdup_printf(RENDER_SEGMENT_LOCATION, config->file_sink, i);
+    }
+    workers = MIN(workers, job.segments);
+
+    // encoder threads are divided between the workers
+    HostConfig host_config = { .expected_broadcasters = workers };
+    GMainContext *context = g_main_context_new();
+    job.host = host_new(&host_config, context);
+    int res = job.host ? 0 : -1;
+    for (guint i = 0; res == 0 && i < workers; i++) {
+        if (!render_add_segment(&job)) {
+            job.failed++;
+            break;
+        }
+    }
+    host_stats host;
+    memset(&host, 0, sizeof(host_stats));
+    if (job.host) {
+        if (host_run(job.host) != 0 || job.failed) {
+            g_printerr("Rendering segments failed.\n");
+            res = -1;
+        }
+        host_get_stats(job.host, &host);
+        host_free(job.host);
+    }
+    g_main_context_unref(context);
+    gint64 rendered_time = g_get_monotonic_time();
+
+    if (res == 0 && job.segments == 1) {
+        // nothing to concatenate
+        if (g_rename(job.locations[0], config->file_sink) != 0) {
+            g_printerr("Failed to move the rendered segment to %s.\n", config->file_sink);
+            res = -1;
+        }
+    } else if (res == 0 && !render_concat(job.locations, job.starts, job.segments, config->file_sink)) {
+        res = -1;
+    }
+    for (guint i = 0; i < job.segments; i++) {
+        g_unlink(job.locations[i]);
+    }
+    gint64 end_time = g_get_monotonic_time();
+
+    if (res == 0) {
+        g_print("Rendered %.1f s in %u segments on %u workers in %.1f s, %.1fx realtime\n",
+                (gdouble)duration / GST_SECOND, job.segments, workers, (end_time - start_time) / 1e6,
+                (gdouble)duration / GST_USECOND / MAX(end_time - start_time, 1));
+    }
+    if (res == 0 && stats) {
+        memset(stats, 0, sizeof(render_stats));
+        stats->duration_ns = duration;
+        stats->segments = job.segments;
+        stats->workers = workers;
+        stats->render_us = rendered_time - start_time;
+        stats->concat_us = end_time - rendered_time;
+        stats->total_us = end_time - start_time;
+        stats->speed = (gdouble)duration / GST_USECOND / MAX(stats->total_us, 1);
+        stats->frames = host.frames;
+    }
+    g_free(job.starts);
+    g_strfreev(job.locations);
+    return res;
+}
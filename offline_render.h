@@ -0,0 +1,53 @@
+#ifndef _OFFLINE_RENDER_H_
+#define _OFFLINE_RENDER_H_
+
+#include <stdint.h>
+
+#include "twitch_broadcaster.h"
+
+/*
+ * Faster than realtime rendering of a file_sink broadcast (e.g. VOD recaps). A single x264enc
+ * keeps one pipeline from using more than a few cores, so the sources' timeline is split into
+ * segments of whole keyframe intervals and every segment is decoded, composited and encoded by
+ * a broadcaster of its own (Config.segment_start_ns), as many at once as there are workers, on
+ * a host sharing their threads. The segment files are then concatenated into Config.file_sink,
+ * remuxed with continuous timestamps, and removed. Every segment starts with a keyframe on a
+ * multiple of the keyframe interval; the AAC encoder restarts at every boundary as well.
+ */
+
+typedef struct {
+    // broadcasters rendering segments at the same time, 0 for the number of CPUs
+    unsigned int workers;
+    // segments the timeline is split into, 0 for one per worker. Segments are whole keyframe
+    // intervals, so there may be fewer of them for short timelines
+    unsigned int segments;
+    // seconds between keyframes, segment boundaries are on them, 0 for 2
+    unsigned int keyframe_seconds;
+} RenderConfig;
+
+typedef struct {
+    // rendered timeline (the longest source), segments and workers it was split between
+    uint64_t duration_ns;
+    unsigned int segments;
+    unsigned int workers;
+    // rendering the segments, concatenating them and both
+    int64_t render_us;
+    int64_t concat_us;
+    int64_t total_us;
+    // timeline duration over total time, how much faster than realtime the render was
+    double speed;
+    // frames encoded over all segments
+    uint64_t frames;
+} render_stats;
+
+/**
+ * Renders the config's sources into its file_sink, blocking until done. The config must have
+ * a file_sink and no outputs, renditions, stall timeout or fast start, its encoder_threads
+ * and memory_budget apply to every worker.
+ * @param render NULL for the defaults
+ * @param stats filled in on success, may be NULL
+ * @return non 0 on failure, 0 otherwise
+ */
+int offline_render(const Config *config, const RenderConfig *render, render_stats *stats);
+
+#endif
@@ -0,0 +1,686 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "output.h"
+
+#define FLV_TAG_HEADER_SIZE 11
+#define FLV_TAG_VIDEO 9
+#define FLV_FRAME_KEY 1
+// Fill level a dropping output has to be below to take data again, from a keyframe on
+#define OUTPUT_RESUME_PERCENT 50
+
+static GstPadProbeReturn output_count_probe(GstPad *pad, GstPadProbeInfo *info, broadcaster_output *self) {
+    g_mutex_lock(&self->stats_lock);
+    if (!self->buffers) {
+        self->first_byte_time = g_get_monotonic_time();
+    }
+    self->buffers++;
+    self->bytes += gst_buffer_get_size(GST_PAD_PROBE_INFO_BUFFER(info));
+    g_mutex_unlock(&self->stats_lock);
+    return GST_PAD_PROBE_OK;
+}
+
+// TRUE for a tag of a video keyframe, the muxer puts a single tag in every buffer
+static gboolean output_is_keyframe(GstBuffer *buffer) {
+    guint8 tag[FLV_TAG_HEADER_SIZE + 1];
+    if (gst_buffer_extract(buffer, 0, tag, sizeof(tag)) != sizeof(tag)) {
+        return FALSE;
+    }
+    return tag[0] == FLV_TAG_VIDEO && (tag[FLV_TAG_HEADER_SIZE] >> 4) == FLV_FRAME_KEY;
+}
+
+// Fill level of the queue in percent, it's full (100) once any of its limits is reached
+static guint output_queue_level(GstElement *queue, guint *buffers, guint *bytes, guint64 *time) {
+    guint level_buffers = 0, level_bytes = 0, max_bytes = 0;
+    guint64 level_time = 0, max_time = 0;
+    g_object_get(queue,
+                 "current-level-buffers", &level_buffers,
+                 "current-level-bytes", &level_bytes,
+                 "current-level-time", &level_time,
+                 "max-size-bytes", &max_bytes,
+                 "max-size-time", &max_time, NULL);
+    guint percent = 0;
+    if (max_bytes) {
+        percent = MAX(percent, (guint)((guint64)level_bytes * 100 / max_bytes));
+    }
+    if (max_time) {
+        percent = MAX(percent, (guint)(level_time * 100 / max_time));
+    }
+    if (buffers) {
+        *buffers = level_buffers;
+    }
+    if (bytes) {
+        *bytes = level_bytes;
+    }
+    if (time) {
+        *time = level_time;
+    }
+    return MIN(percent, 100);
+}
+
+/*
+ * Keeps a slow output from blocking the tee without leaving it undecodable: once its queue is
+ * full the rest of the current GOP is dropped, and every following GOP until a keyframe finds
+ * the queue half drained. Headers always go through, they are rare and small and wait for room
+ * in the worst case. The level only drops while the tee's thread checks it, a buffer let
+ * through never blocks.
+ */
+static GstPadProbeReturn output_drop_probe(GstPad *pad, GstPadProbeInfo *info, broadcaster_output *self) {
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_HEADER)) {
+        return GST_PAD_PROBE_OK;
+    }
+    guint percent = output_queue_level(self->queue, NULL, NULL, NULL);
+    if (self->dropping && percent < OUTPUT_RESUME_PERCENT && output_is_keyframe(buffer)) {
+        self->dropping = FALSE;
+    } else if (!self->dropping && percent >= 100) {
+        self->dropping = TRUE;
+    }
+    if (!self->dropping) {
+        return GST_PAD_PROBE_OK;
+    }
+    g_mutex_lock(&self->stats_lock);
+    self->dropped++;
+    g_mutex_unlock(&self->stats_lock);
+    return GST_PAD_PROBE_DROP;
+}
+
+// Hands the buffer to the output's callback, mapped in place
+static void output_deliver(broadcaster_output *self, GstBuffer *buffer, packet_track track, gboolean header) {
+    GstMapInfo map;
+    // a buffer of several memories is merged to be mapped, that's the only copy
+    gboolean merged = gst_buffer_n_memory(buffer) > 1;
+    if (!gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+        return;
+    }
+    output_packet packet = { 0 };
+    packet.track = track;
+    packet.data = map.data;
+    packet.size = map.size;
+    packet.pts = GST_BUFFER_PTS_IS_VALID(buffer) ? (int64_t)GST_BUFFER_PTS(buffer) : -1;
+    packet.dts = GST_BUFFER_DTS_IS_VALID(buffer) ? (int64_t)GST_BUFFER_DTS(buffer) : -1;
+    packet.header = header || GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_HEADER);
+    packet.keyframe = !packet.header && (track == PACKET_MUXED ? output_is_keyframe(buffer) :
+            !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT));
+    packet.buffer = buffer;
+    g_mutex_lock(&self->callback_lock);
+    g_mutex_lock(&self->stats_lock);
+    if (!self->buffers) {
+        self->first_byte_time = g_get_monotonic_time();
+    }
+    self->buffers++;
+    self->bytes += map.size;
+    self->bytes_copied += merged ? map.size : 0;
+    g_mutex_unlock(&self->stats_lock);
+    self->callback(&packet, self->callback_data);
+    g_mutex_unlock(&self->callback_lock);
+    gst_buffer_unmap(buffer, &map);
+}
+
+static void output_handoff_handler(GstElement *sink, GstBuffer *buffer, GstPad *pad, broadcaster_output *self) {
+    output_deliver(self, buffer, PACKET_MUXED, FALSE);
+}
+
+static GstPadProbeReturn output_elementary_probe(GstPad *pad, GstPadProbeInfo *info, broadcaster_output *self) {
+    packet_track track = pad == self->tap_pads[0] ? PACKET_VIDEO : PACKET_AUDIO;
+    if (info->type & GST_PAD_PROBE_TYPE_BUFFER) {
+        output_deliver(self, GST_PAD_PROBE_INFO_BUFFER(info), track, FALSE);
+        return GST_PAD_PROBE_OK;
+    }
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+    if (GST_EVENT_TYPE(event) == GST_EVENT_CAPS) {
+        // the codec configuration goes ahead of the track's first packet (and any new one)
+        GstCaps *caps = NULL;
+        gst_event_parse_caps(event, &caps);
+        const GValue *codec_data = gst_structure_get_value(gst_caps_get_structure(caps, 0), "codec_data");
+        if (codec_data && GST_VALUE_HOLDS_BUFFER(codec_data)) {
+            output_deliver(self, gst_value_get_buffer(codec_data), track, TRUE);
+        }
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+static void output_ring_clear(broadcaster_output *self) {
+    g_queue_clear_full(&self->ring, (GDestroyNotify)gst_buffer_unref);
+    self->ring_bytes = 0;
+}
+
+// Keeps headers and the current GOP, called with the ring lock held
+static void output_ring_add(broadcaster_output *self, GstBuffer *buffer) {
+    if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_HEADER)) {
+        // headers sent after data replace the previous ones
+        if (!self->in_headers) {
+            g_queue_clear_full(&self->headers, (GDestroyNotify)gst_buffer_unref);
+            self->in_headers = TRUE;
+        }
+        g_queue_push_tail(&self->headers, gst_buffer_ref(buffer));
+        return;
+    }
+    self->in_headers = FALSE;
+    if (output_is_keyframe(buffer)) {
+        output_ring_clear(self);
+        self->ring_aligned = TRUE;
+    }
+    if (!self->ring_aligned) {
+        return;
+    }
+    gsize size = gst_buffer_get_size(buffer);
+    if (self->ring_bytes + size > self->ring_max_bytes) {
+        // a GOP larger than the ring can't be resumed from, wait for the next keyframe
+        output_ring_clear(self);
+        self->ring_aligned = FALSE;
+        return;
+    }
+    g_queue_push_tail(&self->ring, gst_buffer_ref(buffer));
+    self->ring_bytes += size;
+}
+
+static GstPadProbeReturn output_ring_probe(GstPad *pad, GstPadProbeInfo *info, broadcaster_output *self) {
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    GList *replay = NULL;
+    if (self->replaying) {
+        return GST_PAD_PROBE_OK;
+    }
+    g_mutex_lock(&self->ring_lock);
+    output_ring_add(self, buffer);
+    output_connection state = self->state;
+    if (state == OUTPUT_RESUMING && self->ring_aligned && !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_HEADER)) {
+        // headers and the GOP so far, the buffer itself (the ring's tail) follows as usual
+        for (GList *l = self->headers.head; l; l = l->next) {
+            replay = g_list_prepend(replay, gst_buffer_ref(l->data));
+        }
+        for (GList *l = self->ring.head; l && l != self->ring.tail; l = l->next) {
+            replay = g_list_prepend(replay, gst_buffer_ref(l->data));
+        }
+        replay = g_list_reverse(replay);
+        gint64 now = g_get_monotonic_time();
+        self->state = state = OUTPUT_CONNECTED;
+        self->reconnects++;
+        self->disconnected_us += now - self->disconnect_time;
+        g_print("Output %u (%s) resumed after %.1f s, %u buffers replayed\n", self->index, self->location,
+                (now - self->disconnect_time) / (gdouble)G_USEC_PER_SEC, g_list_length(replay));
+    }
+    g_mutex_unlock(&self->ring_lock);
+    if (state != OUTPUT_CONNECTED) {
+        // nobody to send to, the encoder mustn't wait for the connection
+        return GST_PAD_PROBE_DROP;
+    }
+    self->replaying = TRUE;
+    GstFlowReturn ret = GST_FLOW_OK;
+    for (GList *l = replay; l; l = l->next) {
+        GstBuffer *replayed = l->data;
+        l->data = NULL;
+        if (ret == GST_FLOW_OK) {
+            ret = gst_pad_push(pad, replayed);
+        } else {
+            gst_buffer_unref(replayed);
+        }
+    }
+    self->replaying = FALSE;
+    g_list_free(replay);
+    return GST_PAD_PROBE_OK;
+}
+
+// Creates the output's sink for its location, every new connection gets a new one
+static GstElement* output_make_sink(broadcaster_output *self) {
+    gchar *name = g_strdup_printf("output%u-sink", self->index);
+    GstElement *sink = NULL;
+    switch (self->type) {
+        case OUTPUT_RTMP:
+            sink = gst_element_factory_make("rtmpsink", name);
+            if (sink) {
+                g_object_set(sink, "location", self->location, NULL);
+            }
+            break;
+        case OUTPUT_TCP:
+            sink = gst_element_factory_make("tcpclientsink", name);
+            if (sink) {
+                const gchar *address = g_str_has_prefix(self->location, "tcp://") ?
+                        self->location + strlen("tcp://") : self->location;
+                const gchar *colon = strrchr(address, ':');
+                gchar *host = colon ? g_strndup(address, colon - address) : g_strdup(address);
+                g_object_set(sink, "host", host, "port", colon ? atoi(colon + 1) : 0, NULL);
+                g_free(host);
+            }
+            break;
+        case OUTPUT_CALLBACK:
+            // the queue's thread hands muxed chunks over, elementary packets don't come this way
+            sink = gst_element_factory_make("fakesink", name);
+            if (sink) {
+                g_object_set(sink, "sync", FALSE, "signal-handoffs", self->format == PACKETS_FLV, NULL);
+                if (self->format == PACKETS_FLV) {
+                    g_signal_connect(sink, "handoff", G_CALLBACK(output_handoff_handler), self);
+                }
+            }
+            break;
+        case OUTPUT_SHM:
+            sink = gst_element_factory_make("shmsink", name);
+            if (sink) {
+                const gchar *socket_path = g_str_has_prefix(self->location, "shm://") ?
+                        self->location + strlen("shm://") : self->location;
+                // readers come and go, the broadcast doesn't wait for them
+                g_object_set(sink, "socket-path", socket_path, "shm-size",
+                             (guint)OUTPUT_DEFAULT_SHM_BYTES, "wait-for-connection", FALSE, "sync", FALSE, NULL);
+            }
+            break;
+        case OUTPUT_FILE:
+        default:
+            sink = gst_element_factory_make("filesink", name);
+            if (sink) {
+                g_object_set(sink, "location", self->location, NULL);
+            }
+            break;
+    }
+    g_free(name);
+    // callbacks count what they're handed
+    if (sink && self->type != OUTPUT_CALLBACK) {
+        GstPad *sink_pad = gst_element_get_static_pad(sink, "sink");
+        gst_pad_add_probe(sink_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                          (GstPadProbeCallback)output_count_probe, self, NULL);
+        gst_object_unref(sink_pad);
+    }
+    return sink;
+}
+
+broadcaster_output* output_new(const Output *config, guint index, gboolean leaky) {
+    g_return_val_if_fail(config && (config->location || config->type == OUTPUT_CALLBACK), NULL);
+    if (config->type == OUTPUT_CALLBACK && !config->callback) {
+        g_printerr("Callback output %u has no callback.\n", index);
+        return NULL;
+    }
+    broadcaster_output *self = g_malloc0(sizeof(broadcaster_output));
+    gchar *name = NULL;
+    self->index = index;
+    self->type = config->type;
+    self->location = config->location ? g_strdup(config->location) : g_strdup_printf("callback%u", index);
+    self->callback = config->callback;
+    self->callback_data = config->callback_data;
+    self->format = config->format;
+    self->leaky = leaky;
+    g_mutex_init(&self->stats_lock);
+    g_mutex_init(&self->callback_lock);
+    g_mutex_init(&self->ring_lock);
+    g_queue_init(&self->headers);
+    g_queue_init(&self->ring);
+    self->reconnect = (config->type == OUTPUT_RTMP || config->type == OUTPUT_TCP) && config->reconnect_max_ms >= 0;
+    self->reconnect_max_ms = config->reconnect_max_ms > 0 ? config->reconnect_max_ms : OUTPUT_DEFAULT_RECONNECT_MAX_MS;
+    self->ring_max_bytes = config->ring_bytes > 0 ? config->ring_bytes : OUTPUT_DEFAULT_RING_BYTES;
+
+    name = g_strdup_printf("output%u-queue", index);
+    self->queue = gst_element_factory_make("queue", name);
+    g_free(name);
+    self->sink = output_make_sink(self);
+    if (config->rate_limit > 0) {
+        name = g_strdup_printf("output%u-throttle", index);
+        self->throttle = gst_element_factory_make("identity", name);
+        g_free(name);
+    }
+    if (!self->queue || !self->sink || (config->rate_limit > 0 && !self->throttle)) {
+        g_printerr("Failed to create elements of output %u.\n", index);
+        if (self->queue) {
+            gst_object_unref(self->queue);
+        }
+        if (self->sink) {
+            gst_object_unref(self->sink);
+        }
+        if (self->throttle) {
+            gst_object_unref(self->throttle);
+        }
+        output_free(self);
+        return NULL;
+    }
+    if (self->throttle) {
+        // identity timestamps buffers by the data rate and waits for the clock
+        g_object_set(self->throttle, "datarate", config->rate_limit, "sync", TRUE, NULL);
+    }
+
+    // bounded in time (when muxed data is timestamped) and in bytes
+    g_object_set(self->queue,
+                 "max-size-buffers", 0,
+                 "max-size-time", config->max_buffer_ms > 0 ?
+                        config->max_buffer_ms * GST_MSECOND : OUTPUT_DEFAULT_BUFFER_MS * GST_MSECOND,
+                 "max-size-bytes", config->max_buffer_bytes > 0 ?
+                        (guint)config->max_buffer_bytes : OUTPUT_DEFAULT_BUFFER_BYTES, NULL);
+    return self;
+}
+
+void output_set_queue_limits(broadcaster_output *self, guint64 max_time, guint max_bytes) {
+    g_return_if_fail(self);
+    if (max_time) {
+        g_object_set(self->queue, "max-size-time", max_time, NULL);
+    }
+    if (max_bytes) {
+        g_object_set(self->queue, "max-size-bytes", max_bytes, NULL);
+    }
+}
+
+gboolean output_attach(broadcaster_output *self, GstBin *bin, GstElement *tee, GstElement *muxer) {
+    g_return_val_if_fail(self && bin && tee && muxer, FALSE);
+    gst_bin_add_many(bin, self->queue, self->sink, NULL);
+    if (self->throttle) {
+        gst_bin_add(bin, self->throttle);
+    }
+    gboolean linked = self->throttle ?
+            gst_element_link_many(self->queue, self->throttle, self->sink, NULL) :
+            gst_element_link(self->queue, self->sink);
+    if (!linked) {
+        g_printerr("Failed to link elements of output %u.\n", self->index);
+        return FALSE;
+    }
+    self->tee = tee;
+    self->tee_pad = gst_element_get_request_pad(tee, "src_%u");
+    GstPad *queue_sink_pad = gst_element_get_static_pad(self->queue, "sink");
+    GstPadLinkReturn ret = gst_pad_link(self->tee_pad, queue_sink_pad);
+    gst_object_unref(queue_sink_pad);
+    if (GST_PAD_LINK_FAILED(ret)) {
+        g_printerr("Failed to link output %u to the tee.\n", self->index);
+        return FALSE;
+    }
+    if (self->reconnect) {
+        // on the tee's side, dropped buffers never reach the queue while it's flushed
+        gst_pad_add_probe(self->tee_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                          (GstPadProbeCallback)output_ring_probe, self, NULL);
+        self->connect_time = g_get_monotonic_time();
+    }
+    if (self->leaky) {
+        // behind the ring, what a disconnected output drops never counts against its queue
+        gst_pad_add_probe(self->tee_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                          (GstPadProbeCallback)output_drop_probe, self, NULL);
+    }
+    if (self->type == OUTPUT_CALLBACK && self->format == PACKETS_ELEMENTARY) {
+        // what the muxer gets, encoded or remuxed (passthrough)
+        const gchar *pads[] = { "video", "audio" };
+        for (guint i = 0; i < G_N_ELEMENTS(pads); i++) {
+            self->tap_pads[i] = gst_element_get_static_pad(muxer, pads[i]);
+            if (!self->tap_pads[i]) {
+                g_printerr("Output %u can't tap the muxer's %s.\n", self->index, pads[i]);
+                return FALSE;
+            }
+            self->tap_probes[i] = gst_pad_add_probe(self->tap_pads[i],
+                    GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+                    (GstPadProbeCallback)output_elementary_probe, self, NULL);
+        }
+    }
+    return TRUE;
+}
+
+// Stops handing elementary packets over
+static void output_untap(broadcaster_output *self) {
+    for (guint i = 0; i < G_N_ELEMENTS(self->tap_pads); i++) {
+        if (self->tap_pads[i]) {
+            gst_pad_remove_probe(self->tap_pads[i], self->tap_probes[i]);
+            gst_object_unref(self->tap_pads[i]);
+            self->tap_pads[i] = NULL;
+        }
+    }
+}
+
+// Shuts a sink down and takes it out of the bin
+static void output_remove_sink(broadcaster_output *self, GstElement *sink) {
+    gst_element_set_locked_state(sink, TRUE);
+    gst_element_set_state(sink, GST_STATE_NULL);
+    gst_bin_remove(self->bin, sink);
+}
+
+// Puts the sink behind the queue (or throttle) and starts it, FALSE if it failed to start
+static gboolean output_link_sink(broadcaster_output *self, GstElement *sink) {
+    // added to a playing pipeline, the sink mustn't make it lose its state waiting for preroll
+    g_object_set(sink, "async", FALSE, NULL);
+    gst_bin_add(self->bin, sink);
+    if (!gst_element_link(self->throttle ? self->throttle : self->queue, sink) ||
+        !gst_element_sync_state_with_parent(sink)) {
+        output_remove_sink(self, sink);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// Replaces the standby sink with a new connection, called from the main context
+static gboolean output_connect(broadcaster_output *self) {
+    GstElement *sink = output_make_sink(self);
+    if (!sink) {
+        g_printerr("Failed to create a sink for output %u.\n", self->index);
+        return FALSE;
+    }
+    g_mutex_lock(&self->ring_lock);
+    self->sink = sink;
+    g_mutex_unlock(&self->ring_lock);
+    gst_element_unlink(self->throttle ? self->throttle : self->queue, self->standby);
+    if (!output_link_sink(self, sink)) {
+        g_printerr("Output %u (%s) failed to reconnect.\n", self->index, self->location);
+        g_mutex_lock(&self->ring_lock);
+        self->sink = NULL;
+        g_mutex_unlock(&self->ring_lock);
+        gst_element_link(self->throttle ? self->throttle : self->queue, self->standby);
+        return FALSE;
+    }
+    output_remove_sink(self, self->standby);
+    self->standby = NULL;
+    g_mutex_lock(&self->ring_lock);
+    self->state = OUTPUT_RESUMING;
+    self->connect_time = g_get_monotonic_time();
+    g_mutex_unlock(&self->ring_lock);
+    return TRUE;
+}
+
+static gboolean output_reconnect_timeout(broadcaster_output *self) {
+    GMainContext *context = g_source_get_context(self->reconnect_source);
+    g_source_unref(self->reconnect_source);
+    self->reconnect_source = NULL;
+    if (!output_connect(self)) {
+        self->failed_attempts++;
+        output_schedule_reconnect(self, self->bin, context);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+gboolean output_sink_failed(broadcaster_output *self, GstObject *element) {
+    if (!self->reconnect) {
+        return FALSE;
+    }
+    g_mutex_lock(&self->ring_lock);
+    gboolean failed = self->sink && element == GST_OBJECT(self->sink);
+    if (failed && self->state != OUTPUT_RECONNECTING) {
+        if (self->state == OUTPUT_CONNECTED) {
+            self->disconnect_time = g_get_monotonic_time();
+        }
+        self->state = OUTPUT_RECONNECTING;
+    }
+    g_mutex_unlock(&self->ring_lock);
+    return failed;
+}
+
+gboolean output_handle_error(broadcaster_output *self, GstBin *bin, GstObject *element) {
+    g_return_val_if_fail(self && bin, FALSE);
+    if (!self->reconnect || self->detached ||
+        element == GST_OBJECT(self->queue) || (self->throttle && element == GST_OBJECT(self->throttle))) {
+        return FALSE;
+    }
+    // the sync handler saw it first, unless the sink is an old one
+    output_sink_failed(self, element);
+    g_mutex_lock(&self->ring_lock);
+    GstElement *sink = self->sink && element == GST_OBJECT(self->sink) ? self->sink : NULL;
+    if (sink) {
+        self->sink = NULL;
+    }
+    g_mutex_unlock(&self->ring_lock);
+    if (!sink) {
+        return TRUE;
+    }
+    g_printerr("Output %u (%s) lost its connection, reconnecting\n", self->index, self->location);
+    if (g_get_monotonic_time() - self->connect_time > (gint64)self->reconnect_max_ms * 1000) {
+        self->backoff_ms = 0;
+    }
+    self->bin = bin;
+    // the broken connection is closed first, a sink blocked writing to it would hold the queue
+    output_remove_sink(self, sink);
+    // data queued before the failure is stale, flushing drops it and restarts the queue's
+    // streaming thread the failure stopped. The tee's buffers don't reach the queue meanwhile
+    GstPad *queue_sink_pad = gst_element_get_static_pad(self->queue, "sink");
+    gst_pad_send_event(queue_sink_pad, gst_event_new_flush_start());
+    gst_pad_send_event(queue_sink_pad, gst_event_new_flush_stop(FALSE));
+    gst_object_unref(queue_sink_pad);
+    // events still flow, the standby ends the output at EOS like the sink would
+    gchar *name = g_strdup_printf("output%u-standby", self->index);
+    self->standby = gst_element_factory_make("fakesink", name);
+    g_free(name);
+    if (!self->standby) {
+        g_printerr("Failed to create a standby sink for output %u.\n", self->index);
+        return FALSE;
+    }
+    g_object_set(self->standby, "sync", FALSE, NULL);
+    if (!output_link_sink(self, self->standby)) {
+        g_printerr("Failed to start the standby sink of output %u.\n", self->index);
+        self->standby = NULL;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void output_schedule_reconnect(broadcaster_output *self, GstBin *bin, GMainContext *context) {
+    g_return_if_fail(self && bin);
+    if (self->reconnect_source || self->detached) {
+        return;
+    }
+    self->backoff_ms = self->backoff_ms ? MIN(self->backoff_ms * 2, self->reconnect_max_ms) :
+            MIN(OUTPUT_RECONNECT_MIN_MS, self->reconnect_max_ms);
+    self->bin = bin;
+    g_print("Output %u (%s) reconnecting in %u ms\n", self->index, self->location, self->backoff_ms);
+    self->reconnect_source = g_timeout_source_new(self->backoff_ms);
+    g_source_set_callback(self->reconnect_source, (GSourceFunc)output_reconnect_timeout, self, NULL);
+    g_source_attach(self->reconnect_source, context);
+}
+
+void output_cancel_reconnect(broadcaster_output *self) {
+    g_return_if_fail(self);
+    if (self->reconnect_source) {
+        g_source_destroy(self->reconnect_source);
+        g_source_unref(self->reconnect_source);
+        self->reconnect_source = NULL;
+    }
+}
+
+void output_detach(broadcaster_output *self, GstBin *bin) {
+    g_return_if_fail(self && bin);
+    if (self->detached) {
+        return;
+    }
+    self->detached = TRUE;
+    output_cancel_reconnect(self);
+    output_untap(self);
+    // tee copes with src pads going away while it's pushing
+    if (self->tee_pad) {
+        GstPad *queue_sink_pad = gst_element_get_static_pad(self->queue, "sink");
+        gst_pad_unlink(self->tee_pad, queue_sink_pad);
+        gst_object_unref(queue_sink_pad);
+        gst_element_release_request_pad(self->tee, self->tee_pad);
+        gst_object_unref(self->tee_pad);
+        self->tee_pad = NULL;
+    }
+    // downstream first, so a blocked sink doesn't hold the queue's streaming thread
+    GstElement *elements[] = { self->sink, self->standby, self->throttle, self->queue };
+    for (guint i = 0; i < G_N_ELEMENTS(elements); i++) {
+        if (elements[i]) {
+            gst_element_set_locked_state(elements[i], TRUE);
+            gst_element_set_state(elements[i], GST_STATE_NULL);
+            gst_bin_remove(bin, elements[i]);
+        }
+    }
+    self->queue = self->throttle = self->sink = self->standby = NULL;
+}
+
+void output_stop(broadcaster_output *self) {
+    g_return_if_fail(self);
+    output_cancel_reconnect(self);
+    self->queue = self->throttle = self->sink = self->standby = NULL;
+}
+
+gboolean output_owns(broadcaster_output *self, GstObject *element) {
+    // matched by name, messages of already detached elements still have to be recognised
+    gchar *prefix = g_strdup_printf("output%u-", self->index);
+    gboolean res = element && GST_OBJECT_NAME(element) && g_str_has_prefix(GST_OBJECT_NAME(element), prefix);
+    g_free(prefix);
+    return res;
+}
+
+guint output_sample_throughput(broadcaster_output *self, gint64 now) {
+    g_return_val_if_fail(self, 0);
+    g_mutex_lock(&self->stats_lock);
+    guint64 bytes = self->bytes;
+    g_mutex_unlock(&self->stats_lock);
+    guint throughput = self->sampled_time && now > self->sampled_time ?
+            (guint)((bytes - self->sampled_bytes) * 8 * 1000 / (now - self->sampled_time)) : 0;
+    self->sampled_bytes = bytes;
+    self->sampled_time = now;
+    return throughput;
+}
+
+void output_get_stats(broadcaster_output *self, output_stats *stats) {
+    g_return_if_fail(self && stats);
+    memset(stats, 0, sizeof(output_stats));
+    g_mutex_lock(&self->stats_lock);
+    stats->buffers = self->buffers;
+    stats->bytes = self->bytes;
+    stats->dropped = self->dropped;
+    // a sink writes everything it gets out of the process
+    stats->bytes_copied = self->type == OUTPUT_CALLBACK ? self->bytes_copied : self->bytes;
+    g_mutex_unlock(&self->stats_lock);
+    stats->detached = self->detached;
+    if (self->reconnect) {
+        g_mutex_lock(&self->ring_lock);
+        stats->reconnects = self->reconnects;
+        stats->failed_attempts = self->failed_attempts;
+        stats->connected = self->state == OUTPUT_CONNECTED;
+        stats->disconnected_us = self->disconnected_us +
+                (self->state != OUTPUT_CONNECTED ? g_get_monotonic_time() - self->disconnect_time : 0);
+        stats->ring_bytes = self->ring_bytes;
+        g_mutex_unlock(&self->ring_lock);
+    } else {
+        stats->connected = !self->detached;
+    }
+    if (self->queue) {
+        stats->queue_percent = output_queue_level(self->queue, &stats->queue_buffers, &stats->queue_bytes,
+                                                  &stats->queue_time_ns);
+    }
+}
+
+gint64 output_first_byte_time(broadcaster_output *self) {
+    g_return_val_if_fail(self, 0);
+    g_mutex_lock(&self->stats_lock);
+    gint64 first_byte_time = self->first_byte_time;
+    g_mutex_unlock(&self->stats_lock);
+    return first_byte_time;
+}
+
+void output_free(broadcaster_output *self) {
+    if (!self) {
+        return;
+    }
+    if (self->tee_pad) {
+        gst_object_unref(self->tee_pad);
+    }
+    output_cancel_reconnect(self);
+    output_untap(self);
+    output_ring_clear(self);
+    g_queue_clear_full(&self->headers, (GDestroyNotify)gst_buffer_unref);
+    g_mutex_clear(&self->ring_lock);
+    g_mutex_clear(&self->callback_lock);
+    g_mutex_clear(&self->stats_lock);
+    g_free(self->location);
+    g_free(self);
+}
+
+void output_from_string(gchar *description, Output *output) {
+    g_return_if_fail(description && output);
+    memset(output, 0, sizeof(Output));
+    output->location = description;
+    if (g_str_has_prefix(description, "rtmp://") || g_str_has_prefix(description, "rtmps://")) {
+        output->type = OUTPUT_RTMP;
+    } else if (g_str_has_prefix(description, "tcp://")) {
+        output->type = OUTPUT_TCP;
+    } else if (g_str_has_prefix(description, "shm://")) {
+        output->type = OUTPUT_SHM;
+    } else {
+        output->type = OUTPUT_FILE;
+    }
+}
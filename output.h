@@ -0,0 +1,179 @@
+#ifndef _OUTPUT_H_
+#define _OUTPUT_H_
+
+#include <gst/gst.h>
+#include <glib.h>
+
+#include "twitch_broadcaster.h"
+
+// Defaults of a single output's queue
+#define OUTPUT_DEFAULT_BUFFER_MS 5000
+#define OUTPUT_DEFAULT_BUFFER_BYTES (16 * 1024 * 1024)
+// Defaults of reconnecting outputs
+#define OUTPUT_DEFAULT_RING_BYTES (8 * 1024 * 1024)
+#define OUTPUT_DEFAULT_RECONNECT_MAX_MS 8000
+#define OUTPUT_RECONNECT_MIN_MS 250
+// Shared memory area of shm outputs, holds what readers haven't released yet
+#define OUTPUT_DEFAULT_SHM_BYTES (8 * 1024 * 1024)
+
+// Connection of a reconnecting output
+typedef enum {
+    OUTPUT_CONNECTED = 0,
+    // the sink failed, muxed data only goes to the ring until a new sink is connected
+    OUTPUT_RECONNECTING,
+    // a new sink is connected, waiting for the ring to start at a keyframe to replay it
+    OUTPUT_RESUMING,
+} output_connection;
+
+/*
+ * A single destination of the muxed stream: tee -> queue -> [throttle] -> sink
+ * Network outputs reconnect: a probe on the tee's pad keeps the FLV headers and muxed data
+ * since the latest keyframe. Once the sink fails the probe drops data (so the encoder never
+ * waits for it), the sink is replaced by a standby fakesink (events still flow, EOS still
+ * ends the broadcast) and the queue flushed. A new sink is tried with backoff, once it's linked
+ * the headers and the ring are pushed ahead of live data, so the new connection starts at a
+ * keyframe.
+ * Callback outputs end in a fakesink: muxed chunks are handed over from its handoff, elementary
+ * packets from probes on the muxer's sink pads (the muxed stream is dropped).
+ */
+typedef struct broadcaster_output {
+    guint index;
+    output_type type;
+    gchar *location;
+
+    GstElement *queue;
+    // identity limiting the data rate, only when rate limited
+    GstElement *throttle;
+    GstElement *sink;
+    // fakesink standing in for the sink while a reconnecting output is disconnected
+    GstElement *standby;
+    // tee of the rendition the output is fed from, owned by the pipeline
+    GstElement *tee;
+    GstPad *tee_pad;
+
+    // stats, updated from streaming threads under the stats lock
+    GMutex stats_lock;
+    guint64 buffers;
+    guint64 bytes;
+    guint64 dropped;
+    gboolean detached;
+    // when the first buffer reached the sink (monotonic time), 0 before
+    gint64 first_byte_time;
+    // one of several outputs: whole GOPs are dropped while the queue is full, see output_new().
+    // dropping is only touched from the tee's thread
+    gboolean leaky;
+    gboolean dropping;
+
+    // callback outputs, the lock serialises the callback between tracks
+    output_packet_callback callback;
+    gpointer callback_data;
+    packet_format format;
+    GMutex callback_lock;
+    guint64 bytes_copied;
+    // muxer's sink pads tapped for elementary packets and their probes
+    GstPad *tap_pads[2];
+    gulong tap_probes[2];
+
+    // reconnecting, only network outputs not configured otherwise
+    gboolean reconnect;
+    guint reconnect_max_ms;
+    guint ring_max_bytes;
+    // guards the ring, the connection state and sink
+    GMutex ring_lock;
+    output_connection state;
+    // header buffers of the muxer and buffers since the latest keyframe (only when aligned)
+    GQueue headers;
+    GQueue ring;
+    guint64 ring_bytes;
+    gboolean ring_aligned;
+    gboolean in_headers;
+    // set while the ring is pushed from the tee's thread, its buffers pass the probe
+    gboolean replaying;
+    // pending reconnect attempt on the broadcaster's context, the bin the sink goes to
+    GSource *reconnect_source;
+    GstBin *bin;
+    guint backoff_ms;
+    gint64 connect_time;
+    gint64 disconnect_time;
+    guint reconnects;
+    guint failed_attempts;
+    gint64 disconnected_us;
+    // previous output_sample_throughput() call
+    guint64 sampled_bytes;
+    gint64 sampled_time;
+} broadcaster_output;
+
+/**
+ * Creates output elements according to the config.
+ * @param leaky when TRUE data is dropped in front of a full queue instead of blocking upstream,
+ * so a slow output can't stall the others. The rest of the GOP the queue filled up in and
+ * following GOPs are dropped until a keyframe finds the queue half drained, headers never are,
+ * the output stays decodable
+ * @return NULL if elements couldn't be created
+ */
+broadcaster_output* output_new(const Output *config, guint index, gboolean leaky);
+
+// Limits buffering of the output's queue, 0 keeps the current limit
+void output_set_queue_limits(broadcaster_output *self, guint64 max_time, guint max_bytes);
+
+// Adds output elements to the bin and links them to a new tee src pad, elementary callbacks
+// tap the muxer's sink pads
+gboolean output_attach(broadcaster_output *self, GstBin *bin, GstElement *tee, GstElement *muxer);
+
+/**
+ * Unlinks the output from the tee, shuts its elements down and removes them from the bin.
+ * Other outputs keep running.
+ */
+void output_detach(broadcaster_output *self, GstBin *bin);
+
+/**
+ * To be called from the bus' sync handler for every error: when the element is the output's
+ * current sink, the output stops taking data right away, before the failure stops the queue.
+ * @return TRUE if the element is the output's reconnecting sink
+ */
+gboolean output_sink_failed(broadcaster_output *self, GstObject *element);
+
+/**
+ * Handles an error of one of the output's elements: a failed sink of a reconnecting output
+ * is replaced by a standby and the queue flushed, the caller schedules the reconnect. Errors of sinks that
+ * were replaced already are ignored.
+ * @return TRUE if the error is taken care of by reconnecting, FALSE if the output failed for good
+ */
+gboolean output_handle_error(broadcaster_output *self, GstBin *bin, GstObject *element);
+
+/**
+ * Tries to connect a new sink after the backoff delay, from the given context. Failed attempts
+ * are retried with a doubled delay (up to the output's maximum), a failure after a connection
+ * that held for that long starts over at the shortest delay. Nothing happens when an attempt
+ * is already scheduled.
+ */
+void output_schedule_reconnect(broadcaster_output *self, GstBin *bin, GMainContext *context);
+
+// Drops a scheduled reconnect attempt, the pipeline is about to stop
+void output_cancel_reconnect(broadcaster_output *self);
+
+// Drops a scheduled reconnect attempt and forgets the elements, the pipeline owning them is going away
+void output_stop(broadcaster_output *self);
+
+// TRUE if the element is (or was, before detaching) one of the output's elements
+gboolean output_owns(broadcaster_output *self, GstObject *element);
+
+// What the output sent since the previous call in kbit/s, 0 for the first call
+guint output_sample_throughput(broadcaster_output *self, gint64 now);
+
+// Fills in the output's counters and queue fill level
+void output_get_stats(broadcaster_output *self, output_stats *stats);
+
+// When the first buffer reached the sink (monotonic time), 0 before
+gint64 output_first_byte_time(broadcaster_output *self);
+
+void output_free(broadcaster_output *self);
+
+/**
+ * Parses output description: rtmp://... and tcp://host:port are streamed, shm:///path is
+ * shared memory behind that socket, anything else is a file location.
+ * Strings in the Output point into description.
+ */
+void output_from_string(gchar *description, Output *output);
+
+#endif
@@ -0,0 +1,240 @@
+#include <stdio.h>
+
+#include "rendition.h"
+#include "output.h"
+
+#define RENDITION_CAPS "video/x-raw, width=(int)%d, height=(int)%d, pixel-aspect-ratio=(fraction)1/1"
+
+broadcaster_rendition* rendition_new(guint index, gint width, gint height, gint bitrate) {
+    g_return_val_if_fail(width > 0 && height > 0, NULL);
+    if (width % 2 || height % 2) {
+        g_printerr("Rendition %u: %dx%d has to have even dimensions.\n", index, width, height);
+        return NULL;
+    }
+    broadcaster_rendition *self = g_malloc0(sizeof(broadcaster_rendition));
+    self->index = index;
+    self->width = width;
+    self->height = height;
+    self->outputs = g_ptr_array_new_with_free_func((GDestroyNotify)output_free);
+
+    struct {
+        GstElement **element;
+        const gchar *factory;
+        const gchar *name;
+    } elements[] = {
+            { &self->video_queue, "queue", "video-queue" },
+            { &self->scaler, "videoscale", "scaler" },
+            { &self->capsfilter, "capsfilter", "capsfilter" },
+            { &self->encoder, "x264enc", "video-enc" },
+            { &self->audio_queue, "queue", "audio-queue" },
+            { &self->muxer, "flvmux", "muxer" },
+            { &self->tee, "tee", "tee" },
+    };
+    gboolean created = TRUE;
+    for (guint i = 0; i < G_N_ELEMENTS(elements); i++) {
+        gchar *name = g_strdup_printf("rendition%u-%s", index, elements[i].name);
+        *elements[i].element = gst_element_factory_make(elements[i].factory, name);
+        g_free(name);
+        created = created && *elements[i].element;
+    }
+    if (!created) {
+        g_printerr("Failed to create elements of rendition %u.\n", index);
+        for (guint i = 0; i < G_N_ELEMENTS(elements); i++) {
+            if (*elements[i].element) {
+                gst_object_unref(*elements[i].element);
+            }
+        }
+        rendition_free(self);
+        return NULL;
+    }
+    // scaling keeps aspect ratio of the canvas, it's a passthrough when the size matches
+    g_object_set(self->scaler, "add-borders", TRUE, NULL);
+    gchar *caps_str = g_strdup_printf(RENDITION_CAPS, width, height);
+    GstCaps *caps = gst_caps_from_string(caps_str);
+    g_free(caps_str);
+    g_object_set(self->capsfilter, "caps", caps, NULL);
+    gst_caps_unref(caps);
+    if (bitrate > 0) {
+        g_object_set(self->encoder, "bitrate", (guint)bitrate, NULL);
+    }
+    g_object_get(self->encoder, "bitrate", &self->bitrate, NULL);
+    // detached outputs leave the tee's pads unlinked
+    g_object_set(self->tee, "allow-not-linked", TRUE, NULL);
+    return self;
+}
+
+void rendition_enable_adaptive_bitrate(broadcaster_rendition *self, guint min_bitrate) {
+    g_return_if_fail(self);
+    bitrate_controller_init(&self->controller, self->bitrate ? self->bitrate : BITRATE_CONTROLLER_DEFAULT_MAX,
+                            min_bitrate, BITRATE_CONTROLLER_AUDIO_BITRATE);
+    self->adaptive = TRUE;
+}
+
+void rendition_control_bitrate(broadcaster_rendition *self, gint64 now) {
+    g_return_if_fail(self);
+    broadcaster_output *fullest = NULL;
+    output_stats stats, fullest_stats;
+    guint throughput = 0;
+    if (!self->adaptive) {
+        return;
+    }
+    // every output is sampled, so the next fullest one has its throughput over one interval
+    for (guint i = 0; i < self->outputs->len; i++) {
+        broadcaster_output *output = g_ptr_array_index(self->outputs, i);
+        guint output_throughput = output_sample_throughput(output, now);
+        output_get_stats(output, &stats);
+        if (!stats.detached && stats.connected && (!fullest || stats.queue_percent > fullest_stats.queue_percent)) {
+            fullest = output;
+            fullest_stats = stats;
+            throughput = output_throughput;
+        }
+    }
+    if (!fullest) {
+        return;
+    }
+    guint bitrate = bitrate_controller_update(&self->controller, now, throughput,
+                                              fullest_stats.queue_bytes, fullest_stats.queue_percent);
+    if (bitrate) {
+        // x264enc reconfigures itself for the next frame
+        g_object_set(self->encoder, "bitrate", bitrate, NULL);
+        g_print("Rendition %u: output %u sends %u kbit/s with its queue %u%% full, video bitrate %u kbit/s\n",
+                self->index, fullest->index, throughput, fullest_stats.queue_percent, bitrate);
+    }
+}
+
+void rendition_get_stats(broadcaster_rendition *self, rendition_stats *stats) {
+    g_return_if_fail(self && stats);
+    memset(stats, 0, sizeof(rendition_stats));
+    // read from the controller, the encoder is gone once the broadcast finished
+    stats->bitrate = self->adaptive ? self->controller.bitrate : self->bitrate;
+    stats->lowest_bitrate = self->adaptive ? self->controller.lowest_bitrate : self->bitrate;
+    stats->decreases = self->controller.decreases;
+    stats->increases = self->controller.increases;
+    stats->throughput = self->controller.throughput;
+    stats->queue_percent = self->controller.queue_percent;
+    stats->max_queue_percent = self->controller.max_queue_percent;
+    stats->congested = self->controller.congested;
+}
+
+gboolean rendition_enable_passthrough(broadcaster_rendition *self) {
+    g_return_val_if_fail(self, FALSE);
+    gchar *name = g_strdup_printf("rendition%u-video-selector", self->index);
+    self->video_selector = gst_element_factory_make("input-selector", name);
+    g_free(name);
+    name = g_strdup_printf("rendition%u-audio-selector", self->index);
+    self->audio_selector = gst_element_factory_make("input-selector", name);
+    g_free(name);
+    if (!self->video_selector || !self->audio_selector) {
+        g_printerr("Failed to create selectors of rendition %u.\n", self->index);
+        return FALSE;
+    }
+    // only the active track is muxed, data of the other one is dropped right away
+    g_object_set(self->video_selector, "sync-streams", FALSE, NULL);
+    g_object_set(self->audio_selector, "sync-streams", FALSE, NULL);
+    return TRUE;
+}
+
+// Links the element's src pad through a new sink pad of the selector, which links to the muxer's
+// pad of the given name (the selector's caps don't tell which one)
+static GstPad* rendition_link_selector(GstElement *element, GstElement *selector, GstElement *muxer,
+                                       const gchar *muxer_pad) {
+    GstPad *src_pad = gst_element_get_static_pad(element, "src");
+    GstPad *selector_pad = gst_element_get_request_pad(selector, "sink_%u");
+    GstPadLinkReturn ret = gst_pad_link(src_pad, selector_pad);
+    gst_object_unref(src_pad);
+    if (GST_PAD_LINK_FAILED(ret) || !gst_element_link_pads(selector, "src", muxer, muxer_pad)) {
+        gst_object_unref(selector_pad);
+        return NULL;
+    }
+    return selector_pad;
+}
+
+// Links a new src pad of the tee to the element's sink pad
+static GstPad* rendition_link_tee(GstElement *tee, GstElement *element) {
+    GstPad *tee_pad = gst_element_get_request_pad(tee, "src_%u");
+    GstPad *sink_pad = gst_element_get_static_pad(element, "sink");
+    GstPadLinkReturn ret = gst_pad_link(tee_pad, sink_pad);
+    gst_object_unref(sink_pad);
+    if (GST_PAD_LINK_FAILED(ret)) {
+        gst_element_release_request_pad(tee, tee_pad);
+        gst_object_unref(tee_pad);
+        return NULL;
+    }
+    return tee_pad;
+}
+
+gboolean rendition_attach(broadcaster_rendition *self, GstBin *bin, GstElement *video_tee, GstElement *audio_tee) {
+    g_return_val_if_fail(self && bin && video_tee && audio_tee, FALSE);
+    gst_bin_add_many(bin, self->video_queue, self->scaler, self->capsfilter, self->encoder,
+                     self->audio_queue, self->muxer, self->tee, NULL);
+    gboolean linked = gst_element_link_many(self->video_queue, self->scaler, self->capsfilter, self->encoder, NULL) &&
+            gst_element_link(self->muxer, self->tee);
+    if (linked && self->video_selector) {
+        gst_bin_add_many(bin, self->video_selector, self->audio_selector, NULL);
+        self->video_selector_pad = rendition_link_selector(self->encoder, self->video_selector, self->muxer, "video");
+        self->audio_selector_pad = rendition_link_selector(self->audio_queue, self->audio_selector, self->muxer, "audio");
+        linked = self->video_selector_pad && self->audio_selector_pad;
+    } else if (linked) {
+        linked = gst_element_link(self->encoder, self->muxer) && gst_element_link(self->audio_queue, self->muxer);
+    }
+    if (!linked) {
+        g_printerr("Failed to link elements of rendition %u.\n", self->index);
+        return FALSE;
+    }
+    self->video_tee_pad = rendition_link_tee(video_tee, self->video_queue);
+    self->audio_tee_pad = rendition_link_tee(audio_tee, self->audio_queue);
+    if (!self->video_tee_pad || !self->audio_tee_pad) {
+        g_printerr("Failed to link rendition %u to the composited stream.\n", self->index);
+        return FALSE;
+    }
+    for (guint i = 0; i < self->outputs->len; i++) {
+        if (!output_attach(g_ptr_array_index(self->outputs, i), bin, self->tee, self->muxer)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+void rendition_free(broadcaster_rendition *self) {
+    if (!self) {
+        return;
+    }
+    if (self->video_tee_pad) {
+        gst_object_unref(self->video_tee_pad);
+    }
+    if (self->audio_tee_pad) {
+        gst_object_unref(self->audio_tee_pad);
+    }
+    if (self->video_selector_pad) {
+        gst_object_unref(self->video_selector_pad);
+    }
+    if (self->audio_selector_pad) {
+        gst_object_unref(self->audio_selector_pad);
+    }
+    g_ptr_array_free(self->outputs, TRUE);
+    g_free(self);
+}
+
+gboolean rendition_from_string(gchar *description, Rendition *rendition, Output *output) {
+    g_return_val_if_fail(description && rendition && output, FALSE);
+    gchar *location = strchr(description, '=');
+    int consumed = 0;
+    memset(rendition, 0, sizeof(Rendition));
+    if (!location || location[1] == '\0') {
+        return FALSE;
+    }
+    *location++ = '\0';
+    if (sscanf(description, "%dx%d%n", &rendition->width, &rendition->height, &consumed) != 2) {
+        return FALSE;
+    }
+    if (description[consumed] != '\0' && description[consumed] != '@') {
+        return FALSE;
+    }
+    if (description[consumed] == '@' && sscanf(description + consumed + 1, "%d", &rendition->bitrate) != 1) {
+        return FALSE;
+    }
+    output_from_string(location, output);
+    rendition->outputs = output;
+    rendition->num_outputs = 1;
+    return rendition->width > 0 && rendition->height > 0 && rendition->bitrate >= 0;
+}
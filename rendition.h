@@ -0,0 +1,90 @@
+#ifndef _RENDITION_H_
+#define _RENDITION_H_
+
+#include <gst/gst.h>
+#include <glib.h>
+
+#include "twitch_broadcaster.h"
+#include "bitrate_controller.h"
+
+/*
+ * A single step of the ladder, fed from the composited canvas and the shared
+ * encoded audio:
+ * video tee -> queue -> scaler -> capsfilter -> x264enc -> flvmux -> tee -> outputs
+ * audio tee -> queue ----------------------------------------^
+ * The queue gives every rendition its own streaming thread, so encoders run in parallel.
+ */
+typedef struct broadcaster_rendition {
+    guint index;
+    gint width;
+    gint height;
+    // configured video bitrate (kbit/s), the encoder's default when not configured
+    guint bitrate;
+
+    GstElement *video_queue;
+    GstElement *scaler;
+    GstElement *capsfilter;
+    GstElement *encoder;
+    GstElement *audio_queue;
+    GstElement *muxer;
+    GstElement *tee;
+    GstPad *video_tee_pad;
+    GstPad *audio_tee_pad;
+    // with passthrough, input-selectors in front of the muxer choose between the encoded
+    // tracks (their selector pads below) and tracks remuxed from a source
+    GstElement *video_selector;
+    GstElement *audio_selector;
+    GstPad *video_selector_pad;
+    GstPad *audio_selector_pad;
+
+    // outputs the rendition is written to, owned by the rendition
+    GPtrArray *outputs;
+
+    // with adaptive bitrate, the encoder's bitrate follows its fullest output
+    gboolean adaptive;
+    bitrate_controller controller;
+} broadcaster_rendition;
+
+/**
+ * Creates elements of a rendition, outputs are to be added to outputs before attaching.
+ * @param bitrate video bitrate in kbit/s, 0 for the encoder's default
+ * @return NULL if elements couldn't be created
+ */
+broadcaster_rendition* rendition_new(guint index, gint width, gint height, gint bitrate);
+
+/**
+ * Puts selectors between the encoders and the muxer, so compressed tracks of a source can be
+ * muxed instead. To be called before attaching.
+ * @return FALSE if selectors couldn't be created
+ */
+gboolean rendition_enable_passthrough(broadcaster_rendition *self);
+
+/**
+ * Lets the bitrate controller drive the encoder's bitrate, starting at the rendition's (or the
+ * encoder's default) bitrate.
+ * @param min_bitrate kbit/s, 0 for the controller's default
+ */
+void rendition_enable_adaptive_bitrate(broadcaster_rendition *self, guint min_bitrate);
+
+/**
+ * Feeds the controller with the rendition's fullest connected output and applies its decision,
+ * called every BITRATE_CONTROLLER_INTERVAL_MS. Callers serialize it with rendition_get_stats().
+ */
+void rendition_control_bitrate(broadcaster_rendition *self, gint64 now);
+
+// Fills in the encoder's bitrate and the controller's metrics, under the lock rendition_control_bitrate() runs under
+void rendition_get_stats(broadcaster_rendition *self, rendition_stats *stats);
+
+// Adds rendition elements and outputs to the bin and links them to the video and audio tees
+gboolean rendition_attach(broadcaster_rendition *self, GstBin *bin, GstElement *video_tee, GstElement *audio_tee);
+
+void rendition_free(broadcaster_rendition *self);
+
+/**
+ * Parses rendition description WIDTHxHEIGHT[@KBPS]=OUTPUT, e.g. 1280x720@3000=rtmp://host/app/key.
+ * Output is parsed by output_from_string(), strings in the Output point into description.
+ * @return FALSE if the description is malformed
+ */
+gboolean rendition_from_string(gchar *description, Rendition *rendition, Output *output);
+
+#endif
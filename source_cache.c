@@ -0,0 +1,359 @@
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "source_cache.h"
+
+#define SOURCE_CACHE_OBJECTS "objects"
+#define SOURCE_CACHE_INDEX "index"
+#define SOURCE_CACHE_PARTIAL_TEMPLATE ".partial-XXXXXX"
+
+struct source_cache {
+    gchar *objects;
+    gchar *index;
+    guint64 max_bytes;
+    // one eviction at a time, and none while a recording publishes its object and index entry
+    // (recordings are committed from streaming threads)
+    GMutex evict_lock;
+    // stats
+    GMutex lock;
+    guint hits;
+    guint misses;
+    guint stored;
+    guint abandoned;
+    guint evicted;
+    guint64 bytes_saved;
+    guint64 bytes_stored;
+};
+
+// Bytes [start, end) of the object the download delivered
+typedef struct {
+    guint64 start;
+    guint64 end;
+} cache_range;
+
+struct source_cache_recording {
+    source_cache *cache;
+    gchar *uri;
+    gchar *path;
+    FILE *file;
+    // offset of the next bytes of the download, it seeks with range requests (e.g. to an
+    // mp4's index at its end)
+    guint64 position;
+    // sorted, neither overlapping nor touching
+    GArray *ranges;
+    // size of the object, 0 while unknown
+    guint64 length;
+    gboolean failed;
+};
+
+// An object in the cache and when it was last played
+typedef struct {
+    gchar *name;
+    guint64 size;
+    gint64 used;
+} cache_object;
+
+// Index entry of the uri, newly allocated
+static gchar* source_cache_index_path(source_cache *self, const gchar *uri) {
+    gchar *key = g_compute_checksum_for_string(G_CHECKSUM_SHA256, uri, -1);
+    gchar *path = g_build_filename(self->index, key, NULL);
+    g_free(key);
+    return path;
+}
+
+source_cache* source_cache_new(const gchar *directory, guint64 max_bytes) {
+    g_return_val_if_fail(directory, NULL);
+    source_cache *self = g_malloc0(sizeof(source_cache));
+    self->objects = g_build_filename(directory, SOURCE_CACHE_OBJECTS, NULL);
+    self->index = g_build_filename(directory, SOURCE_CACHE_INDEX, NULL);
+    self->max_bytes = max_bytes;
+    g_mutex_init(&self->evict_lock);
+    g_mutex_init(&self->lock);
+    if (g_mkdir_with_parents(self->objects, 0755) != 0 || g_mkdir_with_parents(self->index, 0755) != 0) {
+        g_printerr("Failed to create source cache in %s\n", directory);
+        source_cache_free(self);
+        return NULL;
+    }
+    return self;
+}
+
+gboolean source_cache_is_remote(const gchar *uri) {
+    return uri && (g_str_has_prefix(uri, "http://") || g_str_has_prefix(uri, "https://"));
+}
+
+GMappedFile* source_cache_lookup(source_cache *self, const gchar *uri) {
+    g_return_val_if_fail(self && uri, NULL);
+    gchar *index_path = source_cache_index_path(self, uri);
+    gchar *object = NULL;
+    GMappedFile *mapping = NULL;
+    if (g_file_get_contents(index_path, &object, NULL, NULL)) {
+        // an index entry outlives an object removed by hand, that's a miss
+        gchar *object_path = g_build_filename(self->objects, g_strstrip(object), NULL);
+        mapping = g_mapped_file_new(object_path, FALSE, NULL);
+        if (mapping) {
+            // the entry's modification time is when the object was last played
+            g_utime(index_path, NULL);
+        }
+        g_free(object_path);
+        g_free(object);
+    }
+    g_free(index_path);
+    g_mutex_lock(&self->lock);
+    if (mapping) {
+        self->hits++;
+    } else {
+        self->misses++;
+    }
+    g_mutex_unlock(&self->lock);
+    return mapping;
+}
+
+void source_cache_count_read(source_cache *self, guint64 bytes) {
+    g_return_if_fail(self);
+    g_mutex_lock(&self->lock);
+    self->bytes_saved += bytes;
+    g_mutex_unlock(&self->lock);
+}
+
+source_cache_recording* source_cache_record(source_cache *self, const gchar *uri) {
+    g_return_val_if_fail(self && uri, NULL);
+    // next to the objects, so committing is a rename within the file system
+    gchar *path = g_build_filename(self->objects, SOURCE_CACHE_PARTIAL_TEMPLATE, NULL);
+    gint fd = g_mkstemp(path);
+    FILE *file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (!file) {
+        g_printerr("Failed to create a partial cache object for %s\n", uri);
+        if (fd >= 0) {
+            close(fd);
+            g_unlink(path);
+        }
+        g_free(path);
+        return NULL;
+    }
+    source_cache_recording *recording = g_malloc0(sizeof(source_cache_recording));
+    recording->cache = self;
+    recording->uri = g_strdup(uri);
+    recording->path = path;
+    recording->file = file;
+    recording->ranges = g_array_new(FALSE, FALSE, sizeof(cache_range));
+    return recording;
+}
+
+// Adds [start, end) to the recorded ranges, merging the ones it overlaps or touches
+static void source_cache_recording_cover(source_cache_recording *self, guint64 start, guint64 end) {
+    cache_range range = { start, end };
+    guint i = 0;
+    while (i < self->ranges->len && g_array_index(self->ranges, cache_range, i).end < start) {
+        i++;
+    }
+    while (i < self->ranges->len && g_array_index(self->ranges, cache_range, i).start <= end) {
+        cache_range *merged = &g_array_index(self->ranges, cache_range, i);
+        range.start = MIN(range.start, merged->start);
+        range.end = MAX(range.end, merged->end);
+        g_array_remove_index(self->ranges, i);
+    }
+    g_array_insert_val(self->ranges, i, range);
+}
+
+gboolean source_cache_recording_write(source_cache_recording *self, guint64 offset, const guint8 *data, gsize size) {
+    g_return_val_if_fail(self, FALSE);
+    if (self->failed) {
+        return FALSE;
+    }
+    if (offset == SOURCE_CACHE_OFFSET_NONE) {
+        offset = self->position;
+    }
+    if (!size) {
+        self->position = offset;
+        return TRUE;
+    }
+    if (fseeko(self->file, (off_t)offset, SEEK_SET) != 0 || fwrite(data, 1, size, self->file) != size) {
+        // a full disk, what was recorded can't be completed
+        self->failed = TRUE;
+        return FALSE;
+    }
+    source_cache_recording_cover(self, offset, offset + size);
+    self->position = offset + size;
+    return TRUE;
+}
+
+void source_cache_recording_set_length(source_cache_recording *self, guint64 length) {
+    g_return_if_fail(self);
+    self->length = length;
+}
+
+// Size of the object when the download delivered all of it, 0 otherwise
+static guint64 source_cache_recording_complete_size(source_cache_recording *self) {
+    if (self->ranges->len != 1) {
+        return 0;
+    }
+    cache_range *range = &g_array_index(self->ranges, cache_range, 0);
+    return range->start == 0 && (!self->length || range->end == self->length) ? range->end : 0;
+}
+
+static gint cache_object_compare_used(gconstpointer a, gconstpointer b) {
+    const cache_object *first = a, *second = b;
+    return first->used < second->used ? -1 : first->used > second->used;
+}
+
+// Removes the least recently played objects (and the index entries naming them) until the
+// objects fit max_bytes, except the one just committed
+static void source_cache_evict(source_cache *self, const gchar *keep) {
+    GHashTable *used = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    GHashTable *entries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_ptr_array_unref);
+    GArray *objects = g_array_new(FALSE, FALSE, sizeof(cache_object));
+    guint64 total = 0;
+    const gchar *name;
+    g_mutex_lock(&self->evict_lock);
+
+    GDir *dir = g_dir_open(self->index, 0, NULL);
+    while (dir && (name = g_dir_read_name(dir))) {
+        gchar *entry_path = g_build_filename(self->index, name, NULL);
+        gchar *object = NULL;
+        GStatBuf entry_stat;
+        if (g_stat(entry_path, &entry_stat) == 0 && g_file_get_contents(entry_path, &object, NULL, NULL)) {
+            g_strstrip(object);
+            GPtrArray *paths = g_hash_table_lookup(entries, object);
+            if (!paths) {
+                paths = g_ptr_array_new_with_free_func(g_free);
+                g_hash_table_insert(entries, g_strdup(object), paths);
+            }
+            g_ptr_array_add(paths, g_strdup(entry_path));
+            gint64 last = GPOINTER_TO_SIZE(g_hash_table_lookup(used, object));
+            g_hash_table_insert(used, object, GSIZE_TO_POINTER(MAX(last, (gint64)entry_stat.st_mtime)));
+        }
+        g_free(entry_path);
+    }
+    if (dir) {
+        g_dir_close(dir);
+    }
+    dir = g_dir_open(self->objects, 0, NULL);
+    while (dir && (name = g_dir_read_name(dir))) {
+        gchar *object_path = g_build_filename(self->objects, name, NULL);
+        GStatBuf object_stat;
+        // partial objects of running recordings start with a dot
+        if (name[0] != '.' && g_stat(object_path, &object_stat) == 0) {
+            // objects no entry names anymore go first
+            cache_object object = { g_strdup(name), (guint64)object_stat.st_size,
+                                    (gint64)GPOINTER_TO_SIZE(g_hash_table_lookup(used, name)) };
+            g_array_append_val(objects, object);
+            total += object.size;
+        }
+        g_free(object_path);
+    }
+    if (dir) {
+        g_dir_close(dir);
+    }
+
+    g_array_sort(objects, cache_object_compare_used);
+    guint evicted = 0;
+    for (guint i = 0; i < objects->len; i++) {
+        cache_object *object = &g_array_index(objects, cache_object, i);
+        if (total > self->max_bytes && !g_str_equal(object->name, keep)) {
+            GPtrArray *paths = g_hash_table_lookup(entries, object->name);
+            for (guint j = 0; paths && j < paths->len; j++) {
+                g_unlink(g_ptr_array_index(paths, j));
+            }
+            // mappings of broadcasts still playing it stay valid
+            gchar *object_path = g_build_filename(self->objects, object->name, NULL);
+            g_unlink(object_path);
+            g_free(object_path);
+            total -= object->size;
+            evicted++;
+        }
+        g_free(object->name);
+    }
+    g_mutex_unlock(&self->evict_lock);
+    g_array_free(objects, TRUE);
+    g_hash_table_destroy(entries);
+    g_hash_table_destroy(used);
+
+    g_mutex_lock(&self->lock);
+    self->evicted += evicted;
+    g_mutex_unlock(&self->lock);
+}
+
+// Moves the complete partial object to its content address and points the uri's entry at it
+static gboolean source_cache_commit(source_cache_recording *self) {
+    source_cache *cache = self->cache;
+    GMappedFile *contents = g_mapped_file_new(self->path, FALSE, NULL);
+    if (!contents) {
+        return FALSE;
+    }
+    gchar *object = g_compute_checksum_for_data(G_CHECKSUM_SHA256, (const guchar *)g_mapped_file_get_contents(contents),
+                                                g_mapped_file_get_length(contents));
+    g_mapped_file_unref(contents);
+    gchar *object_path = g_build_filename(cache->objects, object, NULL);
+    gchar *index_path = source_cache_index_path(cache, self->uri);
+    gboolean committed;
+    // an eviction running meanwhile would take an object without its index entry for unused
+    g_mutex_lock(&cache->evict_lock);
+    if (g_file_test(object_path, G_FILE_TEST_EXISTS)) {
+        // the same content under another uri (or recorded by someone else meanwhile)
+        g_unlink(self->path);
+        committed = TRUE;
+    } else {
+        committed = g_rename(self->path, object_path) == 0;
+    }
+    committed = committed && g_file_set_contents(index_path, object, -1, NULL);
+    g_mutex_unlock(&cache->evict_lock);
+    if (committed && cache->max_bytes) {
+        source_cache_evict(cache, object);
+    }
+    g_free(object);
+    g_free(object_path);
+    g_free(index_path);
+    return committed;
+}
+
+void source_cache_recording_finish(source_cache_recording *self, gboolean complete) {
+    if (!self) {
+        return;
+    }
+    source_cache *cache = self->cache;
+    gboolean flushed = fclose(self->file) == 0;
+    guint64 size = source_cache_recording_complete_size(self);
+    complete = complete && flushed && !self->failed && size;
+    if (complete && source_cache_commit(self)) {
+        g_mutex_lock(&cache->lock);
+        cache->stored++;
+        cache->bytes_stored += size;
+        g_mutex_unlock(&cache->lock);
+    } else {
+        g_unlink(self->path);
+        g_mutex_lock(&cache->lock);
+        cache->abandoned++;
+        g_mutex_unlock(&cache->lock);
+    }
+    g_array_free(self->ranges, TRUE);
+    g_free(self->uri);
+    g_free(self->path);
+    g_free(self);
+}
+
+void source_cache_get_stats(source_cache *self, cache_stats *stats) {
+    g_return_if_fail(self && stats);
+    memset(stats, 0, sizeof(cache_stats));
+    g_mutex_lock(&self->lock);
+    stats->hits = self->hits;
+    stats->misses = self->misses;
+    stats->stored = self->stored;
+    stats->abandoned = self->abandoned;
+    stats->evicted = self->evicted;
+    stats->bytes_saved = self->bytes_saved;
+    stats->bytes_stored = self->bytes_stored;
+    g_mutex_unlock(&self->lock);
+}
+
+void source_cache_free(source_cache *self) {
+    if (!self) {
+        return;
+    }
+    g_mutex_clear(&self->evict_lock);
+    g_mutex_clear(&self->lock);
+    g_free(self->objects);
+    g_free(self->index);
+    g_free(self);
+}
@@ -0,0 +1,75 @@
+#ifndef _SOURCE_CACHE_H_
+#define _SOURCE_CACHE_H_
+
+#include <glib.h>
+
+#include "twitch_broadcaster.h"
+
+// Offset of downloaded data that doesn't carry one
+#define SOURCE_CACHE_OFFSET_NONE G_MAXUINT64
+
+/*
+ * Persistent cache of remote (http/https) sources on disk, content addressed:
+ * <directory>/objects/<sha256 of the content> holds every downloaded asset once, however many
+ * uris it's served at, and <directory>/index/<sha256 of the uri> names the object of a uri.
+ * Sources are recorded while they are played: bytes the decoder downloads are written to a
+ * partial object at their offsets (the download may seek, e.g. to an mp4's index at its end),
+ * which is committed once the download ended with every byte of the object recorded, so
+ * nothing is downloaded twice. Cached objects are read through memory mapping. Entries are
+ * written atomically (rename), so several broadcasters (or processes) may share a directory.
+ * With a size bound, every commit evicts the least recently played objects beyond it (by the
+ * modification time of their index entries, which every hit touches).
+ */
+typedef struct source_cache source_cache;
+
+// Download of a single uri being written to the cache
+typedef struct source_cache_recording source_cache_recording;
+
+/**
+ * Opens the cache in the directory, creating it if needed.
+ * @param max_bytes most bytes the objects may take, 0 for no bound
+ * @return NULL if the directory can't be created
+ */
+source_cache* source_cache_new(const gchar *directory, guint64 max_bytes);
+
+// TRUE for remote (http/https) uris, the ones the cache takes
+gboolean source_cache_is_remote(const gchar *uri);
+
+/**
+ * Maps the cached content of the uri, counting a hit or a miss.
+ * @return NULL when the uri is not cached
+ */
+GMappedFile* source_cache_lookup(source_cache *self, const gchar *uri);
+
+// Counts bytes read from a mapping instead of the network
+void source_cache_count_read(source_cache *self, guint64 bytes);
+
+/**
+ * Starts recording a download of the uri, to be fed as it's downloaded.
+ * @return NULL if the partial object can't be created
+ */
+source_cache_recording* source_cache_record(source_cache *self, const gchar *uri);
+
+/**
+ * Writes data found at the offset of the download (SOURCE_CACHE_OFFSET_NONE when unknown,
+ * right after the previous data). Without data (size 0) it only moves the offset of the next
+ * data, where the download seeked to.
+ * @return FALSE once the recording failed (e.g. a full disk)
+ */
+gboolean source_cache_recording_write(source_cache_recording *self, guint64 offset, const guint8 *data, gsize size);
+
+// Size of the object when the download knows it, its recorded bytes have to cover all of it
+void source_cache_recording_set_length(source_cache_recording *self, guint64 length);
+
+/**
+ * Ends the recording: complete when the download reached its end, which commits it to the
+ * cache if every byte of the object was recorded, otherwise the partial object is removed.
+ * Frees the recording.
+ */
+void source_cache_recording_finish(source_cache_recording *self, gboolean complete);
+
+void source_cache_get_stats(source_cache *self, cache_stats *stats);
+
+void source_cache_free(source_cache *self);
+
+#endif
@@ -0,0 +1,519 @@
+#include <gst/gst.h>
+#include <glib.h>
+
+#include "source_registry.h"
+
+// How often a decoder whose data nobody takes yet checks its subscribers again
+#define SHARED_SOURCE_POLL_INTERVAL (10 * G_TIME_SPAN_MILLISECOND)
+// How long a decoder waits for a new subscriber to start before going on without it
+#define SHARED_SOURCE_JOIN_TIMEOUT G_TIME_SPAN_SECOND
+
+typedef struct shared_decoder shared_decoder;
+
+// Raw track of a decoder, its caps are only touched from the track's streaming thread
+typedef struct {
+    shared_decoder *decoder;
+    guint index;
+    gboolean video;
+    GstCaps *caps;
+} decoder_track;
+
+struct shared_decoder {
+    source_registry *registry;
+    gchar *uri;
+    GstElement *pipeline;
+    // guarded by the registry's lock
+    GPtrArray *subscribers;
+    GPtrArray *tracks;
+    gboolean stopping;
+    // data went to subscribers, guarded by the registry's lock
+    gboolean delivering;
+};
+
+struct shared_source {
+    source_registry *registry;
+    shared_decoder *decoder;
+    GstElement *bin;
+    gint refs;
+    gint removed;
+    // the decoder waits for a new subscriber to start until then
+    gint64 join_deadline;
+    GMutex lock;
+    // appsrc per track of the decoder, NULL until the track's first buffer, and the first
+    // timestamp the subscriber got, its running time 0
+    GPtrArray *appsrcs;
+    GstClockTime base;
+    // told the decoder ended or failed before it got any track
+    gboolean failed;
+};
+
+struct source_registry {
+    // subscribers don't join a decoder which delivered data already
+    gboolean from_start;
+    GMutex lock;
+    // wakes up decoders waiting for their subscribers
+    GCond cond;
+    // decoders by uri, the ones which reached their end or failed are not in there anymore
+    GHashTable *decoders;
+    guint num_decoders;
+    guint subscribers;
+    guint64 decoded_frames;
+    guint64 delivered_frames;
+};
+
+static shared_source* shared_source_ref(shared_source *source) {
+    g_atomic_int_inc(&source->refs);
+    return source;
+}
+
+static void shared_source_unref(shared_source *source) {
+    if (!g_atomic_int_dec_and_test(&source->refs)) {
+        return;
+    }
+    for (guint i = 0; i < source->appsrcs->len; i++) {
+        if (g_ptr_array_index(source->appsrcs, i)) {
+            gst_object_unref(g_ptr_array_index(source->appsrcs, i));
+        }
+    }
+    g_ptr_array_free(source->appsrcs, TRUE);
+    gst_object_unref(source->bin);
+    g_mutex_clear(&source->lock);
+    g_free(source);
+}
+
+// The subscriber takes data once its element is started
+static gboolean shared_source_ready(shared_source *source) {
+    GST_OBJECT_LOCK(source->bin);
+    gboolean started = GST_STATE(source->bin) >= GST_STATE_PAUSED;
+    GST_OBJECT_UNLOCK(source->bin);
+    return started && !g_atomic_int_get(&source->removed);
+}
+
+// Creates the subscriber's appsrc for the track and exposes it, to be called with the source's lock
+static GstElement* shared_source_add_track(shared_source *source, decoder_track *track) {
+    gchar *name = g_strdup_printf("%s-track%u", GST_OBJECT_NAME(source->bin), track->index);
+    GstElement *appsrc = gst_element_factory_make("appsrc", name);
+    g_free(name);
+    if (!appsrc) {
+        g_printerr("Failed to create track %u of shared source %s.\n", track->index, GST_OBJECT_NAME(source->bin));
+        return NULL;
+    }
+    g_object_set(appsrc, "format", GST_FORMAT_TIME, "block", TRUE,
+                 "max-bytes", (guint64)SHARED_SOURCE_QUEUE_BYTES, "caps", track->caps, NULL);
+    gst_bin_add(GST_BIN(source->bin), appsrc);
+    GstPad *pad = gst_element_get_static_pad(appsrc, "src");
+    // the subscriber's running time starts at its first buffer, wherever the decoder is
+    gst_pad_set_offset(pad, -(gint64)source->base);
+    name = g_strdup_printf("src_%u", track->index);
+    GstPad *ghost = gst_ghost_pad_new(name, pad);
+    g_free(name);
+    gst_object_unref(pad);
+    gst_pad_set_active(ghost, TRUE);
+    // the subscriber wires the track (pad-added) before any data flows
+    gst_element_add_pad(source->bin, ghost);
+    gst_element_sync_state_with_parent(appsrc);
+    g_ptr_array_set_size(source->appsrcs, MAX(source->appsrcs->len, track->index + 1));
+    source->appsrcs->pdata[track->index] = gst_object_ref(appsrc);
+    return appsrc;
+}
+
+/**
+ * Subscriber's appsrc of the track, created for the first buffer of the track (its timestamp
+ * given) when the subscriber takes data.
+ * @return NULL if there's none, a new reference otherwise
+ */
+static GstElement* shared_source_get_track(shared_source *source, decoder_track *track, gboolean create,
+                                           GstClockTime timestamp) {
+    GstElement *appsrc = NULL;
+    g_mutex_lock(&source->lock);
+    if (!g_atomic_int_get(&source->removed)) {
+        appsrc = track->index < source->appsrcs->len ? g_ptr_array_index(source->appsrcs, track->index) : NULL;
+        if (appsrc) {
+            gst_object_ref(appsrc);
+        } else if (create) {
+            if (!GST_CLOCK_TIME_IS_VALID(source->base)) {
+                source->base = GST_CLOCK_TIME_IS_VALID(timestamp) ? timestamp : 0;
+            }
+            appsrc = shared_source_add_track(source, track);
+            if (appsrc) {
+                gst_object_ref(appsrc);
+            }
+        }
+    }
+    g_mutex_unlock(&source->lock);
+    return appsrc;
+}
+
+// Fails the subscriber's element like a decoder of its own would, once
+static void shared_source_fail(shared_source *source, const GError *error, const gchar *debug) {
+    g_mutex_lock(&source->lock);
+    gboolean fail = !source->failed && !g_atomic_int_get(&source->removed);
+    source->failed = TRUE;
+    g_mutex_unlock(&source->lock);
+    if (fail) {
+        gst_element_post_message(source->bin, gst_message_new_error(GST_OBJECT(source->bin), (GError *)error, debug));
+    }
+}
+
+/**
+ * Subscribers the decoder's data goes to, referenced. For buffers (ready) those which started,
+ * waiting until there's one unless the decoder stops, and for new ones to start unless they
+ * take too long. Events go to all of them.
+ */
+static GPtrArray* shared_decoder_get_targets(shared_decoder *decoder, gboolean ready) {
+    source_registry *self = decoder->registry;
+    GPtrArray *targets = g_ptr_array_new_with_free_func((GDestroyNotify)shared_source_unref);
+    g_mutex_lock(&self->lock);
+    while (ready && !decoder->stopping) {
+        gint64 now = g_get_monotonic_time();
+        gboolean started = FALSE;
+        gboolean joining = FALSE;
+        for (guint i = 0; i < decoder->subscribers->len; i++) {
+            shared_source *source = g_ptr_array_index(decoder->subscribers, i);
+            if (shared_source_ready(source)) {
+                started = TRUE;
+            } else if (now < source->join_deadline) {
+                joining = TRUE;
+            }
+        }
+        if (started && !joining) {
+            break;
+        }
+        g_cond_wait_until(&self->cond, &self->lock, now + SHARED_SOURCE_POLL_INTERVAL);
+    }
+    for (guint i = 0; !(ready && decoder->stopping) && i < decoder->subscribers->len; i++) {
+        shared_source *source = g_ptr_array_index(decoder->subscribers, i);
+        if (!ready || shared_source_ready(source)) {
+            g_ptr_array_add(targets, shared_source_ref(source));
+        }
+    }
+    // under the lock, a subscriber coming later knows it missed data
+    decoder->delivering = decoder->delivering || (ready && targets->len);
+    g_mutex_unlock(&self->lock);
+    return targets;
+}
+
+// New subscribers of the uri get a decoder of their own from now on
+static void shared_decoder_detach(shared_decoder *decoder) {
+    source_registry *self = decoder->registry;
+    g_mutex_lock(&self->lock);
+    if (g_hash_table_lookup(self->decoders, decoder->uri) == decoder) {
+        g_hash_table_remove(self->decoders, decoder->uri);
+    }
+    g_mutex_unlock(&self->lock);
+}
+
+// Pushes the buffer by reference to every subscriber, blocking while one of them is full
+static void shared_decoder_deliver(decoder_track *track, GstBuffer *buffer) {
+    shared_decoder *decoder = track->decoder;
+    source_registry *self = decoder->registry;
+    GPtrArray *targets = shared_decoder_get_targets(decoder, TRUE);
+    guint delivered = 0;
+    for (guint i = 0; i < targets->len; i++) {
+        GstElement *appsrc = shared_source_get_track(g_ptr_array_index(targets, i), track, TRUE,
+                                                     GST_BUFFER_PTS(buffer));
+        if (appsrc) {
+            GstFlowReturn ret = GST_FLOW_OK;
+            // takes its own reference, the buffer isn't copied
+            g_signal_emit_by_name(appsrc, "push-buffer", buffer, &ret);
+            gst_object_unref(appsrc);
+            delivered++;
+        }
+    }
+    if (track->video && delivered) {
+        g_mutex_lock(&self->lock);
+        self->decoded_frames++;
+        self->delivered_frames += delivered;
+        g_mutex_unlock(&self->lock);
+    }
+    g_ptr_array_free(targets, TRUE);
+}
+
+// Ends the track for every subscriber, those which never got a track fail
+static void shared_decoder_end_track(decoder_track *track) {
+    shared_decoder *decoder = track->decoder;
+    shared_decoder_detach(decoder);
+    GPtrArray *targets = shared_decoder_get_targets(decoder, FALSE);
+    for (guint i = 0; i < targets->len; i++) {
+        shared_source *source = g_ptr_array_index(targets, i);
+        GstElement *appsrc = shared_source_get_track(source, track, FALSE, GST_CLOCK_TIME_NONE);
+        if (appsrc) {
+            GstFlowReturn ret = GST_FLOW_OK;
+            g_signal_emit_by_name(appsrc, "end-of-stream", &ret);
+            gst_object_unref(appsrc);
+            continue;
+        }
+        g_mutex_lock(&source->lock);
+        gboolean untracked = TRUE;
+        for (guint j = 0; j < source->appsrcs->len && untracked; j++) {
+            untracked = g_ptr_array_index(source->appsrcs, j) == NULL;
+        }
+        g_mutex_unlock(&source->lock);
+        if (untracked) {
+            GError *error = g_error_new_literal(GST_STREAM_ERROR, GST_STREAM_ERROR_FAILED,
+                                                "Shared source ended before the subscriber started");
+            shared_source_fail(source, error, decoder->uri);
+            g_error_free(error);
+        }
+    }
+    g_ptr_array_free(targets, TRUE);
+}
+
+static GstPadProbeReturn decoder_track_probe(GstPad *pad, GstPadProbeInfo *info, decoder_track *track) {
+    if (info->type & GST_PAD_PROBE_TYPE_BUFFER) {
+        shared_decoder_deliver(track, GST_PAD_PROBE_INFO_BUFFER(info));
+        return GST_PAD_PROBE_OK;
+    }
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+    if (GST_EVENT_TYPE(event) == GST_EVENT_CAPS) {
+        GstCaps *caps = NULL;
+        gst_event_parse_caps(event, &caps);
+        gst_caps_replace(&track->caps, caps);
+        GPtrArray *targets = shared_decoder_get_targets(track->decoder, FALSE);
+        for (guint i = 0; i < targets->len; i++) {
+            GstElement *appsrc = shared_source_get_track(g_ptr_array_index(targets, i), track, FALSE,
+                                                         GST_CLOCK_TIME_NONE);
+            if (appsrc) {
+                // queued in front of the buffers that follow
+                g_object_set(appsrc, "caps", caps, NULL);
+                gst_object_unref(appsrc);
+            }
+        }
+        g_ptr_array_free(targets, TRUE);
+    } else if (GST_EVENT_TYPE(event) == GST_EVENT_EOS) {
+        shared_decoder_end_track(track);
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+static void decoder_pad_added_handler(GstElement *element, GstPad *pad, shared_decoder *decoder) {
+    GstCaps *caps = gst_pad_get_current_caps(pad);
+    if (!caps) {
+        caps = gst_pad_query_caps(pad, NULL);
+    }
+    const gchar *type = gst_caps_get_size(caps) ? gst_structure_get_name(gst_caps_get_structure(caps, 0)) : "";
+    gboolean video = g_str_has_prefix(type, "video/x-raw");
+    gboolean raw = video || g_str_has_prefix(type, "audio/x-raw");
+
+    // the decoder's own pace is set by its subscribers, not by a clock
+    GstElement *sink = gst_element_factory_make("fakesink", NULL);
+    if (!sink) {
+        g_printerr("Failed to create a sink for a track of shared source %s.\n", decoder->uri);
+        gst_caps_unref(caps);
+        return;
+    }
+    g_object_set(sink, "sync", FALSE, "async", FALSE, NULL);
+    gst_bin_add(GST_BIN(decoder->pipeline), sink);
+    if (raw) {
+        decoder_track *track = g_new0(decoder_track, 1);
+        track->decoder = decoder;
+        track->video = video;
+        track->caps = gst_caps_ref(caps);
+        g_mutex_lock(&decoder->registry->lock);
+        track->index = decoder->tracks->len;
+        g_ptr_array_add(decoder->tracks, track);
+        g_mutex_unlock(&decoder->registry->lock);
+        gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+                          (GstPadProbeCallback)decoder_track_probe, track, NULL);
+    }
+    GstPad *sink_pad = gst_element_get_static_pad(sink, "sink");
+    if (GST_PAD_LINK_FAILED(gst_pad_link(pad, sink_pad))) {
+        g_printerr("Failed to link track %s of shared source %s.\n", GST_PAD_NAME(pad), decoder->uri);
+    }
+    gst_object_unref(sink_pad);
+    gst_element_sync_state_with_parent(sink);
+    gst_caps_unref(caps);
+}
+
+// Nobody reads the decoder's bus, its errors fail every subscriber
+static GstBusSyncReply decoder_bus_handler(GstBus *bus, GstMessage *msg, shared_decoder *decoder) {
+    if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR) {
+        GError *error = NULL;
+        gchar *debug_info = NULL;
+        gst_message_parse_error(msg, &error, &debug_info);
+        g_printerr("Shared decoder of %s failed: %s\n", decoder->uri, error->message);
+        shared_decoder_detach(decoder);
+        GPtrArray *targets = shared_decoder_get_targets(decoder, FALSE);
+        for (guint i = 0; i < targets->len; i++) {
+            shared_source_fail(g_ptr_array_index(targets, i), error, debug_info);
+        }
+        g_ptr_array_free(targets, TRUE);
+        g_clear_error(&error);
+        g_free(debug_info);
+    }
+    gst_message_unref(msg);
+    return GST_BUS_DROP;
+}
+
+static void decoder_track_free(decoder_track *track) {
+    if (track->caps) {
+        gst_caps_unref(track->caps);
+    }
+    g_free(track);
+}
+
+static void shared_decoder_free(shared_decoder *decoder) {
+    if (decoder->pipeline) {
+        // stopping, its streaming threads don't wait for subscribers anymore
+        gst_element_set_state(decoder->pipeline, GST_STATE_NULL);
+        gst_object_unref(decoder->pipeline);
+    }
+    g_ptr_array_free(decoder->tracks, TRUE);
+    g_ptr_array_free(decoder->subscribers, TRUE);
+    g_free(decoder->uri);
+    g_free(decoder);
+}
+
+static shared_decoder* shared_decoder_new(source_registry *self, const gchar *uri) {
+    GstElement *pipeline = gst_pipeline_new("shared-source");
+    GstElement *decodebin = gst_element_factory_make("uridecodebin", "shared-decoder");
+    if (!pipeline || !decodebin) {
+        g_printerr("Failed to create the shared decoder of %s.\n", uri);
+        if (pipeline) {
+            gst_object_unref(pipeline);
+        }
+        if (decodebin) {
+            gst_object_unref(decodebin);
+        }
+        return NULL;
+    }
+    shared_decoder *decoder = g_malloc0(sizeof(shared_decoder));
+    decoder->registry = self;
+    decoder->uri = g_strdup(uri);
+    decoder->pipeline = pipeline;
+    decoder->subscribers = g_ptr_array_new();
+    decoder->tracks = g_ptr_array_new_with_free_func((GDestroyNotify)decoder_track_free);
+    g_object_set(decodebin, "uri", uri, NULL);
+    g_signal_connect(decodebin, "pad-added", G_CALLBACK(decoder_pad_added_handler), decoder);
+    gst_bin_add(GST_BIN(pipeline), decodebin);
+    GstBus *bus = gst_element_get_bus(pipeline);
+    gst_bus_set_sync_handler(bus, (GstBusSyncHandler)decoder_bus_handler, decoder, NULL);
+    gst_object_unref(bus);
+    return decoder;
+}
+
+//----------------------------------------------------------------------------------------
+// API implementation
+
+source_registry* source_registry_new(gboolean from_start) {
+    source_registry *self = g_malloc0(sizeof(source_registry));
+    self->from_start = from_start;
+    g_mutex_init(&self->lock);
+    g_cond_init(&self->cond);
+    // keyed by the decoders' own uri
+    self->decoders = g_hash_table_new(g_str_hash, g_str_equal);
+    return self;
+}
+
+shared_source* source_registry_subscribe(source_registry *self, const gchar *uri, const gchar *name) {
+    g_return_val_if_fail(self && uri, NULL);
+    shared_source *source = g_malloc0(sizeof(shared_source));
+    source->registry = self;
+    source->refs = 1;
+    source->bin = gst_object_ref_sink(gst_bin_new(name));
+    source->appsrcs = g_ptr_array_new();
+    source->base = GST_CLOCK_TIME_NONE;
+    source->join_deadline = g_get_monotonic_time() + SHARED_SOURCE_JOIN_TIMEOUT;
+    g_mutex_init(&source->lock);
+
+    g_mutex_lock(&self->lock);
+    shared_decoder *decoder = g_hash_table_lookup(self->decoders, uri);
+    if (decoder && self->from_start && decoder->delivering) {
+        // it goes on for its subscribers, new ones get the next decoder
+        g_hash_table_remove(self->decoders, uri);
+        decoder = NULL;
+    }
+    gboolean start = !decoder;
+    if (start && (decoder = shared_decoder_new(self, uri))) {
+        g_hash_table_insert(self->decoders, decoder->uri, decoder);
+        self->num_decoders++;
+    }
+    if (decoder) {
+        source->decoder = decoder;
+        g_ptr_array_add(decoder->subscribers, source);
+        self->subscribers++;
+    }
+    g_mutex_unlock(&self->lock);
+    if (!decoder) {
+        shared_source_unref(source);
+        return NULL;
+    }
+    if (start) {
+        g_print("Decoding %s once for all its subscribers\n", uri);
+    }
+    if (start && gst_element_set_state(decoder->pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+        g_printerr("Unable to start the shared decoder of %s.\n", uri);
+        source_registry_unsubscribe(source);
+        return NULL;
+    }
+    return source;
+}
+
+GstElement* shared_source_get_element(shared_source *source) {
+    g_return_val_if_fail(source, NULL);
+    return source->bin;
+}
+
+void source_registry_unsubscribe(shared_source *source) {
+    if (!source) {
+        return;
+    }
+    source_registry *self = source->registry;
+    shared_decoder *decoder = source->decoder;
+
+    // no track is added from now on, the flushing appsrcs wake up the decoder if it's
+    // waiting for one of them to make room
+    g_atomic_int_set(&source->removed, TRUE);
+    gst_element_set_locked_state(source->bin, TRUE);
+    gst_element_set_state(source->bin, GST_STATE_NULL);
+    g_mutex_lock(&source->lock);
+    // including a track added while the element was stopped
+    for (guint i = 0; i < source->appsrcs->len; i++) {
+        if (g_ptr_array_index(source->appsrcs, i)) {
+            gst_element_set_state(g_ptr_array_index(source->appsrcs, i), GST_STATE_NULL);
+        }
+    }
+    g_mutex_unlock(&source->lock);
+
+    g_mutex_lock(&self->lock);
+    g_ptr_array_remove(decoder->subscribers, source);
+    self->subscribers--;
+    gboolean last = decoder->subscribers->len == 0;
+    if (last) {
+        decoder->stopping = TRUE;
+        if (g_hash_table_lookup(self->decoders, decoder->uri) == decoder) {
+            g_hash_table_remove(self->decoders, decoder->uri);
+        }
+        self->num_decoders--;
+    }
+    g_cond_broadcast(&self->cond);
+    g_mutex_unlock(&self->lock);
+    shared_source_unref(source);
+    if (last) {
+        // joins the decoder's streaming threads, without the lock they may be waiting for
+        shared_decoder_free(decoder);
+    }
+}
+
+void source_registry_get_stats(source_registry *self, registry_stats *stats) {
+    g_return_if_fail(self && stats);
+    g_mutex_lock(&self->lock);
+    stats->decoders = self->num_decoders;
+    stats->subscribers = self->subscribers;
+    stats->decoded_frames = self->decoded_frames;
+    stats->delivered_frames = self->delivered_frames;
+    g_mutex_unlock(&self->lock);
+}
+
+void source_registry_free(source_registry *self) {
+    if (!self) {
+        return;
+    }
+    if (self->subscribers) {
+        g_printerr("Source registry freed with %u subscriptions left.\n", self->subscribers);
+    }
+    g_hash_table_destroy(self->decoders);
+    g_cond_clear(&self->cond);
+    g_mutex_clear(&self->lock);
+    g_free(self);
+}
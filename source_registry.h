@@ -0,0 +1,63 @@
+#ifndef _SOURCE_REGISTRY_H_
+#define _SOURCE_REGISTRY_H_
+
+#include <gst/gst.h>
+#include <glib.h>
+
+/*
+ * Sources decoded once per process for every broadcaster mixing them (see host.h): the first
+ * subscriber of a uri starts a decoder of its own (uridecodebin in a pipeline of its own) and
+ * every subscriber gets a bin exposing a raw pad per track, like uridecodebin does. Decoded
+ * buffers are pushed by reference to an appsrc per subscriber and track, nothing is copied.
+ * The decoder runs at the pace of its slowest subscriber (the appsrcs block once they hold
+ * SHARED_SOURCE_QUEUE_BYTES) and stops when the last one leaves. Subscribers joining a running
+ * decoder start where it is, like a live feed, their running time starting at 0; the decoder
+ * waits a moment (a second) for new subscribers to start, so one coming later misses the start
+ * of a VOD asset. A registry created from_start gives such subscribers a decoder of their own
+ * instead. Once a decoder reached its end (or failed) new subscribers get a new one.
+ */
+typedef struct source_registry source_registry;
+
+// A broadcaster's subscription to a shared decoder
+typedef struct shared_source shared_source;
+
+// Decoded data an appsrc of a subscriber holds before the decoder waits for it
+#define SHARED_SOURCE_QUEUE_BYTES (16 * 1024 * 1024)
+
+typedef struct {
+    // decoders running and subscriptions to them
+    guint decoders;
+    guint subscribers;
+    // video frames decoded and frames handed to subscribers, decoded - delivered frames were
+    // not decoded again
+    guint64 decoded_frames;
+    guint64 delivered_frames;
+} registry_stats;
+
+/**
+ * @param from_start TRUE if every subscriber plays its uri from the start: a decoder which
+ * delivered data already is not shared with new subscribers
+ */
+source_registry* source_registry_new(gboolean from_start);
+
+/**
+ * Subscribes to the decoder of the uri, starting one if there's none. The subscription's
+ * element is added to the subscriber's pipeline in place of a uridecodebin, its tracks are
+ * exposed (pad-added) once it's at least PAUSED and the decoder has data.
+ * @param name name of the subscription's element
+ * @return NULL if the decoder can't be started
+ */
+shared_source* source_registry_subscribe(source_registry *self, const gchar *uri, const gchar *name);
+
+// Element of the subscription (a bin), owned by the subscription, pipelines take their own reference
+GstElement* shared_source_get_element(shared_source *source);
+
+// Stops the subscription's element and ends the subscription, the decoder stops when it was the last one
+void source_registry_unsubscribe(shared_source *source);
+
+void source_registry_get_stats(source_registry *self, registry_stats *stats);
+
+// To be called once every subscription ended
+void source_registry_free(source_registry *self);
+
+#endif
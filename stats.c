@@ -0,0 +1,178 @@
+#include "stats.h"
+
+#define FLV_TAG_HEADER_SIZE 11
+#define FLV_TAG_TYPE_VIDEO 9
+
+// A queue followed by a memory gauge and the level last taken into account
+typedef struct {
+    memory_gauge *gauge;
+    gint64 level;
+} queue_watch;
+
+void stage_counter_init(stage_counter *self, GstClockTime frame_duration) {
+    g_return_if_fail(self);
+    g_mutex_init(&self->lock);
+    self->buffers = self->dropped = self->late = 0;
+    self->last_buffers = 0;
+    self->last_read = g_get_monotonic_time();
+    latency_tracker_init(&self->latency, frame_duration);
+}
+
+void stage_counter_clear(stage_counter *self) {
+    g_return_if_fail(self);
+    latency_tracker_clear(&self->latency);
+    g_mutex_clear(&self->lock);
+}
+
+void stage_counter_input(stage_counter *self, GstClockTime running_time, gint64 now) {
+    latency_tracker_ingress(&self->latency, running_time, now);
+}
+
+void stage_counter_output(stage_counter *self, GstClockTime running_time, gint64 now) {
+    stage_counter_count(self);
+    latency_tracker_egress(&self->latency, running_time, now, NULL);
+}
+
+void stage_counter_count(stage_counter *self) {
+    g_mutex_lock(&self->lock);
+    self->buffers++;
+    g_mutex_unlock(&self->lock);
+}
+
+void stage_counter_add_qos(stage_counter *self, guint64 dropped, guint64 late) {
+    g_mutex_lock(&self->lock);
+    self->dropped += dropped;
+    self->late += late;
+    g_mutex_unlock(&self->lock);
+}
+
+void stage_counter_read(stage_counter *self, stage_stats *stats, gint64 now) {
+    g_return_if_fail(self && stats);
+    gint64 average_us = 0, max_us = 0;
+    latency_tracker_get(&self->latency, NULL, &average_us, &max_us);
+    stats->latency_us = average_us;
+    stats->max_latency_us = max_us;
+
+    g_mutex_lock(&self->lock);
+    stats->buffers = self->buffers;
+    stats->dropped = self->dropped;
+    stats->late = self->late;
+    stats->fps = now > self->last_read ?
+            (self->buffers - self->last_buffers) * (gdouble)G_USEC_PER_SEC / (now - self->last_read) : 0;
+    self->last_buffers = self->buffers;
+    self->last_read = now;
+    g_mutex_unlock(&self->lock);
+}
+
+void memory_gauge_init(memory_gauge *self) {
+    g_return_if_fail(self);
+    g_mutex_init(&self->lock);
+    self->held = self->peak = 0;
+}
+
+void memory_gauge_clear(memory_gauge *self) {
+    g_return_if_fail(self);
+    g_mutex_clear(&self->lock);
+}
+
+static void memory_gauge_add(memory_gauge *self, gint64 delta) {
+    g_mutex_lock(&self->lock);
+    self->held += delta;
+    self->peak = MAX(self->peak, self->held);
+    g_mutex_unlock(&self->lock);
+}
+
+static GstPadProbeReturn queue_watch_probe(GstPad *pad, GstPadProbeInfo *info, queue_watch *watch) {
+    guint level = 0;
+    g_object_get(GST_PAD_PARENT(pad), "current-level-bytes", &level, NULL);
+    // the buffer leaving was held until now
+    gint64 held = (gint64)level + gst_buffer_get_size(GST_PAD_PROBE_INFO_BUFFER(info));
+    memory_gauge_add(watch->gauge, held - watch->level);
+    watch->level = held;
+    return GST_PAD_PROBE_OK;
+}
+
+static void queue_watch_free(queue_watch *watch) {
+    memory_gauge_add(watch->gauge, -watch->level);
+    g_free(watch);
+}
+
+void memory_gauge_watch_queue(memory_gauge *self, GstElement *queue) {
+    g_return_if_fail(self && queue);
+    queue_watch *watch = g_new0(queue_watch, 1);
+    watch->gauge = self;
+    GstPad *src_pad = gst_element_get_static_pad(queue, "src");
+    gst_pad_add_probe(src_pad, GST_PAD_PROBE_TYPE_BUFFER, (GstPadProbeCallback)queue_watch_probe,
+                      watch, (GDestroyNotify)queue_watch_free);
+    gst_object_unref(src_pad);
+}
+
+void memory_gauge_read(memory_gauge *self, guint64 *held, guint64 *peak) {
+    g_return_if_fail(self);
+    g_mutex_lock(&self->lock);
+    if (held) {
+        *held = MAX(self->held, 0);
+    }
+    if (peak) {
+        *peak = self->peak;
+    }
+    g_mutex_unlock(&self->lock);
+}
+
+// Value of a "Name: value" line of /proc/self/status, 0 if not there
+static guint64 stats_proc_status(const gchar *status, const gchar *field) {
+    const gchar *line = status ? strstr(status, field) : NULL;
+    return line ? g_ascii_strtoull(line + strlen(field), NULL, 10) : 0;
+}
+
+void stats_process_memory(guint64 *rss_bytes, guint64 *peak_rss_bytes, guint *threads) {
+    gchar *status = NULL;
+    g_file_get_contents("/proc/self/status", &status, NULL, NULL);
+    if (rss_bytes) {
+        *rss_bytes = stats_proc_status(status, "VmRSS:") * 1024;
+    }
+    if (peak_rss_bytes) {
+        *peak_rss_bytes = stats_proc_status(status, "VmHWM:") * 1024;
+    }
+    if (threads) {
+        *threads = stats_proc_status(status, "Threads:");
+    }
+    g_free(status);
+}
+
+GstClockTime stats_running_time(GstPad *pad, GstBuffer *buffer) {
+    GstClockTime running_time = GST_CLOCK_TIME_NONE;
+    GstEvent *segment_event = gst_pad_get_sticky_event(pad, GST_EVENT_SEGMENT, 0);
+    if (segment_event) {
+        const GstSegment *segment = NULL;
+        gst_event_parse_segment(segment_event, &segment);
+        running_time = gst_segment_to_running_time(segment, GST_FORMAT_TIME, GST_BUFFER_PTS(buffer));
+        gst_event_unref(segment_event);
+    }
+    if (GST_CLOCK_TIME_IS_VALID(running_time)) {
+        gint64 offset = gst_pad_get_offset(pad);
+        if (offset < 0 && (GstClockTime)-offset > running_time) {
+            return 0;
+        }
+        running_time += offset;
+    }
+    return running_time;
+}
+
+GstClockTime stats_flv_running_time(GstBuffer *buffer, gboolean *is_video) {
+    guint8 tag[FLV_TAG_HEADER_SIZE];
+    if (is_video) {
+        *is_video = FALSE;
+    }
+    if (gst_buffer_extract(buffer, 0, tag, sizeof(tag)) != sizeof(tag)) {
+        return GST_CLOCK_TIME_NONE;
+    }
+    if (is_video) {
+        *is_video = tag[0] == FLV_TAG_TYPE_VIDEO;
+    }
+    if (GST_BUFFER_PTS_IS_VALID(buffer)) {
+        return GST_BUFFER_PTS(buffer);
+    }
+    guint32 timestamp_ms = ((guint32)tag[7] << 24) | (tag[4] << 16) | (tag[5] << 8) | tag[6];
+    return timestamp_ms * GST_MSECOND + GST_MSECOND - 1;
+}
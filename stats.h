@@ -0,0 +1,74 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <gst/gst.h>
+#include <glib.h>
+
+#include "twitch_broadcaster.h"
+#include "latency.h"
+
+// Counters of a single instrumented stage. Updated from streaming threads by pad
+// probes, read by twitch_broadcaster_get_stats().
+typedef struct {
+    GMutex lock;
+    guint64 buffers;
+    guint64 dropped;
+    guint64 late;
+    // buffers entering the stage's element(s) matched with buffers leaving them
+    latency_tracker latency;
+    // previous read, for the frame rate
+    guint64 last_buffers;
+    gint64 last_read;
+} stage_counter;
+
+void stage_counter_init(stage_counter *self, GstClockTime frame_duration);
+
+void stage_counter_clear(stage_counter *self);
+
+// Buffer entering the element(s) in front of the stage, remembered for the latency
+void stage_counter_input(stage_counter *self, GstClockTime running_time, gint64 now);
+
+// Buffer leaving the stage, counted and matched with the input for the latency
+void stage_counter_output(stage_counter *self, GstClockTime running_time, gint64 now);
+
+// Buffer leaving the stage, counted only
+void stage_counter_count(stage_counter *self);
+
+// Buffers dropped or reported late within the stage
+void stage_counter_add_qos(stage_counter *self, guint64 dropped, guint64 late);
+
+// Fills in stats, frame rate is computed over the time since the previous read
+void stage_counter_read(stage_counter *self, stage_stats *stats, gint64 now);
+
+// Bytes held by a group of queues right now and the most they held at once
+typedef struct {
+    GMutex lock;
+    gint64 held;
+    gint64 peak;
+} memory_gauge;
+
+void memory_gauge_init(memory_gauge *self);
+
+void memory_gauge_clear(memory_gauge *self);
+
+// Follows the queue's fill level, sampled whenever a buffer leaves it. The level is taken
+// out of the gauge again once the queue is gone.
+void memory_gauge_watch_queue(memory_gauge *self, GstElement *queue);
+
+void memory_gauge_read(memory_gauge *self, guint64 *held, guint64 *peak);
+
+// RSS of the process, its peak and number of threads (Linux only, 0 elsewhere), any can be NULL
+void stats_process_memory(guint64 *rss_bytes, guint64 *peak_rss_bytes, guint *threads);
+
+// Running time of the buffer pushed through the pad, taking its segment and offset into account
+GstClockTime stats_running_time(GstPad *pad, GstBuffer *buffer);
+
+/**
+ * Running time of a buffer produced by flvmux. flvmux pushes one tag per buffer and
+ * timestamps buffers only when streamable, otherwise the tag's millisecond timestamp
+ * is used (rounded up so it covers the frame it was truncated from).
+ * @param is_video set to TRUE for video tags (can be NULL)
+ */
+GstClockTime stats_flv_running_time(GstBuffer *buffer, gboolean *is_video);
+
+#endif
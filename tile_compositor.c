@@ -0,0 +1,347 @@
+#include <string.h>
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <gst/video/gstvideoaggregator.h>
+
+#include "tile_compositor.h"
+
+// Limited range black of the Y, U and V planes
+static const guint8 tile_compositor_black[] = { 16, 128, 128 };
+
+static GstStaticPadTemplate tile_compositor_src_template = GST_STATIC_PAD_TEMPLATE(
+        "src", GST_PAD_SRC, GST_PAD_ALWAYS, GST_STATIC_CAPS(GST_VIDEO_CAPS_MAKE("I420")));
+
+// anything else is converted to I420 on the pad
+static GstStaticPadTemplate tile_compositor_sink_template = GST_STATIC_PAD_TEMPLATE(
+        "sink_%u", GST_PAD_SINK, GST_PAD_REQUEST, GST_STATIC_CAPS(GST_VIDEO_CAPS_MAKE(GST_VIDEO_FORMATS_ALL)));
+
+//----------------------------------------------------------------------------------------
+// Sink pad
+
+typedef struct {
+    GstVideoAggregatorConvertPad parent;
+    gint xpos;
+    gint ypos;
+    // size the frames are converted to, 0 keeps the frame's own size
+    gint width;
+    gint height;
+} TileCompositorPad;
+
+typedef struct {
+    GstVideoAggregatorConvertPadClass parent_class;
+} TileCompositorPadClass;
+
+G_DEFINE_TYPE(TileCompositorPad, tile_compositor_pad, GST_TYPE_VIDEO_AGGREGATOR_CONVERT_PAD)
+
+enum {
+    PROP_PAD_0,
+    PROP_PAD_XPOS,
+    PROP_PAD_YPOS,
+    PROP_PAD_WIDTH,
+    PROP_PAD_HEIGHT,
+};
+
+static void tile_compositor_pad_get_property(GObject *object, guint prop_id, GValue *value, GParamSpec *pspec) {
+    TileCompositorPad *pad = (TileCompositorPad *)object;
+    GST_OBJECT_LOCK(pad);
+    switch (prop_id) {
+        case PROP_PAD_XPOS:
+            g_value_set_int(value, pad->xpos);
+            break;
+        case PROP_PAD_YPOS:
+            g_value_set_int(value, pad->ypos);
+            break;
+        case PROP_PAD_WIDTH:
+            g_value_set_int(value, pad->width);
+            break;
+        case PROP_PAD_HEIGHT:
+            g_value_set_int(value, pad->height);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+            break;
+    }
+    GST_OBJECT_UNLOCK(pad);
+}
+
+static void tile_compositor_pad_set_property(GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec) {
+    TileCompositorPad *pad = (TileCompositorPad *)object;
+    gboolean resized = FALSE;
+    GST_OBJECT_LOCK(pad);
+    switch (prop_id) {
+        case PROP_PAD_XPOS:
+            pad->xpos = g_value_get_int(value);
+            break;
+        case PROP_PAD_YPOS:
+            pad->ypos = g_value_get_int(value);
+            break;
+        case PROP_PAD_WIDTH:
+            resized = pad->width != g_value_get_int(value);
+            pad->width = g_value_get_int(value);
+            break;
+        case PROP_PAD_HEIGHT:
+            resized = pad->height != g_value_get_int(value);
+            pad->height = g_value_get_int(value);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+            break;
+    }
+    GST_OBJECT_UNLOCK(pad);
+    if (resized) {
+        gst_video_aggregator_convert_pad_update_conversion_info(GST_VIDEO_AGGREGATOR_CONVERT_PAD(pad));
+    }
+}
+
+// Output format of the aggregator at the pad's size, a passthrough when the frames match
+static void tile_compositor_pad_create_conversion_info(GstVideoAggregatorConvertPad *convert_pad,
+                                                       GstVideoAggregator *vagg, GstVideoInfo *conversion_info) {
+    TileCompositorPad *pad = (TileCompositorPad *)convert_pad;
+    GST_VIDEO_AGGREGATOR_CONVERT_PAD_CLASS(tile_compositor_pad_parent_class)->create_conversion_info(
+            convert_pad, vagg, conversion_info);
+    if (!conversion_info->finfo) {
+        return;
+    }
+    gint width = pad->width > 0 ? pad->width : GST_VIDEO_INFO_WIDTH(conversion_info);
+    gint height = pad->height > 0 ? pad->height : GST_VIDEO_INFO_HEIGHT(conversion_info);
+    if (width == GST_VIDEO_INFO_WIDTH(conversion_info) && height == GST_VIDEO_INFO_HEIGHT(conversion_info)) {
+        return;
+    }
+    GstVideoInfo info;
+    gst_video_info_set_format(&info, GST_VIDEO_INFO_FORMAT(conversion_info), width, height);
+    info.chroma_site = conversion_info->chroma_site;
+    info.colorimetry = conversion_info->colorimetry;
+    info.par_n = conversion_info->par_n;
+    info.par_d = conversion_info->par_d;
+    info.fps_n = conversion_info->fps_n;
+    info.fps_d = conversion_info->fps_d;
+    info.flags = conversion_info->flags;
+    info.interlace_mode = conversion_info->interlace_mode;
+    *conversion_info = info;
+}
+
+static void tile_compositor_pad_class_init(TileCompositorPadClass *klass) {
+    GObjectClass *object_class = G_OBJECT_CLASS(klass);
+    GstVideoAggregatorConvertPadClass *convert_pad_class = GST_VIDEO_AGGREGATOR_CONVERT_PAD_CLASS(klass);
+
+    object_class->get_property = tile_compositor_pad_get_property;
+    object_class->set_property = tile_compositor_pad_set_property;
+    convert_pad_class->create_conversion_info = tile_compositor_pad_create_conversion_info;
+
+    GParamFlags flags = G_PARAM_READWRITE | GST_PARAM_CONTROLLABLE | G_PARAM_STATIC_STRINGS;
+    g_object_class_install_property(object_class, PROP_PAD_XPOS,
+            g_param_spec_int("xpos", "X Position", "X position of the tile", G_MININT, G_MAXINT, 0, flags));
+    g_object_class_install_property(object_class, PROP_PAD_YPOS,
+            g_param_spec_int("ypos", "Y Position", "Y position of the tile", G_MININT, G_MAXINT, 0, flags));
+    g_object_class_install_property(object_class, PROP_PAD_WIDTH,
+            g_param_spec_int("width", "Width", "Width of the tile, 0 for the frame's width", 0, G_MAXINT, 0, flags));
+    g_object_class_install_property(object_class, PROP_PAD_HEIGHT,
+            g_param_spec_int("height", "Height", "Height of the tile, 0 for the frame's height", 0, G_MAXINT, 0, flags));
+}
+
+static void tile_compositor_pad_init(TileCompositorPad *pad) {
+}
+
+//----------------------------------------------------------------------------------------
+// Aggregator
+
+typedef struct {
+    GstVideoAggregator parent;
+} TileCompositor;
+
+typedef struct {
+    GstVideoAggregatorClass parent_class;
+} TileCompositorClass;
+
+G_DEFINE_TYPE(TileCompositor, tile_compositor, GST_TYPE_VIDEO_AGGREGATOR)
+
+// Part of a frame visible on the canvas and where it goes
+typedef struct {
+    gint src_x;
+    gint src_y;
+    gint x;
+    gint y;
+    gint width;
+    gint height;
+    // the pad's position was rounded, neighbouring tiles may no longer meet
+    gboolean adjusted;
+} tile_rect;
+
+// FALSE if none of the frame is visible, the caller holds the aggregator's object lock
+static gboolean tile_compositor_clip(TileCompositorPad *pad, GstVideoFrame *frame, GstVideoFrame *out,
+                                     tile_rect *rect) {
+    // even positions keep the tile's chroma aligned with the canvas'
+    rect->x = pad->xpos & ~1;
+    rect->y = pad->ypos & ~1;
+    rect->adjusted = rect->x != pad->xpos || rect->y != pad->ypos;
+    rect->src_x = rect->x < 0 ? -rect->x : 0;
+    rect->src_y = rect->y < 0 ? -rect->y : 0;
+    rect->x = MAX(rect->x, 0);
+    rect->y = MAX(rect->y, 0);
+    rect->width = MIN(GST_VIDEO_FRAME_WIDTH(frame) - rect->src_x, GST_VIDEO_FRAME_WIDTH(out) - rect->x);
+    rect->height = MIN(GST_VIDEO_FRAME_HEIGHT(frame) - rect->src_y, GST_VIDEO_FRAME_HEIGHT(out) - rect->y);
+    return rect->width > 0 && rect->height > 0;
+}
+
+// Copies the visible part of the frame to the output, row by row (or the whole plane when rows are contiguous)
+static void tile_compositor_copy(GstVideoFrame *frame, GstVideoFrame *out, const tile_rect *rect) {
+    const GstVideoFormatInfo *finfo = out->info.finfo;
+    for (guint plane = 0; plane < GST_VIDEO_FRAME_N_PLANES(out); plane++) {
+        // I420 planes hold a single component of a byte per pixel
+        gint in_stride = GST_VIDEO_FRAME_PLANE_STRIDE(frame, plane);
+        gint out_stride = GST_VIDEO_FRAME_PLANE_STRIDE(out, plane);
+        gint row_bytes = GST_VIDEO_FORMAT_INFO_SCALE_WIDTH(finfo, plane, rect->width);
+        gint rows = GST_VIDEO_FORMAT_INFO_SCALE_HEIGHT(finfo, plane, rect->height);
+        const guint8 *src = (const guint8 *)GST_VIDEO_FRAME_PLANE_DATA(frame, plane) +
+                GST_VIDEO_FORMAT_INFO_SCALE_HEIGHT(finfo, plane, rect->src_y) * in_stride +
+                GST_VIDEO_FORMAT_INFO_SCALE_WIDTH(finfo, plane, rect->src_x);
+        guint8 *dst = (guint8 *)GST_VIDEO_FRAME_PLANE_DATA(out, plane) +
+                GST_VIDEO_FORMAT_INFO_SCALE_HEIGHT(finfo, plane, rect->y) * out_stride +
+                GST_VIDEO_FORMAT_INFO_SCALE_WIDTH(finfo, plane, rect->x);
+        if (in_stride == out_stride && row_bytes == out_stride) {
+            memcpy(dst, src, (gsize)rows * out_stride);
+            continue;
+        }
+        for (gint row = 0; row < rows; row++) {
+            memcpy(dst + (gsize)row * out_stride, src + (gsize)row * in_stride, row_bytes);
+        }
+    }
+}
+
+static void tile_compositor_fill_black(GstVideoFrame *out) {
+    for (guint plane = 0; plane < GST_VIDEO_FRAME_N_PLANES(out); plane++) {
+        gint stride = GST_VIDEO_FRAME_PLANE_STRIDE(out, plane);
+        gint rows = GST_VIDEO_FRAME_COMP_HEIGHT(out, plane);
+        guint8 *data = GST_VIDEO_FRAME_PLANE_DATA(out, plane);
+        memset(data, tile_compositor_black[plane], (gsize)rows * stride);
+    }
+}
+
+static GstFlowReturn tile_compositor_aggregate_frames(GstVideoAggregator *vagg, GstBuffer *outbuf) {
+    GstVideoFrame out;
+    gint64 covered = 0;
+    gboolean adjusted = FALSE;
+    tile_rect rect;
+
+    if (!gst_video_frame_map(&out, &vagg->info, outbuf, GST_MAP_WRITE)) {
+        GST_WARNING_OBJECT(vagg, "Could not map output buffer");
+        return GST_FLOW_ERROR;
+    }
+    GST_OBJECT_LOCK(vagg);
+    // tiles don't overlap, so the background is covered once their areas add up to the canvas.
+    // A rounded position may make a tile overlap its neighbour and leave a gap on its other side
+    for (GList *l = GST_ELEMENT(vagg)->sinkpads; l; l = l->next) {
+        GstVideoFrame *frame = gst_video_aggregator_pad_get_prepared_frame(l->data);
+        if (frame && tile_compositor_clip(l->data, frame, &out, &rect)) {
+            covered += (gint64)rect.width * rect.height;
+            adjusted |= rect.adjusted;
+        }
+    }
+    if (adjusted || covered < (gint64)GST_VIDEO_FRAME_WIDTH(&out) * GST_VIDEO_FRAME_HEIGHT(&out)) {
+        tile_compositor_fill_black(&out);
+    }
+    // sink pads are sorted by zorder
+    for (GList *l = GST_ELEMENT(vagg)->sinkpads; l; l = l->next) {
+        GstVideoFrame *frame = gst_video_aggregator_pad_get_prepared_frame(l->data);
+        if (frame && tile_compositor_clip(l->data, frame, &out, &rect)) {
+            tile_compositor_copy(frame, &out, &rect);
+        }
+    }
+    GST_OBJECT_UNLOCK(vagg);
+    gst_video_frame_unmap(&out);
+    return GST_FLOW_OK;
+}
+
+// Canvas spanning all tiles at the highest input frame rate, unless downstream decides otherwise
+static GstCaps* tile_compositor_fixate_src_caps(GstAggregator *aggregator, GstCaps *caps) {
+    GstVideoAggregator *vagg = GST_VIDEO_AGGREGATOR(aggregator);
+    gint best_width = 0, best_height = 0, best_fps_n = 0, best_fps_d = 1;
+    gdouble best_fps = 0.;
+
+    caps = gst_caps_make_writable(caps);
+    GstStructure *structure = gst_caps_get_structure(caps, 0);
+    GST_OBJECT_LOCK(vagg);
+    for (GList *l = GST_ELEMENT(vagg)->sinkpads; l; l = l->next) {
+        GstVideoAggregatorPad *vpad = l->data;
+        TileCompositorPad *pad = l->data;
+        if (!vpad->info.finfo || GST_VIDEO_INFO_FORMAT(&vpad->info) == GST_VIDEO_FORMAT_UNKNOWN) {
+            continue;
+        }
+        gint width = pad->width > 0 ? pad->width : GST_VIDEO_INFO_WIDTH(&vpad->info);
+        gint height = pad->height > 0 ? pad->height : GST_VIDEO_INFO_HEIGHT(&vpad->info);
+        best_width = MAX(best_width, pad->xpos + width);
+        best_height = MAX(best_height, pad->ypos + height);
+        gint fps_n = GST_VIDEO_INFO_FPS_N(&vpad->info);
+        gint fps_d = GST_VIDEO_INFO_FPS_D(&vpad->info);
+        if (fps_n > 0 && fps_d > 0 && (gdouble)fps_n / fps_d > best_fps) {
+            best_fps = (gdouble)fps_n / fps_d;
+            best_fps_n = fps_n;
+            best_fps_d = fps_d;
+        }
+    }
+    GST_OBJECT_UNLOCK(vagg);
+    if (best_fps_n <= 0) {
+        best_fps_n = 25;
+        best_fps_d = 1;
+    }
+    if (best_width > 0 && best_height > 0) {
+        gst_structure_fixate_field_nearest_int(structure, "width", best_width);
+        gst_structure_fixate_field_nearest_int(structure, "height", best_height);
+    }
+    gst_structure_fixate_field_nearest_fraction(structure, "framerate", best_fps_n, best_fps_d);
+    if (gst_structure_has_field(structure, "pixel-aspect-ratio")) {
+        gst_structure_fixate_field_nearest_fraction(structure, "pixel-aspect-ratio", 1, 1);
+    }
+    return gst_caps_fixate(caps);
+}
+
+static void tile_compositor_class_init(TileCompositorClass *klass) {
+    GstElementClass *element_class = GST_ELEMENT_CLASS(klass);
+    GstAggregatorClass *aggregator_class = GST_AGGREGATOR_CLASS(klass);
+    GstVideoAggregatorClass *video_aggregator_class = GST_VIDEO_AGGREGATOR_CLASS(klass);
+
+    aggregator_class->fixate_src_caps = tile_compositor_fixate_src_caps;
+    video_aggregator_class->aggregate_frames = tile_compositor_aggregate_frames;
+
+    gst_element_class_add_static_pad_template_with_gtype(element_class, &tile_compositor_src_template,
+                                                         GST_TYPE_AGGREGATOR_PAD);
+    gst_element_class_add_static_pad_template_with_gtype(element_class, &tile_compositor_sink_template,
+                                                         tile_compositor_pad_get_type());
+    gst_element_class_set_static_metadata(element_class, "Tile compositor", "Filter/Editor/Video/Compositor",
+                                          "Composites opaque, non-overlapping tiles by copying them into place",
+                                          "twitch broadcaster");
+}
+
+static void tile_compositor_init(TileCompositor *self) {
+}
+
+//----------------------------------------------------------------------------------------
+// API implementation
+
+gboolean tile_compositor_register() {
+    static gsize registered = 0;
+    if (g_once_init_enter(&registered)) {
+        gboolean res = gst_element_register(NULL, TILE_COMPOSITOR_FACTORY, GST_RANK_NONE, tile_compositor_get_type());
+        g_once_init_leave(&registered, res ? 1 : 2);
+    }
+    return registered == 1;
+}
+
+gboolean tile_compositor_supports_layout(const layout_tile *tiles, guint num_tiles) {
+    g_return_val_if_fail(tiles || !num_tiles, FALSE);
+    for (guint i = 0; i < num_tiles; i++) {
+        // odd positions would be rounded
+        if (tiles[i].x % 2 || tiles[i].y % 2) {
+            return FALSE;
+        }
+        for (guint j = i + 1; j < num_tiles; j++) {
+            const layout_tile *a = &tiles[i], *b = &tiles[j];
+            if (a->x < b->x + b->width && b->x < a->x + a->width &&
+                a->y < b->y + b->height && b->y < a->y + a->height) {
+                return FALSE;
+            }
+        }
+    }
+    return TRUE;
+}
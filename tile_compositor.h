@@ -0,0 +1,27 @@
+#ifndef _TILE_COMPOSITOR_H_
+#define _TILE_COMPOSITOR_H_
+
+#include <glib.h>
+
+#include "layout.h"
+
+#define TILE_COMPOSITOR_FACTORY "tilecompositor"
+
+/*
+ * Compositor for opaque tiles that don't overlap. Every frame is copied plane by plane into
+ * its place in the pooled I420 output buffer, without blending, and the background is only
+ * filled when the tiles don't cover the whole canvas. Sink pads have the compositor's xpos,
+ * ypos, width and height properties (positions are rounded down to even numbers, the background
+ * is then always filled); frames which are not I420 of the pad's size are converted on the pad
+ * first.
+ * Overlapping pads are drawn in zorder but the background may not be filled under them, such
+ * layouts belong to the generic compositor.
+ */
+
+// Registers the tilecompositor element factory with the application, safe to call repeatedly
+gboolean tile_compositor_register();
+
+// TRUE if no two tiles overlap and all positions are even, so they can be composited by tilecompositor
+gboolean tile_compositor_supports_layout(const layout_tile *tiles, guint num_tiles);
+
+#endif
@@ -1,29 +1,160 @@
 #include <gst/gst.h>
+#include <gst/video/video.h>
 #include <glib.h>
 
+#include "affinity.h"
+
 #include "twitch_broadcaster.h"
+#include "layout.h"
+#include "latency.h"
+#include "stats.h"
+#include "output.h"
+#include "rendition.h"
+#include "tile_compositor.h"
+#include "source_cache.h"
+#include "source_registry.h"
+#include "av_sync.h"
 
 /* Video and audio caps outputted by the mixers */
+#define AUDIO_RATE 44100
+#define AUDIO_CHANNELS 2
 #define AUDIO_CAPS "audio/x-raw, format=(string)S16LE, " \
 "layout=(string)interleaved, rate=(int)44100, channels=(int)2, " \
 "channel-mask=(bitmask)0x03"
 
-#define VIDEO_CAPS "video/x-raw, width=(int)1920 \
-, height=(int)1080, framerate=(fraction)30/1, " \
+#define VIDEO_CAPS "video/x-raw, width=(int)%d \
+, height=(int)%d, framerate=(fraction)%d/1, " \
 "format=I420, pixel-aspect-ratio=(fraction)1/1"
 
-#define SOURCE_SIZE_CAPS "video/x-raw, width=(int)640 \
-, height=(int)1080,pixel-aspect-ratio=(fraction)1/1"
+// Low latency mode settings
+#define LOW_LATENCY_KEYFRAME_SECONDS 1
+#define LOW_LATENCY_QUEUE_TIME (200 * GST_MSECOND)
+#define LOW_LATENCY_AGGREGATOR_LATENCY ((GstClockTime)0)
+
+// Smallest share of a memory limit given to a single queue or source
+#define MIN_BUFFER_BYTES (256 * 1024)
+// x264enc's rc-lookahead, only ever shortened to fit a memory limit
+#define X264_DEFAULT_LOOKAHEAD 40
+
+// Stalled source fallback: live black slate and silence keep the mixers producing
+#define SLATE_PATTERN "black"
+#define SILENCE_WAVE "silence"
+
+// Cached sources are fed by an appsrc from their mapping
+#define CACHED_SOURCE_URI "appsrc://"
+
+// application message posted by streaming threads for source added/lost callbacks
+#define SOURCE_EVENT_MESSAGE "broadcaster-source"
+// application message posted once a source's tracks are wired, for seeking it to the segment
+#define SOURCE_SEEK_MESSAGE "broadcaster-source-seek"
+// application message posted when a source's track ended, for ending the stall fallback
+#define TRACK_ENDED_MESSAGE "broadcaster-track-ended"
+// application message posted when a decoder removed the pad of a wired track, for releasing it
+#define TRACK_REMOVED_MESSAGE "broadcaster-track-removed"
+// application message posted when audio and video of a source or the muxer's input went out of sync
+#define AV_SYNC_ALARM_MESSAGE "broadcaster-av-sync-alarm"
+
+#define SOURCE_SIZE_CAPS "video/x-raw, width=(int)%d \
+, height=(int)%d,pixel-aspect-ratio=(fraction)1/1"
+// compressed tracks a passthrough source's tracks are remuxed as
+#define PASSTHROUGH_VIDEO_CAPS "video/x-h264, stream-format=(string)avc, alignment=(string)au"
+#define PASSTHROUGH_AUDIO_CAPS "audio/mpeg, mpegversion=(int)4, stream-format=(string)raw"
+
+// what the video mixer blends and outputs, sources matching it need no conversion
+#define SOURCE_TILE_FORMAT "I420"
+#define SOURCE_TILE_CAPS "video/x-raw, format=(string)" SOURCE_TILE_FORMAT \
+", width=(int)%d, height=(int)%d, pixel-aspect-ratio=(fraction)1/1"
+
+// A track taken off its branch for being released: the pad it has on the mixer (or selector),
+// the decoder's pad feeding it and its elements, downstream first
+typedef struct {
+    GstPad *mixer_pad;
+    GstPad *decoder_pad;
+    GstElement *elements[5];
+} branch_track;
+
+// Everything created for a single source: the decoder, the dynamically wired
+// video and audio tracks and the counters collected on them
+typedef struct source_branch {
+    guint index;
+    gchar *uri;
+    GstElement *decoder;
+    // where the source is placed on the output canvas
+    layout_tile tile;
+
+    // video track: decoder -> queue -> [scaler/converter -> capsfilter] -> video mixer, the
+    // queue runs scaling on a thread of its own. Scaler and converter are picked for the
+    // decoder's caps, NULL when not needed
+    GstElement *video_queue;
+    GstElement *video_scaler;
+    GstElement *video_converter;
+    GstElement *video_capsfilter;
+    GstPad *video_mixer_pad;
+
+    // audio track: decoder -> queue -> resample -> convert -> capsfilter -> audio mixer
+    GstElement *audio_queue;
+    GstElement *audio_resample;
+    GstElement *audio_convert;
+    GstElement *audio_capsfilter;
+    GstPad *audio_mixer_pad;
+
+    // remuxed tracks (passthrough): decoder -> queue -> parser -> capsfilter -> selector, the
+    // track's queue and capsfilter above are used and its mixer pad is the selector's pad
+    GstElement *video_parser;
+    GstElement *audio_parser;
+
+    // stats, counters are updated from streaming threads under the owner's stats_lock
+    guint64 video_frames;
+    guint64 audio_buffers;
+    latency_tracker scaler_latency;
+    guint64 last_video_frames;
+    gint64 last_read;
+    // audio against video entering the mixers (the selectors when remuxed)
+    av_sync_monitor av_sync;
+
+    // replacement of a previous source in the same slot: offset putting the new source's
+    // running time at the position of the mix, when it happened and the glitch it caused (the
+    // glitch under the owner's stats_lock)
+    guint swaps;
+    GstClockTimeDiff ts_offset;
+    gint64 swap_time;
+    guint64 swap_mixer_frames;
+    gint64 swap_glitch_us;
+    guint64 swap_glitch_frames;
+    // set once the branch was replaced, its late pads are not wired anymore
+    gboolean removed;
+    // the source_added callback was posted for its first track (again after losing all of them)
+    gboolean announced;
+    // tracks released after the decoder removed their pads
+    guint tracks_removed;
 
-#define MAX_SOURCES 3
+    // with a source cache: the cached content the source is read from and the read position,
+    // or the recording of its download when it's not cached yet
+    GMappedFile *cached;
+    guint64 cached_offset;
+    source_cache_recording *recording;
+    // with a source registry: the subscription to the shared decoder, whose element is the
+    // branch's decoder
+    shared_source *shared;
 
+    // liveness, guarded by the owner's stats_lock
+    GstPad *video_decoder_pad;
+    GstPad *audio_decoder_pad;
+    gint64 last_frame_time;
+    gboolean video_eos;
+    gboolean audio_eos;
+    gboolean stalled;
+    guint stalls;
+    gint64 stall_start;
+    gint64 stalled_us;
+
+    struct broadcaster_impl *owner;
+} source_branch;
 
 typedef struct broadcaster_impl {
     GstElement *pipeline;
-    // Sources
-    GstElement *source;
-    GstElement *source1;
-    GstElement *source2;
+    // Sources, one source_branch per configured uri
+    GPtrArray *branches;
 
     // mixers
     GstElement *video_mixer;
@@ -31,32 +162,177 @@ typedef struct broadcaster_impl {
 
     // Video caps for setting mixer out caps
     GstElement *video_capsfilter;
+    // Composited video is split to every rendition
+    GstElement *video_tee;
 
-    // Encoders
-    GstElement *x264_encoder;
+    // Audio is encoded once, on its own thread, and shared by all renditions
+    GstElement *audio_queue;
     GstElement *aac_encoder;
+    GstElement *audio_tee;
 
-    // muxers
-    GstElement *flv_muxer;
-
-    // Queue to decouple media processing from IO
-    GstElement *queue;
-
-    //Sink
-    GstElement *sink;
+    // ABR ladder, every rendition scales, encodes and muxes for its own outputs
+    GPtrArray *renditions;
+    // Outputs of all renditions in order, owned by the renditions
+    GPtrArray *outputs;
 
     // private data
-    int linked_pads;
-    int linked_audio_pads;
+    gint width;
+    gint height;
+    gint fps;
+    gboolean low_latency;
+    // separate videoscale to the tile size for every source regardless of its caps
+    gboolean always_scale;
+    // compatible tracks of the only source are remuxed, see Config.passthrough. Which path
+    // the muxer takes right now is updated from streaming threads, atomically
+    gboolean passthrough;
+    gint video_passthrough;
+    gint audio_passthrough;
+    guint path_switches;
+    // a keyframe was requested from the encoder for switching back to the composite, atomic
+    gint key_unit_requested;
+    // per stage counters and decoder output to sink latency
+    stage_counter stages[STAGE_COUNT];
+    latency_tracker latency;
+    // audio against video entering the first rendition's muxer, sources' thresholds
+    av_sync_monitor av_sync;
+    gint av_sync_max_offset_ms;
+    gint av_sync_max_drift_ms_per_hour;
+    // when the broadcast was started and when the first buffer reached the sink
+    gint64 start_time;
+    gint64 first_buffer_time;
+    // composited frames and running time of the last one, source replacements start there,
+    // guarded by stats_lock like when the first buffer reached the sink
+    guint64 mixer_frames;
+    GstClockTime mixer_position;
+    // stalled source fallback, 0 if disabled
+    GstClockTime stall_timeout;
+    GstElement *slate;
+    GstElement *slate_capsfilter;
+    GstElement *silence;
+    GstElement *silence_capsfilter;
+    // the slate and silence were ended, every source did, so the mixers can end too
+    gboolean fallback_ended;
+    // fast start: the mixed stream is held back until the first source is ready, late sources
+    // join at the mix's position
+    gboolean fast_start;
+    gboolean source_ready;
+    // rendering a segment of the timeline: sources are seeked to its start once wired
+    gboolean segmented;
+    GstClockTime segment_start;
+    GstClockTime segment_stop;
+    // CPUs streaming threads are pinned to, NULL if not pinned
+    affinity_set *source_cpus;
+    affinity_set *encoder_cpus;
+    affinity_set *all_cpus;
+    guint threads;
+    guint pinned_threads;
+    // pool streaming threads are taken from, NULL for the default one
+    GstTaskPool *task_pool;
+    // persistent cache of remote sources and their read-ahead, NULL and 0 if not configured
+    source_cache *cache;
+    guint64 prefetch_bytes;
+    // decoders shared with other broadcasters, NULL if not configured or not applicable
+    source_registry *registry;
+    // bytes the broadcaster may buffer, 0 for the defaults, and bytes its queues hold
+    guint64 memory_limit;
+    memory_gauge memory[MEMORY_COUNT];
+    // last dropped count reported by every element posting QoS messages
+    GHashTable *qos_dropped;
+    // branch_tracks taken off their branches when the decoder removed their pads, released
+    // from the bus (or when the broadcast finishes), guarded by lock
+    GPtrArray *removed_tracks;
+    GMutex stats_lock;
     gboolean initialized;
     GMutex lock;
 
+    // started broadcast: bus watch on the caller's context and callbacks it dispatches
+    struct twitch_broadcaster *instance;
+    GSource *bus_watch;
+    broadcaster_callbacks callbacks;
+    gpointer user_data;
+    // bitrate controllers' ticks on the same context, with adaptive bitrate
+    GSource *bitrate_source;
+
 } broadcaster_impl;
 
 
 //----------------------------------------------------------------------------------------
 // Callbacks
-static void pad_added_handler(GstElement *src, GstPad *new_pad, broadcaster_impl *data);
+static void pad_added_handler(GstElement *src, GstPad *new_pad, source_branch *branch);
+
+// Has the track of a pad the decoder removed released on the broadcaster's context
+static void pad_removed_handler(GstElement *src, GstPad *old_pad, source_branch *branch);
+
+// Counts audio buffers of a source entering the audio mixer and follows their timestamps
+static GstPadProbeReturn audio_mixer_input_probe(GstPad *pad, GstPadProbeInfo *info, source_branch *branch);
+
+// Follows timestamps of the encoded tracks entering the first rendition's muxer
+static GstPadProbeReturn muxer_video_probe(GstPad *pad, GstPadProbeInfo *info, broadcaster_impl *self);
+static GstPadProbeReturn muxer_audio_probe(GstPad *pad, GstPadProbeInfo *info, broadcaster_impl *self);
+
+// Counts decoded video frames and records when they enter the pipeline
+static GstPadProbeReturn decoder_output_probe(GstPad *pad, GstPadProbeInfo *info, source_branch *branch);
+
+// Counts scaled video frames entering the video mixer
+static GstPadProbeReturn scaler_output_probe(GstPad *pad, GstPadProbeInfo *info, source_branch *branch);
+
+// Counts remuxed video frames of a source and switches the muxer to them at a keyframe
+static GstPadProbeReturn passthrough_video_probe(GstPad *pad, GstPadProbeInfo *info, source_branch *branch);
+
+// Switches the muxer to remuxed audio of a source
+static GstPadProbeReturn passthrough_audio_probe(GstPad *pad, GstPadProbeInfo *info, source_branch *branch);
+
+// Switches the muxer back to encoded tracks (at a keyframe) when they come after passthrough
+static GstPadProbeReturn composite_output_probe(GstPad *pad, GstPadProbeInfo *info, broadcaster_impl *self);
+
+// Drops the mixed stream in front of the encoders until the first source is ready (fast start)
+static GstPadProbeReturn fast_start_probe(GstPad *pad, GstPadProbeInfo *info, broadcaster_impl *self);
+
+// Drops a source's data until the seek to the segment flushed the decoder's pad
+static GstPadProbeReturn segment_probe(GstPad *pad, GstPadProbeInfo *info, gboolean *flushed);
+
+// Asks the bus watch to seek a source to the segment once all its tracks are wired
+static void no_more_pads_handler(GstElement *decoder, source_branch *branch);
+
+// Stops decoding tracks which can be remuxed as they are (passthrough)
+static gboolean autoplug_continue_handler(GstElement *bin, GstPad *pad, GstCaps *caps, source_branch *branch);
+
+// Feeds a cached source's appsrc from its mapping, or starts recording a remote source's download
+static void source_setup_handler(GstElement *bin, GstElement *source, source_branch *branch);
+
+// Pushes the cached content the appsrc asks for, without copying it
+static void cached_need_data_handler(GstElement *appsrc, guint length, source_branch *branch);
+static gboolean cached_seek_data_handler(GstElement *appsrc, guint64 offset, source_branch *branch);
+
+// Writes a remote source's download to the cache, committing it at its end
+static GstPadProbeReturn cache_record_probe(GstPad *pad, GstPadProbeInfo *info, source_branch *branch);
+
+// Notes the end of a source's track, an ended video doesn't count as stalled afterwards
+static GstPadProbeReturn decoder_event_probe(GstPad *pad, GstPadProbeInfo *info, source_branch *branch);
+
+// Feeds stage counters of the static part of the pipeline, see stage_probe_data
+static GstPadProbeReturn stage_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data);
+
+// Collects QoS (dropped/late buffers) from the posting element's thread
+static GstBusSyncReply bus_sync_handler(GstBus *bus, GstMessage *msg, broadcaster_impl *self);
+
+// Dispatches pipeline messages to the callbacks, on the context the broadcaster was started on
+static gboolean bus_watch_handler(GstBus *bus, GstMessage *msg, broadcaster_impl *self);
+
+// Ticks the bitrate controllers of all renditions, with adaptive bitrate
+static gboolean twitch_broadcaster_control_bitrate(broadcaster_impl *self);
+
+// Applies the memory limit to decoders of new and replacement sources
+static void deep_element_added_handler(GstBin *bin, GstBin *sub_bin, GstElement *element, broadcaster_impl *self);
+
+// Finishes the run() wrapper's main loop
+static void run_finished_handler(twitch_broadcaster *broadcaster, int result, void *user_data);
+
+// Output the element belongs to, NULL if it's not part of any output
+static broadcaster_output* twitch_broadcaster_element_output(broadcaster_impl *self, GstObject *element);
+
+// Bytes of a memory limit for one of count consumers sharing 1/divisor of it
+static guint memory_share(guint64 limit, guint divisor, guint count);
 
 //-----------------------------------------------------------------------------------------
 // Helper functions (added not as much for re-usability as for making the code more readable
@@ -67,11 +343,106 @@ gboolean twitch_broadcaster_create_elements(broadcaster_impl *self, Config *conf
 // Add all created elements to the pipeline and links static part of the pipeline
 gboolean twitch_broadcaster_configure_pipeline(broadcaster_impl *self);
 
+// Trades compression efficiency and buffering for latency on already created elements
+void twitch_broadcaster_configure_low_latency(broadcaster_impl *self);
+
+// Creates the live slate and silence making the mixers time out on stalled sources
+gboolean twitch_broadcaster_create_fallback(broadcaster_impl *self, GstClockTime stall_timeout);
+
+// Ends the slate and silence once all tracks of every source ended, the mixers (and the broadcast)
+// end with them. Called on the broadcaster's context
+void twitch_broadcaster_end_fallback(broadcaster_impl *self);
+
+// Parses CPU lists of the config, pinning is enabled if any of them is set
+gboolean twitch_broadcaster_configure_affinity(broadcaster_impl *self, Config *config);
+
+// Pins a streaming thread that is just starting according to the task's owner, called from that thread
+void twitch_broadcaster_pin_thread(broadcaster_impl *self, GstElement *owner);
+
+// Marks sources without a frame for longer than the stall timeout as stalled, called for every composited frame
+void twitch_broadcaster_check_liveness(broadcaster_impl *self, gint64 now);
+
+// Posts source added/lost to the bus, from any thread, for the callbacks
+void twitch_broadcaster_post_source_event(broadcaster_impl *self, guint index, gboolean added);
+
+// Posts an A/V sync alarm of the source (-1 for the muxer's input) to the bus, from any thread
+void twitch_broadcaster_post_av_sync_alarm(broadcaster_impl *self, gint source);
+
+// Reports an A/V sync alarm to the callbacks, on the broadcaster's context
+void twitch_broadcaster_report_av_sync_alarm(broadcaster_impl *self, gint source);
+
+// Seeks a source to the segment, ending it when it can't be seeked, called on the broadcaster's context
+void twitch_broadcaster_seek_source(broadcaster_impl *self, guint index);
+
+// Sets the source's share of the memory limit on a source's decoder, other elements are left alone
+void twitch_broadcaster_limit_source_buffering(broadcaster_impl *self, GstElement *element);
+
+// Gives outputs, encoders and sources their shares of the memory limit
+void twitch_broadcaster_apply_memory_limit(broadcaster_impl *self);
+
+// Accounts a queue behind a source's decoder and gives it its share of the memory limit
+void twitch_broadcaster_add_source_queue(broadcaster_impl *self, GstElement *queue);
+
+// Stops the pipeline, releases it and reports the result to the finished callback
+void twitch_broadcaster_finish(broadcaster_impl *self, int result);
+
+// Brings the source back if it stalled, moving it to the current position of the mix if it fell behind,
+// from its streaming thread
+void twitch_broadcaster_branch_rejoin(broadcaster_impl *self, source_branch *branch, GstClockTime running_time, gint64 now);
+
+// Counts a video frame of the source entering the mix (or the muxer), from its streaming thread
+void twitch_broadcaster_branch_count_frame(broadcaster_impl *self, source_branch *branch, gint64 now);
+
+// Installs stage probes on the static part of the pipeline
+void twitch_broadcaster_install_stage_probes(broadcaster_impl *self);
+
+// Stage the element belongs to, STAGE_COUNT if it's not instrumented
+broadcaster_stage twitch_broadcaster_element_stage(broadcaster_impl *self, GstObject *element);
+
+// Creates a branch (decoder only, tracks are wired once discovered) for the given uri,
+// swaps counts previous sources of the slot
+source_branch* twitch_broadcaster_branch_new(broadcaster_impl *self, guint index, const gchar *uri, guint swaps);
+
+// Releases a branch, elements are owned by the pipeline and are not touched
+void twitch_broadcaster_branch_free(source_branch *branch);
+
+// Unlinks the branch from the mixers, releasing their pads, and removes its elements from the pipeline
+void twitch_broadcaster_branch_remove(broadcaster_impl *self, source_branch *branch);
+
+// Sets the decoder pad of the branch's new video or audio track, which hasn't ended yet
+void twitch_broadcaster_branch_set_decoder_pad(broadcaster_impl *self, source_branch *branch, gboolean video,
+                                               GstPad *pad);
+
+// Moves the branch's video or audio track into track, the branch is left without it
+void twitch_broadcaster_branch_take_track(broadcaster_impl *self, source_branch *branch, gboolean video,
+                                          branch_track *track);
+
+// Releases the track's mixer pad and removes its elements from the pipeline, called without the
+// lock: the track's streaming threads may be waiting for it
+void twitch_broadcaster_track_release(broadcaster_impl *self, branch_track *track);
+
+// Releases a track pad_removed_handler took off its branch, unless the finished broadcast released it
+// already, called on the broadcaster's context
+void twitch_broadcaster_remove_track(broadcaster_impl *self, guint index, gboolean video, branch_track *track);
+
+// Takes elements of a track that failed to be wired out of the pipeline (or drops them if they weren't added)
+void twitch_broadcaster_discard_elements(broadcaster_impl *self, GstElement **elements, guint count);
+
+// Forgets the QoS totals of the element and the ones inside it, it's leaving the pipeline
+void twitch_broadcaster_forget_qos(broadcaster_impl *self, GstElement *element);
+
 // Wires new video track into the pipeline dynamically
-gboolean twitch_broadcaster_wire_new_video_track(broadcaster_impl *self, GstPad *new_pad);
+gboolean twitch_broadcaster_wire_new_video_track(broadcaster_impl *self, source_branch *branch, GstPad *new_pad);
 
 // Wires new audio track into the pipeline dynamically
-gboolean twitch_broadcaster_wire_new_audio_track(broadcaster_impl *self, GstPad *new_pad);
+gboolean twitch_broadcaster_wire_new_audio_track(broadcaster_impl *self, source_branch *branch, GstPad *new_pad);
+
+// Wires a compressed track straight to the muxer's selector (passthrough)
+gboolean twitch_broadcaster_wire_passthrough_track(broadcaster_impl *self, source_branch *branch, GstPad *new_pad,
+                                                   gboolean video);
+
+// TRUE if a track of these caps can be muxed without decoding and encoding
+gboolean twitch_broadcaster_can_remux(broadcaster_impl *self, GstCaps *caps);
 
 
 //----------------------------------------------------------------------------------------
@@ -80,254 +451,2184 @@ gboolean twitch_broadcaster_wire_new_audio_track(broadcaster_impl *self, GstPad
 twitch_broadcaster* twitch_broadcaster_new() {
     twitch_broadcaster *instance = g_malloc0(sizeof(twitch_broadcaster));
     instance->impl = g_malloc0(sizeof(broadcaster_impl));
+    instance->impl->instance = instance;
+    latency_tracker_init(&instance->impl->latency, GST_SECOND / LAYOUT_DEFAULT_FPS);
+    av_sync_monitor_init(&instance->impl->av_sync, 0, 0);
+    for (guint i = 0; i < STAGE_COUNT; i++) {
+        stage_counter_init(&instance->impl->stages[i], GST_SECOND / LAYOUT_DEFAULT_FPS);
+    }
+    for (guint i = 0; i < MEMORY_COUNT; i++) {
+        memory_gauge_init(&instance->impl->memory[i]);
+    }
+    instance->impl->qos_dropped = g_hash_table_new(g_direct_hash, g_direct_equal);
+    instance->impl->removed_tracks = g_ptr_array_new();
+    g_mutex_init(&instance->impl->stats_lock);
     return instance;
 }
 
-int twitch_broadcaster_init(twitch_broadcaster *self, Config *config) {
-    g_mutex_init(&self->impl->lock);
-    g_return_val_if_fail(self && config->source1 && config->source2 && config->source3, -1);
-    if (!twitch_broadcaster_create_elements(self->impl, config)) {
-        return -1;
+int twitch_broadcaster_init(twitch_broadcaster *self, Config *config) {
+    g_mutex_init(&self->impl->lock);
+    g_return_val_if_fail(self && config->sources && config->sources[0], -1);
+    if (!twitch_broadcaster_create_elements(self->impl, config)) {
+        return -1;
+    }
+    if (!twitch_broadcaster_configure_pipeline(self->impl)) {
+        return -1;
+    }
+    if (self->impl->memory_limit) {
+        twitch_broadcaster_apply_memory_limit(self->impl);
+    }
+    self->impl->initialized = TRUE;
+    return 0;
+}
+
+typedef struct {
+    GMainLoop *loop;
+    int result;
+} run_data;
+
+int twitch_broadcaster_run(twitch_broadcaster *self) {
+    g_return_val_if_fail(self && self->impl->initialized, -1);
+    GMainContext *context = g_main_context_new();
+    run_data data = { g_main_loop_new(context, FALSE), -1 };
+    broadcaster_callbacks callbacks = { .finished = run_finished_handler };
+
+    if (twitch_broadcaster_start(self, context, &callbacks, &data) == 0) {
+        g_main_loop_run(data.loop);
+    }
+    g_main_loop_unref(data.loop);
+    g_main_context_unref(context);
+    return data.result;
+}
+
+int twitch_broadcaster_start(twitch_broadcaster *self, GMainContext *context,
+                             const broadcaster_callbacks *callbacks, void *user_data) {
+    g_return_val_if_fail(self && self->impl->initialized, -1);
+    broadcaster_impl *impl = self->impl;
+    if (!impl->pipeline || impl->bus_watch) {
+        g_printerr("Broadcaster has already been started.\n");
+        return -1;
+    }
+    if (callbacks) {
+        impl->callbacks = *callbacks;
+    } else {
+        memset(&impl->callbacks, 0, sizeof(broadcaster_callbacks));
+    }
+    impl->user_data = user_data;
+
+    impl->start_time = g_get_monotonic_time();
+    GstStateChangeReturn ret = gst_element_set_state(impl->pipeline, GST_STATE_PLAYING);
+    if (ret == GST_STATE_CHANGE_FAILURE) {
+        g_printerr ("Unable to set the pipeline to the playing state.\n");
+        gst_element_set_state (impl->pipeline, GST_STATE_NULL);
+        g_mutex_lock(&impl->lock);
+        gst_object_unref (impl->pipeline);
+        impl->pipeline = NULL;
+        g_mutex_unlock(&impl->lock);
+        return -1;
+    }
+
+    // messages posted meanwhile wait on the bus until the context dispatches them
+    GstBus *bus = gst_element_get_bus(impl->pipeline);
+    impl->bus_watch = gst_bus_create_watch(bus);
+    g_source_set_callback(impl->bus_watch, (GSourceFunc)bus_watch_handler, impl, NULL);
+    g_source_attach(impl->bus_watch, context);
+    gst_object_unref(bus);
+    if (((broadcaster_rendition *)g_ptr_array_index(impl->renditions, 0))->adaptive) {
+        impl->bitrate_source = g_timeout_source_new(BITRATE_CONTROLLER_INTERVAL_MS);
+        g_source_set_callback(impl->bitrate_source, (GSourceFunc)twitch_broadcaster_control_bitrate, impl, NULL);
+        g_source_attach(impl->bitrate_source, context);
+    }
+    return 0;
+}
+
+int twitch_broadcaster_stop(twitch_broadcaster *self) {
+    g_return_val_if_fail(self && self->impl && self->impl->initialized, -1);
+    if (!self->impl->bus_watch) {
+        g_printerr("Broadcaster is not running.\n");
+        return -1;
+    }
+    twitch_broadcaster_finish(self->impl, 0);
+    return 0;
+}
+
+int twitch_broadcaster_get_stats(twitch_broadcaster *self, broadcaster_stats *stats) {
+    g_return_val_if_fail(self && self->impl && self->impl->initialized && stats, -1);
+    broadcaster_impl *impl = self->impl;
+    gint64 now = g_get_monotonic_time();
+    gint64 average_us = 0, max_us = 0;
+
+    memset(stats, 0, sizeof(broadcaster_stats));
+    for (guint i = 0; i < STAGE_COUNT; i++) {
+        stage_counter_read(&impl->stages[i], &stats->stages[i], now);
+    }
+    latency_tracker_get(&impl->latency, NULL, &average_us, &max_us);
+    stats->pipeline_latency_us = average_us;
+    stats->max_pipeline_latency_us = max_us;
+    g_mutex_lock(&impl->stats_lock);
+    if (impl->first_buffer_time) {
+        stats->time_to_first_buffer_us = impl->first_buffer_time - impl->start_time;
+    }
+    g_mutex_unlock(&impl->stats_lock);
+    av_sync_monitor_read(&impl->av_sync, &stats->av_sync);
+
+    g_mutex_lock(&impl->lock);
+    // scaling happens per source, stage latency is the average over sources
+    guint measured = 0;
+    for (guint i = 0; i < impl->branches->len; i++) {
+        source_branch *branch = g_ptr_array_index(impl->branches, i);
+        latency_tracker_get(&branch->scaler_latency, NULL, &average_us, &max_us);
+        if (average_us) {
+            stats->stages[STAGE_SCALER].latency_us += average_us;
+            stats->stages[STAGE_SCALER].max_latency_us = MAX(stats->stages[STAGE_SCALER].max_latency_us, max_us);
+            measured++;
+        }
+    }
+    if (measured) {
+        stats->stages[STAGE_SCALER].latency_us /= measured;
+    }
+    stats->num_sources = impl->branches->len;
+    stats->threads = g_atomic_int_get(&impl->threads);
+    stats->pinned_threads = g_atomic_int_get(&impl->pinned_threads);
+    stats->video_passthrough = g_atomic_int_get(&impl->video_passthrough);
+    stats->audio_passthrough = g_atomic_int_get(&impl->audio_passthrough);
+    stats->path_switches = g_atomic_int_get(&impl->path_switches);
+    for (guint i = 0; i < MEMORY_COUNT; i++) {
+        memory_gauge_read(&impl->memory[i], &stats->held_bytes[i], &stats->peak_held_bytes[i]);
+    }
+    stats->memory_limit = impl->memory_limit;
+    stats_process_memory(NULL, &stats->peak_rss_bytes, NULL);
+    // queues are gone together with the pipeline once the broadcast ends
+    if (impl->pipeline) {
+        GstIterator *elements = gst_bin_iterate_recurse(GST_BIN(impl->pipeline));
+        GValue item = G_VALUE_INIT;
+        GstIteratorResult next;
+        while ((next = gst_iterator_next(elements, &item)) == GST_ITERATOR_OK || next == GST_ITERATOR_RESYNC) {
+            if (next == GST_ITERATOR_RESYNC) {
+                // decoders plug elements while streaming, counting starts over
+                gst_iterator_resync(elements);
+                stats->elements = 0;
+                continue;
+            }
+            stats->elements++;
+            g_value_reset(&item);
+        }
+        g_value_unset(&item);
+        gst_iterator_free(elements);
+        GST_OBJECT_LOCK(impl->video_mixer);
+        stats->mixer_pads = impl->video_mixer->numsinkpads;
+        GST_OBJECT_UNLOCK(impl->video_mixer);
+        GST_OBJECT_LOCK(impl->audio_mixer);
+        stats->mixer_pads += impl->audio_mixer->numsinkpads;
+        GST_OBJECT_UNLOCK(impl->audio_mixer);
+        for (guint i = 0; i < impl->outputs->len; i++) {
+            output_stats output;
+            output_get_stats(g_ptr_array_index(impl->outputs, i), &output);
+            if (i == 0 || output.queue_percent > stats->queue_percent) {
+                stats->queue_buffers = output.queue_buffers;
+                stats->queue_bytes = output.queue_bytes;
+                stats->queue_time_ns = output.queue_time_ns;
+                stats->queue_percent = output.queue_percent;
+            }
+        }
+    }
+    g_mutex_unlock(&impl->lock);
+    return 0;
+}
+
+int twitch_broadcaster_get_source_stats(twitch_broadcaster *self, unsigned int index, source_stats *stats) {
+    g_return_val_if_fail(self && self->impl && self->impl->initialized && stats, -1);
+    broadcaster_impl *impl = self->impl;
+    gint64 now = g_get_monotonic_time();
+    int res = -1;
+
+    g_mutex_lock(&impl->lock);
+    if (index < impl->branches->len) {
+        source_branch *branch = g_ptr_array_index(impl->branches, index);
+        gint64 average_us = 0;
+        latency_tracker_get(&branch->scaler_latency, NULL, &average_us, NULL);
+        stats->scaler_latency_us = average_us;
+        stats->swaps = branch->swaps;
+        stats->tracks = (branch->video_mixer_pad ? 1 : 0) + (branch->audio_mixer_pad ? 1 : 0);
+        stats->tracks_removed = branch->tracks_removed;
+        stats->video_filters = (branch->video_scaler ? 1 : 0) + (branch->video_converter ? 1 : 0);
+        av_sync_monitor_read(&branch->av_sync, &stats->av_sync);
+        g_mutex_lock(&impl->stats_lock);
+        stats->video_frames = branch->video_frames;
+        stats->audio_buffers = branch->audio_buffers;
+        stats->fps = now > branch->last_read ?
+                (branch->video_frames - branch->last_video_frames) * (gdouble)G_USEC_PER_SEC / (now - branch->last_read) : 0;
+        stats->swap_glitch_us = branch->swap_glitch_us;
+        stats->swap_glitch_frames = branch->swap_glitch_frames;
+        stats->stalls = branch->stalls;
+        stats->stalled = branch->stalled;
+        stats->stalled_us = branch->stalled_us + (branch->stalled ? now - branch->stall_start : 0);
+        branch->last_video_frames = branch->video_frames;
+        branch->last_read = now;
+        g_mutex_unlock(&impl->stats_lock);
+        res = 0;
+    }
+    g_mutex_unlock(&impl->lock);
+    return res;
+}
+
+int twitch_broadcaster_set_memory_limit(twitch_broadcaster *self, uint64_t bytes) {
+    g_return_val_if_fail(self && self->impl && self->impl->initialized && bytes > 0, -1);
+    broadcaster_impl *impl = self->impl;
+
+    g_mutex_lock(&impl->lock);
+    impl->memory_limit = bytes;
+    twitch_broadcaster_apply_memory_limit(impl);
+    g_mutex_unlock(&impl->lock);
+    return 0;
+}
+
+int twitch_broadcaster_get_output_stats(twitch_broadcaster *self, unsigned int index, output_stats *stats) {
+    g_return_val_if_fail(self && self->impl && self->impl->initialized && stats, -1);
+    broadcaster_impl *impl = self->impl;
+    int res = -1;
+
+    g_mutex_lock(&impl->lock);
+    if (index < impl->outputs->len) {
+        broadcaster_output *output = g_ptr_array_index(impl->outputs, index);
+        output_get_stats(output, stats);
+        gint64 first_byte_time = output_first_byte_time(output);
+        if (first_byte_time) {
+            stats->time_to_first_byte_us = first_byte_time - impl->start_time;
+        }
+        if (!impl->pipeline) {
+            // queue is gone together with the pipeline
+            stats->queue_buffers = stats->queue_bytes = stats->queue_percent = 0;
+            stats->queue_time_ns = 0;
+        }
+        res = 0;
+    }
+    g_mutex_unlock(&impl->lock);
+    return res;
+}
+
+int twitch_broadcaster_get_rendition_stats(twitch_broadcaster *self, unsigned int index, rendition_stats *stats) {
+    g_return_val_if_fail(self && self->impl && self->impl->initialized && stats, -1);
+    broadcaster_impl *impl = self->impl;
+    int res = -1;
+
+    // the controller is updated under the same lock, on the broadcaster's context
+    g_mutex_lock(&impl->lock);
+    if (index < impl->renditions->len) {
+        rendition_get_stats(g_ptr_array_index(impl->renditions, index), stats);
+        res = 0;
+    }
+    g_mutex_unlock(&impl->lock);
+    return res;
+}
+
+int twitch_broadcaster_get_cache_stats(twitch_broadcaster *self, cache_stats *stats) {
+    g_return_val_if_fail(self && self->impl && self->impl->initialized && stats, -1);
+    if (!self->impl->cache) {
+        return -1;
+    }
+    source_cache_get_stats(self->impl->cache, stats);
+    return 0;
+}
+
+int twitch_broadcaster_replace_source(twitch_broadcaster *self, unsigned int index, const char *uri) {
+    g_return_val_if_fail(self && self->impl && self->impl->initialized && uri, -1);
+    broadcaster_impl *impl = self->impl;
+    source_branch *old_branch = NULL;
+    source_branch *branch = NULL;
+
+    g_mutex_lock(&impl->lock);
+    if (!impl->pipeline || index >= impl->branches->len) {
+        g_mutex_unlock(&impl->lock);
+        g_printerr("Can't replace source %u.\n", index);
+        return -1;
+    }
+    old_branch = g_ptr_array_index(impl->branches, index);
+    branch = twitch_broadcaster_branch_new(impl, index, uri, old_branch->swaps + 1);
+    if (!branch) {
+        g_mutex_unlock(&impl->lock);
+        g_printerr("Failed to create decoder for source %u.\n", index);
+        return -1;
+    }
+    branch->tile = old_branch->tile;
+    branch->scaler_latency.frame_duration = old_branch->scaler_latency.frame_duration;
+    // the new decoder starts at 0, move it to where the mix is now
+    g_mutex_lock(&impl->stats_lock);
+    branch->ts_offset = GST_CLOCK_TIME_IS_VALID(impl->mixer_position) ?
+            (GstClockTimeDiff)(impl->mixer_position + GST_SECOND / impl->fps) : 0;
+    g_mutex_unlock(&impl->stats_lock);
+    old_branch->removed = TRUE;
+    // the old branch is gone from the slot's point of view, stats read the new one
+    impl->branches->pdata[index] = branch;
+    g_mutex_unlock(&impl->lock);
+
+    // old decoder's streaming threads may be waiting for the lock in pad_added_handler
+    // until it's torn down, so this happens unlocked. A slot whose replacement failed has none
+    if (old_branch->decoder) {
+        g_signal_handlers_disconnect_by_data(old_branch->decoder, old_branch);
+    }
+    twitch_broadcaster_branch_remove(impl, old_branch);
+    if (old_branch->announced) {
+        twitch_broadcaster_post_source_event(impl, index, FALSE);
+    }
+    g_mutex_lock(&impl->stats_lock);
+    branch->swap_time = g_get_monotonic_time();
+    branch->swap_mixer_frames = impl->mixer_frames;
+    g_mutex_unlock(&impl->stats_lock);
+    twitch_broadcaster_branch_free(old_branch);
+
+    g_signal_connect(branch->decoder, "pad-added", G_CALLBACK(pad_added_handler), branch);
+    g_signal_connect(branch->decoder, "pad-removed", G_CALLBACK(pad_removed_handler), branch);
+    if (impl->passthrough) {
+        g_signal_connect(branch->decoder, "autoplug-continue", G_CALLBACK(autoplug_continue_handler), branch);
+    }
+    gst_bin_add(GST_BIN(impl->pipeline), branch->decoder);
+    if (!gst_element_sync_state_with_parent(branch->decoder)) {
+        g_printerr("Failed to start decoder of source %u.\n", index);
+        // the slot stays without a source until it's replaced again, nothing of the new one is
+        // left in the pipeline and its download or shared decoder is let go
+        g_mutex_lock(&impl->lock);
+        branch->removed = TRUE;
+        g_mutex_unlock(&impl->lock);
+        g_signal_handlers_disconnect_by_data(branch->decoder, branch);
+        twitch_broadcaster_branch_remove(impl, branch);
+        source_cache_recording_finish(branch->recording, FALSE);
+        branch->recording = NULL;
+        source_registry_unsubscribe(branch->shared);
+        branch->shared = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void twitch_broadcaster_destroy(twitch_broadcaster *self) {
+    if (self && self->impl) {
+        if (self->impl->bus_watch) {
+            twitch_broadcaster_finish(self->impl, 0);
+        }
+        if (self->impl->initialized) {
+            g_mutex_clear(&(self->impl->lock));
+        }
+        if (self->impl->pipeline) {
+            // initialised but never run
+            gst_object_unref(self->impl->pipeline);
+        }
+        if (self->impl->branches) {
+            g_ptr_array_free(self->impl->branches, TRUE);
+        }
+        // after the branches, they end their recordings
+        source_cache_free(self->impl->cache);
+        if (self->impl->outputs) {
+            g_ptr_array_free(self->impl->outputs, TRUE);
+        }
+        if (self->impl->renditions) {
+            g_ptr_array_free(self->impl->renditions, TRUE);
+        }
+        latency_tracker_clear(&self->impl->latency);
+        av_sync_monitor_clear(&self->impl->av_sync);
+        for (guint i = 0; i < STAGE_COUNT; i++) {
+            stage_counter_clear(&self->impl->stages[i]);
+        }
+        affinity_set_free(self->impl->source_cpus);
+        affinity_set_free(self->impl->encoder_cpus);
+        affinity_set_free(self->impl->all_cpus);
+        if (self->impl->task_pool) {
+            gst_object_unref(self->impl->task_pool);
+        }
+        for (guint i = 0; i < MEMORY_COUNT; i++) {
+            memory_gauge_clear(&self->impl->memory[i]);
+        }
+        g_hash_table_destroy(self->impl->qos_dropped);
+        // released when the broadcast finished
+        g_ptr_array_free(self->impl->removed_tracks, TRUE);
+        g_mutex_clear(&self->impl->stats_lock);
+        g_free(self->impl);
+        self->impl = NULL;
+    }
+    g_free(self);
+}
+
+//----------------------------------------------------------------------------------------
+// Helpers && callbacks impl
+
+static void pad_added_handler (GstElement *src, GstPad *new_pad, source_branch *branch) {
+    broadcaster_impl *data = branch->owner;
+    GstCaps *new_pad_caps = NULL;
+    GstStructure *new_pad_struct = NULL;
+    const gchar *new_pad_type = NULL;
+
+    g_print("Received new pad '%s' from '%s':\n", GST_PAD_NAME (new_pad), GST_ELEMENT_NAME (src));
+
+    new_pad_caps = gst_pad_get_current_caps (new_pad);
+    if (!new_pad_caps) {
+        // shared sources expose their tracks before data flows
+        new_pad_caps = gst_pad_query_caps(new_pad, NULL);
+    }
+    new_pad_struct = gst_caps_get_structure (new_pad_caps, 0);
+    new_pad_type = gst_structure_get_name (new_pad_struct);
+
+    g_mutex_lock(&data->lock);
+    g_mutex_lock(&data->stats_lock);
+    if (data->fast_start && !branch->announced && !branch->ts_offset && data->mixer_frames) {
+        // discovered after going live, the source starts where the mix is now
+        branch->ts_offset = (GstClockTimeDiff)(data->mixer_position + GST_SECOND / data->fps);
+    }
+    g_mutex_unlock(&data->stats_lock);
+    if (branch->ts_offset) {
+        gst_pad_set_offset(new_pad, branch->ts_offset);
+    }
+    if (data->segmented && !branch->swaps && !branch->removed) {
+        // installed before the pad is linked, nothing from before the seek gets through
+        gst_pad_add_probe(new_pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM |
+                          GST_PAD_PROBE_TYPE_EVENT_FLUSH, (GstPadProbeCallback)segment_probe,
+                          g_new0(gboolean, 1), g_free);
+    }
+    gboolean wired = FALSE;
+    if (branch->removed) {
+        // replaced while the decoder was still discovering its tracks
+    } else if (g_str_has_prefix (new_pad_type, "video/x-raw")) {
+        wired = twitch_broadcaster_wire_new_video_track(data, branch, new_pad);
+
+    } else if (g_str_has_prefix (new_pad_type, "audio/x-raw")) {
+        wired = twitch_broadcaster_wire_new_audio_track(data, branch, new_pad);
+    } else if (g_str_equal(new_pad_type, "video/x-h264") || g_str_equal(new_pad_type, "audio/mpeg")) {
+        // only exposed undecoded when it can be remuxed
+        wired = twitch_broadcaster_wire_passthrough_track(data, branch, new_pad, g_str_has_prefix(new_pad_type, "video/"));
+    }
+    if (wired && !branch->announced) {
+        branch->announced = TRUE;
+        g_atomic_int_set(&data->source_ready, TRUE);
+        twitch_broadcaster_post_source_event(data, branch->index, TRUE);
+    }
+    if (new_pad_caps != NULL) {
+        gst_caps_unref(new_pad_caps);
+    }
+    g_mutex_unlock(&data->lock);
+}
+
+static void pad_removed_handler(GstElement *src, GstPad *old_pad, source_branch *branch) {
+    broadcaster_impl *self = branch->owner;
+    g_mutex_lock(&self->lock);
+    if (branch->removed || !self->pipeline ||
+        (old_pad != branch->video_decoder_pad && old_pad != branch->audio_decoder_pad)) {
+        g_mutex_unlock(&self->lock);
+        return;
+    }
+    // the track is taken off the branch right away, a pad the decoder adds in its place (a
+    // chained stream) gets a track of its own. From a streaming thread (or the one stopping
+    // the decoder) the mixers' pads and the track's queue can't be shut down, that is left to
+    // the bus
+    gboolean video = old_pad == branch->video_decoder_pad;
+    branch_track *track = g_malloc(sizeof(branch_track));
+    twitch_broadcaster_branch_take_track(self, branch, video, track);
+    g_ptr_array_add(self->removed_tracks, track);
+    branch->tracks_removed++;
+    // a source without tracks is lost until the decoder comes up with a new one
+    gboolean lost = branch->announced && !branch->video_mixer_pad && !branch->audio_mixer_pad;
+    if (lost) {
+        branch->announced = FALSE;
+        twitch_broadcaster_post_source_event(self, branch->index, FALSE);
+    }
+    GstStructure *structure = gst_structure_new(TRACK_REMOVED_MESSAGE, "index", G_TYPE_UINT, branch->index,
+                                                "video", G_TYPE_BOOLEAN, video, "track", G_TYPE_POINTER, track, NULL);
+    gst_element_post_message(self->pipeline, gst_message_new_application(GST_OBJECT(self->pipeline), structure));
+    g_mutex_unlock(&self->lock);
+}
+
+static GstPadProbeReturn audio_mixer_input_probe(GstPad *pad, GstPadProbeInfo *info, source_branch *branch) {
+    g_mutex_lock(&branch->owner->stats_lock);
+    branch->audio_buffers++;
+    g_mutex_unlock(&branch->owner->stats_lock);
+    if (av_sync_monitor_push(&branch->av_sync, AV_SYNC_AUDIO, pad, GST_PAD_PROBE_INFO_BUFFER(info))) {
+        twitch_broadcaster_post_av_sync_alarm(branch->owner, branch->index);
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn muxer_video_probe(GstPad *pad, GstPadProbeInfo *info, broadcaster_impl *self) {
+    if (av_sync_monitor_push(&self->av_sync, AV_SYNC_VIDEO, pad, GST_PAD_PROBE_INFO_BUFFER(info))) {
+        twitch_broadcaster_post_av_sync_alarm(self, -1);
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn muxer_audio_probe(GstPad *pad, GstPadProbeInfo *info, broadcaster_impl *self) {
+    if (av_sync_monitor_push(&self->av_sync, AV_SYNC_AUDIO, pad, GST_PAD_PROBE_INFO_BUFFER(info))) {
+        twitch_broadcaster_post_av_sync_alarm(self, -1);
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn decoder_output_probe(GstPad *pad, GstPadProbeInfo *info, source_branch *branch) {
+    broadcaster_impl *self = branch->owner;
+    GstClockTime running_time = stats_running_time(pad, GST_PAD_PROBE_INFO_BUFFER(info));
+    gint64 now = g_get_monotonic_time();
+
+    stage_counter_count(&self->stages[STAGE_DECODER]);
+    latency_tracker_ingress(&branch->scaler_latency, running_time, now);
+    latency_tracker_ingress(&self->latency, running_time, now);
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn scaler_output_probe(GstPad *pad, GstPadProbeInfo *info, source_branch *branch) {
+    broadcaster_impl *self = branch->owner;
+    GstClockTime running_time = stats_running_time(pad, GST_PAD_PROBE_INFO_BUFFER(info));
+    gint64 now = g_get_monotonic_time();
+
+    // checks whether the source stalled under stats_lock, the stall timer marks it from the mixer's thread
+    twitch_broadcaster_branch_rejoin(self, branch, running_time, now);
+    twitch_broadcaster_branch_count_frame(self, branch, now);
+    latency_tracker_egress(&branch->scaler_latency, running_time, now, NULL);
+    if (av_sync_monitor_push(&branch->av_sync, AV_SYNC_VIDEO, pad, GST_PAD_PROBE_INFO_BUFFER(info))) {
+        twitch_broadcaster_post_av_sync_alarm(self, branch->index);
+    }
+    stage_counter_count(&self->stages[STAGE_SCALER]);
+    stage_counter_input(&self->stages[STAGE_MIXER], running_time, now);
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn decoder_event_probe(GstPad *pad, GstPadProbeInfo *info, source_branch *branch) {
+    broadcaster_impl *self = branch->owner;
+    if (GST_EVENT_TYPE(GST_PAD_PROBE_INFO_EVENT(info)) == GST_EVENT_EOS) {
+        g_mutex_lock(&self->stats_lock);
+        gboolean video = pad == branch->video_decoder_pad;
+        if (video) {
+            branch->video_eos = TRUE;
+        } else if (pad == branch->audio_decoder_pad) {
+            branch->audio_eos = TRUE;
+        }
+        g_mutex_unlock(&self->stats_lock);
+        // a replaced source was reported lost already
+        if (video && !branch->removed) {
+            twitch_broadcaster_post_source_event(self, branch->index, FALSE);
+        }
+        GstElement *pipeline = self->pipeline;
+        if (self->stall_timeout && pipeline) {
+            gst_element_post_message(pipeline, gst_message_new_application(GST_OBJECT(pipeline),
+                    gst_structure_new_empty(TRACK_ENDED_MESSAGE)));
+        }
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+// Makes the selector the pad is linked to take the pad's data from its first keyframe on, dropping
+// data before it
+static GstPadProbeReturn twitch_broadcaster_select_path(broadcaster_impl *self, GstPad *pad, GstBuffer *buffer,
+                                                        gboolean passthrough) {
+    GstPadProbeReturn ret = GST_PAD_PROBE_OK;
+    GstPad *selector_pad = gst_pad_get_peer(pad);
+    if (!selector_pad) {
+        return ret;
+    }
+    GstElement *selector = gst_pad_get_parent_element(selector_pad);
+    GstPad *active_pad = NULL;
+    g_object_get(selector, "active-pad", &active_pad, NULL);
+    if (active_pad != selector_pad) {
+        broadcaster_rendition *primary = g_ptr_array_index(self->renditions, 0);
+        gboolean video = selector == primary->video_selector;
+        if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+            // encoder's next frame is made a keyframe instead of waiting for the next GOP
+            if (video && !passthrough && g_atomic_int_compare_and_exchange(&self->key_unit_requested, FALSE, TRUE)) {
+                gst_pad_send_event(pad, gst_video_event_new_upstream_force_key_unit(GST_CLOCK_TIME_NONE, TRUE, 0));
+            }
+            ret = GST_PAD_PROBE_DROP;
+        } else {
+            g_object_set(selector, "active-pad", selector_pad, NULL);
+            if (video) {
+                g_atomic_int_set(&self->video_passthrough, passthrough);
+                g_atomic_int_set(&self->key_unit_requested, FALSE);
+            } else {
+                g_atomic_int_set(&self->audio_passthrough, passthrough);
+            }
+            // the first selection isn't a switch
+            if (active_pad) {
+                g_atomic_int_inc(&self->path_switches);
+            }
+        }
+    }
+    if (active_pad) {
+        gst_object_unref(active_pad);
+    }
+    gst_object_unref(selector);
+    gst_object_unref(selector_pad);
+    return ret;
+}
+
+static GstPadProbeReturn passthrough_video_probe(GstPad *pad, GstPadProbeInfo *info, source_branch *branch) {
+    broadcaster_impl *self = branch->owner;
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    if (twitch_broadcaster_select_path(self, pad, buffer, TRUE) == GST_PAD_PROBE_DROP) {
+        return GST_PAD_PROBE_DROP;
+    }
+    GstClockTime running_time = stats_running_time(pad, buffer);
+    gint64 now = g_get_monotonic_time();
+    twitch_broadcaster_branch_count_frame(self, branch, now);
+    // nothing is composited meanwhile, replacements start where the remuxed video is
+    g_mutex_lock(&self->stats_lock);
+    if (GST_CLOCK_TIME_IS_VALID(running_time) &&
+        (!GST_CLOCK_TIME_IS_VALID(self->mixer_position) || running_time > self->mixer_position)) {
+        self->mixer_position = running_time;
+    }
+    g_mutex_unlock(&self->stats_lock);
+    latency_tracker_ingress(&self->latency, running_time, now);
+    if (av_sync_monitor_push(&branch->av_sync, AV_SYNC_VIDEO, pad, buffer)) {
+        twitch_broadcaster_post_av_sync_alarm(self, branch->index);
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn passthrough_audio_probe(GstPad *pad, GstPadProbeInfo *info, source_branch *branch) {
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    g_mutex_lock(&branch->owner->stats_lock);
+    branch->audio_buffers++;
+    g_mutex_unlock(&branch->owner->stats_lock);
+    if (twitch_broadcaster_select_path(branch->owner, pad, buffer, TRUE) == GST_PAD_PROBE_DROP) {
+        return GST_PAD_PROBE_DROP;
+    }
+    if (av_sync_monitor_push(&branch->av_sync, AV_SYNC_AUDIO, pad, buffer)) {
+        twitch_broadcaster_post_av_sync_alarm(branch->owner, branch->index);
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn composite_output_probe(GstPad *pad, GstPadProbeInfo *info, broadcaster_impl *self) {
+    return twitch_broadcaster_select_path(self, pad, GST_PAD_PROBE_INFO_BUFFER(info), FALSE);
+}
+
+static GstPadProbeReturn fast_start_probe(GstPad *pad, GstPadProbeInfo *info, broadcaster_impl *self) {
+    return g_atomic_int_get(&self->source_ready) ? GST_PAD_PROBE_REMOVE : GST_PAD_PROBE_DROP;
+}
+
+static GstPadProbeReturn segment_probe(GstPad *pad, GstPadProbeInfo *info, gboolean *flushed) {
+    if (info->type & GST_PAD_PROBE_TYPE_BUFFER) {
+        // after the flush only data of the segment comes
+        return *flushed ? GST_PAD_PROBE_REMOVE : GST_PAD_PROBE_DROP;
+    }
+    switch (GST_EVENT_TYPE(GST_PAD_PROBE_INFO_EVENT(info))) {
+        case GST_EVENT_FLUSH_STOP:
+            *flushed = TRUE;
+            return GST_PAD_PROBE_OK;
+        case GST_EVENT_EOS:
+            // a short source may reach its end before it's seeked
+            return *flushed ? GST_PAD_PROBE_OK : GST_PAD_PROBE_DROP;
+        default:
+            return GST_PAD_PROBE_OK;
+    }
+}
+
+static void no_more_pads_handler(GstElement *decoder, source_branch *branch) {
+    // seeking flushes the decoder, which its own streaming thread can't wait for
+    GstElement *pipeline = branch->owner->pipeline;
+    if (pipeline) {
+        GstStructure *structure = gst_structure_new(SOURCE_SEEK_MESSAGE, "index", G_TYPE_UINT, branch->index, NULL);
+        gst_element_post_message(pipeline, gst_message_new_application(GST_OBJECT(pipeline), structure));
+    }
+}
+
+static gboolean autoplug_continue_handler(GstElement *bin, GstPad *pad, GstCaps *caps, source_branch *branch) {
+    return !twitch_broadcaster_can_remux(branch->owner, caps);
+}
+
+static void source_setup_handler(GstElement *bin, GstElement *source, source_branch *branch) {
+    if (branch->cached) {
+        g_object_set(source, "size", (gint64)g_mapped_file_get_length(branch->cached),
+                     "format", GST_FORMAT_BYTES, NULL);
+        // demuxers pull what they need, e.g. an mp4's index at its end
+        gst_util_set_object_arg(G_OBJECT(source), "stream-type", "random-access");
+        g_signal_connect(source, "need-data", G_CALLBACK(cached_need_data_handler), branch);
+        g_signal_connect(source, "seek-data", G_CALLBACK(cached_seek_data_handler), branch);
+        return;
+    }
+    source_cache_recording_finish(branch->recording, FALSE);
+    branch->recording = source_cache_record(branch->owner->cache, branch->uri);
+    if (branch->recording) {
+        GstPad *src_pad = gst_element_get_static_pad(source, "src");
+        gst_pad_add_probe(src_pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+                          (GstPadProbeCallback)cache_record_probe, branch, NULL);
+        gst_object_unref(src_pad);
+    }
+}
+
+static void cached_need_data_handler(GstElement *appsrc, guint length, source_branch *branch) {
+    gsize size = g_mapped_file_get_length(branch->cached);
+    GstFlowReturn ret;
+    if (branch->cached_offset >= size) {
+        g_signal_emit_by_name(appsrc, "end-of-stream", &ret);
+        return;
+    }
+    gsize chunk = size - branch->cached_offset;
+    if (length && length < chunk) {
+        chunk = length;
+    }
+    // the buffer keeps the mapping alive
+    GstBuffer *buffer = gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY,
+                                                    (gpointer)g_mapped_file_get_contents(branch->cached), size,
+                                                    branch->cached_offset, chunk, g_mapped_file_ref(branch->cached),
+                                                    (GDestroyNotify)g_mapped_file_unref);
+    GST_BUFFER_OFFSET(buffer) = branch->cached_offset;
+    branch->cached_offset += chunk;
+    g_signal_emit_by_name(appsrc, "push-buffer", buffer, &ret);
+    gst_buffer_unref(buffer);
+    source_cache_count_read(branch->owner->cache, chunk);
+}
+
+static gboolean cached_seek_data_handler(GstElement *appsrc, guint64 offset, source_branch *branch) {
+    branch->cached_offset = offset;
+    return offset <= g_mapped_file_get_length(branch->cached);
+}
+
+static GstPadProbeReturn cache_record_probe(GstPad *pad, GstPadProbeInfo *info, source_branch *branch) {
+    source_cache_recording *recording = branch->recording;
+    gboolean recording_on = TRUE;
+    if (!recording) {
+        return GST_PAD_PROBE_REMOVE;
+    }
+    if (info->type & GST_PAD_PROBE_TYPE_BUFFER) {
+        GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+        GstMapInfo map;
+        if (gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+            guint64 offset = GST_BUFFER_OFFSET_IS_VALID(buffer) ? GST_BUFFER_OFFSET(buffer) : SOURCE_CACHE_OFFSET_NONE;
+            recording_on = source_cache_recording_write(recording, offset, map.data, map.size);
+            gst_buffer_unmap(buffer, &map);
+        }
+    } else {
+        GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+        const GstSegment *segment = NULL;
+        if (GST_EVENT_TYPE(event) == GST_EVENT_SEGMENT) {
+            gst_event_parse_segment(event, &segment);
+            // a seek, the data continues at the segment's start
+            recording_on = segment->format != GST_FORMAT_BYTES ||
+                    source_cache_recording_write(recording, segment->start, NULL, 0);
+        } else if (GST_EVENT_TYPE(event) == GST_EVENT_EOS) {
+            gint64 length = 0;
+            // the demuxer may be done before the download is, e.g. when the end was read first
+            if (gst_pad_query_duration(pad, GST_FORMAT_BYTES, &length) && length > 0) {
+                source_cache_recording_set_length(recording, (guint64)length);
+            }
+            branch->recording = NULL;
+            source_cache_recording_finish(recording, TRUE);
+            return GST_PAD_PROBE_REMOVE;
+        }
+    }
+    if (!recording_on) {
+        g_print("Source %u couldn't be recorded, it's not cached\n", branch->index);
+        branch->recording = NULL;
+        source_cache_recording_finish(recording, FALSE);
+        return GST_PAD_PROBE_REMOVE;
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+// Which stages a probe on a static pad feeds: buffers leave output_stage and/or
+// enter input_stage (STAGE_COUNT for none). Muxed (flv) buffers carry running
+// time in the tag and only video tags are matched for latency.
+typedef struct {
+    broadcaster_impl *self;
+    broadcaster_stage output_stage;
+    broadcaster_stage input_stage;
+    gboolean flv;
+} stage_probe_data;
+
+static GstPadProbeReturn stage_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    stage_probe_data *data = user_data;
+    broadcaster_impl *self = data->self;
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    gint64 now = g_get_monotonic_time();
+    gboolean is_video = TRUE;
+    GstClockTime running_time = data->flv ?
+            stats_flv_running_time(buffer, &is_video) : stats_running_time(pad, buffer);
+
+    if (data->output_stage == STAGE_MIXER) {
+        g_mutex_lock(&self->stats_lock);
+        self->mixer_frames++;
+        self->mixer_position = running_time;
+        g_mutex_unlock(&self->stats_lock);
+        if (self->stall_timeout) {
+            twitch_broadcaster_check_liveness(self, now);
+        }
+    }
+    if (data->output_stage != STAGE_COUNT) {
+        if (is_video) {
+            stage_counter_output(&self->stages[data->output_stage], running_time, now);
+        } else {
+            stage_counter_count(&self->stages[data->output_stage]);
+        }
+        if (data->output_stage == STAGE_SINK) {
+            g_mutex_lock(&self->stats_lock);
+            if (!self->first_buffer_time) {
+                self->first_buffer_time = now;
+            }
+            g_mutex_unlock(&self->stats_lock);
+            if (is_video) {
+                latency_tracker_egress(&self->latency, running_time, now, NULL);
+            }
+        }
+    }
+    if (data->input_stage != STAGE_COUNT && is_video) {
+        stage_counter_input(&self->stages[data->input_stage], running_time, now);
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+static GstBusSyncReply bus_sync_handler(GstBus *bus, GstMessage *msg, broadcaster_impl *self) {
+    if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_STREAM_STATUS) {
+        // posted from the new streaming thread itself before it starts its task
+        GstStreamStatusType type;
+        GstElement *owner = NULL;
+        gst_message_parse_stream_status(msg, &type, &owner);
+        if (type == GST_STREAM_STATUS_TYPE_CREATE && self->task_pool) {
+            // the task isn't started yet, its thread comes from the shared pool
+            const GValue *task = gst_message_get_stream_status_object(msg);
+            if (task && G_VALUE_HOLDS(task, GST_TYPE_TASK)) {
+                gst_task_set_pool(GST_TASK(g_value_get_object(task)), self->task_pool);
+            }
+        } else if (type == GST_STREAM_STATUS_TYPE_ENTER) {
+            g_atomic_int_inc(&self->threads);
+            if (self->all_cpus) {
+                twitch_broadcaster_pin_thread(self, owner);
+            }
+        }
+        return GST_BUS_PASS;
+    }
+    if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR) {
+        // posted by a failing sink before it fails the queue in front of it, a reconnecting
+        // output stops taking data right away. Outputs are only added at init, no lock needed
+        for (guint i = 0; i < self->outputs->len; i++) {
+            if (output_sink_failed(g_ptr_array_index(self->outputs, i), GST_MESSAGE_SRC(msg))) {
+                break;
+            }
+        }
+        return GST_BUS_PASS;
+    }
+    if (GST_MESSAGE_TYPE(msg) != GST_MESSAGE_QOS) {
+        return GST_BUS_PASS;
+    }
+    GstFormat format;
+    guint64 processed = 0, dropped = 0;
+    gint64 jitter = 0;
+    gst_message_parse_qos_stats(msg, &format, &processed, &dropped);
+    gst_message_parse_qos_values(msg, &jitter, NULL, NULL);
+
+    broadcaster_stage stage = twitch_broadcaster_element_stage(self, GST_MESSAGE_SRC(msg));
+    if (stage == STAGE_COUNT) {
+        return GST_BUS_PASS;
+    }
+    // elements report dropped buffers as a running total
+    g_mutex_lock(&self->stats_lock);
+    guint64 last_dropped = GPOINTER_TO_SIZE(g_hash_table_lookup(self->qos_dropped, GST_MESSAGE_SRC(msg)));
+    if (dropped != G_MAXUINT64 && dropped > last_dropped) {
+        g_hash_table_insert(self->qos_dropped, GST_MESSAGE_SRC(msg), GSIZE_TO_POINTER(dropped));
+    } else {
+        dropped = last_dropped;
+    }
+    g_mutex_unlock(&self->stats_lock);
+    stage_counter_add_qos(&self->stages[stage], dropped - last_dropped, jitter > 0 ? 1 : 0);
+    return GST_BUS_PASS;
+}
+
+static gboolean bus_watch_handler(GstBus *bus, GstMessage *msg, broadcaster_impl *self) {
+    broadcaster_callbacks *callbacks = &self->callbacks;
+    twitch_broadcaster *instance = self->instance;
+    gboolean terminate = FALSE;
+    int res = 0;
+
+    switch (GST_MESSAGE_TYPE(msg)) {
+        case GST_MESSAGE_ERROR: {
+            GError *error = NULL;
+            gchar *debug_info = NULL;
+            gst_message_parse_error(msg, &error, &debug_info);
+            g_printerr("Error received from element %s: %s\n", GST_OBJECT_NAME (msg->src), error->message);
+            g_printerr("Debugging information: %s\n", debug_info ? debug_info : "none");
+            // a failing output reconnects or is dropped as long as there are others left
+            broadcaster_output *output = twitch_broadcaster_element_output(self, GST_MESSAGE_SRC(msg));
+            guint attached = 0;
+            g_mutex_lock(&self->lock);
+            for (guint i = 0; i < self->outputs->len; i++) {
+                attached += ((broadcaster_output *)g_ptr_array_index(self->outputs, i))->detached ? 0 : 1;
+            }
+            if (output && output_handle_error(output, GST_BIN(self->pipeline), GST_MESSAGE_SRC(msg))) {
+                output_schedule_reconnect(output, GST_BIN(self->pipeline), g_source_get_context(self->bus_watch));
+            } else if (output && (output->detached || attached > 1)) {
+                if (!output->detached) {
+                    g_printerr("Removing output %u (%s), %u outputs left\n",
+                               output->index, output->location, attached - 1);
+                    output_detach(output, GST_BIN(self->pipeline));
+                }
+            } else {
+                terminate = TRUE;
+                res = -1;
+            }
+            g_mutex_unlock(&self->lock);
+            if (callbacks->error) {
+                callbacks->error(instance, GST_OBJECT_NAME(msg->src), error->message, terminate, self->user_data);
+            }
+            g_clear_error(&error);
+            g_free(debug_info);
+            break;
+        }
+        case GST_MESSAGE_EOS:
+            g_print("End-Of-Stream reached.\n");
+            if (callbacks->eos) {
+                callbacks->eos(instance, self->user_data);
+            }
+            terminate = TRUE;
+            break;
+        case GST_MESSAGE_STATE_CHANGED:
+            if (GST_MESSAGE_SRC (msg) == GST_OBJECT (self->pipeline)) {
+                GstState old_state, new_state, pending_state;
+                gst_message_parse_state_changed (msg, &old_state, &new_state, &pending_state);
+                g_print("Pipeline state changed from %s to %s:\n",
+                         gst_element_state_get_name (old_state), gst_element_state_get_name (new_state));
+                GST_DEBUG_BIN_TO_DOT_FILE_WITH_TS(GST_BIN(self->pipeline),
+                        GST_DEBUG_GRAPH_SHOW_ALL,
+                        "pipeline");
+                if (callbacks->state_changed) {
+                    callbacks->state_changed(instance, gst_element_state_get_name(old_state),
+                                             gst_element_state_get_name(new_state), self->user_data);
+                }
+            }
+            break;
+        case GST_MESSAGE_APPLICATION: {
+            const GstStructure *structure = gst_message_get_structure(msg);
+            guint index = 0;
+            gboolean added = FALSE;
+            if (gst_structure_has_name(structure, SOURCE_EVENT_MESSAGE) &&
+                gst_structure_get(structure, "index", G_TYPE_UINT, &index, "added", G_TYPE_BOOLEAN, &added, NULL)) {
+                if (added && callbacks->source_added) {
+                    callbacks->source_added(instance, index, self->user_data);
+                } else if (!added && callbacks->source_lost) {
+                    callbacks->source_lost(instance, index, self->user_data);
+                }
+            } else if (gst_structure_has_name(structure, SOURCE_SEEK_MESSAGE) &&
+                       gst_structure_get(structure, "index", G_TYPE_UINT, &index, NULL)) {
+                twitch_broadcaster_seek_source(self, index);
+            } else if (gst_structure_has_name(structure, TRACK_ENDED_MESSAGE)) {
+                twitch_broadcaster_end_fallback(self);
+            } else if (gst_structure_has_name(structure, AV_SYNC_ALARM_MESSAGE)) {
+                gint source = -1;
+                if (gst_structure_get(structure, "source", G_TYPE_INT, &source, NULL)) {
+                    twitch_broadcaster_report_av_sync_alarm(self, source);
+                }
+            } else if (gst_structure_has_name(structure, TRACK_REMOVED_MESSAGE)) {
+                gboolean video = FALSE;
+                gpointer track = NULL;
+                if (gst_structure_get(structure, "index", G_TYPE_UINT, &index, "video", G_TYPE_BOOLEAN, &video,
+                                      "track", G_TYPE_POINTER, &track, NULL)) {
+                    twitch_broadcaster_remove_track(self, index, video, track);
+                }
+            }
+            break;
+        }
+        default:
+            break;
+    }
+    // callbacks may have stopped the broadcast already
+    if (terminate && self->bus_watch) {
+        twitch_broadcaster_finish(self, res);
+    }
+    return self->bus_watch ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
+}
+
+static gboolean twitch_broadcaster_control_bitrate(broadcaster_impl *self) {
+    gint64 now = g_get_monotonic_time();
+    // output queues go away with the pipeline
+    g_mutex_lock(&self->lock);
+    for (guint i = 0; self->pipeline && i < self->renditions->len; i++) {
+        rendition_control_bitrate(g_ptr_array_index(self->renditions, i), now);
+    }
+    g_mutex_unlock(&self->lock);
+    return G_SOURCE_CONTINUE;
+}
+
+static void deep_element_added_handler(GstBin *bin, GstBin *sub_bin, GstElement *element, broadcaster_impl *self) {
+    if (self->memory_limit) {
+        twitch_broadcaster_limit_source_buffering(self, element);
+    }
+}
+
+static void run_finished_handler(twitch_broadcaster *broadcaster, int result, void *user_data) {
+    run_data *data = user_data;
+    data->result = result;
+    g_main_loop_quit(data->loop);
+}
+
+source_branch* twitch_broadcaster_branch_new(broadcaster_impl *self, guint index, const gchar *uri, guint swaps) {
+    g_return_val_if_fail(self && uri, NULL);
+    // replacements live next to the decoder they replace for a moment, names have to differ
+    gchar *name = swaps ? g_strdup_printf("source%u-%u", index, swaps) : g_strdup_printf("source%u", index);
+    shared_source *shared = self->registry ? source_registry_subscribe(self->registry, uri, name) : NULL;
+    GstElement *decoder = shared ? shared_source_get_element(shared) :
+            self->registry ? NULL : gst_element_factory_make("uridecodebin", name);
+    g_free(name);
+    if (!decoder) {
+        return NULL;
+    }
+    source_branch *branch = g_malloc0(sizeof(source_branch));
+    branch->index = index;
+    branch->uri = g_strdup(uri);
+    branch->decoder = decoder;
+    branch->shared = shared;
+    branch->owner = self;
+    branch->swaps = swaps;
+    latency_tracker_init(&branch->scaler_latency, GST_SECOND / LAYOUT_DEFAULT_FPS);
+    av_sync_monitor_init(&branch->av_sync, self->av_sync_max_offset_ms, self->av_sync_max_drift_ms_per_hour);
+    branch->last_read = g_get_monotonic_time();
+    if (shared) {
+        // decoded by the registry, downloads and caching are its decoder's business
+        return branch;
+    }
+    gboolean remote = source_cache_is_remote(uri);
+    if (self->cache && remote) {
+        // replays are read from the cache, first plays are recorded into it
+        branch->cached = source_cache_lookup(self->cache, uri);
+        g_signal_connect(branch->decoder, "source-setup", G_CALLBACK(source_setup_handler), branch);
+    }
+    g_object_set(branch->decoder, "uri", branch->cached ? CACHED_SOURCE_URI : branch->uri, NULL);
+    if (self->prefetch_bytes && remote && !branch->cached) {
+        // read-ahead bounded by bytes only, not by the default duration
+        g_object_set(branch->decoder, "buffer-size", (gint)MIN(self->prefetch_bytes, G_MAXINT),
+                     "buffer-duration", (gint64)0, NULL);
+    }
+    return branch;
+}
+
+void twitch_broadcaster_branch_free(source_branch *branch) {
+    if (!branch) {
+        return;
+    }
+    if (branch->video_mixer_pad) {
+        gst_object_unref(branch->video_mixer_pad);
+    }
+    if (branch->audio_mixer_pad) {
+        gst_object_unref(branch->audio_mixer_pad);
+    }
+    if (branch->video_decoder_pad) {
+        gst_object_unref(branch->video_decoder_pad);
+    }
+    if (branch->audio_decoder_pad) {
+        gst_object_unref(branch->audio_decoder_pad);
+    }
+    latency_tracker_clear(&branch->scaler_latency);
+    av_sync_monitor_clear(&branch->av_sync);
+    // a download that didn't reach its end is not cached
+    source_cache_recording_finish(branch->recording, FALSE);
+    if (branch->cached) {
+        g_mapped_file_unref(branch->cached);
+    }
+    source_registry_unsubscribe(branch->shared);
+    g_free(branch->uri);
+    g_free(branch);
+}
+
+static GstPadProbeReturn drop_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    return GST_PAD_PROBE_DROP;
+}
+
+void twitch_broadcaster_branch_set_decoder_pad(broadcaster_impl *self, source_branch *branch, gboolean video,
+                                               GstPad *pad) {
+    g_mutex_lock(&self->stats_lock);
+    if (video) {
+        branch->video_decoder_pad = gst_object_ref(pad);
+        branch->video_eos = FALSE;
+    } else {
+        branch->audio_decoder_pad = gst_object_ref(pad);
+        branch->audio_eos = FALSE;
+    }
+    g_mutex_unlock(&self->stats_lock);
+}
+
+void twitch_broadcaster_branch_take_track(broadcaster_impl *self, source_branch *branch, gboolean video,
+                                          branch_track *track) {
+    memset(track, 0, sizeof(branch_track));
+    if (video) {
+        GstElement *elements[] = { branch->video_capsfilter, branch->video_converter, branch->video_scaler,
+                                   branch->video_parser, branch->video_queue };
+        memcpy(track->elements, elements, sizeof(elements));
+        track->mixer_pad = branch->video_mixer_pad;
+        branch->video_capsfilter = branch->video_converter = branch->video_scaler = NULL;
+        branch->video_parser = branch->video_queue = NULL;
+        branch->video_mixer_pad = NULL;
+    } else {
+        GstElement *elements[] = { branch->audio_capsfilter, branch->audio_convert, branch->audio_resample,
+                                   branch->audio_parser, branch->audio_queue };
+        memcpy(track->elements, elements, sizeof(elements));
+        track->mixer_pad = branch->audio_mixer_pad;
+        branch->audio_capsfilter = branch->audio_convert = branch->audio_resample = NULL;
+        branch->audio_parser = branch->audio_queue = NULL;
+        branch->audio_mixer_pad = NULL;
+    }
+    // rejoining stalled sources read the decoder's pads from streaming threads
+    g_mutex_lock(&self->stats_lock);
+    if (video) {
+        track->decoder_pad = branch->video_decoder_pad;
+        branch->video_decoder_pad = NULL;
+    } else {
+        track->decoder_pad = branch->audio_decoder_pad;
+        branch->audio_decoder_pad = NULL;
+    }
+    g_mutex_unlock(&self->stats_lock);
+}
+
+void twitch_broadcaster_track_release(broadcaster_impl *self, branch_track *track) {
+    if (track->mixer_pad) {
+        // whatever still heads to the mixer is dropped instead of blocked: the decoder must
+        // neither fail with not-linked nor hang in a probe while it's shut down
+        GstPad *peer = gst_pad_get_peer(track->mixer_pad);
+        if (peer) {
+            gst_pad_add_probe(peer, GST_PAD_PROBE_TYPE_DATA_DOWNSTREAM, drop_probe, NULL, NULL);
+            gst_object_unref(peer);
+        }
+        // releasing flushes the pad, waking up a streaming thread waiting in the mixer
+        // (or the passthrough selector)
+        GstElement *mixer = gst_pad_get_parent_element(track->mixer_pad);
+        if (mixer) {
+            gst_element_release_request_pad(mixer, track->mixer_pad);
+            gst_object_unref(mixer);
+        }
+        gst_object_unref(track->mixer_pad);
+        track->mixer_pad = NULL;
+    }
+    // downstream first, so no streaming thread waits on an element that is already gone
+    for (guint i = 0; i < G_N_ELEMENTS(track->elements); i++) {
+        if (track->elements[i]) {
+            twitch_broadcaster_forget_qos(self, track->elements[i]);
+            gst_element_set_locked_state(track->elements[i], TRUE);
+            gst_element_set_state(track->elements[i], GST_STATE_NULL);
+            gst_bin_remove(GST_BIN(self->pipeline), track->elements[i]);
+            track->elements[i] = NULL;
+        }
+    }
+    if (track->decoder_pad) {
+        gst_object_unref(track->decoder_pad);
+        track->decoder_pad = NULL;
+    }
+}
+
+void twitch_broadcaster_branch_remove(broadcaster_impl *self, source_branch *branch) {
+    g_return_if_fail(self && branch);
+    branch_track tracks[2];
+    twitch_broadcaster_branch_take_track(self, branch, TRUE, &tracks[0]);
+    twitch_broadcaster_branch_take_track(self, branch, FALSE, &tracks[1]);
+    for (guint i = 0; i < G_N_ELEMENTS(tracks); i++) {
+        twitch_broadcaster_track_release(self, &tracks[i]);
+    }
+    if (branch->decoder) {
+        twitch_broadcaster_forget_qos(self, branch->decoder);
+        gst_element_set_locked_state(branch->decoder, TRUE);
+        gst_element_set_state(branch->decoder, GST_STATE_NULL);
+        gst_bin_remove(GST_BIN(self->pipeline), branch->decoder);
+        branch->decoder = NULL;
+    }
+}
+
+void twitch_broadcaster_remove_track(broadcaster_impl *self, guint index, gboolean video, branch_track *track) {
+    g_mutex_lock(&self->lock);
+    // the broadcast may have finished meanwhile, releasing it already
+    gboolean pending = g_ptr_array_remove(self->removed_tracks, track);
+    g_mutex_unlock(&self->lock);
+    if (!pending) {
+        return;
+    }
+    twitch_broadcaster_track_release(self, track);
+    g_free(track);
+    g_print("Source %u: %s track removed, its elements released\n", index, video ? "video" : "audio");
+}
+
+void twitch_broadcaster_discard_elements(broadcaster_impl *self, GstElement **elements, guint count) {
+    for (guint i = 0; i < count; i++) {
+        if (!elements[i]) {
+            continue;
+        }
+        if (GST_OBJECT_PARENT(elements[i])) {
+            gst_element_set_locked_state(elements[i], TRUE);
+            gst_element_set_state(elements[i], GST_STATE_NULL);
+            gst_bin_remove(GST_BIN(self->pipeline), elements[i]);
+        } else {
+            gst_object_unref(elements[i]);
+        }
+    }
+}
+
+void twitch_broadcaster_forget_qos(broadcaster_impl *self, GstElement *element) {
+    g_mutex_lock(&self->stats_lock);
+    g_hash_table_remove(self->qos_dropped, element);
+    if (GST_IS_BIN(element)) {
+        // decoders post QoS from the elements they plugged
+        GstIterator *children = gst_bin_iterate_recurse(GST_BIN(element));
+        GValue item = G_VALUE_INIT;
+        while (gst_iterator_next(children, &item) == GST_ITERATOR_OK) {
+            g_hash_table_remove(self->qos_dropped, g_value_get_object(&item));
+            g_value_reset(&item);
+        }
+        g_value_unset(&item);
+        gst_iterator_free(children);
+    }
+    g_mutex_unlock(&self->stats_lock);
+}
+
+// Creates all static pipeline elements based on the provided config
+gboolean twitch_broadcaster_create_elements(broadcaster_impl *self, Config *config) {
+    GstCaps *caps = NULL;
+    guint num_sources = 0;
+    g_return_val_if_fail(self && config->sources && config->sources[0], FALSE);
+
+    num_sources = g_strv_length(config->sources);
+    if (config->cache_dir && !(self->cache = source_cache_new(config->cache_dir, config->cache_max_bytes))) {
+        return FALSE;
+    }
+    self->prefetch_bytes = config->prefetch_bytes;
+    // sources' monitors are created with their branches
+    self->av_sync_max_offset_ms = config->av_sync_max_offset_ms;
+    self->av_sync_max_drift_ms_per_hour = config->av_sync_max_drift_ms_per_hour;
+    av_sync_monitor_set_limits(&self->av_sync, self->av_sync_max_offset_ms, self->av_sync_max_drift_ms_per_hour);
+    // remuxing and seeking a segment take the source's own decoder
+    self->registry = (config->passthrough && num_sources == 1) || config->segment_start_ns || config->segment_stop_ns ?
+            NULL : config->registry;
+    self->branches = g_ptr_array_new_full(num_sources, (GDestroyNotify)twitch_broadcaster_branch_free);
+    for (guint i = 0; i < num_sources; i++) {
+        source_branch *branch = twitch_broadcaster_branch_new(self, i, config->sources[i], 0);
+        if (!branch) {
+            g_printerr("Failed to create decoder for source %u.\n", i);
+            return FALSE;
+        }
+        g_ptr_array_add(self->branches, branch);
+    }
+
+    // Output canvas and position of every source on it
+    self->width = config->width ? config->width : LAYOUT_DEFAULT_WIDTH;
+    self->height = config->height ? config->height : LAYOUT_DEFAULT_HEIGHT;
+    self->fps = config->fps ? config->fps : LAYOUT_DEFAULT_FPS;
+    self->low_latency = config->low_latency != 0;
+    self->always_scale = config->always_scale != 0;
+    if (config->task_pool) {
+        self->task_pool = gst_object_ref(config->task_pool);
+    }
+    self->latency.frame_duration = GST_SECOND / self->fps;
+    for (guint i = 0; i < STAGE_COUNT; i++) {
+        self->stages[i].latency.frame_duration = self->latency.frame_duration;
+    }
+    layout_tile *tiles = g_new0(layout_tile, num_sources);
+    if (!layout_compute(config->layout, self->width, self->height, num_sources, tiles)) {
+        g_printerr("Can't lay out %u sources on %dx%d canvas.\n", num_sources, self->width, self->height);
+        g_free(tiles);
+        return FALSE;
+    }
+    for (guint i = 0; i < num_sources; i++) {
+        source_branch *branch = g_ptr_array_index(self->branches, i);
+        branch->tile = tiles[i];
+        branch->scaler_latency.frame_duration = GST_SECOND / self->fps;
+    }
+    // fast start mixes live, behind the stall fallback, which is only ever enabled explicitly
+    self->fast_start = config->fast_start != 0;
+    gint stall_timeout_ms = config->stall_timeout_ms;
+    if (self->fast_start && stall_timeout_ms <= 0) {
+        g_printerr("Fast start needs a stall timeout, the live mix shows the slate for late sources.\n");
+        g_free(tiles);
+        return FALSE;
+    }
+    // opaque tiles side by side are copied into place, overlays need the generic compositor
+    // and so does the stall fallback, whose slate lies under all tiles
+    gboolean tiled = tile_compositor_supports_layout(tiles, num_sources) && stall_timeout_ms <= 0 &&
+            tile_compositor_register();
+    g_free(tiles);
+
+    self->video_mixer = gst_element_factory_make(tiled ? TILE_COMPOSITOR_FACTORY : "compositor", "video_mixer");
+    self->audio_mixer = gst_element_factory_make("audiomixer", "audio_mixer");
+    self->video_capsfilter = gst_element_factory_make("capsfilter","video_mixer_capsfilter");
+    gchar *caps_str = g_strdup_printf(VIDEO_CAPS, self->width, self->height, self->fps);
+    caps = gst_caps_from_string(caps_str);
+    g_free(caps_str);
+    g_object_set (self->video_capsfilter, "caps", caps, NULL);
+    gst_caps_unref(caps);
+
+    self->video_tee = gst_element_factory_make("tee", "video_tee");
+    self->audio_queue = gst_element_factory_make("queue", "audio_encoder_queue");
+    self->aac_encoder = gst_element_factory_make("avenc_aac", "aac_encoder");
+    self->audio_tee = gst_element_factory_make("tee", "audio_tee");
+
+    // Composited once, encoded once per rendition and written to every output of it.
+    // Without a ladder the canvas is the only rendition and, without explicit outputs,
+    // the legacy file_sink / rtmp_address pair describes its only output.
+    Output legacy_output = { 0 };
+    Rendition canvas_rendition = { self->width, self->height, 0, config->outputs, config->num_outputs };
+    Rendition *renditions = config->renditions;
+    guint num_renditions = config->num_renditions;
+    if (!num_renditions) {
+        if (!canvas_rendition.num_outputs) {
+            legacy_output.type = config->file_sink ? OUTPUT_FILE : OUTPUT_RTMP;
+            legacy_output.location = config->file_sink ? config->file_sink : config->rtmp_address;
+            canvas_rendition.outputs = &legacy_output;
+            canvas_rendition.num_outputs = 1;
+        }
+        renditions = &canvas_rendition;
+        num_renditions = 1;
+    }
+    guint num_outputs = 0;
+    for (guint i = 0; i < num_renditions; i++) {
+        if (!renditions[i].num_outputs || !renditions[i].outputs) {
+            g_printerr("Rendition %u has no outputs.\n", i);
+            return FALSE;
+        }
+        num_outputs += renditions[i].num_outputs;
+    }
+    self->renditions = g_ptr_array_new_full(num_renditions, (GDestroyNotify)rendition_free);
+    self->outputs = g_ptr_array_new_full(num_outputs, NULL);
+    for (guint i = 0; i < num_renditions; i++) {
+        broadcaster_rendition *rendition = rendition_new(i,
+                renditions[i].width ? renditions[i].width : self->width,
+                renditions[i].height ? renditions[i].height : self->height,
+                renditions[i].bitrate);
+        if (!rendition) {
+            g_printerr("Failed to create rendition %u.\n", i);
+            return FALSE;
+        }
+        g_ptr_array_add(self->renditions, rendition);
+        if (config->adaptive_bitrate) {
+            rendition_enable_adaptive_bitrate(rendition, config->min_bitrate > 0 ? config->min_bitrate : 0);
+        }
+        for (guint j = 0; j < renditions[i].num_outputs; j++) {
+            // a single output keeps back pressure, several must not stall each other
+            broadcaster_output *output = output_new(&renditions[i].outputs[j], self->outputs->len, num_outputs > 1);
+            if (!output) {
+                g_printerr("Failed to create output %u of rendition %u.\n", j, i);
+                return FALSE;
+            }
+            g_ptr_array_add(rendition->outputs, output);
+            g_ptr_array_add(self->outputs, output);
+        }
+    }
+
+    self->pipeline = gst_pipeline_new("test-pipeline");
+    if (!self->pipeline || !self->video_mixer || !self->video_capsfilter || !self->video_tee
+        || !self->audio_queue || !self->aac_encoder || !self->audio_tee || !self->audio_mixer) {
+        g_printerr ("Not all elements could be created.\n");
+        return FALSE;
+    }
+    //Black background, tilecompositor fills only what tiles don't cover
+    if (!tiled) {
+        g_object_set (self->video_mixer, "background", 1, NULL);
+    }
+    if (self->low_latency) {
+        twitch_broadcaster_configure_low_latency(self);
+    }
+    if (config->keyframe_interval > 0) {
+        for (guint i = 0; i < self->renditions->len; i++) {
+            g_object_set(((broadcaster_rendition *)g_ptr_array_index(self->renditions, i))->encoder,
+                         "key-int-max", config->keyframe_interval, NULL);
+        }
+    }
+    // renditions share the broadcaster's threads
+    guint encoder_threads = config->encoder_threads > 0 ?
+            MAX((guint)config->encoder_threads / self->renditions->len, 1) : 0;
+    if (encoder_threads) {
+        for (guint i = 0; i < self->renditions->len; i++) {
+            g_object_set(((broadcaster_rendition *)g_ptr_array_index(self->renditions, i))->encoder,
+                         "threads", encoder_threads, NULL);
+        }
+    }
+    self->memory_limit = config->memory_budget;
+    if (self->memory_limit && !self->low_latency) {
+        // x264 holds about its lookahead plus a frame per thread, the lookahead gets three
+        // quarters of the encoder's share (the queue in front of it the rest)
+        guint encoder_bytes = memory_share(self->memory_limit, 4, self->renditions->len + 1);
+        guint threads = encoder_threads ? encoder_threads : g_get_num_processors();
+        for (guint i = 0; i < self->renditions->len; i++) {
+            broadcaster_rendition *rendition = g_ptr_array_index(self->renditions, i);
+            guint64 frame_bytes = (guint64)rendition->width * rendition->height * 3 / 2;
+            gint frames = (gint)(encoder_bytes * 3 / 4 / frame_bytes) - (gint)threads;
+            if (frames < X264_DEFAULT_LOOKAHEAD) {
+                g_object_set(rendition->encoder, "rc-lookahead", MAX(frames, 0), NULL);
+            }
+        }
+    }
+    // remuxing needs a single source going to a single rendition of the canvas' size, segments
+    // are cut at the encoder's keyframes
+    broadcaster_rendition *primary = g_ptr_array_index(self->renditions, 0);
+    self->passthrough = config->passthrough && num_sources == 1 && self->renditions->len == 1 &&
+            primary->width == self->width && primary->height == self->height && stall_timeout_ms <= 0 &&
+            !config->segment_start_ns && !config->segment_stop_ns;
+    if (config->passthrough && !self->passthrough) {
+        g_print("Passthrough needs a single source, a single rendition of the canvas' size, no stall timeout, "
+                "no fast start and no segment.\n");
+    }
+    if (self->passthrough) {
+        if (!rendition_enable_passthrough(primary)) {
+            return FALSE;
+        }
+        // a source replacing a remuxed one starts at the current position, not at 0
+        GstElement *aggregators[] = { self->video_mixer, self->audio_mixer };
+        for (guint i = 0; i < G_N_ELEMENTS(aggregators); i++) {
+            gst_util_set_object_arg(G_OBJECT(aggregators[i]), "start-time-selection", "first");
+        }
+    }
+    // a live mix has no timeline to seek in
+    self->segmented = (config->segment_start_ns || config->segment_stop_ns) && stall_timeout_ms <= 0;
+    if ((config->segment_start_ns || config->segment_stop_ns) && !self->segmented) {
+        g_printerr("Rendering a segment needs an offline mix, without stall timeout and fast start.\n");
+        return FALSE;
+    }
+    self->segment_start = config->segment_start_ns;
+    self->segment_stop = config->segment_stop_ns;
+    if (self->segment_stop && self->segment_stop <= self->segment_start) {
+        g_printerr("Segment ends before it starts.\n");
+        return FALSE;
+    }
+    if (stall_timeout_ms > 0 && !twitch_broadcaster_create_fallback(self, stall_timeout_ms * GST_MSECOND)) {
+        return FALSE;
+    }
+    if (!twitch_broadcaster_configure_affinity(self, config)) {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+gboolean twitch_broadcaster_configure_affinity(broadcaster_impl *self, Config *config) {
+    if (!config->source_cpus && !config->encoder_cpus) {
+        return TRUE;
+    }
+    if (config->source_cpus && !(self->source_cpus = affinity_set_from_string(config->source_cpus))) {
+        g_printerr("Malformed CPU list: %s\n", config->source_cpus);
+        return FALSE;
+    }
+    if (config->encoder_cpus && !(self->encoder_cpus = affinity_set_from_string(config->encoder_cpus))) {
+        g_printerr("Malformed CPU list: %s\n", config->encoder_cpus);
+        return FALSE;
+    }
+    // threads are reused between tasks, those without a set get all CPUs back
+    self->all_cpus = affinity_set_all();
+    return TRUE;
+}
+
+void twitch_broadcaster_pin_thread(broadcaster_impl *self, GstElement *owner) {
+    // encoders run in the streaming thread of the queue in front of them
+    gboolean encoder = owner == self->audio_queue;
+    for (guint i = 0; i < self->renditions->len && !encoder; i++) {
+        encoder = owner == ((broadcaster_rendition *)g_ptr_array_index(self->renditions, i))->video_queue;
     }
-    if (!twitch_broadcaster_configure_pipeline(self->impl)) {
-        return -1;
+    affinity_set *cpus = encoder ? self->encoder_cpus : self->source_cpus;
+    if (affinity_pin_current_thread(cpus ? cpus : self->all_cpus)) {
+        if (cpus) {
+            g_atomic_int_inc(&self->pinned_threads);
+        }
+    } else {
+        g_printerr("Failed to pin streaming thread of %s\n", owner ? GST_ELEMENT_NAME(owner) : "unknown element");
     }
-    self->impl->initialized = TRUE;
-    return 0;
 }
 
-int twitch_broadcaster_run(twitch_broadcaster *self) {
-    GstBus *bus = NULL;
-    GstMessage *msg = NULL;
-    gboolean terminate = FALSE;
-    int res = 0;
+gboolean twitch_broadcaster_create_fallback(broadcaster_impl *self, GstClockTime stall_timeout) {
+    self->slate = gst_element_factory_make("videotestsrc", "slate");
+    self->slate_capsfilter = gst_element_factory_make("capsfilter", "slate_capsfilter");
+    self->silence = gst_element_factory_make("audiotestsrc", "silence");
+    self->silence_capsfilter = gst_element_factory_make("capsfilter", "silence_capsfilter");
+    if (!self->slate || !self->slate_capsfilter || !self->silence || !self->silence_capsfilter) {
+        g_printerr("Failed to create slate and silence.\n");
+        return FALSE;
+    }
+    self->stall_timeout = stall_timeout;
+    // live sources make the mixers live: they produce output on time and go on
+    // without pads that have no data by the deadline
+    g_object_set(self->slate, "is-live", TRUE, NULL);
+    gst_util_set_object_arg(G_OBJECT(self->slate), "pattern", SLATE_PATTERN);
+    g_object_set(self->silence, "is-live", TRUE, NULL);
+    gst_util_set_object_arg(G_OBJECT(self->silence), "wave", SILENCE_WAVE);
+    gchar *caps_str = g_strdup_printf(VIDEO_CAPS, self->width, self->height, self->fps);
+    GstCaps *caps = gst_caps_from_string(caps_str);
+    g_free(caps_str);
+    g_object_set(self->slate_capsfilter, "caps", caps, NULL);
+    gst_caps_unref(caps);
+    caps = gst_caps_from_string(AUDIO_CAPS);
+    g_object_set(self->silence_capsfilter, "caps", caps, NULL);
+    gst_caps_unref(caps);
+    // the deadline: how long the mixers wait for a source's data
+    g_object_set(self->video_mixer, "latency", stall_timeout, NULL);
+    g_object_set(self->audio_mixer, "latency", stall_timeout, NULL);
+    return TRUE;
+}
 
-    g_return_val_if_fail(self && self->impl->initialized, -1);
-    GstStateChangeReturn ret = gst_element_set_state(self->impl->pipeline, GST_STATE_PLAYING);
-    if (ret == GST_STATE_CHANGE_FAILURE) {
-        g_printerr ("Unable to set the pipeline to the playing state.\n");
-        gst_object_unref (self->impl->pipeline);
-        return -1;
+void twitch_broadcaster_end_fallback(broadcaster_impl *self) {
+    gboolean ended = TRUE;
+    g_mutex_lock(&self->lock);
+    if (!self->pipeline || !self->stall_timeout || self->fallback_ended) {
+        g_mutex_unlock(&self->lock);
+        return;
+    }
+    g_mutex_lock(&self->stats_lock);
+    for (guint i = 0; ended && i < self->branches->len; i++) {
+        source_branch *branch = g_ptr_array_index(self->branches, i);
+        // a slot left empty by a failed replacement has nothing to wait for, a source still
+        // discovering its tracks does
+        if (branch->removed) {
+            continue;
+        }
+        ended = (branch->video_decoder_pad || branch->audio_decoder_pad) &&
+                (!branch->video_decoder_pad || branch->video_eos) &&
+                (!branch->audio_decoder_pad || branch->audio_eos);
+    }
+    g_mutex_unlock(&self->stats_lock);
+    self->fallback_ended = ended;
+    g_mutex_unlock(&self->lock);
+    if (ended) {
+        // live sources push EOS from their own streaming threads
+        g_print("All sources ended, ending the slate and silence\n");
+        gst_element_send_event(self->slate, gst_event_new_eos());
+        gst_element_send_event(self->silence, gst_event_new_eos());
     }
+}
 
-    // pop and react on messages appearing on the pipeline's bus
-    bus = gst_element_get_bus(self->impl->pipeline);
-    do {
-        msg = gst_bus_timed_pop_filtered(bus,
-                GST_CLOCK_TIME_NONE,
-                GST_MESSAGE_ERROR | GST_MESSAGE_EOS | GST_MESSAGE_STATE_CHANGED);
-        if (msg) {
-            GError *error = NULL;
-            gchar *debug_info = NULL;
+void twitch_broadcaster_check_liveness(broadcaster_impl *self, gint64 now) {
+    // never holds up the mixer, the next frame checks again
+    if (!g_mutex_trylock(&self->lock)) {
+        return;
+    }
+    gint64 timeout_us = self->stall_timeout / GST_USECOND;
+    g_mutex_lock(&self->stats_lock);
+    for (guint i = 0; i < self->branches->len; i++) {
+        source_branch *branch = g_ptr_array_index(self->branches, i);
+        // sources that haven't started or already ended don't stall
+        if (branch->stalled || branch->video_eos || !branch->last_frame_time ||
+            now - branch->last_frame_time <= timeout_us) {
+            continue;
+        }
+        branch->stalled = TRUE;
+        branch->stalls++;
+        branch->stall_start = branch->last_frame_time;
+        g_print("Source %u stalled, no frame for %.1f ms\n", branch->index, (now - branch->last_frame_time) / 1000.0);
+        twitch_broadcaster_post_source_event(self, branch->index, FALSE);
+    }
+    g_mutex_unlock(&self->stats_lock);
+    g_mutex_unlock(&self->lock);
+}
 
-            switch (GST_MESSAGE_TYPE(msg)) {
-                case GST_MESSAGE_ERROR:
-                    gst_message_parse_error(msg, &error, &debug_info);
-                    g_printerr("Error received from element %s: %s\n", GST_OBJECT_NAME (msg->src), error->message);
-                    g_printerr("Debugging information: %s\n", debug_info ? debug_info : "none");
-                    g_clear_error(&error);
-                    g_free(debug_info);
-                    terminate = TRUE;
-                    res = -1;
-                    break;
-                case GST_MESSAGE_EOS:
-                    g_print("End-Of-Stream reached.\n");
-                    terminate = TRUE;
-                    break;
-                case GST_MESSAGE_STATE_CHANGED:
-                    if (GST_MESSAGE_SRC (msg) == GST_OBJECT (self->impl->pipeline)) {
-                        GstState old_state, new_state, pending_state;
-                        gst_message_parse_state_changed (msg, &old_state, &new_state, &pending_state);
-                        g_print("Pipeline state changed from %s to %s:\n",
-                                 gst_element_state_get_name (old_state), gst_element_state_get_name (new_state));
-                        GST_DEBUG_BIN_TO_DOT_FILE_WITH_TS(GST_BIN(self->impl->pipeline),
-                                GST_DEBUG_GRAPH_SHOW_ALL,
-                                "pipeline");
-                    }
-                    break;
-                default:
-                    /* We should not reach here */
-                    g_printerr ("Unexpected message received.\n");
-                    break;
+void twitch_broadcaster_branch_rejoin(broadcaster_impl *self, source_branch *branch, GstClockTime running_time, gint64 now) {
+    g_mutex_lock(&self->stats_lock);
+    if (!branch->stalled) {
+        g_mutex_unlock(&self->stats_lock);
+        return;
+    }
+    branch->stalled = FALSE;
+    branch->stalled_us += now - branch->stall_start;
+    // a source that paused is behind the mix by about the time it was gone, its frames
+    // would be dropped as late until it caught up. Shifting both tracks keeps A/V in sync.
+    GstClockTimeDiff lag = GST_CLOCK_TIME_IS_VALID(running_time) ?
+            GST_CLOCK_DIFF(running_time, self->mixer_position) : 0;
+    if (lag > (GstClockTimeDiff)(GST_SECOND / self->fps)) {
+        branch->ts_offset += lag;
+        GstPad *pads[] = { branch->video_decoder_pad, branch->audio_decoder_pad };
+        for (guint i = 0; i < G_N_ELEMENTS(pads); i++) {
+            if (pads[i]) {
+                gst_pad_set_offset(pads[i], branch->ts_offset);
             }
-            gst_message_unref (msg);
         }
-    } while(!terminate);
-
-    /* Free resources */
-    gst_object_unref (bus);
-    gst_element_set_state (self->impl->pipeline, GST_STATE_NULL);
-    gst_object_unref (self->impl->pipeline);
-    return res;
+    }
+    g_print("Source %u rejoined after %.1f ms, %.1f ms behind the mix\n", branch->index,
+            (now - branch->stall_start) / 1000.0, MAX(lag, 0) / 1e6);
+    twitch_broadcaster_post_source_event(self, branch->index, TRUE);
+    g_mutex_unlock(&self->stats_lock);
 }
 
-void twitch_broadcaster_destroy(twitch_broadcaster *self) {
-    if (self && self->impl) {
-        if (self->impl->initialized) {
-            g_mutex_clear(&(self->impl->lock));
-        }
-        g_free(self->impl);
-        self->impl = NULL;
+void twitch_broadcaster_branch_count_frame(broadcaster_impl *self, source_branch *branch, gint64 now) {
+    g_mutex_lock(&self->stats_lock);
+    branch->last_frame_time = now;
+    if (branch->video_frames++ == 0 && branch->swap_time) {
+        branch->swap_glitch_us = now - branch->swap_time;
+        branch->swap_glitch_frames = self->mixer_frames - branch->swap_mixer_frames;
     }
-    g_free(self);
+    g_mutex_unlock(&self->stats_lock);
 }
 
-//----------------------------------------------------------------------------------------
-// Helpers && callbacks impl
+void twitch_broadcaster_post_source_event(broadcaster_impl *self, guint index, gboolean added) {
+    GstElement *pipeline = self->pipeline;
+    if (!pipeline) {
+        return;
+    }
+    GstStructure *structure = gst_structure_new(SOURCE_EVENT_MESSAGE, "index", G_TYPE_UINT, index,
+                                                "added", G_TYPE_BOOLEAN, added, NULL);
+    gst_element_post_message(pipeline, gst_message_new_application(GST_OBJECT(pipeline), structure));
+}
 
-static void pad_added_handler (GstElement *src, GstPad *new_pad, broadcaster_impl *data) {
-    GstCaps *new_pad_caps = NULL;
-    GstStructure *new_pad_struct = NULL;
-    const gchar *new_pad_type = NULL;
+void twitch_broadcaster_post_av_sync_alarm(broadcaster_impl *self, gint source) {
+    GstElement *pipeline = self->pipeline;
+    if (!pipeline) {
+        return;
+    }
+    GstStructure *structure = gst_structure_new(AV_SYNC_ALARM_MESSAGE, "source", G_TYPE_INT, source, NULL);
+    gst_element_post_message(pipeline, gst_message_new_application(GST_OBJECT(pipeline), structure));
+}
 
-    g_print("Received new pad '%s' from '%s':\n", GST_PAD_NAME (new_pad), GST_ELEMENT_NAME (src));
+void twitch_broadcaster_report_av_sync_alarm(broadcaster_impl *self, gint source) {
+    av_sync_stats stats;
+    g_mutex_lock(&self->lock);
+    if (source >= 0 && (guint)source >= self->branches->len) {
+        g_mutex_unlock(&self->lock);
+        return;
+    }
+    // a replaced source's alarm is reported against its replacement's counters
+    av_sync_monitor_read(source < 0 ? &self->av_sync :
+                         &((source_branch *)g_ptr_array_index(self->branches, source))->av_sync, &stats);
+    g_mutex_unlock(&self->lock);
+    if (source < 0) {
+        g_printerr("A/V sync alarm on the muxer's input: audio %+.1f ms against video, drifting %+.1f ms/h\n",
+                   stats.offset_ms, stats.drift_ms_per_hour);
+    } else {
+        g_printerr("A/V sync alarm on source %d: audio %+.1f ms against video, drifting %+.1f ms/h\n",
+                   source, stats.offset_ms, stats.drift_ms_per_hour);
+    }
+    if (self->callbacks.av_sync_alarm) {
+        self->callbacks.av_sync_alarm(self->instance, source, &stats, self->user_data);
+    }
+}
 
-    new_pad_caps = gst_pad_get_current_caps (new_pad);
-    new_pad_struct = gst_caps_get_structure (new_pad_caps, 0);
-    new_pad_type = gst_structure_get_name (new_pad_struct);
+void twitch_broadcaster_seek_source(broadcaster_impl *self, guint index) {
+    GstPad *pads[2] = { NULL, NULL };
+    g_mutex_lock(&self->lock);
+    source_branch *branch = index < self->branches->len ? g_ptr_array_index(self->branches, index) : NULL;
+    if (branch && !branch->swaps) {
+        pads[0] = branch->video_decoder_pad ? gst_object_ref(branch->video_decoder_pad) : NULL;
+        pads[1] = branch->audio_decoder_pad ? gst_object_ref(branch->audio_decoder_pad) : NULL;
+    }
+    g_mutex_unlock(&self->lock);
+    if (!pads[0] && !pads[1]) {
+        return;
+    }
+    // one seek moves every track of the source, accurate so the decoders clip at the start
+    GstEvent *seek = gst_event_new_seek(1.0, GST_FORMAT_TIME, GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_ACCURATE,
+                                        GST_SEEK_TYPE_SET, self->segment_start,
+                                        self->segment_stop ? GST_SEEK_TYPE_SET : GST_SEEK_TYPE_NONE,
+                                        self->segment_stop ? self->segment_stop : GST_CLOCK_TIME_NONE);
+    if (!gst_pad_send_event(pads[0] ? pads[0] : pads[1], seek)) {
+        // e.g. it ends before the segment, as in a full render its tiles stay empty
+        g_print("Source %u can't be seeked to %.3f s, ending it\n", index,
+                (gdouble)self->segment_start / GST_SECOND);
+        for (guint i = 0; i < G_N_ELEMENTS(pads); i++) {
+            GstPad *peer = pads[i] ? gst_pad_get_peer(pads[i]) : NULL;
+            if (peer) {
+                gst_pad_send_event(peer, gst_event_new_eos());
+                gst_object_unref(peer);
+            }
+        }
+    }
+    for (guint i = 0; i < G_N_ELEMENTS(pads); i++) {
+        if (pads[i]) {
+            gst_object_unref(pads[i]);
+        }
+    }
+}
 
-    g_mutex_lock(&data->lock);
-    if (g_str_has_prefix (new_pad_type, "video/x-raw")) {
-        twitch_broadcaster_wire_new_video_track(data, new_pad);
+static guint memory_share(guint64 limit, guint divisor, guint count) {
+    return (guint)CLAMP(limit / divisor / MAX(count, 1), MIN_BUFFER_BYTES, G_MAXINT);
+}
 
-    } else if (g_str_has_prefix (new_pad_type, "audio/x-raw")) {
-        twitch_broadcaster_wire_new_audio_track(data, new_pad);
+void twitch_broadcaster_limit_source_buffering(broadcaster_impl *self, GstElement *element) {
+    GstElementFactory *factory = gst_element_get_factory(element);
+    if (!factory || !self->memory_limit) {
+        return;
     }
-    if (new_pad_caps != NULL) {
-        gst_caps_unref(new_pad_caps);
+    const gchar *name = GST_OBJECT_NAME(factory);
+    // half of a source's share, its queues get the other half
+    guint source_bytes = memory_share(self->memory_limit, 2, self->branches->len) / 2;
+    if (g_str_equal(name, "uridecodebin")) {
+        // download buffering of network sources, prefetching no more than configured
+        if (self->prefetch_bytes) {
+            source_bytes = (guint)MIN(source_bytes, self->prefetch_bytes);
+        }
+        g_object_set(element, "buffer-size", (gint)source_bytes, NULL);
+    } else if (g_str_equal(name, "decodebin")) {
+        // demuxed data waiting in decodebin's multiqueue
+        g_object_set(element, "max-size-bytes", source_bytes, NULL);
+    } else if (g_str_equal(name, "appsrc") && self->registry) {
+        // raw data a shared decoder handed over, per track
+        g_object_set(element, "max-bytes", (guint64)source_bytes / 2, NULL);
     }
-    g_mutex_unlock(&data->lock);
 }
 
-// Creates all static pipeline elements based on the provided config
-gboolean twitch_broadcaster_create_elements(broadcaster_impl *self, Config *config) {
-    GstCaps *caps = NULL;
-    g_return_val_if_fail(self && config->source1 && config->source2 && config->source3, FALSE);
-    self->source = gst_element_factory_make("uridecodebin", "source");
-    self->source1 = gst_element_factory_make("uridecodebin", "source1");
-    self->source2 = gst_element_factory_make("uridecodebin", "source2");
+void twitch_broadcaster_add_source_queue(broadcaster_impl *self, GstElement *queue) {
+    memory_gauge_watch_queue(&self->memory[MEMORY_SOURCES], queue);
+    if (self->memory_limit) {
+        // a quarter of the source's share for each of its tracks
+        g_object_set(queue, "max-size-bytes", memory_share(self->memory_limit, 2, self->branches->len) / 4, NULL);
+    }
+}
 
-    self->video_mixer = gst_element_factory_make("compositor", "video_mixer");
-    self->audio_mixer = gst_element_factory_make("audiomixer", "audio_mixer");
-    self->video_capsfilter = gst_element_factory_make("capsfilter","video_mixer_capsfilter");
-    caps = gst_caps_from_string(VIDEO_CAPS);
-    g_object_set (self->video_capsfilter, "caps", caps, NULL);
-    gst_caps_unref(caps);
+void twitch_broadcaster_apply_memory_limit(broadcaster_impl *self) {
+    guint output_bytes = memory_share(self->memory_limit, 4, self->outputs->len);
+    for (guint i = 0; i < self->outputs->len; i++) {
+        broadcaster_output *output = g_ptr_array_index(self->outputs, i);
+        if (!output->detached) {
+            output_set_queue_limits(output, 0, output_bytes);
+        }
+    }
+    // every rendition's video encoder and the audio encoder, x264's lookahead took the
+    // rest of a video encoder's share when it was created
+    guint encoder_bytes = memory_share(self->memory_limit, 4, self->renditions->len + 1);
+    for (guint i = 0; i < self->renditions->len; i++) {
+        broadcaster_rendition *rendition = g_ptr_array_index(self->renditions, i);
+        g_object_set(rendition->video_queue, "max-size-bytes", encoder_bytes / 4, NULL);
+    }
+    g_object_set(self->audio_queue, "max-size-bytes", encoder_bytes, NULL);
+    guint source_bytes = memory_share(self->memory_limit, 2, self->branches->len) / 4;
+    for (guint i = 0; i < self->branches->len; i++) {
+        source_branch *branch = g_ptr_array_index(self->branches, i);
+        GstElement *queues[] = { branch->video_queue, branch->audio_queue };
+        for (guint j = 0; j < G_N_ELEMENTS(queues); j++) {
+            if (queues[j]) {
+                g_object_set(queues[j], "max-size-bytes", source_bytes, NULL);
+            }
+        }
+    }
+    // decoders of every source, including the ones inside uridecodebin
+    if (self->pipeline) {
+        GstIterator *elements = gst_bin_iterate_recurse(GST_BIN(self->pipeline));
+        GValue item = G_VALUE_INIT;
+        while (gst_iterator_next(elements, &item) == GST_ITERATOR_OK) {
+            twitch_broadcaster_limit_source_buffering(self, g_value_get_object(&item));
+            g_value_reset(&item);
+        }
+        g_value_unset(&item);
+        gst_iterator_free(elements);
+    }
+}
 
-    self->x264_encoder = gst_element_factory_make("x264enc", "video-enc-1");
-    self->aac_encoder = gst_element_factory_make("avenc_aac", "aac_encoder");
+void twitch_broadcaster_finish(broadcaster_impl *self, int result) {
+    g_source_destroy(self->bus_watch);
+    g_source_unref(self->bus_watch);
+    self->bus_watch = NULL;
+    if (self->bitrate_source) {
+        g_source_destroy(self->bitrate_source);
+        g_source_unref(self->bitrate_source);
+        self->bitrate_source = NULL;
+    }
 
-    self->flv_muxer = gst_element_factory_make("flvmux", "muxer");
-    self->queue = gst_element_factory_make("queue", "buffer");
+    broadcaster_stats stats;
+    twitch_broadcaster_get_stats(self->instance, &stats);
+    g_print("Encoded %" G_GUINT64_FORMAT " frames, pipeline latency: average %.1f ms, max %.1f ms\n",
+            stats.stages[STAGE_ENCODER].buffers,
+            stats.pipeline_latency_us / 1000.0, stats.max_pipeline_latency_us / 1000.0);
+    if (self->cache) {
+        cache_stats cache;
+        source_cache_get_stats(self->cache, &cache);
+        g_print("Source cache: %u hits, %u misses, %.1f MB read from the cache, %.1f MB stored, %u evicted\n",
+                cache.hits, cache.misses, cache.bytes_saved / 1e6, cache.bytes_stored / 1e6, cache.evicted);
+    }
 
-    if (config->file_sink) {
-        self->sink = gst_element_factory_make("filesink", "file-sink");
-        g_object_set(self->sink, "location", config->file_sink, NULL);
-    } else {
-        self->sink = gst_element_factory_make("rtmpsink", "rtmp-sink");
-        g_object_set(self->sink, "location", config->rtmp_address, NULL);
+    gst_element_set_state (self->pipeline, GST_STATE_NULL);
+    // tracks whose removal didn't make it through the bus
+    g_mutex_lock(&self->lock);
+    GPtrArray *removed_tracks = self->removed_tracks;
+    self->removed_tracks = g_ptr_array_new();
+    g_mutex_unlock(&self->lock);
+    for (guint i = 0; i < removed_tracks->len; i++) {
+        twitch_broadcaster_track_release(self, g_ptr_array_index(removed_tracks, i));
+        g_free(g_ptr_array_index(removed_tracks, i));
     }
+    g_ptr_array_free(removed_tracks, TRUE);
+    g_mutex_lock(&self->lock);
+    for (guint i = 0; i < self->outputs->len; i++) {
+        output_stop(g_ptr_array_index(self->outputs, i));
+    }
+    gst_object_unref (self->pipeline);
+    self->pipeline = NULL;
+    g_mutex_unlock(&self->lock);
+    // other broadcasters' shared decoders don't wait for this one anymore, their
+    // streaming threads may need the lock
+    for (guint i = 0; i < self->branches->len; i++) {
+        source_branch *branch = g_ptr_array_index(self->branches, i);
+        source_registry_unsubscribe(branch->shared);
+        branch->shared = NULL;
+    }
+    if (self->callbacks.finished) {
+        self->callbacks.finished(self->instance, result, self->user_data);
+    }
+}
 
-    self->pipeline = gst_pipeline_new("test-pipeline");
-    if (!self->pipeline || !self->source || !self->source1 || !self->source2 || !self->video_mixer
-        || !self->video_capsfilter || !self->x264_encoder || !self->flv_muxer
-        || !self->queue || !self->sink || !self->aac_encoder || !self->audio_mixer) {
-        g_printerr ("Not all elements could be created.\n");
-        return FALSE;
+void twitch_broadcaster_configure_low_latency(broadcaster_impl *self) {
+    // no lookahead, no B-frames, sliced threads instead of frame threads
+    for (guint i = 0; i < self->renditions->len; i++) {
+        broadcaster_rendition *rendition = g_ptr_array_index(self->renditions, i);
+        gst_util_set_object_arg(G_OBJECT(rendition->encoder), "tune", "zerolatency");
+        g_object_set(rendition->encoder,
+                     "bframes", 0,
+                     "rc-lookahead", 0,
+                     "sync-lookahead", 0,
+                     "sliced-threads", TRUE,
+                     "key-int-max", self->fps * LOW_LATENCY_KEYFRAME_SECONDS, NULL);
+        gst_util_set_object_arg(G_OBJECT(rendition->muxer), "start-time-selection", "first");
+        g_object_set(rendition->muxer, "latency", LOW_LATENCY_AGGREGATOR_LATENCY, "streamable", TRUE, NULL);
+    }
+    // aggregators start with the first buffer instead of waiting from running time 0
+    // and don't add any latency on top of upstream's
+    GstElement *aggregators[] = { self->video_mixer, self->audio_mixer };
+    for (guint i = 0; i < G_N_ELEMENTS(aggregators); i++) {
+        gst_util_set_object_arg(G_OBJECT(aggregators[i]), "start-time-selection", "first");
+        g_object_set(aggregators[i], "latency", LOW_LATENCY_AGGREGATOR_LATENCY, NULL);
+    }
+    for (guint i = 0; i < self->outputs->len; i++) {
+        output_set_queue_limits(g_ptr_array_index(self->outputs, i), LOW_LATENCY_QUEUE_TIME, 0);
     }
-    g_object_set(self->source, "uri", config->source1, NULL);
-    g_object_set(self->source1, "uri", config->source2, NULL);
-    g_object_set(self->source2, "uri", config->source3, NULL);
-    //Black background
-    g_object_set (self->video_mixer, "background", 1, NULL);
-    // Decouple rtmpsink from the rest of the pipeline
-    g_object_set(self->queue, "max-size-time", 5 * GST_SECOND, NULL);
-    return TRUE;
 }
 
 // Adds created elements to the pipeline and links them. To be called once after
 // twitch_broadcaster_create_elements
 gboolean twitch_broadcaster_configure_pipeline(broadcaster_impl *self) {
     g_return_val_if_fail(self, FALSE);
+    // memory limits reach into decoders created later on
+    g_signal_connect(self->pipeline, "deep-element-added", G_CALLBACK(deep_element_added_handler), self);
     // Add all elements to the pipeline
+    for (guint i = 0; i < self->branches->len; i++) {
+        source_branch *branch = g_ptr_array_index(self->branches, i);
+        gst_bin_add(GST_BIN(self->pipeline), branch->decoder);
+    }
     gst_bin_add_many(GST_BIN(self->pipeline),
-                     self->source, self->source1, self->source2,
                      self->video_mixer,
                      self->video_capsfilter,
+                     self->video_tee,
                      self->audio_mixer,
-                     self->x264_encoder,
+                     self->audio_queue,
                      self->aac_encoder,
-                     self->flv_muxer,
-                     self->queue,
-                     self->sink, NULL);
+                     self->audio_tee, NULL);
 
     // Link video chain
     if (!gst_element_link_many(
             self->video_mixer,
             self->video_capsfilter,
-            self->x264_encoder,
-            self->flv_muxer,
-            self->queue,
-            self->sink, NULL)) {
+            self->video_tee, NULL)) {
         g_printerr("Video elements could not be linked.\n");
         gst_object_unref(self->pipeline);
+        self->pipeline = NULL;
         return FALSE;
     }
     // Link audio chain
     if (!gst_element_link_many(
             self->audio_mixer,
+            self->audio_queue,
             self->aac_encoder,
-            self->flv_muxer,
+            self->audio_tee,
             NULL)) {
         g_printerr("Failed to link audio branch");
         gst_object_unref(self->pipeline);
+        self->pipeline = NULL;
         return FALSE;
     }
+    // Every rendition encodes and muxes the shared streams for its outputs
+    for (guint i = 0; i < self->renditions->len; i++) {
+        if (!rendition_attach(g_ptr_array_index(self->renditions, i), GST_BIN(self->pipeline),
+                              self->video_tee, self->audio_tee)) {
+            gst_object_unref(self->pipeline);
+            self->pipeline = NULL;
+            return FALSE;
+        }
+    }
+    // Encoded tracks take over from remuxed ones at a keyframe
+    if (self->passthrough) {
+        broadcaster_rendition *primary = g_ptr_array_index(self->renditions, 0);
+        GstElement *composite[] = { primary->encoder, primary->audio_queue };
+        for (guint i = 0; i < G_N_ELEMENTS(composite); i++) {
+            GstPad *src_pad = gst_element_get_static_pad(composite[i], "src");
+            gst_pad_add_probe(src_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                              (GstPadProbeCallback)composite_output_probe, self, NULL);
+            gst_object_unref(src_pad);
+        }
+    }
+    // Slate and silence the mixers fall back to when sources stall
+    if (self->stall_timeout) {
+        gst_bin_add_many(GST_BIN(self->pipeline), self->slate, self->slate_capsfilter,
+                         self->silence, self->silence_capsfilter, NULL);
+        // lowest zorder, sources are drawn on top of the slate
+        if (!gst_element_link_many(self->slate, self->slate_capsfilter, self->video_mixer, NULL) ||
+            !gst_element_link_many(self->silence, self->silence_capsfilter, self->audio_mixer, NULL)) {
+            g_printerr("Failed to link slate and silence.\n");
+            gst_object_unref(self->pipeline);
+            self->pipeline = NULL;
+            return FALSE;
+        }
+    }
+    // With fast start the slate goes live right away, the encoders get the mix once a source is there
+    if (self->fast_start) {
+        GstElement *gated[] = { self->video_tee, self->audio_queue };
+        for (guint i = 0; i < G_N_ELEMENTS(gated); i++) {
+            GstPad *sink_pad = gst_element_get_static_pad(gated[i], "sink");
+            gst_pad_add_probe(sink_pad, GST_PAD_PROBE_TYPE_BUFFER, (GstPadProbeCallback)fast_start_probe, self, NULL);
+            gst_object_unref(sink_pad);
+        }
+    }
+    // Instrumentation, source branches get theirs once their tracks are wired
+    twitch_broadcaster_install_stage_probes(self);
+    memory_gauge_watch_queue(&self->memory[MEMORY_ENCODERS], self->audio_queue);
+    for (guint i = 0; i < self->renditions->len; i++) {
+        memory_gauge_watch_queue(&self->memory[MEMORY_ENCODERS],
+                                 ((broadcaster_rendition *)g_ptr_array_index(self->renditions, i))->video_queue);
+    }
+    for (guint i = 0; i < self->outputs->len; i++) {
+        memory_gauge_watch_queue(&self->memory[MEMORY_OUTPUTS],
+                                 ((broadcaster_output *)g_ptr_array_index(self->outputs, i))->queue);
+    }
+    GstBus *bus = gst_element_get_bus(self->pipeline);
+    gst_bus_set_sync_handler(bus, (GstBusSyncHandler)bus_sync_handler, self, NULL);
+    gst_object_unref(bus);
+
     // Installing pad added handler to be able to reconfigure pipeline dynamically
-    g_signal_connect(self->source, "pad-added", G_CALLBACK(pad_added_handler), self);
-    g_signal_connect(self->source1, "pad-added", G_CALLBACK(pad_added_handler), self);
-    g_signal_connect(self->source2, "pad-added", G_CALLBACK(pad_added_handler), self);
+    for (guint i = 0; i < self->branches->len; i++) {
+        source_branch *branch = g_ptr_array_index(self->branches, i);
+        g_signal_connect(branch->decoder, "pad-added", G_CALLBACK(pad_added_handler), branch);
+        g_signal_connect(branch->decoder, "pad-removed", G_CALLBACK(pad_removed_handler), branch);
+        if (self->passthrough) {
+            g_signal_connect(branch->decoder, "autoplug-continue", G_CALLBACK(autoplug_continue_handler), branch);
+        }
+        if (self->segmented) {
+            g_signal_connect(branch->decoder, "no-more-pads", G_CALLBACK(no_more_pads_handler), branch);
+        }
+    }
     return TRUE;
 }
 
-gboolean twitch_broadcaster_wire_new_video_track(broadcaster_impl *self, GstPad *new_pad) {
-    g_return_val_if_fail(self && new_pad, FALSE);
-    // Scaler to resize the signal but keep aspect ratio
-    GstElement *video_scaler = NULL;
-    GstElement *video_capsfilter = NULL;
+void twitch_broadcaster_install_stage_probes(broadcaster_impl *self) {
+    // encoding, muxing and sink latency and time to first buffer are measured on the
+    // first rendition and its first output
+    broadcaster_rendition *primary = g_ptr_array_index(self->renditions, 0);
+    struct {
+        GstElement *element;
+        const gchar *pad_name;
+        broadcaster_stage output_stage;
+        broadcaster_stage input_stage;
+        gboolean flv;
+    } probes[] = {
+            { self->video_mixer, "src", STAGE_MIXER, STAGE_COUNT, FALSE },
+            { primary->encoder, "sink", STAGE_COUNT, STAGE_ENCODER, FALSE },
+            { primary->encoder, "src", STAGE_ENCODER, STAGE_MUXER, FALSE },
+            { primary->muxer, "src", STAGE_MUXER, STAGE_SINK, TRUE },
+            // leaving the queue rather than entering the sink, a reconnecting output replaces its sink
+            { ((broadcaster_output *)g_ptr_array_index(primary->outputs, 0))->queue, "src", STAGE_SINK, STAGE_COUNT, TRUE },
+    };
+    for (guint i = 0; i < G_N_ELEMENTS(probes); i++) {
+        stage_probe_data *data = g_new0(stage_probe_data, 1);
+        data->self = self;
+        data->output_stage = probes[i].output_stage;
+        data->input_stage = probes[i].input_stage;
+        data->flv = probes[i].flv;
+        GstPad *pad = gst_element_get_static_pad(probes[i].element, probes[i].pad_name);
+        gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, stage_probe, data, g_free);
+        gst_object_unref(pad);
+    }
+    // A/V sync of what's muxed, encoded or remuxed
+    GstPad *muxer_pads[] = {
+            gst_element_get_static_pad(primary->muxer, "video"),
+            gst_element_get_static_pad(primary->muxer, "audio"),
+    };
+    GstPadProbeCallback muxer_probes[] = {
+            (GstPadProbeCallback)muxer_video_probe,
+            (GstPadProbeCallback)muxer_audio_probe,
+    };
+    for (guint i = 0; i < G_N_ELEMENTS(muxer_pads); i++) {
+        if (muxer_pads[i]) {
+            gst_pad_add_probe(muxer_pads[i], GST_PAD_PROBE_TYPE_BUFFER, muxer_probes[i], self, NULL);
+            gst_object_unref(muxer_pads[i]);
+        }
+    }
+}
 
-    if (self->linked_pads == MAX_SOURCES) {
-        // assume sources have only one video track for simplicity.
-        g_print("We are already linked. Ignoring.\n");
-        goto exit;
+broadcaster_stage twitch_broadcaster_element_stage(broadcaster_impl *self, GstObject *element) {
+    if (element == GST_OBJECT(self->video_mixer)) {
+        return STAGE_MIXER;
+    } else if (twitch_broadcaster_element_output(self, element)) {
+        return STAGE_SINK;
+    }
+    for (guint i = 0; i < self->renditions->len; i++) {
+        broadcaster_rendition *rendition = g_ptr_array_index(self->renditions, i);
+        if (element == (GstObject *)rendition->encoder) {
+            return STAGE_ENCODER;
+        } else if (element == (GstObject *)rendition->muxer) {
+            return STAGE_MUXER;
+        }
+    }
+    broadcaster_stage stage = STAGE_COUNT;
+    g_mutex_lock(&self->lock);
+    for (guint i = 0; i < self->branches->len && stage == STAGE_COUNT; i++) {
+        source_branch *branch = g_ptr_array_index(self->branches, i);
+        if (element == (GstObject *)branch->video_scaler || element == (GstObject *)branch->video_converter ||
+            element == (GstObject *)branch->video_capsfilter) {
+            stage = STAGE_SCALER;
+        } else if (gst_object_has_as_ancestor(element, GST_OBJECT(branch->decoder))) {
+            stage = STAGE_DECODER;
+        }
+    }
+    g_mutex_unlock(&self->lock);
+    return stage;
+}
+
+static broadcaster_output* twitch_broadcaster_element_output(broadcaster_impl *self, GstObject *element) {
+    broadcaster_output *output = NULL;
+    g_mutex_lock(&self->lock);
+    for (guint i = 0; i < self->outputs->len && !output; i++) {
+        broadcaster_output *candidate = g_ptr_array_index(self->outputs, i);
+        if (output_owns(candidate, element)) {
+            output = candidate;
+        }
+    }
+    g_mutex_unlock(&self->lock);
+    return output;
+}
+
+// TRUE if decoded frames can go to the mixer as they are: I420 of the tile's size with square pixels
+static gboolean video_caps_match_tile(GstCaps *caps, const layout_tile *tile) {
+    if (!caps || !gst_caps_is_fixed(caps)) {
+        return FALSE;
+    }
+    GstStructure *structure = gst_caps_get_structure(caps, 0);
+    const gchar *format = gst_structure_get_string(structure, "format");
+    gint width = 0, height = 0, par_n = 1, par_d = 1;
+    gst_structure_get_int(structure, "width", &width);
+    gst_structure_get_int(structure, "height", &height);
+    if (gst_structure_has_field(structure, "pixel-aspect-ratio")) {
+        gst_structure_get_fraction(structure, "pixel-aspect-ratio", &par_n, &par_d);
+    }
+    return format && g_str_equal(format, SOURCE_TILE_FORMAT) &&
+           width == tile->width && height == tile->height && par_n == par_d;
+}
+
+/**
+ * Creates the elements converting decoded frames for the mixer, in linking order.
+ * Nothing is needed when the frames already match the tile. Otherwise frames are scaled
+ * and converted in a single pass straight to I420 of the tile's size: by videoconvertscale
+ * where available, else by videoscale and videoconvert ordered so the conversion runs on
+ * the smaller frame. Only the missing step is added when size or format already match.
+ * With always_scale every source gets a videoscale to the tile's size as before.
+ * @param filters array of at least 3 elements to be filled in
+ * @return FALSE if elements couldn't be created
+ */
+static gboolean twitch_broadcaster_make_video_filters(broadcaster_impl *self, source_branch *branch, GstCaps *caps,
+                                                      GstElement **filters, guint *num_filters) {
+    GstElement *scaler = NULL;
+    GstElement *converter = NULL;
+    GstElement *capsfilter = NULL;
+    const gchar *caps_template = SOURCE_TILE_CAPS;
+    gboolean scale_first = TRUE;
+    *num_filters = 0;
+
+    if (self->always_scale) {
+        scaler = gst_element_factory_make("videoscale", NULL);
+        caps_template = SOURCE_SIZE_CAPS;
+    } else if (video_caps_match_tile(caps, &branch->tile)) {
+        return TRUE;
+    } else {
+        GstStructure *structure = caps ? gst_caps_get_structure(caps, 0) : NULL;
+        const gchar *format = structure ? gst_structure_get_string(structure, "format") : NULL;
+        gint width = 0, height = 0, par_n = 1, par_d = 1;
+        if (structure) {
+            gst_structure_get_int(structure, "width", &width);
+            gst_structure_get_int(structure, "height", &height);
+            if (gst_structure_has_field(structure, "pixel-aspect-ratio")) {
+                gst_structure_get_fraction(structure, "pixel-aspect-ratio", &par_n, &par_d);
+            }
+        }
+        gboolean convert = !format || !g_str_equal(format, SOURCE_TILE_FORMAT);
+        gboolean scale = width != branch->tile.width || height != branch->tile.height || par_n != par_d;
+        // videoconvertscale (GStreamer >= 1.22) does both in one pass
+        gboolean combined = FALSE;
+        if (convert && scale) {
+            scaler = gst_element_factory_make("videoconvertscale", NULL);
+            combined = scaler != NULL;
+        }
+        if (!scaler && scale) {
+            scaler = gst_element_factory_make("videoscale", NULL);
+        }
+        if (convert && !combined) {
+            converter = gst_element_factory_make("videoconvert", NULL);
+            // upscaling converts before scaling, fewer pixels either way
+            scale_first = (gint64)width * height >= (gint64)branch->tile.width * branch->tile.height;
+        }
+        if ((scale && !scaler) || (convert && !combined && !converter)) {
+            g_printerr("Failed to create scaler or converter.\n");
+            goto failed;
+        }
     }
-    // time to link pads decodebin -> scaler (keeping aspect ratio) -> capsfilter -> video mixer
-    video_scaler = gst_element_factory_make("videoscale", NULL);
-    if (!video_scaler) {
+    if (self->always_scale && !scaler) {
         g_printerr("Failed to create scaler.\n");
-        goto exit;
+        goto failed;
     }
-    video_capsfilter = gst_element_factory_make("capsfilter", NULL);
-    if (!video_capsfilter) {
+    capsfilter = gst_element_factory_make("capsfilter", NULL);
+    if (!capsfilter) {
         g_printerr("Failed to create capsfilter in front of mixer.\n");
-        gst_object_unref(video_scaler);
-        goto exit;
+        goto failed;
     }
-    // keep aspect ratio
-    g_object_set(video_scaler, "add-borders", TRUE, NULL);
-
-    // make sure each source takes 1/3 of the output on the horizontal line
-    GstCaps *size_caps = gst_caps_from_string(SOURCE_SIZE_CAPS);
-    g_object_set (video_capsfilter, "caps", size_caps, NULL);
+    if (scaler) {
+        // keep aspect ratio
+        g_object_set(scaler, "add-borders", TRUE, NULL);
+    }
+    // scale straight to the tile size so nothing gets scaled twice
+    gchar *size_caps_str = g_strdup_printf(caps_template, branch->tile.width, branch->tile.height);
+    GstCaps *size_caps = gst_caps_from_string(size_caps_str);
+    g_free(size_caps_str);
+    g_object_set(capsfilter, "caps", size_caps, NULL);
     gst_caps_unref(size_caps);
 
-    gst_bin_add_many(GST_BIN(self->pipeline), video_scaler, video_capsfilter, NULL);
+    if (scaler && (scale_first || !converter)) {
+        filters[(*num_filters)++] = scaler;
+    }
+    if (converter) {
+        filters[(*num_filters)++] = converter;
+    }
+    if (scaler && !scale_first && converter) {
+        filters[(*num_filters)++] = scaler;
+    }
+    filters[(*num_filters)++] = capsfilter;
+    branch->video_scaler = scaler;
+    branch->video_converter = converter;
+    branch->video_capsfilter = capsfilter;
+    return TRUE;
+
+    failed:
+    if (scaler) {
+        gst_object_unref(scaler);
+    }
+    if (converter) {
+        gst_object_unref(converter);
+    }
+    return FALSE;
+}
+
+gboolean twitch_broadcaster_wire_new_video_track(broadcaster_impl *self, source_branch *branch, GstPad *new_pad) {
+    g_return_val_if_fail(self && branch && new_pad, FALSE);
+    GstElement *video_queue = NULL;
+    GstElement *filters[3] = { NULL, NULL, NULL };
+    guint num_filters = 0;
+    GstPad *mixer_sink_pad = NULL;
+    gboolean res = FALSE;
+
+    if (branch->video_mixer_pad) {
+        // assume sources have only one video track for simplicity.
+        g_print("We are already linked. Ignoring.\n");
+        return FALSE;
+    }
+    // time to link pads decodebin -> queue -> [scaler/converter -> capsfilter] -> video mixer
+    video_queue = gst_element_factory_make("queue", NULL);
+    if (!video_queue) {
+        g_printerr("Failed to create queue in front of scaler.\n");
+        return FALSE;
+    }
+    // decodebin exposes its pads once caps are known
+    GstCaps *decoder_caps = gst_pad_get_current_caps(new_pad);
+    if (!decoder_caps) {
+        decoder_caps = gst_pad_query_caps(new_pad, NULL);
+    }
+    gboolean created = twitch_broadcaster_make_video_filters(self, branch, decoder_caps, filters, &num_filters);
+    if (decoder_caps) {
+        gst_caps_unref(decoder_caps);
+    }
+    if (!created) {
+        gst_object_unref(video_queue);
+        return FALSE;
+    }
 
-    if (!gst_element_sync_state_with_parent(video_scaler) ||
-        !gst_element_sync_state_with_parent(video_capsfilter)) {
+    twitch_broadcaster_add_source_queue(self, video_queue);
+    gst_bin_add(GST_BIN(self->pipeline), video_queue);
+    for (guint i = 0; i < num_filters; i++) {
+        gst_bin_add(GST_BIN(self->pipeline), filters[i]);
+    }
+    gboolean synced = gst_element_sync_state_with_parent(video_queue);
+    for (guint i = 0; i < num_filters; i++) {
+        synced = gst_element_sync_state_with_parent(filters[i]) && synced;
+    }
+    if (!synced) {
         g_printerr("Failed to sync state of a video scaler or capsfilter with the pipeline's state\n");
-        gst_object_unref(video_scaler);
-        gst_object_unref(video_capsfilter);
         goto exit;
     }
 
@@ -335,7 +2636,7 @@ gboolean twitch_broadcaster_wire_new_video_track(broadcaster_impl *self, GstPad
     GstPadTemplate *mixer_sink_pad_template = gst_element_class_get_pad_template(
             GST_ELEMENT_GET_CLASS(self->video_mixer),
             "sink_%u");
-    GstPad *mixer_sink_pad =gst_element_request_pad(
+    mixer_sink_pad = gst_element_request_pad(
             self->video_mixer,
             mixer_sink_pad_template,
             NULL, NULL);
@@ -343,82 +2644,134 @@ gboolean twitch_broadcaster_wire_new_video_track(broadcaster_impl *self, GstPad
         g_printerr("failed to get mixer sink pad\n");
         goto exit;
     }
-    // Configure position and size in the output stream
-    g_object_set(mixer_sink_pad, "xpos", self->linked_pads * 640, NULL);
-    g_object_set(mixer_sink_pad, "ypos", 0, NULL);
-    g_object_set(mixer_sink_pad, "width", 640, NULL);
-    g_object_set(mixer_sink_pad, "height", 1080, NULL);
+    // Configure position and size in the output stream. Frames already have the tile's size,
+    // width and height only matter if the source changes caps later on
+    g_object_set(mixer_sink_pad, "xpos", branch->tile.x, NULL);
+    g_object_set(mixer_sink_pad, "ypos", branch->tile.y, NULL);
+    g_object_set(mixer_sink_pad, "width", branch->tile.width, NULL);
+    g_object_set(mixer_sink_pad, "height", branch->tile.height, NULL);
+    // above the slate (zorder 0) if there is one
+    g_object_set(mixer_sink_pad, "zorder", branch->tile.zorder + (self->stall_timeout ? 1 : 0), NULL);
 
 
-    GstPad *scaler_sink_pad = gst_element_get_static_pad(video_scaler, "sink");
-    GstPad *scaler_src_pad = gst_element_get_static_pad(video_scaler, "src");
+    GstPad *queue_sink_pad = gst_element_get_static_pad(video_queue, "sink");
 
-    // linking decodebin and scaler
-    GstPadLinkReturn ret = gst_pad_link(new_pad, scaler_sink_pad);
+    // linking decodebin and queue, scaling happens on the queue's thread
+    GstPadLinkReturn ret = gst_pad_link(new_pad, queue_sink_pad);
+    gst_object_unref(queue_sink_pad);
     if (GST_PAD_LINK_FAILED (ret)) {
-        gst_object_unref(scaler_src_pad);
-        gst_object_unref(scaler_sink_pad);
         g_printerr("Failed to link decodebin and scaler\n");
         goto exit;
     }
 
-    // linking scaler and capsfilter
-    if (!gst_element_link(video_scaler, video_capsfilter)) {
-        gst_object_unref(scaler_src_pad);
-        gst_object_unref(scaler_sink_pad);
-        g_printerr("Failed to link scaler and capsfilter\n");
-        goto exit;
+    // linking queue, scaler/converter and capsfilter
+    GstElement *last = video_queue;
+    for (guint i = 0; i < num_filters; i++) {
+        if (!gst_element_link(last, filters[i])) {
+            g_printerr("Failed to link scaler and capsfilter\n");
+            goto exit;
+        }
+        last = filters[i];
     }
 
-    // linking capsfilter and mixer
-    GstPad *capsfilter_src_pad = gst_element_get_static_pad(video_capsfilter, "src");
-    ret = gst_pad_link(capsfilter_src_pad, mixer_sink_pad);
+    // linking the last element and mixer
+    GstPad *last_src_pad = gst_element_get_static_pad(last, "src");
+    ret = gst_pad_link(last_src_pad, mixer_sink_pad);
+    if (!GST_PAD_LINK_FAILED (ret)) {
+        gst_pad_add_probe(last_src_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                          (GstPadProbeCallback)scaler_output_probe, branch, NULL);
+        gst_pad_add_probe(new_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                          (GstPadProbeCallback)decoder_output_probe, branch, NULL);
+        gst_pad_add_probe(new_pad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+                          (GstPadProbeCallback)decoder_event_probe, branch, NULL);
+    }
 
-    gst_object_unref(capsfilter_src_pad);
-    gst_object_unref(scaler_sink_pad);
+    gst_object_unref(last_src_pad);
 
     if (GST_PAD_LINK_FAILED (ret)) {
         g_printerr("Faild to link capsfilter and mixer\n");
         goto exit;
     }
-    self->linked_pads++;
+    branch->video_queue = video_queue;
+    branch->video_mixer_pad = gst_object_ref(mixer_sink_pad);
+    twitch_broadcaster_branch_set_decoder_pad(self, branch, TRUE, new_pad);
+    res = TRUE;
     exit:
+    if (!res) {
+        // nothing of the track stays behind, a later track of the source gets the tile
+        if (mixer_sink_pad) {
+            gst_element_release_request_pad(self->video_mixer, mixer_sink_pad);
+        }
+        GstElement *elements[] = { filters[2], filters[1], filters[0], video_queue };
+        twitch_broadcaster_discard_elements(self, elements, G_N_ELEMENTS(elements));
+        branch->video_scaler = branch->video_converter = branch->video_capsfilter = NULL;
+    }
     /* Unreference the sink pad */
     if (mixer_sink_pad) {
         gst_object_unref(mixer_sink_pad);
     }
-    return TRUE;
+    return res;
 }
 
-gboolean twitch_broadcaster_wire_new_audio_track(broadcaster_impl *self, GstPad *new_pad) {
-    g_return_val_if_fail(self && new_pad, FALSE);
+gboolean twitch_broadcaster_wire_new_audio_track(broadcaster_impl *self, source_branch *branch, GstPad *new_pad) {
+    g_return_val_if_fail(self && branch && new_pad, FALSE);
     GstPadTemplate *audio_mixer_sink_pad_template = gst_element_class_get_pad_template (
             GST_ELEMENT_GET_CLASS(self->audio_mixer),
             "sink_%u");
-    GstCaps *new_pad_caps = gst_pad_get_current_caps(new_pad);
+    GstCaps *new_pad_caps = NULL;
+    GstCaps *caps_to_use = NULL;
+    GstPad *audio_mixer_sink_pad = NULL;
+    GstPad *queue_src_pad = NULL;
+    GstElement *audio_queue = NULL, *audio_convert = NULL, *audio_resample = NULL, *audio_capsfilter = NULL;
+    gboolean res = FALSE;
     //TODO: remove limit - assume one track per source for simplicity
-    if (self->linked_audio_pads == MAX_SOURCES) {
+    if (branch->audio_mixer_pad) {
         // assume sources have only one audio track for simplicity.
         g_print("We are already linked. Ignoring.\n");
-        goto exit;
+        return FALSE;
+    }
+    new_pad_caps = gst_pad_get_current_caps(new_pad);
+    if (!new_pad_caps) {
+        new_pad_caps = gst_pad_query_caps(new_pad, NULL);
     }
     // dyn. part
-    GstCaps *caps_to_use = NULL;
-    GstElement *audio_convert, *audio_resample, *audio_capsfilter;
-
     caps_to_use = gst_caps_from_string(AUDIO_CAPS);
-    GstPad *audio_mixer_sink_pad = gst_element_request_pad(
+    audio_mixer_sink_pad = gst_element_request_pad(
             self->audio_mixer, audio_mixer_sink_pad_template, NULL, NULL);
     if (!audio_mixer_sink_pad) {
         g_printerr("failed to get mixer sink pad!\n");
         goto exit;
     }
+    // decodebin -> queue, conversion happens on the queue's thread
+    audio_queue = gst_element_factory_make("queue", NULL);
+    if (!audio_queue) {
+        g_printerr("Failed to create audio queue!\n");
+        goto exit;
+    }
+    twitch_broadcaster_add_source_queue(self, audio_queue);
+    gst_bin_add(GST_BIN(self->pipeline), audio_queue);
+    if (!gst_element_sync_state_with_parent(audio_queue)) {
+        g_printerr("Failed to sync new audio el. state with parent!\n");
+        goto exit;
+    }
+    GstPad *queue_sink_pad = gst_element_get_static_pad(audio_queue, "sink");
+    GstPadLinkReturn queue_ret = gst_pad_link(new_pad, queue_sink_pad);
+    gst_object_unref(queue_sink_pad);
+    if (GST_PAD_LINK_FAILED(queue_ret)) {
+        g_printerr("Failed to link decodebin and audio queue\n");
+        goto exit;
+    }
+    queue_src_pad = gst_element_get_static_pad(audio_queue, "src");
 
     if (!gst_caps_is_equal(caps_to_use, new_pad_caps)) {
         // convert audio
         audio_resample = gst_element_factory_make("audioresample", NULL);
         audio_convert = gst_element_factory_make("audioconvert", NULL);
         audio_capsfilter = gst_element_factory_make("capsfilter", NULL);
+        if (!audio_resample || !audio_convert || !audio_capsfilter) {
+            g_printerr("Failed to create audio conversion elements!\n");
+            goto exit;
+        }
         g_object_set(audio_capsfilter, "caps", caps_to_use, NULL);
         gst_bin_add_many(GST_BIN(self->pipeline),
                 audio_resample,
@@ -435,9 +2788,9 @@ gboolean twitch_broadcaster_wire_new_audio_track(broadcaster_impl *self, GstPad
             g_printerr("Failed to sync new audio el. state with parent!\n");
             goto exit;
         }
-        // now link decodebin -> resample && capsfilter -> mixer
+        // now link queue -> resample && capsfilter -> mixer
         GstPad *resample_sink_pad = gst_element_get_static_pad (audio_resample, "sink");
-        GstPadLinkReturn ret = gst_pad_link(new_pad, resample_sink_pad);
+        GstPadLinkReturn ret = gst_pad_link(queue_src_pad, resample_sink_pad);
         gst_object_unref(resample_sink_pad);
         if (GST_PAD_LINK_FAILED(ret)) {
             g_printerr("Failed to link decodebin and resampler\n");
@@ -452,19 +2805,163 @@ gboolean twitch_broadcaster_wire_new_audio_track(broadcaster_impl *self, GstPad
         }
     } else {
         // pass through link directly to mixer
-        GstPadLinkReturn ret = gst_pad_link(new_pad, audio_mixer_sink_pad);
+        GstPadLinkReturn ret = gst_pad_link(queue_src_pad, audio_mixer_sink_pad);
         if (GST_PAD_LINK_FAILED(ret)) {
             g_print("Failed to link decodebin to audio mixer");
             goto exit;
         }
     }
-    self->linked_audio_pads++;
+    gst_pad_add_probe(audio_mixer_sink_pad, GST_PAD_PROBE_TYPE_BUFFER,
+                      (GstPadProbeCallback)audio_mixer_input_probe, branch, NULL);
+    gst_pad_add_probe(new_pad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+                      (GstPadProbeCallback)decoder_event_probe, branch, NULL);
+    branch->audio_queue = audio_queue;
+    branch->audio_resample = audio_resample;
+    branch->audio_convert = audio_convert;
+    branch->audio_capsfilter = audio_capsfilter;
+    branch->audio_mixer_pad = gst_object_ref(audio_mixer_sink_pad);
+    twitch_broadcaster_branch_set_decoder_pad(self, branch, FALSE, new_pad);
+    res = TRUE;
     exit:
+    if (queue_src_pad) {
+        gst_object_unref(queue_src_pad);
+    }
+    if (!res) {
+        // nothing of the track stays behind, a later track of the source gets mixed
+        if (audio_mixer_sink_pad) {
+            gst_element_release_request_pad(self->audio_mixer, audio_mixer_sink_pad);
+        }
+        GstElement *elements[] = { audio_capsfilter, audio_convert, audio_resample, audio_queue };
+        twitch_broadcaster_discard_elements(self, elements, G_N_ELEMENTS(elements));
+    }
     if (new_pad_caps) {
         gst_caps_unref(new_pad_caps);
     }
+    if (caps_to_use) {
+        gst_caps_unref(caps_to_use);
+    }
     if (audio_mixer_sink_pad) {
         gst_object_unref(audio_mixer_sink_pad);
     }
-    return TRUE;
-}
\ No newline at end of file
+    return res;
+}
+
+gboolean twitch_broadcaster_can_remux(broadcaster_impl *self, GstCaps *caps) {
+    if (!self->passthrough || !caps || gst_caps_is_empty(caps) || gst_caps_is_any(caps)) {
+        return FALSE;
+    }
+    GstStructure *structure = gst_caps_get_structure(caps, 0);
+    if (gst_structure_has_name(structure, "audio/mpeg")) {
+        // AAC of what the encoder produces, the muxer's audio can't change format on a switch
+        gint version = 0, rate = 0, channels = 0;
+        return gst_structure_get_int(structure, "mpegversion", &version) && version == 4 &&
+               gst_structure_get_int(structure, "rate", &rate) && rate == AUDIO_RATE &&
+               gst_structure_get_int(structure, "channels", &channels) && channels == AUDIO_CHANNELS;
+    }
+    if (!gst_structure_has_name(structure, "video/x-h264")) {
+        return FALSE;
+    }
+    // target settings of the encoder: canvas size and frame rate, square pixels
+    gint width = 0, height = 0, fps_n = 0, fps_d = 1, par_n = 1, par_d = 1;
+    if (!gst_structure_get_int(structure, "width", &width) || !gst_structure_get_int(structure, "height", &height) ||
+        !gst_structure_get_fraction(structure, "framerate", &fps_n, &fps_d)) {
+        return FALSE;
+    }
+    if (gst_structure_has_field(structure, "pixel-aspect-ratio")) {
+        gst_structure_get_fraction(structure, "pixel-aspect-ratio", &par_n, &par_d);
+    }
+    return width == self->width && height == self->height && fps_n == self->fps * fps_d && par_n == par_d;
+}
+
+gboolean twitch_broadcaster_wire_passthrough_track(broadcaster_impl *self, source_branch *branch, GstPad *new_pad,
+                                                   gboolean video) {
+    g_return_val_if_fail(self && branch && new_pad, FALSE);
+    broadcaster_rendition *primary = g_ptr_array_index(self->renditions, 0);
+    GstElement *selector = video ? primary->video_selector : primary->audio_selector;
+    GstElement *queue = NULL, *parser = NULL, *capsfilter = NULL;
+    GstPad *selector_pad = NULL;
+    gboolean res = FALSE;
+
+    if (video ? branch->video_mixer_pad : branch->audio_mixer_pad) {
+        g_print("We are already linked. Ignoring.\n");
+        return FALSE;
+    }
+    // decodebin -> queue -> parser -> capsfilter -> selector, parsing happens on the queue's thread
+    queue = gst_element_factory_make("queue", NULL);
+    parser = gst_element_factory_make(video ? "h264parse" : "aacparse", NULL);
+    capsfilter = gst_element_factory_make("capsfilter", NULL);
+    if (!queue || !parser || !capsfilter) {
+        g_printerr("Failed to create passthrough elements.\n");
+        goto exit;
+    }
+    // flvmux takes AVC with codec data and raw AAC
+    GstCaps *caps = gst_caps_from_string(video ? PASSTHROUGH_VIDEO_CAPS : PASSTHROUGH_AUDIO_CAPS);
+    g_object_set(capsfilter, "caps", caps, NULL);
+    gst_caps_unref(caps);
+
+    twitch_broadcaster_add_source_queue(self, queue);
+    gst_bin_add_many(GST_BIN(self->pipeline), queue, parser, capsfilter, NULL);
+    if (!gst_element_link_many(queue, parser, capsfilter, NULL)) {
+        g_printerr("Failed to link passthrough elements.\n");
+        goto exit;
+    }
+    if (!gst_element_sync_state_with_parent(queue) ||
+        !gst_element_sync_state_with_parent(parser) ||
+        !gst_element_sync_state_with_parent(capsfilter)) {
+        g_printerr("Failed to sync state of passthrough elements with the pipeline's state\n");
+        goto exit;
+    }
+    selector_pad = gst_element_get_request_pad(selector, "sink_%u");
+    if (!selector_pad) {
+        g_printerr("Failed to get selector sink pad\n");
+        goto exit;
+    }
+    GstPad *capsfilter_src_pad = gst_element_get_static_pad(capsfilter, "src");
+    GstPadLinkReturn ret = gst_pad_link(capsfilter_src_pad, selector_pad);
+    if (!GST_PAD_LINK_FAILED(ret)) {
+        // the muxer switches to the track at its first keyframe
+        gst_pad_add_probe(capsfilter_src_pad, GST_PAD_PROBE_TYPE_BUFFER, video ?
+                          (GstPadProbeCallback)passthrough_video_probe : (GstPadProbeCallback)passthrough_audio_probe,
+                          branch, NULL);
+    }
+    gst_object_unref(capsfilter_src_pad);
+    if (GST_PAD_LINK_FAILED(ret)) {
+        g_printerr("Failed to link passthrough track and selector\n");
+        goto exit;
+    }
+    GstPad *queue_sink_pad = gst_element_get_static_pad(queue, "sink");
+    ret = gst_pad_link(new_pad, queue_sink_pad);
+    gst_object_unref(queue_sink_pad);
+    if (GST_PAD_LINK_FAILED(ret)) {
+        g_printerr("Failed to link decodebin and passthrough queue\n");
+        goto exit;
+    }
+    gst_pad_add_probe(new_pad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+                      (GstPadProbeCallback)decoder_event_probe, branch, NULL);
+    if (video) {
+        branch->video_queue = queue;
+        branch->video_parser = parser;
+        branch->video_capsfilter = capsfilter;
+        branch->video_mixer_pad = gst_object_ref(selector_pad);
+    } else {
+        branch->audio_queue = queue;
+        branch->audio_parser = parser;
+        branch->audio_capsfilter = capsfilter;
+        branch->audio_mixer_pad = gst_object_ref(selector_pad);
+    }
+    twitch_broadcaster_branch_set_decoder_pad(self, branch, video, new_pad);
+    g_print("Source %u: remuxing %s without decoding\n", branch->index, video ? "video" : "audio");
+    res = TRUE;
+    exit:
+    if (!res) {
+        if (selector_pad) {
+            gst_element_release_request_pad(selector, selector_pad);
+        }
+        GstElement *elements[] = { capsfilter, parser, queue };
+        twitch_broadcaster_discard_elements(self, elements, G_N_ELEMENTS(elements));
+    }
+    if (selector_pad) {
+        gst_object_unref(selector_pad);
+    }
+    return res;
+}
@@ -1,22 +1,407 @@
 #ifndef _TWITCH_BROADCASTER_H_
 #define _TWITCH_BROADCASTER_H_
 
+#include <stdint.h>
+
 struct broadcaster_impl;
+struct _GMainContext;
+struct _GstTaskPool;
+struct source_registry;
+struct _GstBuffer;
+
+// How sources are placed on the output canvas
+typedef enum {
+    LAYOUT_SIDE_BY_SIDE = 0, // one next to the other across x-axis (default)
+    LAYOUT_GRID, // rows x columns, as square as possible
+    LAYOUT_PICTURE_IN_PICTURE, // first source full screen, others as small overlays
+    LAYOUT_MAIN_THUMBNAILS, // first source large on the left, others stacked on the right
+} layout_type;
+
+typedef enum {
+    OUTPUT_FILE = 0, // filesink, location is a path
+    OUTPUT_RTMP, // rtmpsink, location is an rtmp:// address
+    OUTPUT_TCP, // tcpclientsink streaming plain FLV, location is tcp://host:port (or host:port)
+    OUTPUT_CALLBACK, // encoded packets handed to Output.callback in process, location only names it
+    OUTPUT_SHM, // shmsink, location is shm:///path/of/socket (or the path), local processes read it with shmsrc
+} output_type;
+
+// What a callback output is handed
+typedef enum {
+    PACKETS_FLV = 0, // muxed FLV chunks, the FLV header and one tag each, as written to files
+    PACKETS_ELEMENTARY, // H.264 access units (AVC) and AAC frames as they enter the muxer
+} packet_format;
+
+typedef enum {
+    PACKET_MUXED = 0,
+    PACKET_VIDEO,
+    PACKET_AUDIO,
+} packet_track;
+
+// An encoded packet handed to an output callback, nothing is copied on the way
+typedef struct {
+    packet_track track;
+    // mapped contents of buffer, valid until the callback returns
+    const uint8_t *data;
+    size_t size;
+    // timestamps in ns, -1 when unknown
+    int64_t pts;
+    int64_t dts;
+    int keyframe;
+    // stream headers rather than media: FLV header and metadata, or the codec configuration
+    // (avcC, AudioSpecificConfig) of elementary tracks
+    int header;
+    // the GstBuffer holding the data, reference-counted: gst_buffer_ref() it to keep the data
+    // past the callback. Shared with other outputs, never to be written to
+    struct _GstBuffer *buffer;
+} output_packet;
+
+// Called from streaming threads (one at a time per output), packets in order per track. A
+// slow callback holds back the output's queue like a slow sink would, for elementary packets
+// the encoders themselves.
+typedef void (*output_packet_callback)(const output_packet *packet, void *user_data);
+
+// A destination of the encoded stream, every output gets the same encoded data
+typedef struct {
+    output_type type;
+    char *location;
+    // limits of the queue in front of the output, 0 means default (5 s, 16 MB).
+    // With multiple outputs a full queue drops whole GOPs instead of stalling the others
+    int max_buffer_ms;
+    int max_buffer_bytes;
+    // non 0 limits the output to this many bytes per second (testing slow links)
+    int rate_limit;
+    // rtmp and tcp outputs reconnect after a failure instead of being removed (or ending the
+    // broadcast) while decoding and encoding go on. Muxed data since the latest keyframe is
+    // kept in a ring of up to ring_bytes (0 means 8 MB), the new connection gets the FLV
+    // headers and the ring before live data. Attempts back off from 250 ms up to
+    // reconnect_max_ms (0 means 8 s), negative disables reconnecting.
+    int reconnect_max_ms;
+    int ring_bytes;
+    // OUTPUT_CALLBACK: the callback, its user data and what it's handed. Muxed chunks come
+    // from the output's queue, elementary packets from the muxer's inputs (they don't wait
+    // for the muxer and skip the output's queue).
+    output_packet_callback callback;
+    void *callback_data;
+    packet_format format;
+} Output;
+
+// A step of the ABR ladder: the composited canvas scaled and encoded for its own outputs
+typedef struct {
+    // size of the rendition, the canvas' aspect ratio is kept (letterboxed)
+    int width;
+    int height;
+    // video bitrate in kbit/s, 0 means encoder default
+    int bitrate;
+    Output *outputs;
+    unsigned int num_outputs;
+} Rendition;
 
 // Config for the broadcaster
 typedef struct {
     char *file_sink; // if present indicates usage of filesink instead of rtmp (testing)
-    // Source addresses (could be uri or localfile (file://...)
-    char *source1;
-    char *source2;
-    char *source3;
+    // NULL terminated list of source addresses (could be uri or localfile (file://...)
+    // Sources are laid out one next to the other in the given order
+    char **sources;
     char *rtmp_address;
+    // Output canvas, 0 means default (1920x1080 @ 30 fps)
+    int width;
+    int height;
+    int fps;
+    layout_type layout;
+    // non 0 trades compression efficiency and buffering for latency: zerolatency encoder
+    // settings, 1 s keyframe interval, no aggregator latency and a small sink queue
+    int low_latency;
+    // Outputs the stream is encoded once for, when num_outputs is 0 the single output
+    // is file_sink or rtmp_address
+    Output *outputs;
+    unsigned int num_outputs;
+    // ABR ladder, sources are decoded and composited once for all renditions and audio
+    // is encoded once. When num_renditions is 0 the only rendition is the canvas itself,
+    // written to the outputs above; otherwise outputs above are ignored.
+    Rendition *renditions;
+    unsigned int num_renditions;
+    // non 0 makes the mix live: the mixers don't wait longer than this for any source.
+    // A source without a new frame for this long counts as stalled, its tile keeps the
+    // last frame (black slate before the first one) and its audio is silent until it
+    // rejoins. Sources are then consumed in realtime, even local files. The broadcast ends
+    // once every track of every source ended.
+    int stall_timeout_ms;
+    // CPU lists (taskset -c syntax, e.g. "0-3,6") streaming threads are pinned to, NULL for
+    // no pinning. Encoder threads (x264enc of every rendition and the AAC encoder, with the
+    // worker threads they spawn) run on encoder_cpus, all other threads (decoding, scaling,
+    // mixing, muxing and outputs) on source_cpus. Linux only.
+    char *source_cpus;
+    char *encoder_cpus;
+    // Sources are converted for the mixer according to their decoded caps: not at all when
+    // they already are I420 of their tile's size, otherwise in a single scale and convert
+    // pass. Non 0 scales every source with videoscale and leaves conversion to the mixer
+    // (the previous behaviour, for comparing in benchmarks).
+    int always_scale;
+    // non 0 remuxes the tracks of a single source without decoding when they already are
+    // H.264 of the canvas' size and frame rate and 44.1 kHz stereo AAC; other tracks are decoded, composited
+    // and encoded as usual. twitch_broadcaster_replace_source() switches between remuxing
+    // and compositing at the next keyframe. Applies to a single source with a single
+    // rendition of the canvas' size and without stall_timeout_ms.
+    int passthrough;
+    // encoder threads of the broadcaster, split between the renditions' x264enc instances,
+    // 0 leaves the encoder's default (as many as it sees fit for the machine)
+    int encoder_threads;
+    // pool streaming threads of the broadcaster are taken from (see host.h, shared by all
+    // broadcasters of a host), NULL for GStreamer's default pool
+    struct _GstTaskPool *task_pool;
+    // non 0 caps the memory buffered by the broadcaster (bytes): a quarter of it for the
+    // output queues, a quarter for the encoders (the queues in front of them and x264's
+    // lookahead, which is shortened to fit) and half for the sources (download and demuxer
+    // buffering and the queues behind the decoders). Queues are capped by bytes.
+    uint64_t memory_budget;
+    // non 0 adapts the video bitrate of every rendition to its uplink, from the queue of its
+    // fullest output and what that output sends: once the queue fills up (or keeps growing) the
+    // bitrate drops to just below the measured throughput, once it stays nearly empty the
+    // bitrate climbs back in small steps. The rendition's bitrate (x264's 2048 kbit/s when 0)
+    // is the maximum, min_bitrate the minimum (kbit/s, 0 means an eighth of the maximum).
+    // Decisions are taken on the broadcaster's main context.
+    int adaptive_bitrate;
+    int min_bitrate;
+    // non 0 goes live as soon as the encoders and the first source are ready instead of
+    // waiting for every source to be discovered. Needs stall_timeout_ms, the mix is live
+    // behind its fallback: tiles of sources that aren't there yet show the black slate and
+    // late sources join at the mix's current position, from their start. Not combined with
+    // passthrough.
+    int fast_start;
+    // directory of the persistent source cache (see source_cache.h), NULL for none. Remote
+    // (http/https) sources are recorded into it while they play and replays read them from
+    // disk through memory mapping instead of downloading them again.
+    char *cache_dir;
+    // most bytes the cache's objects may take, the least recently played ones are evicted
+    // when a download is committed. 0 for no bound (the directory is managed by the operator)
+    uint64_t cache_max_bytes;
+    // read-ahead of remote sources in bytes, absorbing network jitter before it reaches the
+    // mixers. 0 leaves uridecodebin's default; a memory budget's source share caps it.
+    uint64_t prefetch_bytes;
+    // renders only a segment of the sources' timeline (see offline_render.h): every source is
+    // seeked to segment_start_ns once its tracks are wired, data before the seek is dropped,
+    // and ends at segment_stop_ns (0 for its end). The output starts at 0. Applies to offline
+    // mixes, not with stall_timeout_ms or fast_start, and disables passthrough (segments are cut
+    // at the encoder's keyframes); replacement sources start from their start.
+    uint64_t segment_start_ns;
+    uint64_t segment_stop_ns;
+    // frames between keyframes, 0 for the encoder's default (1 s with low_latency)
+    int keyframe_interval;
+    // registry decoding every uri once for all the broadcasters using it (see
+    // source_registry.h, shared by the broadcasters of a host), NULL to decode every source
+    // on its own. Sources of a running decoder join at its current position (unless the
+    // registry plays sources from_start). Not with passthrough or segments, which need a
+    // decoder of their own; the source cache is bypassed.
+    struct source_registry *registry;
+    // A/V sync alarm thresholds (see av_sync.h): audio against video in ms and the drift of that
+    // offset in ms per hour of stream, 0 for the defaults (80 ms, 40 ms/h)
+    int av_sync_max_offset_ms;
+    int av_sync_max_drift_ms_per_hour;
 } Config;
 
+// Instrumented pipeline stages, video path only
+typedef enum {
+    STAGE_DECODER = 0, // decoded frames leaving uridecodebin (all sources)
+    STAGE_SCALER, // scaled frames entering the video mixer (all sources), latency of scaling
+    STAGE_MIXER, // composited frames, latency from the oldest input frame to the output
+    // stages below are measured on the first rendition (and its first output)
+    STAGE_ENCODER, // encoded frames, latency of the encoder (frames that are not reordered)
+    STAGE_MUXER, // muxed tags (audio and video), latency of muxing video
+    STAGE_SINK, // tags reaching the sink, latency of the queue in front of it
+    STAGE_COUNT
+} broadcaster_stage;
+
+// Where the broadcaster buffers data, for memory accounting
+typedef enum {
+    MEMORY_SOURCES = 0, // queues behind the sources' decoders (decoded or remuxed tracks)
+    MEMORY_ENCODERS, // queues in front of the encoders (composited video, mixed audio)
+    MEMORY_OUTPUTS, // queues in front of the sinks (muxed data)
+    MEMORY_COUNT
+} broadcaster_memory_stage;
+
+typedef struct {
+    uint64_t buffers;
+    // buffers per second since the previous twitch_broadcaster_get_stats() call
+    double fps;
+    // processing latency of the stage in microseconds, 0 if not measured
+    int64_t latency_us;
+    int64_t max_latency_us;
+    // buffers dropped and reported late (QoS) by the stage's elements
+    uint64_t dropped;
+    uint64_t late;
+} stage_stats;
+
+// Alignment of a video and an audio track. A track's origin is where its timestamps put its
+// first sample once the media its buffers held so far is played back to back; offsets are the
+// audio origin minus the video one, positive when audio plays late.
+typedef struct {
+    // offset right now, when both tracks started and the furthest one so far (with its sign)
+    double offset_ms;
+    double start_offset_ms;
+    double max_offset_ms;
+    // change of the offset per hour of stream, fitted over the whole stream, 0 before a minute of it
+    double drift_ms_per_hour;
+    // timestamps jumping off the end of the track's previous buffer (gaps, overlaps or flagged
+    // discontinuities), playback follows the timestamps across them
+    unsigned int video_discontinuities;
+    unsigned int audio_discontinuities;
+    // stream time both tracks were seen for
+    int64_t duration_ms;
+    // non 0 while offset or drift is beyond its threshold (Config.av_sync_*), times it was raised
+    int alarm;
+    unsigned int alarms;
+} av_sync_stats;
+
+typedef struct {
+    stage_stats stages[STAGE_COUNT];
+    // fill level of the fullest output queue
+    unsigned int queue_buffers;
+    unsigned int queue_bytes;
+    uint64_t queue_time_ns;
+    // fill level relative to its limit, 0 - 100
+    unsigned int queue_percent;
+    // decoder output to sink, taking the slowest source of every output frame
+    int64_t pipeline_latency_us;
+    int64_t max_pipeline_latency_us;
+    // from twitch_broadcaster_run() to the first buffer reaching the sink, 0 if none did yet
+    int64_t time_to_first_buffer_us;
+    unsigned int num_sources;
+    // streaming threads started so far and how many of them were pinned to CPUs
+    unsigned int threads;
+    unsigned int pinned_threads;
+    // with Config.passthrough: whether video and audio are remuxed right now and how many
+    // times the muxer switched between remuxed and composited tracks
+    int video_passthrough;
+    int audio_passthrough;
+    unsigned int path_switches;
+    // bytes held by the queues of every memory stage now and at most at once, and the memory
+    // limit (Config.memory_budget or the host's share), 0 without a limit
+    uint64_t held_bytes[MEMORY_COUNT];
+    uint64_t peak_held_bytes[MEMORY_COUNT];
+    uint64_t memory_limit;
+    // peak RSS of the whole process (Linux only)
+    uint64_t peak_rss_bytes;
+    // elements of the pipeline (those inside decoders included) and sink pads of both mixers,
+    // flat over source replacements and tracks coming and going unless something leaks
+    unsigned int elements;
+    unsigned int mixer_pads;
+    // encoded (or remuxed) tracks entering the first rendition's muxer
+    av_sync_stats av_sync;
+} broadcaster_stats;
+
+typedef struct {
+    uint64_t video_frames; // frames delivered to the video mixer
+    uint64_t audio_buffers; // buffers delivered to the audio mixer
+    double fps; // since the previous twitch_broadcaster_get_source_stats() call
+    int64_t scaler_latency_us;
+    // times the source was replaced by twitch_broadcaster_replace_source(), counters above
+    // restart with every replacement
+    unsigned int swaps;
+    // glitch of the last replacement: from the previous source leaving the mixers to the first
+    // frame of the new one reaching the video mixer, and frames composited in between (with
+    // the source's tile empty), 0 until the new source delivered its first frame
+    int64_t swap_glitch_us;
+    uint64_t swap_glitch_frames;
+    // with Config.stall_timeout_ms: times the source stalled, total time spent stalled
+    // (including an ongoing stall) and whether it's stalled right now
+    unsigned int stalls;
+    int64_t stalled_us;
+    int stalled;
+    // tracks wired to the mixers right now and tracks the decoder removed while running (their
+    // elements are released, a later track of the same kind takes the source's tile again)
+    unsigned int tracks;
+    unsigned int tracks_removed;
+    // scaler and converter elements fitting the source's video to its tile, 0 when its frames
+    // go to the mixer as they are
+    unsigned int video_filters;
+    // the source's tracks entering the mixers (or the muxer when remuxed), restarting with replacements
+    av_sync_stats av_sync;
+} source_stats;
+
+typedef struct {
+    uint64_t buffers; // muxed buffers written
+    uint64_t bytes;
+    uint64_t dropped; // buffers dropped because the output couldn't keep up, whole GOPs
+    // fill level of the output's queue
+    unsigned int queue_buffers;
+    unsigned int queue_bytes;
+    uint64_t queue_time_ns;
+    unsigned int queue_percent;
+    // non 0 once the output failed and was removed, other outputs keep running
+    int detached;
+    // reconnecting outputs: successful reconnects, attempts that failed to connect, whether
+    // the output is connected right now, time spent disconnected (ongoing outage included)
+    // and muxed data held for resuming
+    unsigned int reconnects;
+    unsigned int failed_attempts;
+    int connected;
+    int64_t disconnected_us;
+    uint64_t ring_bytes;
+    // from twitch_broadcaster_start() to the first byte handed to the sink, 0 if none was yet
+    int64_t time_to_first_byte_us;
+    // bytes copied on the way out of the process: written to a file or a socket, or into the
+    // shared memory area; callbacks copy nothing unless a packet had to be merged to be mapped
+    uint64_t bytes_copied;
+} output_stats;
+
+typedef struct {
+    // video bitrate the encoder runs at (kbit/s), the lowest one so far and how often the
+    // bitrate controller lowered and raised it (Config.adaptive_bitrate)
+    unsigned int bitrate;
+    unsigned int lowest_bitrate;
+    unsigned int decreases;
+    unsigned int increases;
+    // inputs of the controller's last decision: what the fullest output sent (kbit/s), its
+    // queue's fill level (and the highest seen) and whether that counted as congestion
+    unsigned int throughput;
+    unsigned int queue_percent;
+    unsigned int max_queue_percent;
+    int congested;
+} rendition_stats;
+
+typedef struct {
+    // lookups of remote sources answered from the cache and the ones that had to be downloaded
+    unsigned int hits;
+    unsigned int misses;
+    // downloads committed to the cache and the ones that couldn't be (incomplete)
+    unsigned int stored;
+    unsigned int abandoned;
+    // objects evicted to keep the cache within Config.cache_max_bytes
+    unsigned int evicted;
+    // bytes read from the cache instead of the network and bytes written to it
+    uint64_t bytes_saved;
+    uint64_t bytes_stored;
+} cache_stats;
+
 typedef struct twitch_broadcaster {
     struct broadcaster_impl *impl;
 } twitch_broadcaster;
 
+// Events of a started broadcaster, dispatched from the main context given to
+// twitch_broadcaster_start(). Any of them may be NULL.
+typedef struct {
+    // the pipeline changed state, states are GStreamer state names (e.g. "PLAYING")
+    void (*state_changed)(twitch_broadcaster *broadcaster, const char *old_state, const char *new_state,
+                          void *user_data);
+    // an element failed, fatal is 0 when only a failing output was removed (or is reconnecting)
+    // and the broadcast goes on
+    void (*error)(twitch_broadcaster *broadcaster, const char *element, const char *message, int fatal,
+                  void *user_data);
+    // all sources ended, the broadcast finishes right after
+    void (*eos)(twitch_broadcaster *broadcaster, void *user_data);
+    // the source at the index started delivering (also after a replacement or a stall)
+    void (*source_added)(twitch_broadcaster *broadcaster, unsigned int index, void *user_data);
+    // the source at the index ended, stalled or was replaced
+    void (*source_lost)(twitch_broadcaster *broadcaster, unsigned int index, void *user_data);
+    // the broadcast finished and the pipeline is stopped (EOS, fatal error or
+    // twitch_broadcaster_stop()), result is 0 unless it failed. Called once per start.
+    void (*finished)(twitch_broadcaster *broadcaster, int result, void *user_data);
+    // audio and video of the source at the index (-1 for the muxer's input) went out of sync:
+    // their offset or its drift went beyond the Config.av_sync_* threshold
+    void (*av_sync_alarm)(twitch_broadcaster *broadcaster, int source, const av_sync_stats *stats,
+                          void *user_data);
+} broadcaster_callbacks;
+
 /**
  * Allocates memory for a new broadcaster instance
  * @return twitch_broadcaster* pointing to newly allocated instance
@@ -34,14 +419,89 @@ int twitch_broadcaster_init(twitch_broadcaster *self, Config *config);
  * Runs broadcaster
  * Starts media pipeline which will read data from give sources, process it
  * and sends it to configured location.
- * Function call will return only upon finishing the broadcast.
+ * Function call will return only upon finishing the broadcast, it runs a main loop of its
+ * own around twitch_broadcaster_start().
  * @return non 0 on failure, 0 otherwise
  */
 int twitch_broadcaster_run(twitch_broadcaster *self);
 
+/**
+ * Starts broadcasting without blocking. Messages of the pipeline are handled by a bus watch
+ * attached to the given context (NULL for the global default context) and reported through
+ * the callbacks, which are copied. The caller runs the context, one context (and thread) can
+ * drive any number of broadcasters. Once finished the broadcaster can't be started again.
+ * @return non 0 on failure (e.g. not initialised, already started), 0 otherwise
+ */
+int twitch_broadcaster_start(twitch_broadcaster *self, struct _GMainContext *context,
+                             const broadcaster_callbacks *callbacks, void *user_data);
+
+/**
+ * Stops a started broadcast right away and calls the finished callback. To be called from
+ * the thread running the broadcaster's context, callbacks included.
+ * @return non 0 on failure (e.g. not running), 0 otherwise
+ */
+int twitch_broadcaster_stop(twitch_broadcaster *self);
+
+/**
+ * Per stage performance counters. Safe to call from any thread while running and
+ * after twitch_broadcaster_run() returned.
+ * Instrumentation is always on: a handful of pad probes per video frame, each costing
+ * a lock and a counter increment, plus a scan of a 512 entry ring on stage outputs.
+ * Budget is ~2 us per frame and stage, below 0.1% of a core for 16 sources at 30 fps.
+ * @return non 0 on failure, 0 otherwise
+ */
+int twitch_broadcaster_get_stats(twitch_broadcaster *self, broadcaster_stats *stats);
+
+/**
+ * Counters of a single source, see twitch_broadcaster_get_stats().
+ * @return non 0 on failure (e.g. index out of range), 0 otherwise
+ */
+int twitch_broadcaster_get_source_stats(twitch_broadcaster *self, unsigned int index, source_stats *stats);
+
+/**
+ * Replaces the source at the given index with a new uri at the same tile position while
+ * the broadcast goes on: the old decoder chain is torn down and its mixer pads released,
+ * encoders and outputs keep running (no new rtmp handshake). The new source starts at
+ * the current position of the mix. Safe to call from any thread. When the new decoder fails
+ * to start the old source is gone nonetheless, the tile stays empty until the next replacement.
+ * @return non 0 on failure (e.g. not initialised, index out of range), 0 otherwise
+ */
+int twitch_broadcaster_replace_source(twitch_broadcaster *self, unsigned int index, const char *uri);
+
+/**
+ * Changes the memory limit of a running broadcaster, split as Config.memory_budget. Queues
+ * are limited right away, sources' download and demuxer buffering from their next buffering
+ * decision on; x264's lookahead keeps the length it started with. A host balances its
+ * budget with it.
+ * @param bytes memory limit in bytes, has to be > 0
+ * @return non 0 on failure (e.g. not initialised), 0 otherwise
+ */
+int twitch_broadcaster_set_memory_limit(twitch_broadcaster *self, uint64_t bytes);
+
+/**
+ * Counters of a single output in the order of Config.outputs (outputs of all renditions in
+ * order when renditions are configured), see twitch_broadcaster_get_stats().
+ * @return non 0 on failure (e.g. index out of range), 0 otherwise
+ */
+int twitch_broadcaster_get_output_stats(twitch_broadcaster *self, unsigned int index, output_stats *stats);
+
+/**
+ * Bitrate and congestion control of a single rendition in the order of Config.renditions (the
+ * canvas is the only rendition without a ladder), see twitch_broadcaster_get_stats().
+ * @return non 0 on failure (e.g. index out of range), 0 otherwise
+ */
+int twitch_broadcaster_get_rendition_stats(twitch_broadcaster *self, unsigned int index, rendition_stats *stats);
+
+/**
+ * Lookups and traffic of the source cache (Config.cache_dir) since the broadcaster was
+ * initialised, replaced sources included.
+ * @return non 0 on failure (e.g. no cache configured), 0 otherwise
+ */
+int twitch_broadcaster_get_cache_stats(twitch_broadcaster *self, cache_stats *stats);
 
 /**
- * Releases all resources allocated by the given broadcaster instance.
+ * Releases all resources allocated by the given broadcaster instance, a running
+ * broadcast is stopped first.
  * Safe to call multiple times.
  */
 void twitch_broadcaster_destroy(twitch_broadcaster *self);
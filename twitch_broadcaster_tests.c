@@ -1,7 +1,73 @@
 #include "twitch_broadcaster.h"
+#include "layout.h"
+#include "fixtures.h"
+#include "tile_compositor.h"
+#include "host.h"
+#include "bitrate_controller.h"
+#include "offline_render.h"
+#include "av_sync.h"
 #include <glib.h>
+#include <string.h>
+#include <glib/gstdio.h>
 #include <gst/gst.h>
 
+#define FIXTURES_DIR "fixtures"
+
+// Short locally generated sources, distinct pattern per source
+static gchar** test_sources(guint num_sources, gint width, gint height) {
+    gchar **uris = g_new0(gchar *, num_sources + 1);
+    for (guint i = 0; i < num_sources; i++) {
+        fixture_spec spec = { width, height, 30, 3, FIXTURE_H264_AAC_MP4, (gint)i };
+        uris[i] = fixture_get_uri(FIXTURES_DIR, &spec);
+        if (!uris[i]) {
+            g_strfreev(uris);
+            return NULL;
+        }
+    }
+    return uris;
+}
+
+typedef struct {
+    twitch_broadcaster *broadcaster;
+    GMainLoop *loop;
+    int result;
+    gboolean timed_out;
+} deadline_run;
+
+static void deadline_run_finished(twitch_broadcaster *broadcaster, int result, void *user_data) {
+    deadline_run *run = user_data;
+    run->result = result;
+    g_main_loop_quit(run->loop);
+}
+
+static gboolean deadline_run_expired(deadline_run *run) {
+    run->timed_out = TRUE;
+    twitch_broadcaster_stop(run->broadcaster);
+    return G_SOURCE_REMOVE;
+}
+
+// Runs the broadcast to its end like twitch_broadcaster_run(), stopping it once it's still going
+// after the deadline: a broadcast that never ends fails the test instead of hanging it
+static gboolean run_before_deadline(twitch_broadcaster *broadcaster, guint seconds) {
+    GMainContext *context = g_main_context_new();
+    deadline_run run = { broadcaster, g_main_loop_new(context, FALSE), -1, FALSE };
+    broadcaster_callbacks callbacks = { .finished = deadline_run_finished };
+    if (twitch_broadcaster_start(broadcaster, context, &callbacks, &run) == 0) {
+        GSource *deadline = g_timeout_source_new_seconds(seconds);
+        g_source_set_callback(deadline, (GSourceFunc)deadline_run_expired, &run, NULL);
+        g_source_attach(deadline, context);
+        g_main_loop_run(run.loop);
+        g_source_destroy(deadline);
+        g_source_unref(deadline);
+    }
+    g_main_loop_unref(run.loop);
+    g_main_context_unref(context);
+    if (run.timed_out) {
+        g_printerr("Broadcast still running after %u s, stopped\n", seconds);
+    }
+    return run.result == 0 && !run.timed_out;
+}
+
 gboolean test_init_with_incomplete_config_returns_error() {
     twitch_broadcaster *broadcaster = twitch_broadcaster_new();
     Config *config = g_malloc0(sizeof(Config));
@@ -26,13 +92,211 @@ gboolean test_run_without_init_returns_error() {
     return ret;
 }
 
+gboolean test_layout_tiles_cover_canvas_exactly() {
+    layout_tile tiles[16];
+    layout_type types[] = { LAYOUT_SIDE_BY_SIDE, LAYOUT_GRID, LAYOUT_MAIN_THUMBNAILS };
+    gboolean ret = TRUE;
+
+    for (guint t = 0; t < G_N_ELEMENTS(types); t++) {
+        for (guint n = 1; n <= 16; n++) {
+            gint64 area = 0;
+            if (!layout_compute(types[t], 1280, 720, n, tiles)) {
+                g_printerr("test_layout_tiles_cover_canvas_exactly FAILED: layout %d, %u tiles\n", types[t], n);
+                return FALSE;
+            }
+            for (guint i = 0; i < n; i++) {
+                if (tiles[i].x % 2 || tiles[i].y % 2 || tiles[i].width % 2 || tiles[i].height % 2 ||
+                    tiles[i].x + tiles[i].width > 1280 || tiles[i].y + tiles[i].height > 720) {
+                    ret = FALSE;
+                }
+                area += (gint64)tiles[i].width * tiles[i].height;
+            }
+            // tiles never overlap, full rows/columns cover the canvas
+            if (area > 1280 * 720 || (types[t] == LAYOUT_SIDE_BY_SIDE && area != 1280 * 720)) {
+                ret = FALSE;
+            }
+        }
+    }
+    if (!layout_compute(LAYOUT_PICTURE_IN_PICTURE, 1280, 720, 4, tiles) ||
+        tiles[0].width != 1280 || tiles[1].zorder <= tiles[0].zorder) {
+        ret = FALSE;
+    }
+    if (layout_compute(LAYOUT_GRID, 1281, 720, 2, tiles)) {
+        ret = FALSE;
+    }
+    if (!ret) {
+        g_printerr("test_layout_tiles_cover_canvas_exactly FAILED\n");
+    }
+    return ret;
+}
+
+// Simulates an uplink of capacity kbit/s draining a queue of limit bytes behind the controlled
+// encoder for the given time, average bitrate and fullest queue of the last half are returned
+static void simulate_uplink(bitrate_controller *controller, gint64 *now, gdouble *queue, guint capacity,
+                            guint seconds, gdouble *average_bitrate, guint *max_percent) {
+    const gdouble limit = 1024 * 1024;
+    const gdouble interval = BITRATE_CONTROLLER_INTERVAL_MS / 1000.0;
+    guint samples = seconds * 1000 / BITRATE_CONTROLLER_INTERVAL_MS;
+    *average_bitrate = 0;
+    *max_percent = 0;
+    for (guint i = 0; i < samples; i++) {
+        *now += BITRATE_CONTROLLER_INTERVAL_MS * 1000;
+        *queue += (controller->bitrate + BITRATE_CONTROLLER_AUDIO_BITRATE) * 1000 / 8.0 * interval;
+        gdouble sent = MIN(capacity * 1000 / 8.0 * interval, *queue);
+        *queue -= sent;
+        guint percent = (guint)MIN(*queue * 100 / limit, 100);
+        bitrate_controller_update(controller, *now, (guint)(sent * 8 / 1000 / interval), (guint)*queue, percent);
+        if (i >= samples / 2) {
+            *average_bitrate += controller->bitrate / (gdouble)(samples - samples / 2);
+            *max_percent = MAX(*max_percent, percent);
+        }
+    }
+}
+
+gboolean test_bitrate_controller_follows_uplink() {
+    bitrate_controller controller;
+    gint64 now = 0;
+    gdouble queue = 0, average = 0;
+    guint max_percent = 0;
+    gboolean ret = TRUE;
+
+    bitrate_controller_init(&controller, 3000, 0, BITRATE_CONTROLLER_AUDIO_BITRATE);
+    // a 1 Mbit/s uplink: the bitrate settles below it and the queue below the congestion mark
+    simulate_uplink(&controller, &now, &queue, 1000, 60, &average, &max_percent);
+    if (controller.decreases == 0 || controller.lowest_bitrate < 3000 / 8 ||
+        average > 1000 - BITRATE_CONTROLLER_AUDIO_BITRATE || average < 500 || max_percent >= 20) {
+        g_printerr("test_bitrate_controller_follows_uplink: %.0f kbit/s on average, queue up to %u%%\n",
+                   average, max_percent);
+        ret = FALSE;
+    }
+    // the uplink recovers and so does the bitrate, up to the maximum
+    simulate_uplink(&controller, &now, &queue, 5000, 30, &average, &max_percent);
+    if (controller.increases == 0 || controller.bitrate != 3000 || max_percent > 0) {
+        g_printerr("test_bitrate_controller_follows_uplink: back at %u kbit/s, queue up to %u%%\n",
+                   controller.bitrate, max_percent);
+        ret = FALSE;
+    }
+    if (!ret) {
+        g_printerr("test_bitrate_controller_follows_uplink FAILED\n");
+    }
+    return ret;
+}
+
+// Source pad carrying a time segment from 0, for pushing buffers through a monitor
+static GstPad* timed_pad(const gchar *name, const gchar *media_type) {
+    GstPad *pad = gst_pad_new(name, GST_PAD_SRC);
+    GstSegment segment;
+    gst_segment_init(&segment, GST_FORMAT_TIME);
+    gst_pad_set_active(pad, TRUE);
+    gst_pad_push_event(pad, gst_event_new_stream_start(name));
+    gst_pad_push_event(pad, gst_event_new_caps(gst_caps_new_empty_simple(media_type)));
+    gst_pad_push_event(pad, gst_event_new_segment(&segment));
+    return pad;
+}
+
+/**
+ * Pushes 30 fps video and AAC sized (1024 samples at 44.1 kHz) audio buffers through the monitor,
+ * in timestamp order. Audio starts audio_delay late, its timestamps run audio_rate times as fast
+ * as its media and jump ahead by audio_gap halfway through.
+ * @return alarms raised
+ */
+static guint simulate_av_tracks(av_sync_monitor *monitor, guint seconds, GstClockTime audio_delay,
+                                gdouble audio_rate, GstClockTime audio_gap) {
+    GstPad *video_pad = timed_pad("video", "video/x-raw");
+    GstPad *audio_pad = timed_pad("audio", "audio/x-raw");
+    GstClockTime audio_duration = gst_util_uint64_scale(1024, GST_SECOND, 44100);
+    guint64 frames = 0, audio_buffers = 0;
+    guint raised = 0;
+    while (TRUE) {
+        GstClockTime video_pts = gst_util_uint64_scale(frames, GST_SECOND, 30);
+        GstClockTime audio_media = audio_buffers * audio_duration;
+        GstClockTime audio_pts = audio_delay + (GstClockTime)(audio_media * audio_rate) +
+                (audio_media >= seconds * GST_SECOND / 2 ? audio_gap : 0);
+        if (video_pts >= seconds * GST_SECOND && audio_pts >= seconds * GST_SECOND) {
+            break;
+        }
+        gboolean video = video_pts <= audio_pts;
+        GstBuffer *buffer = gst_buffer_new();
+        GST_BUFFER_PTS(buffer) = video ? video_pts : audio_pts;
+        GST_BUFFER_DURATION(buffer) = video ? gst_util_uint64_scale(frames + 1, GST_SECOND, 30) - video_pts : audio_duration;
+        if (av_sync_monitor_push(monitor, video ? AV_SYNC_VIDEO : AV_SYNC_AUDIO, video ? video_pad : audio_pad, buffer)) {
+            raised++;
+        }
+        gst_buffer_unref(buffer);
+        if (video) {
+            frames++;
+        } else {
+            audio_buffers++;
+        }
+    }
+    gst_object_unref(video_pad);
+    gst_object_unref(audio_pad);
+    return raised;
+}
+
+gboolean test_av_sync_monitor_follows_offset_and_drift() {
+    av_sync_monitor monitor;
+    av_sync_stats stats;
+    gboolean ret = TRUE;
+
+    // in sync for two minutes
+    av_sync_monitor_init(&monitor, 0, 0);
+    guint raised = simulate_av_tracks(&monitor, 120, 0, 1, 0);
+    av_sync_monitor_read(&monitor, &stats);
+    av_sync_monitor_clear(&monitor);
+    if (raised || stats.alarms || ABS(stats.max_offset_ms) > 1 || ABS(stats.drift_ms_per_hour) > 1 ||
+        stats.video_discontinuities || stats.audio_discontinuities || stats.duration_ms < 119000) {
+        g_printerr("test_av_sync_monitor_follows_offset_and_drift: in sync, %.1f ms at most, %.1f ms/h\n",
+                   stats.max_offset_ms, stats.drift_ms_per_hour);
+        ret = FALSE;
+    }
+    // audio timestamps 100 ppm fast: 360 ms/h, only 12 ms off after two minutes
+    av_sync_monitor_init(&monitor, 0, 0);
+    raised = simulate_av_tracks(&monitor, 120, 0, 1.0001, 0);
+    av_sync_monitor_read(&monitor, &stats);
+    av_sync_monitor_clear(&monitor);
+    if (raised != 1 || !stats.alarm || stats.drift_ms_per_hour < 340 || stats.drift_ms_per_hour > 380 ||
+        stats.offset_ms < 10 || stats.offset_ms > 14 || stats.audio_discontinuities) {
+        g_printerr("test_av_sync_monitor_follows_offset_and_drift: drifting, %.1f ms, %.1f ms/h\n",
+                   stats.offset_ms, stats.drift_ms_per_hour);
+        ret = FALSE;
+    }
+    // audio 100 ms late from the start
+    av_sync_monitor_init(&monitor, 0, 0);
+    raised = simulate_av_tracks(&monitor, 10, 100 * GST_MSECOND, 1, 0);
+    av_sync_monitor_read(&monitor, &stats);
+    av_sync_monitor_clear(&monitor);
+    if (raised != 1 || !stats.alarm || ABS(stats.start_offset_ms - 100) > 1 || ABS(stats.offset_ms - 100) > 1) {
+        g_printerr("test_av_sync_monitor_follows_offset_and_drift: late audio, %.1f ms\n", stats.offset_ms);
+        ret = FALSE;
+    }
+    // a gap in audio is a discontinuity, playback follows the timestamps across it
+    av_sync_monitor_init(&monitor, 0, 0);
+    raised = simulate_av_tracks(&monitor, 10, 0, 1, 500 * GST_MSECOND);
+    av_sync_monitor_read(&monitor, &stats);
+    av_sync_monitor_clear(&monitor);
+    if (raised || stats.audio_discontinuities != 1 || stats.video_discontinuities || ABS(stats.max_offset_ms) > 1) {
+        g_printerr("test_av_sync_monitor_follows_offset_and_drift: %u audio discontinuities, %.1f ms at most\n",
+                   stats.audio_discontinuities, stats.max_offset_ms);
+        ret = FALSE;
+    }
+    if (!ret) {
+        g_printerr("test_av_sync_monitor_follows_offset_and_drift FAILED\n");
+    }
+    return ret;
+}
+
 gboolean test_mixing_3_sources_creates_correct_file() {
     twitch_broadcaster *broadcaster = twitch_broadcaster_new();
     Config *config = g_malloc0(sizeof(Config));
     gboolean ret = TRUE;
-    config->source1 = "https://www.freedesktop.org/software/gstreamer-sdk/data/media/sintel_trailer-480p.webm";
-    config->source2 = "https://dl8.webmfiles.org/big-buck-bunny_trailer.webm";
-    config->source3 = "https://dl8.webmfiles.org/elephants-dream.webm";
+    char *sources[] = {
+            "https://www.freedesktop.org/software/gstreamer-sdk/data/media/sintel_trailer-480p.webm",
+            "https://dl8.webmfiles.org/big-buck-bunny_trailer.webm",
+            "https://dl8.webmfiles.org/elephants-dream.webm",
+            NULL
+    };
+    config->sources = sources;
     config->file_sink = "mixed.flv";
 
     if(twitch_broadcaster_init(broadcaster, config) != 0) {
@@ -47,19 +311,1681 @@ gboolean test_mixing_3_sources_creates_correct_file() {
         ret = FALSE;
         goto exit;
     }
-    // TODO: more checks on produced file
-    // eg. using gst_discoverer* API
+    broadcaster_stats stats;
+    if (twitch_broadcaster_get_stats(broadcaster, &stats) != 0 || stats.stages[STAGE_ENCODER].buffers == 0) {
+        g_printerr("test_mixing_3_sources_creates_correct_file FAILED: no frames encoded\n");
+        ret = FALSE;
+        goto exit;
+    }
+    // every stage saw the frames that were encoded
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        if (stats.stages[i].buffers < stats.stages[STAGE_ENCODER].buffers) {
+            g_printerr("test_mixing_3_sources_creates_correct_file FAILED: stage %d saw %" G_GUINT64_FORMAT " buffers\n",
+                       i, stats.stages[i].buffers);
+            ret = FALSE;
+        }
+    }
+    if (stats.num_sources != 3 || stats.stages[STAGE_ENCODER].latency_us == 0) {
+        ret = FALSE;
+    }
+    // the file decodes to both tracks, in sync and without discontinuities
+    av_sync_stats sync;
+    if (!av_sync_verify_file(config->file_sink, 0, 0, &sync) || sync.alarms ||
+        sync.video_discontinuities || sync.audio_discontinuities) {
+        g_printerr("test_mixing_3_sources_creates_correct_file FAILED: audio %.1f ms against video at most, "
+                   "%u/%u discontinuities\n", sync.max_offset_ms, sync.video_discontinuities, sync.audio_discontinuities);
+        ret = FALSE;
+    }
     exit:
     g_free(config);
     twitch_broadcaster_destroy(broadcaster);
     return ret;
 };
 
+gboolean test_low_latency_mode_meets_latency_target() {
+    twitch_broadcaster *broadcaster = twitch_broadcaster_new();
+    Config *config = g_malloc0(sizeof(Config));
+    gboolean ret = TRUE;
+    broadcaster_stats stats;
+    gchar **sources = test_sources(2, 1280, 720);
+    config->sources = sources;
+    config->file_sink = "low_latency.flv";
+    config->low_latency = 1;
+
+    if (twitch_broadcaster_init(broadcaster, config) != 0 || twitch_broadcaster_run(broadcaster) != 0) {
+        ret = FALSE;
+        goto exit;
+    }
+    twitch_broadcaster_get_stats(broadcaster, &stats);
+    if (stats.pipeline_latency_us == 0 || stats.pipeline_latency_us > 500 * 1000) {
+        g_printerr("test_low_latency_mode_meets_latency_target FAILED: average latency %" G_GINT64_FORMAT " us\n",
+                   stats.pipeline_latency_us);
+        ret = FALSE;
+    }
+    exit:
+    g_strfreev(sources);
+    g_free(config);
+    twitch_broadcaster_destroy(broadcaster);
+    return ret;
+}
+
+gboolean test_mixing_synthetic_sources_offline() {
+    twitch_broadcaster *broadcaster = twitch_broadcaster_new();
+    Config *config = g_malloc0(sizeof(Config));
+    gboolean ret = TRUE;
+    broadcaster_stats stats;
+    gchar **sources = test_sources(4, 640, 480);
+    config->sources = sources;
+    config->file_sink = "mixed_offline.flv";
+    config->width = 1280;
+    config->height = 720;
+    config->layout = LAYOUT_GRID;
+
+    if (!sources || twitch_broadcaster_init(broadcaster, config) != 0 || twitch_broadcaster_run(broadcaster) != 0) {
+        ret = FALSE;
+        goto exit;
+    }
+    // 3 s of 30 fps sources
+    twitch_broadcaster_get_stats(broadcaster, &stats);
+    if (!g_file_test(config->file_sink, G_FILE_TEST_EXISTS) || stats.stages[STAGE_ENCODER].buffers < 85 ||
+        stats.time_to_first_buffer_us == 0) {
+        ret = FALSE;
+    }
+    for (guint i = 0; i < 4; i++) {
+        source_stats source;
+        if (twitch_broadcaster_get_source_stats(broadcaster, i, &source) != 0 || source.video_frames < 85 ||
+            source.audio_buffers == 0 || source.av_sync.alarms || source.av_sync.duration_ms < 2500) {
+            ret = FALSE;
+        }
+    }
+    // muxed in sync, and so is what was written
+    av_sync_stats sync;
+    if (stats.av_sync.alarms || stats.av_sync.duration_ms < 2500 ||
+        !av_sync_verify_file(config->file_sink, 0, 0, &sync) || sync.alarms || sync.duration_ms < 2500 ||
+        sync.video_discontinuities || sync.audio_discontinuities) {
+        g_printerr("test_mixing_synthetic_sources_offline: muxed audio %.1f ms against video at most, written "
+                   "%.1f ms, %u/%u discontinuities\n", stats.av_sync.max_offset_ms, sync.max_offset_ms,
+                   sync.video_discontinuities, sync.audio_discontinuities);
+        ret = FALSE;
+    }
+    exit:
+    if (!ret) {
+        g_printerr("test_mixing_synthetic_sources_offline FAILED\n");
+    }
+    g_strfreev(sources);
+    g_free(config);
+    twitch_broadcaster_destroy(broadcaster);
+    return ret;
+}
+
+// FLV file an output dropped data of: it starts with the file header and the AVC sequence
+// header, and video starts again at a keyframe after every gap (data is dropped in whole GOPs)
+static gboolean flv_gaps_start_at_keyframes(const gchar *location) {
+    gchar *data = NULL;
+    gsize size = 0;
+    gboolean sequence_header = FALSE, ok = TRUE;
+    gint64 last_timestamp = -1;
+    if (!g_file_get_contents(location, &data, &size, NULL) || size < 13 || memcmp(data, "FLV", 3) != 0) {
+        g_free(data);
+        return FALSE;
+    }
+    const guint8 *bytes = (const guint8*)data;
+    // file header and the first previous tag size, then tag header, data and tag size
+    for (gsize offset = 13; ok && offset + 13 <= size;) {
+        gsize length = bytes[offset + 1] << 16 | bytes[offset + 2] << 8 | bytes[offset + 3];
+        gint64 timestamp = (gint64)bytes[offset + 7] << 24 | bytes[offset + 4] << 16 | bytes[offset + 5] << 8 | bytes[offset + 6];
+        if (bytes[offset] == 9 && bytes[offset + 12] == 0) {
+            sequence_header = TRUE;
+        } else if (bytes[offset] == 9 && bytes[offset + 12] == 1) {
+            gboolean keyframe = bytes[offset + 11] >> 4 == 1;
+            if (!sequence_header || ((last_timestamp < 0 || timestamp - last_timestamp > 100) && !keyframe)) {
+                ok = FALSE;
+            }
+            last_timestamp = timestamp;
+        }
+        offset += 11 + length + 4;
+    }
+    g_free(data);
+    return ok && last_timestamp >= 0;
+}
+
+gboolean test_slow_output_does_not_stall_others() {
+    twitch_broadcaster *broadcaster = twitch_broadcaster_new();
+    Config *config = g_malloc0(sizeof(Config));
+    gboolean ret = TRUE;
+    broadcaster_stats stats;
+    output_stats fast[2], slow;
+    gchar **sources = test_sources(2, 640, 480);
+    // two regular outputs and one throttled far below the stream's bitrate
+    Output outputs[] = {
+            { OUTPUT_FILE, "fan_out_0.flv" },
+            { OUTPUT_FILE, "fan_out_1.flv" },
+            { OUTPUT_FILE, "fan_out_slow.flv", 0, 64 * 1024, 16 * 1024 },
+    };
+    config->sources = sources;
+    config->outputs = outputs;
+    config->num_outputs = G_N_ELEMENTS(outputs);
+    config->width = 1280;
+    config->height = 720;
+
+    if (!sources || twitch_broadcaster_init(broadcaster, config) != 0 || twitch_broadcaster_run(broadcaster) != 0) {
+        ret = FALSE;
+        goto exit;
+    }
+    twitch_broadcaster_get_stats(broadcaster, &stats);
+    if (twitch_broadcaster_get_output_stats(broadcaster, 0, &fast[0]) != 0 ||
+        twitch_broadcaster_get_output_stats(broadcaster, 1, &fast[1]) != 0 ||
+        twitch_broadcaster_get_output_stats(broadcaster, 2, &slow) != 0 ||
+        twitch_broadcaster_get_output_stats(broadcaster, 3, &slow) == 0) {
+        ret = FALSE;
+        goto exit;
+    }
+    // encoded once: both regular outputs got the whole stream, the slow one dropped whole GOPs
+    if (stats.stages[STAGE_ENCODER].buffers < 85 || fast[0].dropped || fast[1].dropped ||
+        fast[0].bytes == 0 || fast[0].bytes != fast[1].bytes || slow.dropped == 0 || slow.bytes >= fast[0].bytes ||
+        !flv_gaps_start_at_keyframes("fan_out_slow.flv")) {
+        ret = FALSE;
+    }
+    exit:
+    if (!ret) {
+        g_printerr("test_slow_output_does_not_stall_others FAILED\n");
+    }
+    g_strfreev(sources);
+    g_free(config);
+    twitch_broadcaster_destroy(broadcaster);
+    return ret;
+}
+
+// What a callback output was handed
+typedef struct {
+    guint64 muxed_bytes;
+    guint muxed;
+    gboolean starts_with_flv_header;
+    guint video;
+    guint video_headers;
+    guint audio;
+    guint audio_headers;
+    gboolean header_first;
+    gboolean keyframe_first;
+    gboolean dts_backwards;
+    gint64 last_dts;
+} packet_log;
+
+static void packet_log_callback(const output_packet *packet, void *user_data) {
+    packet_log *log = user_data;
+    if (packet->track == PACKET_MUXED) {
+        if (!log->muxed) {
+            log->starts_with_flv_header = packet->header && packet->size > 3 && memcmp(packet->data, "FLV", 3) == 0;
+        }
+        log->muxed++;
+        log->muxed_bytes += packet->size;
+    } else if (packet->track == PACKET_AUDIO) {
+        log->audio_headers += packet->header ? 1 : 0;
+        log->audio += packet->header ? 0 : 1;
+    } else if (packet->header) {
+        log->header_first = log->header_first || !log->video;
+        log->video_headers++;
+    } else {
+        if (!log->video) {
+            log->keyframe_first = packet->keyframe;
+        } else if (packet->dts < log->last_dts) {
+            log->dts_backwards = TRUE;
+        }
+        log->last_dts = packet->dts;
+        log->video++;
+    }
+}
+
+gboolean test_callback_outputs_hand_out_packets() {
+    twitch_broadcaster *broadcaster = twitch_broadcaster_new();
+    Config *config = g_malloc0(sizeof(Config));
+    gboolean ret = TRUE;
+    output_stats file, flv, elementary;
+    packet_log muxed_log = { 0 }, elementary_log = { 0 };
+    gchar **sources = test_sources(1, 320, 240);
+    Output outputs[] = {
+            { OUTPUT_FILE, "callback.flv" },
+            { OUTPUT_CALLBACK, NULL, 0, 0, 0, 0, 0, packet_log_callback, &muxed_log, PACKETS_FLV },
+            { OUTPUT_CALLBACK, NULL, 0, 0, 0, 0, 0, packet_log_callback, &elementary_log, PACKETS_ELEMENTARY },
+    };
+    config->sources = sources;
+    config->outputs = outputs;
+    config->num_outputs = G_N_ELEMENTS(outputs);
+    config->width = 320;
+    config->height = 240;
+
+    if (!sources || twitch_broadcaster_init(broadcaster, config) != 0 || twitch_broadcaster_run(broadcaster) != 0 ||
+        twitch_broadcaster_get_output_stats(broadcaster, 0, &file) != 0 ||
+        twitch_broadcaster_get_output_stats(broadcaster, 1, &flv) != 0 ||
+        twitch_broadcaster_get_output_stats(broadcaster, 2, &elementary) != 0) {
+        ret = FALSE;
+        goto exit;
+    }
+    // the same muxed stream as the file, from its header on
+    if (!muxed_log.starts_with_flv_header || muxed_log.muxed_bytes != file.bytes || flv.bytes != file.bytes ||
+        flv.dropped || file.dropped) {
+        ret = FALSE;
+    }
+    // every encoded frame, configuration ahead of the first one, decodable from the first one
+    if (elementary_log.video < 85 || !elementary_log.header_first || !elementary_log.keyframe_first ||
+        elementary_log.dts_backwards || !elementary_log.audio || !elementary_log.audio_headers) {
+        ret = FALSE;
+    }
+    // mapped in place, the file output wrote everything out
+    if (flv.bytes_copied || elementary.bytes_copied || file.bytes_copied != file.bytes) {
+        ret = FALSE;
+    }
+    exit:
+    if (!ret) {
+        g_printerr("test_callback_outputs_hand_out_packets FAILED\n");
+    }
+    g_strfreev(sources);
+    g_free(config);
+    twitch_broadcaster_destroy(broadcaster);
+    return ret;
+}
+
+gboolean test_adaptive_bitrate_follows_rate_limited_output() {
+    twitch_broadcaster *broadcaster = twitch_broadcaster_new();
+    Config *config = g_malloc0(sizeof(Config));
+    gboolean ret = TRUE;
+    broadcaster_stats stats;
+    rendition_stats rendition;
+    output_stats output;
+    // snow keeps x264 at its bitrate, 2 Mbit/s through an 800 kbit/s uplink
+    fixture_spec spec = { 640, 360, 30, 12, FIXTURE_H264_AAC_MP4, 1, 4000 };
+    gchar *sources[] = { fixture_get_uri(FIXTURES_DIR, &spec), NULL };
+    Output outputs[] = { { OUTPUT_FILE, "adaptive.flv", 0, 0, 100 * 1000 } };
+    Rendition renditions[] = { { 640, 360, 2000, outputs, G_N_ELEMENTS(outputs) } };
+    config->sources = sources;
+    config->renditions = renditions;
+    config->num_renditions = G_N_ELEMENTS(renditions);
+    config->width = 640;
+    config->height = 360;
+    // realtime, like a live broadcast
+    config->stall_timeout_ms = 1000;
+    config->adaptive_bitrate = 1;
+
+    // 12 s of source and the queue draining through the uplink
+    if (!sources[0] || twitch_broadcaster_init(broadcaster, config) != 0 || !run_before_deadline(broadcaster, 60)) {
+        ret = FALSE;
+        goto exit;
+    }
+    twitch_broadcaster_get_stats(broadcaster, &stats);
+    twitch_broadcaster_get_rendition_stats(broadcaster, 0, &rendition);
+    twitch_broadcaster_get_output_stats(broadcaster, 0, &output);
+    // backed off below the uplink before the queue filled up, nothing dropped upstream
+    if (rendition.decreases == 0 || rendition.lowest_bitrate >= 800 || rendition.max_queue_percent >= 100 ||
+        stats.stages[STAGE_ENCODER].buffers < 12 * 30 * 0.9 || stats.stages[STAGE_ENCODER].dropped ||
+        twitch_broadcaster_get_rendition_stats(broadcaster, 1, &rendition) == 0) {
+        g_printerr("test_adaptive_bitrate_follows_rate_limited_output: lowest %u kbit/s after %u decreases, "
+                   "queue up to %u%%, %" G_GUINT64_FORMAT " frames encoded\n", rendition.lowest_bitrate,
+                   rendition.decreases, rendition.max_queue_percent, stats.stages[STAGE_ENCODER].buffers);
+        ret = FALSE;
+    }
+    exit:
+    if (!ret) {
+        g_printerr("test_adaptive_bitrate_follows_rate_limited_output FAILED\n");
+    }
+    g_free(sources[0]);
+    g_free(config);
+    twitch_broadcaster_destroy(broadcaster);
+    return ret;
+}
+
+gboolean test_rendition_ladder_composites_once() {
+    twitch_broadcaster *broadcaster = twitch_broadcaster_new();
+    Config *config = g_malloc0(sizeof(Config));
+    gboolean ret = TRUE;
+    broadcaster_stats stats;
+    output_stats outputs[2];
+    gchar **sources = test_sources(2, 640, 480);
+    Output rendition_outputs[] = {
+            { OUTPUT_FILE, "ladder_720p.flv" },
+            { OUTPUT_FILE, "ladder_360p.flv" },
+    };
+    Rendition renditions[] = {
+            { 1280, 720, 2500, &rendition_outputs[0], 1 },
+            { 640, 360, 800, &rendition_outputs[1], 1 },
+    };
+    config->sources = sources;
+    config->renditions = renditions;
+    config->num_renditions = G_N_ELEMENTS(renditions);
+    config->width = 1280;
+    config->height = 720;
+
+    if (!sources || twitch_broadcaster_init(broadcaster, config) != 0 || twitch_broadcaster_run(broadcaster) != 0) {
+        ret = FALSE;
+        goto exit;
+    }
+    twitch_broadcaster_get_stats(broadcaster, &stats);
+    if (twitch_broadcaster_get_output_stats(broadcaster, 0, &outputs[0]) != 0 ||
+        twitch_broadcaster_get_output_stats(broadcaster, 1, &outputs[1]) != 0) {
+        ret = FALSE;
+        goto exit;
+    }
+    // one composite for both renditions, the smaller one at a lower bitrate
+    if (stats.stages[STAGE_MIXER].buffers < 85 || stats.stages[STAGE_ENCODER].buffers < 85 ||
+        outputs[0].bytes == 0 || outputs[1].bytes == 0 || outputs[1].bytes >= outputs[0].bytes) {
+        ret = FALSE;
+    }
+    exit:
+    if (!ret) {
+        g_printerr("test_rendition_ladder_composites_once FAILED\n");
+    }
+    g_strfreev(sources);
+    g_free(config);
+    twitch_broadcaster_destroy(broadcaster);
+    return ret;
+}
+
+static gpointer run_broadcaster_thread(gpointer broadcaster) {
+    return GINT_TO_POINTER(twitch_broadcaster_run(broadcaster));
+}
+
+gboolean test_replace_source_while_running() {
+    twitch_broadcaster *broadcaster = twitch_broadcaster_new();
+    Config *config = g_malloc0(sizeof(Config));
+    gboolean ret = TRUE;
+    broadcaster_stats stats;
+    source_stats source;
+    // long enough to still be running when the first source gets replaced
+    fixture_spec long_spec = { 640, 480, 30, 10, FIXTURE_H264_AAC_MP4, 0 };
+    fixture_spec replacement_spec = { 640, 480, 30, 3, FIXTURE_VP8_VORBIS_WEBM, 2 };
+    gchar *sources[] = { fixture_get_uri(FIXTURES_DIR, &long_spec), fixture_get_uri(FIXTURES_DIR, &long_spec), NULL };
+    gchar *replacement = fixture_get_uri(FIXTURES_DIR, &replacement_spec);
+    GThread *thread = NULL;
+    config->sources = sources;
+    config->file_sink = "replaced.flv";
+    config->width = 1280;
+    config->height = 720;
+
+    if (!sources[0] || !replacement || twitch_broadcaster_init(broadcaster, config) != 0) {
+        ret = FALSE;
+        goto exit;
+    }
+    thread = g_thread_new("broadcaster", run_broadcaster_thread, broadcaster);
+    // wait for the mix to get going (at most 10 s)
+    for (guint i = 0; i < 1000; i++) {
+        g_usleep(10 * 1000);
+        twitch_broadcaster_get_stats(broadcaster, &stats);
+        if (stats.stages[STAGE_MIXER].buffers >= 30) {
+            break;
+        }
+    }
+    if (twitch_broadcaster_replace_source(broadcaster, 0, replacement) != 0 ||
+        twitch_broadcaster_replace_source(broadcaster, 2, replacement) == 0) {
+        ret = FALSE;
+    }
+    if (GPOINTER_TO_INT(g_thread_join(thread)) != 0) {
+        ret = FALSE;
+        goto exit;
+    }
+    // all of the replacement got mixed, the glitch was measured
+    if (twitch_broadcaster_get_source_stats(broadcaster, 0, &source) != 0 || source.swaps != 1 ||
+        source.video_frames < 85 || source.audio_buffers == 0 || source.swap_glitch_us <= 0) {
+        ret = FALSE;
+    } else {
+        g_print("Source replaced with a glitch of %.1f ms, %" G_GUINT64_FORMAT " frames\n",
+                source.swap_glitch_us / 1000.0, source.swap_glitch_frames);
+    }
+    exit:
+    if (!ret) {
+        g_printerr("test_replace_source_while_running FAILED\n");
+    }
+    g_free(sources[0]);
+    g_free(sources[1]);
+    g_free(replacement);
+    g_free(config);
+    twitch_broadcaster_destroy(broadcaster);
+    return ret;
+}
+
+// Waits (at most 5 s) for both tracks of the source to be wired and its frames to get mixed
+static gboolean wait_for_source_tracks(twitch_broadcaster *broadcaster, guint index, guint64 frames) {
+    source_stats source;
+    for (guint i = 0; i < 500; i++) {
+        if (twitch_broadcaster_get_source_stats(broadcaster, index, &source) == 0 && source.tracks == 2 &&
+            source.video_frames >= frames && source.audio_buffers > 0) {
+            return TRUE;
+        }
+        g_usleep(10 * 1000);
+    }
+    return FALSE;
+}
+
+gboolean test_replaced_sources_release_elements() {
+    twitch_broadcaster *broadcaster = twitch_broadcaster_new();
+    Config *config = g_malloc0(sizeof(Config));
+    gboolean ret = TRUE;
+    broadcaster_stats before, after;
+    // replacements decode like the source they replace, the same elements get plugged
+    fixture_spec long_spec = { 640, 480, 30, 10, FIXTURE_H264_AAC_MP4, 0 };
+    fixture_spec replacement_spec = { 640, 480, 30, 3, FIXTURE_H264_AAC_MP4, 1 };
+    gchar *sources[] = { fixture_get_uri(FIXTURES_DIR, &long_spec), fixture_get_uri(FIXTURES_DIR, &long_spec), NULL };
+    gchar *replacement = fixture_get_uri(FIXTURES_DIR, &replacement_spec);
+    GThread *thread = NULL;
+    config->sources = sources;
+    config->file_sink = "released.flv";
+    config->width = 1280;
+    config->height = 720;
+
+    if (!sources[0] || !replacement || twitch_broadcaster_init(broadcaster, config) != 0) {
+        ret = FALSE;
+        goto exit;
+    }
+    thread = g_thread_new("broadcaster", run_broadcaster_thread, broadcaster);
+    if (!wait_for_source_tracks(broadcaster, 0, 30) || !wait_for_source_tracks(broadcaster, 1, 30)) {
+        ret = FALSE;
+    }
+    twitch_broadcaster_get_stats(broadcaster, &before);
+    for (guint i = 0; ret && i < 4; i++) {
+        if (twitch_broadcaster_replace_source(broadcaster, 0, replacement) != 0 ||
+            !wait_for_source_tracks(broadcaster, 0, 15)) {
+            ret = FALSE;
+        }
+    }
+    twitch_broadcaster_get_stats(broadcaster, &after);
+    if (GPOINTER_TO_INT(g_thread_join(thread)) != 0) {
+        ret = FALSE;
+        goto exit;
+    }
+    // every replaced decoder, its tracks' elements and mixer pads went away
+    if (!before.elements || after.elements != before.elements || before.mixer_pads != 4 ||
+        after.mixer_pads != before.mixer_pads) {
+        g_printerr("%u elements and %u mixer pads before replacing, %u and %u after\n",
+                   before.elements, before.mixer_pads, after.elements, after.mixer_pads);
+        ret = FALSE;
+    }
+    exit:
+    if (!ret) {
+        g_printerr("test_replaced_sources_release_elements FAILED\n");
+    }
+    g_free(sources[0]);
+    g_free(sources[1]);
+    g_free(replacement);
+    g_free(config);
+    twitch_broadcaster_destroy(broadcaster);
+    return ret;
+}
+
+gboolean test_chained_source_replaces_tracks() {
+    twitch_broadcaster *broadcaster = twitch_broadcaster_new();
+    Config *config = g_malloc0(sizeof(Config));
+    gboolean ret = TRUE;
+    broadcaster_stats before, after;
+    source_stats source;
+    // the decoder removes both tracks of the first chain and adds new ones for the second
+    fixture_spec first_spec = { 640, 480, 30, 3, FIXTURE_THEORA_VORBIS_OGG, 1 };
+    fixture_spec second_spec = { 640, 480, 30, 3, FIXTURE_THEORA_VORBIS_OGG, 2 };
+    fixture_spec long_spec = { 640, 480, 30, 6, FIXTURE_H264_AAC_MP4, 0 };
+    gchar *sources[] = { fixture_get_chained_uri(FIXTURES_DIR, &first_spec, &second_spec),
+                         fixture_get_uri(FIXTURES_DIR, &long_spec), NULL };
+    GThread *thread = NULL;
+    config->sources = sources;
+    config->file_sink = "chained.flv";
+    config->width = 1280;
+    config->height = 720;
+
+    if (!sources[0] || !sources[1] || twitch_broadcaster_init(broadcaster, config) != 0) {
+        ret = FALSE;
+        goto exit;
+    }
+    thread = g_thread_new("broadcaster", run_broadcaster_thread, broadcaster);
+    if (!wait_for_source_tracks(broadcaster, 0, 30) || !wait_for_source_tracks(broadcaster, 1, 30)) {
+        ret = FALSE;
+    }
+    twitch_broadcaster_get_stats(broadcaster, &before);
+    // wait (at most 10 s) for frames of the second chain to get mixed, the first one has 90,
+    // and for the first chain's elements and mixer pads to go away
+    gboolean replaced = FALSE;
+    for (guint i = 0; ret && !replaced && i < 1000; i++) {
+        g_usleep(10 * 1000);
+        twitch_broadcaster_get_stats(broadcaster, &after);
+        replaced = twitch_broadcaster_get_source_stats(broadcaster, 0, &source) == 0 &&
+                   source.tracks_removed == 2 && source.tracks == 2 && source.video_frames >= 120 &&
+                   source.audio_buffers > 0 && after.elements == before.elements &&
+                   after.mixer_pads == before.mixer_pads;
+    }
+    if (GPOINTER_TO_INT(g_thread_join(thread)) != 0) {
+        ret = FALSE;
+        goto exit;
+    }
+    if (ret && !replaced) {
+        g_printerr("%u tracks (%u removed), %" G_GUINT64_FORMAT " frames mixed, %u elements and %u mixer pads "
+                   "before the chain ended, %u and %u after\n", source.tracks, source.tracks_removed,
+                   source.video_frames, before.elements, before.mixer_pads, after.elements, after.mixer_pads);
+        ret = FALSE;
+    }
+    exit:
+    if (!ret) {
+        g_printerr("test_chained_source_replaces_tracks FAILED\n");
+    }
+    g_free(sources[0]);
+    g_free(sources[1]);
+    g_free(config);
+    twitch_broadcaster_destroy(broadcaster);
+    return ret;
+}
+
+// Events of one broadcaster sharing a main context with others
+typedef struct {
+    guint *running;
+    GMainLoop *loop;
+    gboolean stop_when_playing;
+    gboolean playing;
+    guint sources_added;
+    guint errors;
+    gboolean eos;
+    gint result;
+    guint finished;
+} async_events;
+
+static void async_state_changed(twitch_broadcaster *broadcaster, const char *old_state, const char *new_state,
+                                void *user_data) {
+    async_events *events = user_data;
+    if (g_str_equal(new_state, "PLAYING")) {
+        events->playing = TRUE;
+        if (events->stop_when_playing) {
+            twitch_broadcaster_stop(broadcaster);
+        }
+    }
+}
+
+static void async_error(twitch_broadcaster *broadcaster, const char *element, const char *message, int fatal,
+                        void *user_data) {
+    ((async_events *)user_data)->errors++;
+}
+
+static void async_eos(twitch_broadcaster *broadcaster, void *user_data) {
+    ((async_events *)user_data)->eos = TRUE;
+}
+
+static void async_source_added(twitch_broadcaster *broadcaster, unsigned int index, void *user_data) {
+    ((async_events *)user_data)->sources_added++;
+}
+
+static void async_finished(twitch_broadcaster *broadcaster, int result, void *user_data) {
+    async_events *events = user_data;
+    events->result = result;
+    events->finished++;
+    if (--(*events->running) == 0) {
+        g_main_loop_quit(events->loop);
+    }
+}
+
+gboolean test_broadcasters_share_main_context() {
+    const guint num_broadcasters = 4;
+    twitch_broadcaster *broadcasters[4];
+    Config configs[4];
+    async_events events[4];
+    gchar *file_sinks[4];
+    gboolean ret = TRUE;
+    guint running = 0;
+    // the last one outlives the others unless it's stopped
+    fixture_spec spec = { 320, 240, 30, 3, FIXTURE_H264_AAC_MP4, 0 };
+    fixture_spec long_spec = { 320, 240, 30, 10, FIXTURE_H264_AAC_MP4, 1 };
+    gchar *sources[] = { fixture_get_uri(FIXTURES_DIR, &spec), NULL };
+    gchar *long_sources[] = { fixture_get_uri(FIXTURES_DIR, &long_spec), NULL };
+    GMainContext *context = g_main_context_new();
+    GMainLoop *loop = g_main_loop_new(context, FALSE);
+    broadcaster_callbacks callbacks = {
+            async_state_changed, async_error, async_eos, async_source_added, NULL, async_finished
+    };
+
+    memset(configs, 0, sizeof(configs));
+    memset(events, 0, sizeof(events));
+    for (guint i = 0; i < num_broadcasters; i++) {
+        broadcasters[i] = twitch_broadcaster_new();
+        file_sinks[i] = g_strdup_printf("async%u.flv", i);
+        configs[i].sources = i == num_broadcasters - 1 ? long_sources : sources;
+        configs[i].file_sink = file_sinks[i];
+        configs[i].width = 320;
+        configs[i].height = 240;
+        events[i].running = &running;
+        events[i].loop = loop;
+        events[i].result = -1;
+        events[i].stop_when_playing = i == num_broadcasters - 1;
+    }
+    if (!sources[0] || !long_sources[0]) {
+        ret = FALSE;
+        goto exit;
+    }
+    for (guint i = 0; i < num_broadcasters; i++) {
+        if (twitch_broadcaster_init(broadcasters[i], &configs[i]) != 0 ||
+            twitch_broadcaster_start(broadcasters[i], context, &callbacks, &events[i]) != 0) {
+            ret = FALSE;
+            goto exit;
+        }
+        running++;
+    }
+    // a started broadcaster can't be started again
+    if (twitch_broadcaster_start(broadcasters[0], context, &callbacks, &events[0]) == 0) {
+        ret = FALSE;
+    }
+    // every broadcaster is driven from this thread only
+    g_main_loop_run(loop);
+    for (guint i = 0; i < num_broadcasters; i++) {
+        gboolean stopped = events[i].stop_when_playing;
+        if (events[i].finished != 1 || events[i].result != 0 || events[i].errors || !events[i].playing ||
+            events[i].eos == stopped || (!stopped && events[i].sources_added != 1) ||
+            twitch_broadcaster_stop(broadcasters[i]) == 0) {
+            g_printerr("Broadcaster %u: finished %u, result %d, errors %u, sources added %u\n", i,
+                       events[i].finished, events[i].result, events[i].errors, events[i].sources_added);
+            ret = FALSE;
+        }
+    }
+    exit:
+    if (!ret) {
+        g_printerr("test_broadcasters_share_main_context FAILED\n");
+    }
+    for (guint i = 0; i < num_broadcasters; i++) {
+        twitch_broadcaster_destroy(broadcasters[i]);
+        g_free(file_sinks[i]);
+    }
+    g_main_loop_unref(loop);
+    g_main_context_unref(context);
+    g_free(sources[0]);
+    g_free(long_sources[0]);
+    return ret;
+}
+
+gboolean test_host_divides_budget_between_broadcasters() {
+    HostConfig host_config = { .memory_budget = 64 * 1024 * 1024, .encoder_threads = 4, .expected_broadcasters = 2,
+                               .max_threads = 128 };
+    HostConfig unexpected = { .encoder_threads = 4 };
+    gboolean ret = TRUE;
+    host_stats stats;
+    fixture_spec spec = { 320, 240, 30, 3, FIXTURE_H264_AAC_MP4, 0 };
+    gchar *sources[] = { fixture_get_uri(FIXTURES_DIR, &spec), NULL };
+    gchar *file_sinks[] = { "host0.flv", "host1.flv" };
+    GMainContext *context = g_main_context_new();
+    broadcaster_host *host = host_new(&host_config, context);
+
+    if (!sources[0] || !host) {
+        ret = FALSE;
+        goto exit;
+    }
+    // encoder threads can't be divided without knowing between how many
+    if (host_new(&unexpected, context)) {
+        ret = FALSE;
+        goto exit;
+    }
+    for (guint i = 0; i < G_N_ELEMENTS(file_sinks); i++) {
+        Config config = { 0 };
+        config.sources = sources;
+        config.file_sink = file_sinks[i];
+        config.width = 320;
+        config.height = 240;
+        if (host_add(host, &config, NULL, NULL) != (int)i) {
+            ret = FALSE;
+            goto exit;
+        }
+        // the first one doesn't take the threads the second one will need
+        host_get_stats(host, &stats);
+        if (stats.broadcasters != i + 1 || stats.encoder_threads != 2) {
+            ret = FALSE;
+        }
+    }
+    host_get_stats(host, &stats);
+    if (stats.memory_limit != host_config.memory_budget / 2) {
+        ret = FALSE;
+    }
+    if (host_run(host) != 0) {
+        ret = FALSE;
+        goto exit;
+    }
+    host_get_stats(host, &stats);
+    if (stats.broadcasters != 0 || stats.finished != 2 || stats.failed != 0 || stats.frames < 170 ||
+        stats.cpu_us == 0 || stats.queued_bytes != 0) {
+        ret = FALSE;
+    }
+    if (host_remove(host, 0) != 0 || host_get_broadcaster(host, 0) || !host_get_broadcaster(host, 1) ||
+        host_remove(host, 0) == 0) {
+        ret = FALSE;
+    }
+    exit:
+    if (!ret) {
+        g_printerr("test_host_divides_budget_between_broadcasters FAILED\n");
+    }
+    host_free(host);
+    g_main_context_unref(context);
+    g_free(sources[0]);
+    return ret;
+}
+
+gboolean test_host_shares_decoders_between_broadcasters() {
+    HostConfig host_config = { .encoder_threads = 3, .expected_broadcasters = 3, .share_decoders = 1 };
+    gboolean ret = TRUE;
+    host_stats running, finished;
+    fixture_spec spec = { 320, 240, 30, 3, FIXTURE_H264_AAC_MP4, 0 };
+    gchar *sources[] = { fixture_get_uri(FIXTURES_DIR, &spec), NULL };
+    gchar *file_sinks[] = { "shared0.flv", "shared1.flv", "shared2.flv" };
+    GMainContext *context = g_main_context_new();
+    broadcaster_host *host = host_new(&host_config, context);
+
+    if (!sources[0] || !host) {
+        ret = FALSE;
+        goto exit;
+    }
+    // encoder threads can't be divided without knowing between how many
+    if (host_new(&unexpected, context)) {
+        ret = FALSE;
+        goto exit;
+    }
+    for (guint i = 0; i < G_N_ELEMENTS(file_sinks); i++) {
+        Config config = { 0 };
+        config.sources = sources;
+        config.file_sink = file_sinks[i];
+        config.width = 320;
+        config.height = 240;
+        if (host_add(host, &config, NULL, NULL) != (int)i) {
+            ret = FALSE;
+            goto exit;
+        }
+    }
+    // one decoder for the three of them
+    host_get_stats(host, &running);
+    if (host_run(host) != 0) {
+        ret = FALSE;
+        goto exit;
+    }
+    // every broadcaster got (nearly) every frame, two of them without decoding it, and the
+    // decoder is gone with its last subscriber
+    host_get_stats(host, &finished);
+    if (running.shared_decoders != 1 || running.shared_sources != 3 || finished.failed != 0 ||
+        finished.frames < 255 || finished.shared_frames < 170 || finished.shared_decoders != 0 ||
+        finished.shared_sources != 0) {
+        g_printerr("test_host_shares_decoders_between_broadcasters: %u decoders for %u sources while running, "
+                   "%u failed, %" G_GUINT64_FORMAT " frames, %" G_GUINT64_FORMAT " not decoded again, "
+                   "%u decoders left\n", running.shared_decoders, running.shared_sources, finished.failed,
+                   finished.frames, finished.shared_frames, finished.shared_decoders);
+        ret = FALSE;
+    }
+    exit:
+    if (!ret) {
+        g_printerr("test_host_shares_decoders_between_broadcasters FAILED\n");
+    }
+    host_free(host);
+    g_main_context_unref(context);
+    g_free(sources[0]);
+    return ret;
+}
+
+// multiqueue and x264enc elements added to any pipeline, whose buffering the memory budget limits
+typedef struct {
+    GMutex lock;
+    GPtrArray *elements;
+} budget_elements;
+
+static gboolean budget_element_added(GSignalInvocationHint *hint, guint n_params, const GValue *params,
+                                     gpointer user_data) {
+    budget_elements *found = user_data;
+    // emitted on every bin up the hierarchy, the pipeline sees each element once
+    if (n_params == 3 && GST_IS_PIPELINE(g_value_get_object(&params[0]))) {
+        GstElement *element = g_value_get_object(&params[2]);
+        GstElementFactory *factory = gst_element_get_factory(element);
+        if (factory && (g_str_equal(GST_OBJECT_NAME(factory), "multiqueue") ||
+                        g_str_equal(GST_OBJECT_NAME(factory), "x264enc"))) {
+            g_mutex_lock(&found->lock);
+            g_ptr_array_add(found->elements, gst_object_ref(element));
+            g_mutex_unlock(&found->lock);
+        }
+    }
+    return TRUE;
+}
+
+gboolean test_memory_budget_caps_held_bytes() {
+    twitch_broadcaster *broadcaster = twitch_broadcaster_new();
+    Config *config = g_malloc0(sizeof(Config));
+    gboolean ret = TRUE;
+    broadcaster_stats stats;
+    // snow at a high bitrate, the worst case for every buffer on the way
+    fixture_spec spec = { 1920, 1080, 30, 10, FIXTURE_H264_AAC_MP4, 1, 20000 };
+    gchar *source = fixture_get_uri(FIXTURES_DIR, &spec);
+    gchar *sources[] = { source, source, source, NULL };
+    config->sources = sources;
+    config->file_sink = "memory_budget.flv";
+    config->width = 1280;
+    config->height = 720;
+    config->memory_budget = 48 * 1024 * 1024;
+    budget_elements found;
+    g_mutex_init(&found.lock);
+    found.elements = g_ptr_array_new_with_free_func(gst_object_unref);
+    guint element_added = g_signal_lookup("deep-element-added", GST_TYPE_BIN);
+    gulong hook = g_signal_add_emission_hook(element_added, 0, budget_element_added, &found, NULL);
+
+    gboolean ran = source && twitch_broadcaster_init(broadcaster, config) == 0 && twitch_broadcaster_run(broadcaster) == 0;
+    g_signal_remove_emission_hook(element_added, hook);
+    if (!ran) {
+        ret = FALSE;
+        goto exit;
+    }
+    // the limits the queues' peaks depend on: demuxed data of every source within half of its
+    // share (the budget's half for sources), x264's lookahead within the encoder's quarter
+    guint multiqueues = 0, encoders = 0;
+    for (guint i = 0; i < found.elements->len; i++) {
+        GstElement *element = g_ptr_array_index(found.elements, i);
+        if (g_str_equal(GST_OBJECT_NAME(gst_element_get_factory(element)), "multiqueue")) {
+            guint bytes = 0;
+            g_object_get(element, "max-size-bytes", &bytes, NULL);
+            if (bytes == 0 || bytes > config->memory_budget / 2 / 3 / 2) {
+                ret = FALSE;
+            }
+            multiqueues++;
+        } else {
+            gint lookahead = 0;
+            g_object_get(element, "rc-lookahead", &lookahead, NULL);
+            if ((guint64)lookahead * config->width * config->height * 3 / 2 > config->memory_budget / 4) {
+                ret = FALSE;
+            }
+            encoders++;
+        }
+    }
+    if (multiqueues < 3 || encoders != 1) {
+        ret = FALSE;
+    }
+    twitch_broadcaster_get_stats(broadcaster, &stats);
+    guint64 peak = 0;
+    for (guint i = 0; i < MEMORY_COUNT; i++) {
+        peak += stats.peak_held_bytes[i];
+        // every stage held something and gave it all back
+        if (stats.peak_held_bytes[i] == 0 || stats.held_bytes[i] != 0) {
+            ret = FALSE;
+        }
+    }
+    if (peak > config->memory_budget || stats.memory_limit != config->memory_budget ||
+        stats.stages[STAGE_ENCODER].buffers < 285 || stats.peak_rss_bytes == 0) {
+        ret = FALSE;
+    }
+    exit:
+    if (!ret) {
+        g_printerr("test_memory_budget_caps_held_bytes FAILED\n");
+    }
+    g_ptr_array_free(found.elements, TRUE);
+    g_mutex_clear(&found.lock);
+    g_free(source);
+    g_free(config);
+    twitch_broadcaster_destroy(broadcaster);
+    return ret;
+}
+
+gboolean test_passthrough_remuxes_until_mixing_is_needed() {
+    twitch_broadcaster *broadcaster = twitch_broadcaster_new();
+    Config *config = g_malloc0(sizeof(Config));
+    gboolean ret = TRUE;
+    broadcaster_stats stats;
+    // H.264/AAC at the canvas' size and frame rate is remuxed, VP8 has to be decoded and encoded
+    fixture_spec remux_spec = { 1280, 720, 30, 10, FIXTURE_H264_AAC_MP4, 0 };
+    fixture_spec decode_spec = { 1280, 720, 30, 3, FIXTURE_VP8_VORBIS_WEBM, 1 };
+    gchar *sources[] = { fixture_get_uri(FIXTURES_DIR, &remux_spec), NULL };
+    gchar *replacement = fixture_get_uri(FIXTURES_DIR, &decode_spec);
+    GThread *thread = NULL;
+    config->sources = sources;
+    config->file_sink = "passthrough.flv";
+    config->width = 1280;
+    config->height = 720;
+    config->passthrough = 1;
+
+    if (!sources[0] || !replacement || twitch_broadcaster_init(broadcaster, config) != 0) {
+        ret = FALSE;
+        goto exit;
+    }
+    thread = g_thread_new("broadcaster", run_broadcaster_thread, broadcaster);
+    // wait for the remuxed stream to get going (at most 10 s)
+    for (guint i = 0; i < 1000; i++) {
+        g_usleep(10 * 1000);
+        twitch_broadcaster_get_stats(broadcaster, &stats);
+        if (stats.stages[STAGE_SINK].buffers >= 60) {
+            break;
+        }
+    }
+    if (!stats.video_passthrough || !stats.audio_passthrough || stats.stages[STAGE_ENCODER].buffers != 0 ||
+        stats.stages[STAGE_MIXER].buffers != 0) {
+        g_printerr("test_passthrough_remuxes_until_mixing_is_needed: source wasn't remuxed\n");
+        ret = FALSE;
+    }
+    if (twitch_broadcaster_replace_source(broadcaster, 0, replacement) != 0) {
+        ret = FALSE;
+    }
+    if (GPOINTER_TO_INT(g_thread_join(thread)) != 0) {
+        ret = FALSE;
+        goto exit;
+    }
+    // the replacement got composited and encoded, the muxer switched over
+    twitch_broadcaster_get_stats(broadcaster, &stats);
+    if (stats.video_passthrough || stats.audio_passthrough || stats.path_switches < 2 ||
+        stats.stages[STAGE_ENCODER].buffers < 85) {
+        ret = FALSE;
+    }
+    exit:
+    if (!ret) {
+        g_printerr("test_passthrough_remuxes_until_mixing_is_needed FAILED\n");
+    }
+    g_free(sources[0]);
+    g_free(replacement);
+    g_free(config);
+    twitch_broadcaster_destroy(broadcaster);
+    return ret;
+}
+
+// FLV stream starting with the file header whose first video frame (after the sequence
+// header) is a keyframe
+static gboolean flv_starts_at_keyframe(GBytes *bytes) {
+    gsize size = 0;
+    const guint8 *data = bytes ? g_bytes_get_data(bytes, &size) : NULL;
+    if (size < 13 || memcmp(data, "FLV", 3) != 0) {
+        return FALSE;
+    }
+    // file header and the first previous tag size, then tag header, data and tag size
+    for (gsize offset = 13; offset + 13 <= size;) {
+        gsize length = data[offset + 1] << 16 | data[offset + 2] << 8 | data[offset + 3];
+        if (data[offset] == 9 && data[offset + 12] == 1) {
+            return data[offset + 11] >> 4 == 1;
+        }
+        offset += 11 + length + 4;
+    }
+    return FALSE;
+}
+
+typedef struct {
+    fixture_tcp_server *server;
+    guint step;
+} receiver_restart;
+
+// Kills the receiver and brings it back on the next call
+static gboolean receiver_restart_step(receiver_restart *restart) {
+    if (restart->step++ == 0) {
+        fixture_tcp_server_stop(restart->server);
+        return G_SOURCE_CONTINUE;
+    }
+    fixture_tcp_server_restart(restart->server);
+    return G_SOURCE_REMOVE;
+}
+
+gboolean test_output_reconnects_after_receiver_restart() {
+    twitch_broadcaster *broadcaster = twitch_broadcaster_new();
+    Config *config = g_malloc0(sizeof(Config));
+    gboolean ret = TRUE;
+    guint running = 1;
+    broadcaster_stats stats;
+    output_stats output;
+    async_events events;
+    fixture_spec spec = { 320, 240, 30, 6, FIXTURE_H264_AAC_MP4, 0 };
+    gchar *sources[] = { fixture_get_uri(FIXTURES_DIR, &spec), NULL };
+    fixture_tcp_server *server = fixture_tcp_server_new();
+    receiver_restart restart = { server, 0 };
+    GMainContext *context = g_main_context_new();
+    GMainLoop *loop = g_main_loop_new(context, FALSE);
+    GSource *timer = g_timeout_source_new(1500);
+    // the broadcast ends with its source unless the stall fallback keeps it going
+    GSource *deadline = g_timeout_source_new_seconds(30);
+    deadline_run expired = { broadcaster, loop, -1, FALSE };
+    gchar *location = server ? g_strdup_printf("tcp://127.0.0.1:%u", fixture_tcp_server_port(server)) : NULL;
+    GBytes *resumed = NULL;
+    broadcaster_callbacks callbacks = { NULL, async_error, async_eos, NULL, NULL, async_finished };
+    Output outputs[] = { { OUTPUT_TCP, location } };
+
+    memset(&events, 0, sizeof(events));
+    events.running = &running;
+    events.loop = loop;
+    events.result = -1;
+    // realtime, so encoding goes on through the outage; a keyframe every second
+    config->sources = sources;
+    config->outputs = outputs;
+    config->num_outputs = G_N_ELEMENTS(outputs);
+    config->width = 320;
+    config->height = 240;
+    config->low_latency = 1;
+    config->stall_timeout_ms = 1000;
+    if (!sources[0] || !server || twitch_broadcaster_init(broadcaster, config) != 0 ||
+        twitch_broadcaster_start(broadcaster, context, &callbacks, &events) != 0) {
+        ret = FALSE;
+        goto exit;
+    }
+    // the receiver goes away 1.5 s in and is back 1.5 s later
+    g_source_set_callback(timer, (GSourceFunc)receiver_restart_step, &restart, NULL);
+    g_source_attach(timer, context);
+    g_source_set_callback(deadline, (GSourceFunc)deadline_run_expired, &expired, NULL);
+    g_source_attach(deadline, context);
+    g_main_loop_run(loop);
+
+    twitch_broadcaster_get_stats(broadcaster, &stats);
+    twitch_broadcaster_get_output_stats(broadcaster, 0, &output);
+    guint connections = fixture_tcp_server_connections(server);
+    resumed = connections ? fixture_tcp_server_data(server, connections - 1) : NULL;
+    // the broadcast went on and ended normally, the new connection starts with headers and a keyframe
+    if (expired.timed_out || events.result != 0 || !events.eos || output.reconnects == 0 || !output.connected ||
+        connections < 2 || output.disconnected_us < 1000 * 1000 ||
+        stats.stages[STAGE_ENCODER].buffers < 6 * 30 * 0.9 || !flv_starts_at_keyframe(resumed)) {
+        g_printerr("test_output_reconnects_after_receiver_restart: %s, %u reconnects, %u failed attempts, "
+                   "%u connections, %.1f s disconnected, %" G_GUINT64_FORMAT " frames encoded\n",
+                   expired.timed_out ? "stopped at the deadline" : "ended", output.reconnects,
+                   output.failed_attempts, connections, output.disconnected_us / 1e6,
+                   stats.stages[STAGE_ENCODER].buffers);
+        ret = FALSE;
+    }
+    exit:
+    if (!ret) {
+        g_printerr("test_output_reconnects_after_receiver_restart FAILED\n");
+    }
+    twitch_broadcaster_destroy(broadcaster);
+    g_source_destroy(timer);
+    g_source_unref(timer);
+    g_source_destroy(deadline);
+    g_source_unref(deadline);
+    g_main_loop_unref(loop);
+    g_main_context_unref(context);
+    if (resumed) {
+        g_bytes_unref(resumed);
+    }
+    fixture_tcp_server_free(server);
+    g_free(location);
+    g_free(sources[0]);
+    g_free(config);
+    return ret;
+}
+
+gboolean test_stalled_source_does_not_freeze_mix() {
+    twitch_broadcaster *broadcaster = twitch_broadcaster_new();
+    Config *config = g_malloc0(sizeof(Config));
+    gboolean ret = TRUE;
+    broadcaster_stats stats;
+    source_stats local, stalled;
+    fixture_spec local_spec = { 640, 480, 30, 4, FIXTURE_H264_AAC_MP4, 0 };
+    // webm plays from a non seekable http stream
+    fixture_spec remote_spec = { 640, 480, 30, 4, FIXTURE_VP8_VORBIS_WEBM, 1 };
+    gchar *local_uri = fixture_get_uri(FIXTURES_DIR, &local_spec);
+    gchar *remote_file_uri = fixture_get_uri(FIXTURES_DIR, &remote_spec);
+    gchar *remote_path = remote_file_uri ? g_filename_from_uri(remote_file_uri, NULL, NULL) : NULL;
+    fixture_http_server *server = NULL;
+    gchar *sources[] = { local_uri, NULL, NULL };
+    GStatBuf remote_stat;
+
+    if (!local_uri || !remote_path || g_stat(remote_path, &remote_stat) != 0) {
+        ret = FALSE;
+        goto exit;
+    }
+    // the remote source pauses for 1.5 s a third into the stream
+    server = fixture_http_server_new(FIXTURES_DIR, remote_stat.st_size / 3, 1500);
+    if (!server) {
+        ret = FALSE;
+        goto exit;
+    }
+    sources[1] = fixture_http_server_uri(server, remote_file_uri);
+    config->sources = sources;
+    config->file_sink = "stalled.flv";
+    config->width = 1280;
+    config->height = 720;
+    config->stall_timeout_ms = 300;
+
+    gint64 start = g_get_monotonic_time();
+    if (twitch_broadcaster_init(broadcaster, config) != 0 || !run_before_deadline(broadcaster, 30)) {
+        ret = FALSE;
+        goto exit;
+    }
+    gdouble wall_s = (g_get_monotonic_time() - start) / 1e6;
+    twitch_broadcaster_get_stats(broadcaster, &stats);
+    twitch_broadcaster_get_source_stats(broadcaster, 0, &local);
+    twitch_broadcaster_get_source_stats(broadcaster, 1, &stalled);
+    // the mix went on in realtime through the stall, the remote source came back
+    if (stalled.stalls == 0 || stalled.stalled || stalled.stalled_us < 1000 * 1000 || local.stalls ||
+        local.video_frames < 115 || stats.stages[STAGE_MIXER].buffers < (wall_s - 1) * 30 * 0.8) {
+        g_printerr("test_stalled_source_does_not_freeze_mix: %u stalls, %.1f ms stalled, %" G_GUINT64_FORMAT
+                   " frames mixed in %.1f s\n", stalled.stalls, stalled.stalled_us / 1000.0,
+                   stats.stages[STAGE_MIXER].buffers, wall_s);
+        ret = FALSE;
+    }
+    exit:
+    if (!ret) {
+        g_printerr("test_stalled_source_does_not_freeze_mix FAILED\n");
+    }
+    fixture_http_server_free(server);
+    g_free(sources[1]);
+    g_free(local_uri);
+    g_free(remote_file_uri);
+    g_free(remote_path);
+    g_free(config);
+    twitch_broadcaster_destroy(broadcaster);
+    return ret;
+}
+
+gboolean test_stall_fallback_ends_with_sources() {
+    twitch_broadcaster *broadcaster = twitch_broadcaster_new();
+    Config *config = g_malloc0(sizeof(Config));
+    gboolean ret = TRUE;
+    source_stats source;
+    gchar **sources = test_sources(2, 640, 480);
+    config->sources = sources;
+    config->file_sink = "fallback_ends.flv";
+    config->width = 1280;
+    config->height = 720;
+    config->stall_timeout_ms = 500;
+
+    // 3 s sources consumed in realtime, the live slate and silence end with them
+    gint64 start = g_get_monotonic_time();
+    if (!sources || twitch_broadcaster_init(broadcaster, config) != 0 || !run_before_deadline(broadcaster, 20)) {
+        ret = FALSE;
+        goto exit;
+    }
+    gdouble wall_s = (g_get_monotonic_time() - start) / 1e6;
+    for (guint i = 0; i < 2; i++) {
+        if (twitch_broadcaster_get_source_stats(broadcaster, i, &source) != 0 || source.video_frames < 85 ||
+            source.stalls) {
+            ret = FALSE;
+        }
+    }
+    if (wall_s < 3 * 0.9) {
+        g_printerr("test_stall_fallback_ends_with_sources: ended after %.1f s\n", wall_s);
+        ret = FALSE;
+    }
+    exit:
+    if (!ret) {
+        g_printerr("test_stall_fallback_ends_with_sources FAILED\n");
+    }
+    g_strfreev(sources);
+    g_free(config);
+    twitch_broadcaster_destroy(broadcaster);
+    return ret;
+}
+
+gboolean test_fast_start_does_not_wait_for_slow_source() {
+    twitch_broadcaster *broadcaster = twitch_broadcaster_new();
+    Config *config = g_malloc0(sizeof(Config));
+    gboolean ret = TRUE;
+    output_stats output;
+    source_stats local, late;
+    fixture_spec local_spec = { 640, 480, 30, 4, FIXTURE_H264_AAC_MP4, 0 };
+    fixture_spec remote_spec = { 640, 480, 30, 4, FIXTURE_VP8_VORBIS_WEBM, 1 };
+    gchar *local_uri = fixture_get_uri(FIXTURES_DIR, &local_spec);
+    gchar *remote_file_uri = fixture_get_uri(FIXTURES_DIR, &remote_spec);
+    fixture_http_server *server = NULL;
+    gchar *sources[] = { local_uri, NULL, NULL };
+
+    if (!local_uri || !remote_file_uri) {
+        ret = FALSE;
+        goto exit;
+    }
+    // the remote source can't be discovered for 2.5 s
+    server = fixture_http_server_new(FIXTURES_DIR, 16, 2500);
+    if (!server) {
+        ret = FALSE;
+        goto exit;
+    }
+    sources[1] = fixture_http_server_uri(server, remote_file_uri);
+    config->sources = sources;
+    config->file_sink = "fast_start.flv";
+    config->width = 1280;
+    config->height = 720;
+    config->fast_start = 1;
+    config->stall_timeout_ms = 500;
+
+    gint64 start = g_get_monotonic_time();
+    if (twitch_broadcaster_init(broadcaster, config) != 0 || !run_before_deadline(broadcaster, 30)) {
+        ret = FALSE;
+        goto exit;
+    }
+    gdouble wall_s = (g_get_monotonic_time() - start) / 1e6;
+    twitch_broadcaster_get_output_stats(broadcaster, 0, &output);
+    twitch_broadcaster_get_source_stats(broadcaster, 0, &local);
+    twitch_broadcaster_get_source_stats(broadcaster, 1, &late);
+    // output started with the local source, the remote one joined later and played from its
+    // start in realtime instead of catching up with the mix
+    if (!output.time_to_first_byte_us || output.time_to_first_byte_us > 1500 * 1000 ||
+        local.video_frames < 115 || late.video_frames < 115 || wall_s < 2.5 + 4 * 0.9) {
+        g_printerr("test_fast_start_does_not_wait_for_slow_source: first byte after %.1f ms, %" G_GUINT64_FORMAT
+                   " and %" G_GUINT64_FORMAT " frames of the sources in %.1f s\n",
+                   output.time_to_first_byte_us / 1000.0, local.video_frames, late.video_frames, wall_s);
+        ret = FALSE;
+    }
+    exit:
+    if (!ret) {
+        g_printerr("test_fast_start_does_not_wait_for_slow_source FAILED\n");
+    }
+    fixture_http_server_free(server);
+    g_free(sources[1]);
+    g_free(local_uri);
+    g_free(remote_file_uri);
+    g_free(config);
+    twitch_broadcaster_destroy(broadcaster);
+    return ret;
+}
+
+// Removes a source cache directory created by a test
+static void remove_cache_dir(const gchar *directory) {
+    const gchar *subdirectories[] = { "objects", "index" };
+    for (guint i = 0; i < G_N_ELEMENTS(subdirectories); i++) {
+        gchar *path = g_build_filename(directory, subdirectories[i], NULL);
+        GDir *dir = g_dir_open(path, 0, NULL);
+        const gchar *name;
+        while (dir && (name = g_dir_read_name(dir))) {
+            gchar *file = g_build_filename(path, name, NULL);
+            g_unlink(file);
+            g_free(file);
+        }
+        if (dir) {
+            g_dir_close(dir);
+        }
+        g_rmdir(path);
+        g_free(path);
+    }
+    g_rmdir(directory);
+}
+
+// Plays the source once with the cache, returns encoded frames (0 on failure) and cache stats
+static guint64 play_cached(gchar **sources, gchar *cache_dir, guint64 max_bytes, cache_stats *cache) {
+    twitch_broadcaster *broadcaster = twitch_broadcaster_new();
+    Config *config = g_malloc0(sizeof(Config));
+    broadcaster_stats stats;
+    guint64 frames = 0;
+    config->sources = sources;
+    config->file_sink = "cached.flv";
+    config->width = 640;
+    config->height = 480;
+    config->cache_dir = cache_dir;
+    config->cache_max_bytes = max_bytes;
+    config->prefetch_bytes = 4 * 1024 * 1024;
+    if (twitch_broadcaster_init(broadcaster, config) == 0 && twitch_broadcaster_run(broadcaster) == 0 &&
+        twitch_broadcaster_get_cache_stats(broadcaster, cache) == 0) {
+        twitch_broadcaster_get_stats(broadcaster, &stats);
+        frames = stats.stages[STAGE_ENCODER].buffers;
+    }
+    g_free(config);
+    twitch_broadcaster_destroy(broadcaster);
+    return frames;
+}
+
+// Objects in a source cache directory
+static guint count_cache_objects(const gchar *directory) {
+    gchar *path = g_build_filename(directory, "objects", NULL);
+    GDir *dir = g_dir_open(path, 0, NULL);
+    guint objects = 0;
+    const gchar *name;
+    while (dir && (name = g_dir_read_name(dir))) {
+        objects += name[0] != '.';
+    }
+    if (dir) {
+        g_dir_close(dir);
+    }
+    g_free(path);
+    return objects;
+}
+
+gboolean test_source_cache_serves_replays() {
+    gboolean ret = TRUE;
+    // webm downloads in one go, mp4mux puts the index at the end, which qtdemux seeks to
+    fixture_spec specs[] = {
+            { 640, 480, 30, 2, FIXTURE_VP8_VORBIS_WEBM, 2 },
+            { 640, 480, 30, 2, FIXTURE_H264_AAC_MP4, 2 },
+            { 640, 480, 30, 2, FIXTURE_VP8_VORBIS_WEBM, 3 }
+    };
+    gchar *file_uris[G_N_ELEMENTS(specs)] = { NULL };
+    gchar *cache_dir = g_dir_make_tmp("broadcaster-cache-XXXXXX", NULL);
+    fixture_http_server *server = NULL;
+    gchar *sources[] = { NULL, NULL };
+    GStatBuf file_stat;
+
+    if (!cache_dir || !(server = fixture_http_server_new(FIXTURES_DIR, 0, 0))) {
+        ret = FALSE;
+        goto exit;
+    }
+    for (guint i = 0; i < G_N_ELEMENTS(specs); i++) {
+        cache_stats first = { 0 }, replay = { 0 };
+        file_uris[i] = fixture_get_uri(FIXTURES_DIR, &specs[i]);
+        gchar *path = file_uris[i] ? g_filename_from_uri(file_uris[i], NULL, NULL) : NULL;
+        if (!path || g_stat(path, &file_stat) != 0) {
+            g_free(path);
+            ret = FALSE;
+            goto exit;
+        }
+        g_free(path);
+        g_free(sources[0]);
+        sources[0] = fixture_http_server_uri(server, file_uris[i]);
+        // the last one goes to a cache bound to its own size, the others are evicted for it
+        guint64 max_bytes = i == G_N_ELEMENTS(specs) - 1 ? (guint64)file_stat.st_size : 0;
+        // the first play downloads and records the source, the replay maps it from disk
+        guint64 first_frames = play_cached(sources, cache_dir, max_bytes, &first);
+        guint requests = fixture_http_server_requests(server);
+        guint64 replay_frames = play_cached(sources, cache_dir, max_bytes, &replay);
+        if (!first_frames || first.misses != 1 || first.hits || first.stored != 1 || first.abandoned ||
+            first.bytes_stored != (guint64)file_stat.st_size || first.evicted != (max_bytes ? i : 0) ||
+            replay_frames < first_frames * 9 / 10 || replay.hits != 1 || replay.misses ||
+            replay.bytes_saved < (guint64)file_stat.st_size || fixture_http_server_requests(server) != requests) {
+            g_printerr("test_source_cache_serves_replays: source %u first play %" G_GUINT64_FORMAT " frames, %u misses, "
+                       "%u stored (%" G_GUINT64_FORMAT " of %" G_GINT64_FORMAT " bytes), %u evicted, replay %"
+                       G_GUINT64_FORMAT " frames, %u hits, %" G_GUINT64_FORMAT " bytes saved, %u requests\n", i,
+                       first_frames, first.misses, first.stored, first.bytes_stored, (gint64)file_stat.st_size,
+                       first.evicted, replay_frames, replay.hits, replay.bytes_saved,
+                       fixture_http_server_requests(server) - requests);
+            ret = FALSE;
+        }
+    }
+    if (count_cache_objects(cache_dir) != 1) {
+        ret = FALSE;
+    }
+    exit:
+    if (!ret) {
+        g_printerr("test_source_cache_serves_replays FAILED\n");
+    }
+    fixture_http_server_free(server);
+    if (cache_dir) {
+        remove_cache_dir(cache_dir);
+    }
+    g_free(cache_dir);
+    g_free(sources[0]);
+    for (guint i = 0; i < G_N_ELEMENTS(file_uris); i++) {
+        g_free(file_uris[i]);
+    }
+    return ret;
+}
+
+gboolean test_streaming_threads_pinned_to_cpus() {
+    twitch_broadcaster *broadcaster = twitch_broadcaster_new();
+    Config *config = g_malloc0(sizeof(Config));
+    gboolean ret = TRUE;
+    broadcaster_stats stats;
+    gchar **sources = test_sources(2, 640, 480);
+    config->sources = sources;
+    config->file_sink = "pinned.flv";
+    config->width = 1280;
+    config->height = 720;
+    config->source_cpus = "0";
+    config->encoder_cpus = g_get_num_processors() > 1 ? "1" : "0";
+
+    if (!sources || twitch_broadcaster_init(broadcaster, config) != 0 || twitch_broadcaster_run(broadcaster) != 0) {
+        ret = FALSE;
+        goto exit;
+    }
+    // a queue per track and source, per encoder, per output plus decoders and mixers
+    twitch_broadcaster_get_stats(broadcaster, &stats);
+    if (stats.stages[STAGE_ENCODER].buffers < 85 || stats.threads < 8 || stats.pinned_threads != stats.threads) {
+        g_printerr("test_streaming_threads_pinned_to_cpus: %u of %u threads pinned\n",
+                   stats.pinned_threads, stats.threads);
+        ret = FALSE;
+    }
+    exit:
+    if (!ret) {
+        g_printerr("test_streaming_threads_pinned_to_cpus FAILED\n");
+    }
+    g_strfreev(sources);
+    g_free(config);
+    twitch_broadcaster_destroy(broadcaster);
+    return ret;
+}
+
+gboolean test_sources_matching_tiles_skip_scaling() {
+    twitch_broadcaster *broadcaster = twitch_broadcaster_new();
+    Config *config = g_malloc0(sizeof(Config));
+    gboolean ret = TRUE;
+    broadcaster_stats stats;
+    // 2x2 grid of 640x360 tiles: two sources of the tile's size go to the mixer as they are,
+    // one is downscaled and one upscaled
+    fixture_spec specs[] = {
+            { 640, 360, 30, 3, FIXTURE_H264_AAC_MP4, 0 },
+            { 640, 360, 30, 3, FIXTURE_H264_AAC_MP4, 1 },
+            { 1280, 720, 30, 3, FIXTURE_H264_AAC_MP4, 2 },
+            { 320, 180, 30, 3, FIXTURE_VP8_VORBIS_WEBM, 0 },
+    };
+    gchar **sources = g_new0(gchar *, G_N_ELEMENTS(specs) + 1);
+    for (guint i = 0; i < G_N_ELEMENTS(specs); i++) {
+        sources[i] = fixture_get_uri(FIXTURES_DIR, &specs[i]);
+        if (!sources[i]) {
+            ret = FALSE;
+            goto exit;
+        }
+    }
+    config->sources = sources;
+    config->file_sink = "mixed_matching_tiles.flv";
+    config->width = 1280;
+    config->height = 720;
+    config->layout = LAYOUT_GRID;
+
+    if (twitch_broadcaster_init(broadcaster, config) != 0 || twitch_broadcaster_run(broadcaster) != 0) {
+        ret = FALSE;
+        goto exit;
+    }
+    twitch_broadcaster_get_stats(broadcaster, &stats);
+    if (stats.stages[STAGE_ENCODER].buffers < 85) {
+        ret = FALSE;
+    }
+    // every kind of branch delivers all of its frames, only the ones of another size are scaled
+    for (guint i = 0; i < G_N_ELEMENTS(specs); i++) {
+        source_stats source = { 0 };
+        gboolean matching = specs[i].width == 640 && specs[i].height == 360;
+        if (twitch_broadcaster_get_source_stats(broadcaster, i, &source) != 0 || source.video_frames < 85 ||
+            (matching ? source.video_filters != 0 : source.video_filters == 0)) {
+            g_printerr("test_sources_matching_tiles_skip_scaling: source %u has %u video filters\n", i,
+                       source.video_filters);
+            ret = FALSE;
+        }
+    }
+    exit:
+    if (!ret) {
+        g_printerr("test_sources_matching_tiles_skip_scaling FAILED\n");
+    }
+    g_strfreev(sources);
+    g_free(config);
+    twitch_broadcaster_destroy(broadcaster);
+    return ret;
+}
+
+static void tile_compositor_handoff(GstElement *sink, GstBuffer *buffer, GstPad *pad, GstBuffer **frame) {
+    if (!*frame) {
+        *frame = gst_buffer_ref(buffer);
+    }
+}
+
+gboolean test_tile_compositor_copies_tiles() {
+    layout_tile tiles[4];
+    GstBuffer *frame = NULL;
+    GError *error = NULL;
+    gboolean ret = tile_compositor_register();
+    // overlays are left to the generic compositor
+    if (!layout_compute(LAYOUT_SIDE_BY_SIDE, 1920, 1080, 3, tiles) || !tile_compositor_supports_layout(tiles, 3) ||
+        !layout_compute(LAYOUT_PICTURE_IN_PICTURE, 1920, 1080, 4, tiles) || tile_compositor_supports_layout(tiles, 4)) {
+        ret = FALSE;
+    }
+    // as are odd positions, rounding them would leave gaps
+    layout_tile odd[] = { { 0, 0, 641, 720, 0 }, { 641, 0, 639, 720, 0 } };
+    if (tile_compositor_supports_layout(odd, G_N_ELEMENTS(odd))) {
+        ret = FALSE;
+    }
+    // white and red tiles on the top half of the canvas, the bottom half is background
+    GstElement *pipeline = gst_parse_launch(
+            TILE_COMPOSITOR_FACTORY " name=mixer sink_0::xpos=0 sink_1::xpos=320 "
+            "! video/x-raw,format=I420,width=640,height=480 ! fakesink name=sink signal-handoffs=true "
+            "videotestsrc num-buffers=1 pattern=white ! video/x-raw,format=I420,width=320,height=240 ! mixer.sink_0 "
+            "videotestsrc num-buffers=1 pattern=red ! video/x-raw,format=I420,width=320,height=240 ! mixer.sink_1",
+            &error);
+    if (!pipeline) {
+        g_printerr("test_tile_compositor_copies_tiles: %s\n", error->message);
+        g_error_free(error);
+        ret = FALSE;
+        goto exit;
+    }
+    GstElement *sink = gst_bin_get_by_name(GST_BIN(pipeline), "sink");
+    g_signal_connect(sink, "handoff", G_CALLBACK(tile_compositor_handoff), &frame);
+    gst_object_unref(sink);
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+    GstBus *bus = gst_element_get_bus(pipeline);
+    GstMessage *msg = gst_bus_timed_pop_filtered(bus, 10 * GST_SECOND, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+    if (!msg || GST_MESSAGE_TYPE(msg) != GST_MESSAGE_EOS) {
+        ret = FALSE;
+    }
+    if (msg) {
+        gst_message_unref(msg);
+    }
+    gst_object_unref(bus);
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(pipeline);
+
+    GstMapInfo map;
+    if (!frame || !gst_buffer_map(frame, &map, GST_MAP_READ)) {
+        ret = FALSE;
+        goto exit;
+    }
+    // I420 640x480: Y plane with a stride of 640 followed by U with a stride of 320
+    const guint8 *y = map.data, *u = map.data + 640 * 480;
+    if (ABS(y[10 * 640 + 10] - 235) > 2 || ABS(y[10 * 640 + 330] - 81) > 2 ||
+        y[300 * 640 + 10] != 16 || u[200 * 320 + 5] != 128) {
+        ret = FALSE;
+    }
+    gst_buffer_unmap(frame, &map);
+    exit:
+    if (frame) {
+        gst_buffer_unref(frame);
+    }
+    if (!ret) {
+        g_printerr("test_tile_compositor_copies_tiles FAILED\n");
+    }
+    return ret;
+}
+
+// Video timeline of an FLV file: decoding timestamps only move forward, by at most a few frames
+typedef struct {
+    guint frames;
+    guint keyframes;
+    GstClockTime last_dts;
+    gboolean continuous;
+} flv_timeline;
+
+static void flv_timeline_handoff(GstElement *sink, GstBuffer *buffer, GstPad *pad, flv_timeline *timeline) {
+    GstClockTime dts = GST_BUFFER_DTS_OR_PTS(buffer);
+    if (timeline->frames && (!GST_CLOCK_TIME_IS_VALID(dts) || dts < timeline->last_dts ||
+                             dts - timeline->last_dts > 100 * GST_MSECOND)) {
+        timeline->continuous = FALSE;
+    }
+    if (!GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+        timeline->keyframes++;
+    }
+    timeline->frames++;
+    timeline->last_dts = dts;
+}
+
+static gboolean read_flv_timeline(const gchar *location, flv_timeline *timeline) {
+    GError *error = NULL;
+    memset(timeline, 0, sizeof(flv_timeline));
+    timeline->continuous = TRUE;
+    gchar *description = g_strdup_printf("filesrc location=%s ! flvdemux ! video/x-h264 ! "
+                                         "fakesink name=sink signal-handoffs=true", location);
+    GstElement *pipeline = gst_parse_launch(description, &error);
+    g_free(description);
+    if (!pipeline) {
+        g_printerr("Can't read %s: %s\n", location, error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+    GstElement *sink = gst_bin_get_by_name(GST_BIN(pipeline), "sink");
+    g_signal_connect(sink, "handoff", G_CALLBACK(flv_timeline_handoff), timeline);
+    gst_object_unref(sink);
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+    GstBus *bus = gst_element_get_bus(pipeline);
+    GstMessage *msg = gst_bus_timed_pop_filtered(bus, 30 * GST_SECOND, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+    gboolean read = msg && GST_MESSAGE_TYPE(msg) == GST_MESSAGE_EOS;
+    if (msg) {
+        gst_message_unref(msg);
+    }
+    gst_object_unref(bus);
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(pipeline);
+    return read;
+}
+
+gboolean test_offline_render_concatenates_segments() {
+    Config *config = g_malloc0(sizeof(Config));
+    gboolean ret = TRUE;
+    render_stats stats;
+    flv_timeline timeline;
+    gchar *sources[3] = { NULL, NULL, NULL };
+    memset(&stats, 0, sizeof(stats));
+    for (guint i = 0; i < 2; i++) {
+        fixture_spec spec = { 640, 480, 30, 6, FIXTURE_H264_AAC_MP4, (gint)i };
+        sources[i] = fixture_get_uri(FIXTURES_DIR, &spec);
+        ret = ret && sources[i] != NULL;
+    }
+    config->sources = sources;
+    config->file_sink = "offline_render.flv";
+    config->width = 1280;
+    config->height = 720;
+    // 6 s of 1 s keyframe intervals, 2 intervals per segment
+    RenderConfig render = { 2, 3, 1 };
+
+    if (!ret || offline_render(config, &render, &stats) != 0) {
+        ret = FALSE;
+        goto exit;
+    }
+    if (stats.segments != 3 || stats.workers != 2 || stats.frames < 175 || stats.speed <= 0) {
+        g_printerr("test_offline_render_concatenates_segments FAILED: %u segments on %u workers, %"
+                   G_GUINT64_FORMAT " frames\n", stats.segments, stats.workers, stats.frames);
+        ret = FALSE;
+    }
+    // one file with every frame, timestamps running on across segment boundaries and a keyframe
+    // at least every second
+    if (!read_flv_timeline(config->file_sink, &timeline) || timeline.frames < 175 || timeline.frames > 185 ||
+        !timeline.continuous || timeline.keyframes < 6 || timeline.last_dts < 5800 * GST_MSECOND) {
+        g_printerr("test_offline_render_concatenates_segments FAILED: %u frames, %u keyframes, continuous %d, "
+                   "last at %" GST_TIME_FORMAT "\n", timeline.frames, timeline.keyframes, timeline.continuous,
+                   GST_TIME_ARGS(timeline.last_dts));
+        ret = FALSE;
+    }
+    // audio stays within a frame of video across the boundaries, where at most the frame
+    // running into the next segment is missing
+    av_sync_stats sync;
+    if (!av_sync_verify_file(config->file_sink, 0, 0, &sync) || sync.alarms || sync.duration_ms < 5800 ||
+        ABS(sync.max_offset_ms) > 1024 * 1000.0 / 44100 || sync.video_discontinuities ||
+        sync.audio_discontinuities > stats.segments - 1) {
+        g_printerr("test_offline_render_concatenates_segments FAILED: audio %.1f ms against video at most over "
+                   "%" G_GINT64_FORMAT " ms, %u/%u discontinuities\n", sync.max_offset_ms, (gint64)sync.duration_ms,
+                   sync.video_discontinuities, sync.audio_discontinuities);
+        ret = FALSE;
+    }
+    for (guint i = 0; i < stats.segments; i++) {
+        gchar *segment = g_strdup_printf("%s.segment%03u.flv", config->file_sink, i);
+        if (g_file_test(segment, G_FILE_TEST_EXISTS)) {
+            g_printerr("test_offline_render_concatenates_segments FAILED: %s left behind\n", segment);
+            ret = FALSE;
+        }
+        g_free(segment);
+    }
+    exit:
+    g_free(sources[0]);
+    g_free(sources[1]);
+    g_free(config);
+    return ret;
+}
+
 int main(int argc, char *argv[]) {
     g_print("RUNNING ALL TESTS!");
     gst_init(&argc, &argv);
     gboolean res = test_init_with_incomplete_config_returns_error();
     res = res && test_run_without_init_returns_error();
+    res = res && test_layout_tiles_cover_canvas_exactly();
+    res = res && test_bitrate_controller_follows_uplink();
+    res = res && test_av_sync_monitor_follows_offset_and_drift();
+    res = res && test_tile_compositor_copies_tiles();
+    res = res && test_mixing_synthetic_sources_offline();
+    res = res && test_low_latency_mode_meets_latency_target();
+    res = res && test_slow_output_does_not_stall_others();
+    res = res && test_callback_outputs_hand_out_packets();
+    res = res && test_adaptive_bitrate_follows_rate_limited_output();
+    res = res && test_rendition_ladder_composites_once();
+    res = res && test_replace_source_while_running();
+    res = res && test_replaced_sources_release_elements();
+    res = res && test_chained_source_replaces_tracks();
+    res = res && test_broadcasters_share_main_context();
+    res = res && test_host_divides_budget_between_broadcasters();
+    res = res && test_host_shares_decoders_between_broadcasters();
+    res = res && test_memory_budget_caps_held_bytes();
+    res = res && test_passthrough_remuxes_until_mixing_is_needed();
+    res = res && test_output_reconnects_after_receiver_restart();
+    res = res && test_stalled_source_does_not_freeze_mix();
+    res = res && test_stall_fallback_ends_with_sources();
+    res = res && test_fast_start_does_not_wait_for_slow_source();
+    res = res && test_source_cache_serves_replays();
+    res = res && test_offline_render_concatenates_segments();
+    res = res && test_streaming_threads_pinned_to_cpus();
+    res = res && test_sources_matching_tiles_skip_scaling();
+    // needs network
     res = res && test_mixing_3_sources_creates_correct_file();
 
     if (!res) {